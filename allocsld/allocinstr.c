@@ -320,9 +320,9 @@ void instrument_ld_so_allocators(uintptr_t ld_so_load_addr)
 		PROT_READ|PROT_WRITE, FLAGS, -1, 0);
 	hard_assert((uintptr_t) linear_malloc < (uintptr_t) -4095);
 	*linear_malloc = (struct linear_malloc_index_instance) {
-		.recs = RELF_ROUND_UP_PTR_((char*) linear_malloc + sizeof (*linear_malloc),
-			_Alignof(struct linear_malloc_rec))  /* we map this */,
-		.nrecs = MAX_LINEAR_MALLOCS,
+		.leaves = RELF_ROUND_UP_PTR_((char*) linear_malloc + sizeof (*linear_malloc),
+			_Alignof(struct linear_malloc_leaf *))  /* we map this */,
+		.nleaves_max = LINEAR_MALLOC_INLINE_NLEAVES,
 		/* We take the address of these guys so that we can swap them out once
 		 * liballocs starts up, for ones that ensure the bigalloc is created.
 		 * Our versions are just the "early versions" for when that is not yet
@@ -403,9 +403,10 @@ void instrument_ld_so_allocators(uintptr_t ld_so_load_addr)
  *
  * Or we could skip the generic_malloc_index.h above and just
  * implement our own indexing.
- * E.g. instead of a bitmap, maybe we should simply push <addr, length> pairs into a
- * bump vector. If we detect an address that is not greater than the last allocated
- * address, we need to sort the vector. Otherwise it's still sorted.
+ * E.g. instead of a bitmap, maybe we should simply keep <addr, length> pairs
+ * sorted by address. Since the chunks are mostly allocated in increasing
+ * address order, most inserts are appends. (linear_malloc_index.h keeps them
+ * in a two-level sorted structure, so that it can grow.)
  *
  * Or perhaps we should use the generic-small index?
  *
@@ -446,35 +447,20 @@ static void linear_malloc_index_insert(
 	struct insert *insert = insert_for_chunk_and_caller_usable_size(allocptr,
 		real_caller_usable_size);
 	insert->initial.alloc_site = (uintptr_t) caller;
-	linear_malloc->recs[linear_malloc->nrecs_used++] = (struct linear_malloc_rec) {
+	int ret = linear_malloc_index_insert_rec(linear_malloc, (struct linear_malloc_rec) {
 		.addr = allocptr,
 		.caller_requested_size = caller_requested_size,
 		.padding_to_caller_usable_size = real_caller_usable_size - caller_requested_size
-	};
-	
-	if (linear_malloc->nrecs_used > 1 &&
-			(uintptr_t) linear_malloc->recs[linear_malloc->nrecs_used - 1].addr <
-			(uintptr_t) linear_malloc->recs[linear_malloc->nrecs_used - 2].addr)
-	{
-		qsort(linear_malloc->recs,
-			linear_malloc->nrecs_used, sizeof (struct linear_malloc_rec),
-			compare_linear_mallocs);
-	}
+	});
+	hard_assert(ret == 0);
 }
 static void linear_malloc_index_delete(struct allocator *a,
 	struct linear_malloc_index_instance *ignored,
 	void *userptr,
 	sizefn_t *sizefn)
 {
-	struct linear_malloc_rec *found = find_linear_malloc_rec(userptr,
-		linear_malloc->recs,
-		MAX_LINEAR_MALLOCS, linear_malloc->nrecs_used);
-	found->addr = 0;
-	qsort(linear_malloc->recs,
-			linear_malloc->nrecs_used, sizeof (struct linear_malloc_rec),
-			compare_linear_mallocs);
-	assert(!linear_malloc->recs[linear_malloc->nrecs_used - 1].addr);
-	--linear_malloc->nrecs_used;
+	int ret = linear_malloc_index_delete_rec(linear_malloc, userptr);
+	assert(ret == 0);
 #if 0 /* version that assumes only the greatest addr can be freed... this is not quite
          the restriction */ 
 	if (found && found - linear_malloc->recs == linear_malloc->nrecs_used - 1)
@@ -497,8 +483,7 @@ static void linear_malloc_index_reinsert_after_resize(
 static inline
 size_t ld_so_malloc_usable_size(void *arg)
 {
-	return linear_malloc_usable_size(arg, linear_malloc->recs,
-		MAX_LINEAR_MALLOCS, linear_malloc->nrecs_used);
+	return linear_malloc_usable_size(arg, linear_malloc);
 }
 void __notify_free(void *arg) __attribute__((visibility("hidden")));
 void __notify_free(void *arg) {}
@@ -379,6 +379,40 @@ int __liballocs_walk_allocations_df(
 	walk_alloc_cb_t *cb,
 	void *arg
 );
+/* A whole-heap depth-first walk can be split into independent subtrees of
+ * the bigalloc tree -- top-level mapping sequences, children of bigallocs that
+ * have no suballocator, and imposed children -- which we hand out to a pool of
+ * threads. The contract is:
+ *
+ * - 'cb' may be called concurrently from several threads, and always with
+ *   the arg returned by 'subtree_begin' for the subtree being walked (or the
+ *   shared 'arg' if 'subtree_begin' is NULL); it must be thread-safe to the
+ *   extent that those args are shared.
+ * - paths passed to 'cb' stop at the root of the subtree (its 'encl' is NULL);
+ *   walk up further using the bigalloc parent links.
+ * - returning -1 from 'cb' skips the subtree as usual; any other non-zero
+ *   value stops the whole walk as soon as every thread notices, and is
+ *   returned.
+ * - 'subtree_end', if not NULL, is called once per subtree that was begun.
+ *   With ALLOC_WALK_PARALLEL_ORDERED it is called on the calling thread,
+ *   after all threads have finished, in increasing address order (outer
+ *   before inner), so results gathered per subtree can be merged in order;
+ *   otherwise it is called on the worker thread as soon as the subtree is done.
+ *
+ * 'nthreads' of zero means one per online CPU. */
+#define ALLOC_WALK_PARALLEL_ORDERED 0x1
+struct walk_df_parallel_ops
+{
+	walk_alloc_cb_t *cb;
+	void *(*subtree_begin)(struct big_allocation *subtree_root, void *arg);
+	void (*subtree_end)(struct big_allocation *subtree_root, void *subtree_arg, void *arg);
+};
+int __liballocs_walk_allocations_df_parallel(
+	const struct walk_df_parallel_ops *ops,
+	void *arg,
+	unsigned nthreads,
+	unsigned flags
+);
 /* We use our general cross-allocator depth-first traversal to write a reference walker,
  * parameterised by an interpreter (i.e. many notions of 'reference'). */
 struct walk_refs_state
@@ -463,6 +497,7 @@ void __mmap_allocator_notify_mmap(void *ret, void *requested_addr, size_t length
 void __mmap_allocator_notify_mremap(void *ret_addr, void *old_addr, size_t old_size,
 	size_t new_size, int flags, void *new_address, void *caller);
 void __mmap_allocator_notify_munmap(void *addr, size_t length, void *caller);
+void __mmap_allocator_notify_fds_closing(unsigned first, unsigned last) __attribute__((visibility("hidden")));
 
 _Bool __mmap_allocator_is_initialized(void) __attribute__((visibility("hidden")));
 _Bool __mmap_allocator_notify_unindexed_address(const void *ptr);
@@ -495,6 +530,11 @@ struct allocs_file_metadata
 	struct allocsites_vectors_by_base_id_entry *allocsites_info;
 	struct frame_allocsite_entry *frames_info;
 	unsigned nframes;
+	/* Optional two-level index over frames_info (see stackframe.c). */
+	uintptr_t frames_index_base_vaddr;
+	unsigned *frames_index_l1;
+	unsigned char *frames_index_l2;
+	unsigned frames_index_npages;
 	/* We extend the librunt structure. Since it is variable-size
 	 * at the end, we must put it at the end.
 	 * GAH. Actually this doesn't work! Not permitted in C. Need to
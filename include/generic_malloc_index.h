@@ -7,6 +7,7 @@
 #endif
 
 #include <stdbool.h>
+#include <string.h>
 #include <pthread.h>
 #include <dlfcn.h>
 #include "liballocs_config.h"
@@ -152,6 +153,7 @@ struct arena_bitmap_info
 	unsigned long bitmap_insert_count;
 	unsigned long biggest_allocated_object;
 	unsigned long biggest_unpromoted_object;
+	struct allocator *allocator; /* for footprint accounting */
 #ifdef TRACE_GENERIC_MALLOC_INDEX
 	/* Size the circular buffer of recently freed chunks */
 #define RECENTLY_FREED_SIZE 100
@@ -284,6 +286,9 @@ static inline struct arena_bitmap_info *ensure_arena_has_info(struct big_allocat
 		info->bitmap_insert_count = 0;
 		info->biggest_allocated_object = 0;
 		info->biggest_unpromoted_object = 0;
+		info->allocator = arena->suballocator;
+		__liballocs_footprint_add(LIBALLOCS_FOOTPRINT_ARENA_BITMAPS, info->allocator,
+			sizeof (*info));
 #ifdef TRACE_GENERIC_MALLOC_INDEX
 		info->next_recently_freed_to_replace = &info->recently_freed[0];
 		bzero(info->recently_freed, sizeof info->recently_freed);
@@ -324,6 +329,8 @@ static inline void ensure_has_bitmap_to(struct allocator *a,
 			total_words * sizeof (bitmap_word_t));
 		if (!info->bitmap) abort();
 		bzero(info->bitmap + info->nwords, (total_words - info->nwords) * sizeof (bitmap_word_t));
+		__liballocs_footprint_add(LIBALLOCS_FOOTPRINT_ARENA_BITMAPS, info->allocator,
+			(total_words - info->nwords) * sizeof (bitmap_word_t));
 		info->nwords = total_words;
 	}
 }
@@ -424,6 +431,7 @@ static inline struct insert *__generic_malloc_index_insert(
 #endif
 	/* Add it to the bitmap. */
 	bitmap_set_l(bitmap, (allocptr - info->bitmap_base_addr) / MALLOC_ALIGN);
+	LIBALLOCS_TRACE4(malloc_index_insert, a, allocptr, caller_requested_size, caller);
 out:
 	BIG_UNLOCK
 	return p_insert;
@@ -443,6 +451,7 @@ static inline void __generic_malloc_index_delete(struct allocator *a,
 	 * trailer.
 	 */
 	assert(userptr != NULL);
+	LIBALLOCS_TRACE2(malloc_index_delete, a, userptr);
 #ifndef NO_ALLOC_CACHE
 	void *allocptr = userptr;
 	__liballocs_uncache_all(allocptr, sizefn(allocptr)); // FIXME: per-allocator call
@@ -662,7 +671,7 @@ liballocs_err_t __generic_malloc_get_info(struct allocator *a, sizefn_t *sizefn,
 	struct uniqtype **out_type, void **out_base,
 	unsigned long *out_size, const void **out_site)
 {
-	++__liballocs_hit_heap_case;
+	__liballocs_count(LIBALLOCS_COUNTER_HIT_HEAP_CASE);
 	/* For heap allocations, we look up the allocation site.
 	 * (This also yields an offset within a toplevel object.)
 	 * Then we translate the allocation site to a uniqtypes rec location.
@@ -696,10 +705,15 @@ liballocs_err_t __generic_malloc_get_info(struct allocator *a, sizefn_t *sizefn,
 			 * for promoted chunks, we might know the size and base because we
 			 * can promote to bigalloc knowing just the original base pointer, from
 			 * which malloc_usable_size() can do the rest. */
-			++__liballocs_aborted_unindexed_heap;
+			__liballocs_count(LIBALLOCS_COUNTER_ABORTED_UNINDEXED_HEAP);
 			return &__liballocs_err_unindexed_heap_object;
 		}
 		assert(base);
+		/* The bitmap search went backwards from obj to base. */
+		if (__builtin_expect(__liballocs_query_histograms_enabled, 0))
+		{
+			__liballocs_record_scan_length(a, ((char*) obj - (char*) base) / MALLOC_ALIGN);
+		}
 		caller_usable_size = caller_usable_size_for_chunk_and_usable_size(base,
 			alloc_usable_chunksize);
 	}
@@ -731,6 +745,58 @@ liballocs_err_t __generic_malloc_set_type(struct allocator *a,
 	return NULL;
 }
 
+/* Walk the chunks of one arena. We copy the arena's bitmap with its lock
+ * held, so we see a consistent set of chunk starts and hold up the program
+ * only for a memcpy, then walk the copy with no lock held, so the callback
+ * is free to query us. A chunk freed since the copy is skipped, since
+ * looking it up no longer finds an object starting there. */
+static inline
+int __generic_malloc_walk_allocations(struct allocator *a, sizefn_t *sizefn,
+	struct alloc_tree_pos *pos, walk_alloc_cb_t *cb, void *arg,
+	void *maybe_range_begin, void *maybe_range_end)
+{
+	assert(BOU_IS_BIGALLOC(pos->bigalloc_or_uniqtype));
+	struct big_allocation *arena = BOU_BIGALLOC(pos->bigalloc_or_uniqtype);
+	struct arena_bitmap_info *info = arena->suballocator_private;
+	if (!info || arena->suballocator != a) return 0;
+	int lock_ret;
+	BIG_LOCK
+	void *bitmap_base_addr = info->bitmap_base_addr;
+	unsigned long nwords = info->nwords;
+	bitmap_word_t *bitmap = __liballocs_private_malloc((nwords ?: 1) * sizeof (bitmap_word_t));
+	if (bitmap) memcpy(bitmap, info->bitmap, nwords * sizeof (bitmap_word_t));
+	BIG_UNLOCK
+	if (!bitmap) return -1;
+	struct alloc_tree_link link = {
+		.container = { pos->base, pos->bigalloc_or_uniqtype },
+		.containee_coord = 0
+	};
+	int ret = 0;
+	for (unsigned long w = 0; w < nwords && !ret; ++w)
+	{
+		bitmap_word_t word = bitmap[w];
+		while (word && !ret)
+		{
+			unsigned bit = __builtin_ctzl(word);
+			word &= word - 1;
+			void *userptr = (char*) bitmap_base_addr
+				+ MALLOC_ALIGN * (w * BITMAP_WORD_NBITS + bit);
+			if (maybe_range_begin && (uintptr_t) userptr < (uintptr_t) maybe_range_begin) continue;
+			if (maybe_range_end && (uintptr_t) userptr >= (uintptr_t) maybe_range_end) goto out;
+			struct uniqtype *t = NULL;
+			const void *site = NULL;
+			void *base = NULL;
+			__generic_malloc_get_info(a, sizefn, userptr, NULL, &t, &base, NULL, &site);
+			if (base != userptr) continue;
+			++link.containee_coord;
+			ret = cb(NULL, userptr, t, site, &link, arg);
+		}
+	}
+out:
+	__liballocs_private_free(bitmap);
+	return ret;
+}
+
 static inline
 liballocs_err_t extract_and_output_alloc_site_and_type(
     struct insert *p_ins,
@@ -740,7 +806,7 @@ liballocs_err_t extract_and_output_alloc_site_and_type(
 {
 	if (!p_ins)
 	{
-		++__liballocs_aborted_unindexed_heap;
+		__liballocs_count(LIBALLOCS_COUNTER_ABORTED_UNINDEXED_HEAP);
 		return &__liballocs_err_unindexed_heap_object;
 	}
 
@@ -777,12 +843,9 @@ liballocs_err_t extract_and_output_alloc_site_and_type(
 		if (out_site) *out_site = alloc_site;
 		struct allocsite_entry *entry = __liballocs_find_allocsite_entry_at(alloc_site);
 		alloc_uniqtype = entry ? entry->uniqtype : NULL;
-		/* Remember the unrecog'd alloc sites we see. */
-		if (!alloc_uniqtype && alloc_site && 
-				!__liballocs_addrlist_contains(&__liballocs_unrecognised_heap_alloc_sites, alloc_site))
-		{
-			__liballocs_addrlist_add(&__liballocs_unrecognised_heap_alloc_sites, alloc_site);
-		}
+		/* Remember (and count) the unrecog'd alloc sites we see. */
+		if (!alloc_uniqtype && alloc_site) __liballocs_addrlist_add(
+			&__liballocs_unrecognised_heap_alloc_sites, alloc_site);
 #ifdef NDEBUG
 		// install it for future lookups
 		// FIXME: make this atomic using a union
@@ -809,9 +872,9 @@ liballocs_err_t extract_and_output_alloc_site_and_type(
 	{
 		//if (__builtin_expect(k == HEAP, 1))
 		//{
-			++__liballocs_aborted_unrecognised_allocsite;
+			__liballocs_count(LIBALLOCS_COUNTER_ABORTED_UNRECOGNISED_ALLOCSITE);
 		//}
-		//else ++__liballocs_aborted_stack;
+		//else __liballocs_count(LIBALLOCS_COUNTER_ABORTED_STACK);
 			
 		/* We used to do this in clear_alloc_site_metadata in libcrunch... 
 		 * In cases where heap classification failed, we null out the allocsite 
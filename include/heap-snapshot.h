@@ -0,0 +1,208 @@
+#ifndef HEAP_SNAPSHOT_H_
+#define HEAP_SNAPSHOT_H_
+
+#if defined(__cplusplus) || defined(c_plusplus)
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* A heap snapshot is a point-in-time dump of every allocation liballocs
+ * knows about, one row per allocation, sorted by base address (and outer
+ * before inner where allocations nest). It is stored column by column so
+ * that an offline reader can mmap the file and scan just the columns it
+ * needs. Names of allocators and types, and the object file that each
+ * allocation site lies in, are interned in a shared string table. Index
+ * zero of the type and site tables means "unknown".
+ *
+ * All sections are 8-byte aligned; offsets are from the start of the file. */
+#define HEAP_SNAPSHOT_MAGIC "LASNAP\0\1"
+#define HEAP_SNAPSHOT_VERSION 1
+#define HEAP_SNAPSHOT_NO_PARENT ((uint32_t) -1)
+#define HEAP_SNAPSHOT_ROW_IS_BIGALLOC 0x1
+
+enum heap_snapshot_section
+{
+	HEAP_SNAPSHOT_BASE,            /* uint64_t per row */
+	HEAP_SNAPSHOT_SIZE,            /* uint64_t per row */
+	HEAP_SNAPSHOT_PARENT,          /* uint32_t per row: row of the innermost enclosing allocation */
+	HEAP_SNAPSHOT_TYPE,            /* uint32_t per row: index into type table */
+	HEAP_SNAPSHOT_SITE,            /* uint32_t per row: index into site table */
+	HEAP_SNAPSHOT_ALLOCATOR,       /* uint16_t per row: index into allocator table */
+	HEAP_SNAPSHOT_FLAGS,           /* uint8_t per row */
+	HEAP_SNAPSHOT_ALLOCATOR_NAMES, /* uint32_t string offset per allocator */
+	HEAP_SNAPSHOT_TYPE_NAMES,      /* uint32_t string offset per type */
+	HEAP_SNAPSHOT_SITES,           /* struct heap_snapshot_site per site */
+	HEAP_SNAPSHOT_STRINGS,         /* NUL-terminated strings; offset 0 is "" */
+	HEAP_SNAPSHOT_NSECTIONS
+};
+struct heap_snapshot_site
+{
+	uint32_t file;                 /* string offset of the containing object's path */
+	uint32_t unused;
+	uint64_t offset;               /* from that object's load address */
+};
+struct heap_snapshot_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t pid;
+	uint64_t nrows;
+	uint64_t nallocators;
+	uint64_t ntypes;
+	uint64_t nsites;
+	struct
+	{
+		uint64_t offset;
+		uint64_t size;
+	} sections[HEAP_SNAPSHOT_NSECTIONS];
+};
+
+/* Write a snapshot of the current process's heap to 'path'. Returns 0 on
+ * success, or -1 with errno set. Only the copy of each malloc arena's
+ * bitmap happens with that arena's index locked; everything else runs
+ * alongside the program, so allocations that come or go during the call
+ * may or may not be included. */
+int __liballocs_write_heap_snapshot(const char *path);
+
+/* The reader needs nothing from liballocs, so offline tools can use it
+ * just by including this file. */
+struct heap_snapshot
+{
+	void *map;
+	size_t len;
+	const struct heap_snapshot_header *hdr;
+	uint64_t nrows;
+	const uint64_t *base;
+	const uint64_t *size;
+	const uint32_t *parent;
+	const uint32_t *type;
+	const uint32_t *site;
+	const uint16_t *allocator;
+	const uint8_t *flags;
+	const uint32_t *allocator_names;
+	const uint32_t *type_names;
+	const struct heap_snapshot_site *sites;
+	const char *strings;
+	uint64_t strings_len;
+};
+
+/* A section holds 'count' elements of 'elt_size' bytes each, and must lie
+ * after the header and within the file. The counts come from the file, so
+ * we check them against its length before multiplying. */
+static inline const void *heap_snapshot_section_(const struct heap_snapshot *s,
+	enum heap_snapshot_section which, uint64_t count, size_t elt_size)
+{
+	const uint64_t hdr_size = sizeof (struct heap_snapshot_header);
+	uint64_t off = s->hdr->sections[which].offset;
+	uint64_t sz = s->hdr->sections[which].size;
+	if (count > (s->len - hdr_size) / elt_size) return NULL;
+	if (sz != count * elt_size || off % 8 != 0 || off < hdr_size
+			|| off > s->len || sz > s->len - off) return NULL;
+	return (const char *) s->map + off;
+}
+/* Returns 0 on success, -1 if the file can't be mapped or isn't a snapshot. */
+static inline int heap_snapshot_open(const char *path, struct heap_snapshot *s)
+{
+	memset(s, 0, sizeof *s);
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) return -1;
+	struct stat st;
+	if (0 != fstat(fd, &st) || (size_t) st.st_size < sizeof (struct heap_snapshot_header))
+	{
+		close(fd);
+		return -1;
+	}
+	s->len = st.st_size;
+	s->map = mmap(NULL, s->len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (s->map == MAP_FAILED) { s->map = NULL; return -1; }
+	s->hdr = (const struct heap_snapshot_header *) s->map;
+	uint64_t n;
+	if (0 != memcmp(s->hdr->magic, HEAP_SNAPSHOT_MAGIC, sizeof s->hdr->magic)
+			|| s->hdr->version != HEAP_SNAPSHOT_VERSION) goto fail;
+	n = s->nrows = s->hdr->nrows;
+	s->strings_len = s->hdr->sections[HEAP_SNAPSHOT_STRINGS].size;
+#define HEAP_SNAPSHOT_GET_SECTION_(field, which, count) \
+	(s->field = (__typeof__(s->field)) heap_snapshot_section_(s, (which), (count), sizeof *s->field))
+	if (!HEAP_SNAPSHOT_GET_SECTION_(base, HEAP_SNAPSHOT_BASE, n)
+		|| !HEAP_SNAPSHOT_GET_SECTION_(size, HEAP_SNAPSHOT_SIZE, n)
+		|| !HEAP_SNAPSHOT_GET_SECTION_(parent, HEAP_SNAPSHOT_PARENT, n)
+		|| !HEAP_SNAPSHOT_GET_SECTION_(type, HEAP_SNAPSHOT_TYPE, n)
+		|| !HEAP_SNAPSHOT_GET_SECTION_(site, HEAP_SNAPSHOT_SITE, n)
+		|| !HEAP_SNAPSHOT_GET_SECTION_(allocator, HEAP_SNAPSHOT_ALLOCATOR, n)
+		|| !HEAP_SNAPSHOT_GET_SECTION_(flags, HEAP_SNAPSHOT_FLAGS, n)
+		|| !HEAP_SNAPSHOT_GET_SECTION_(allocator_names, HEAP_SNAPSHOT_ALLOCATOR_NAMES,
+				s->hdr->nallocators)
+		|| !HEAP_SNAPSHOT_GET_SECTION_(type_names, HEAP_SNAPSHOT_TYPE_NAMES, s->hdr->ntypes)
+		|| !HEAP_SNAPSHOT_GET_SECTION_(sites, HEAP_SNAPSHOT_SITES, s->hdr->nsites)
+		|| !HEAP_SNAPSHOT_GET_SECTION_(strings, HEAP_SNAPSHOT_STRINGS, s->strings_len)
+		|| s->strings_len == 0 || s->strings[s->strings_len - 1] != '\0') goto fail;
+#undef HEAP_SNAPSHOT_GET_SECTION_
+	return 0;
+fail:
+	munmap(s->map, s->len);
+	memset(s, 0, sizeof *s);
+	return -1;
+}
+static inline void heap_snapshot_close(struct heap_snapshot *s)
+{
+	if (s->map) munmap(s->map, s->len);
+	memset(s, 0, sizeof *s);
+}
+static inline const char *heap_snapshot_string_(const struct heap_snapshot *s, uint32_t off)
+{
+	return (off < s->strings_len) ? s->strings + off : "";
+}
+/* Find the innermost allocation containing 'addr', as a row number, or -1.
+ * We binary-search for the last allocation starting at or below addr, then
+ * follow parent links outwards until one contains it. */
+static inline long heap_snapshot_lookup(const struct heap_snapshot *s, uint64_t addr)
+{
+	uint64_t lo = 0, hi = s->nrows;
+	while (lo < hi)
+	{
+		uint64_t mid = lo + (hi - lo) / 2;
+		if (s->base[mid] <= addr) lo = mid + 1;
+		else hi = mid;
+	}
+	if (lo == 0) return -1;
+	uint64_t row = lo - 1;
+	for (;;)
+	{
+		if (addr - s->base[row] < s->size[row]) return (long) row;
+		if (s->parent[row] == HEAP_SNAPSHOT_NO_PARENT || s->parent[row] >= row) return -1;
+		row = s->parent[row];
+	}
+}
+static inline const char *heap_snapshot_allocator_name(const struct heap_snapshot *s, uint64_t row)
+{
+	uint16_t a = s->allocator[row];
+	return (a < s->hdr->nallocators) ? heap_snapshot_string_(s, s->allocator_names[a]) : "";
+}
+/* Returns NULL if the type is unknown. */
+static inline const char *heap_snapshot_type_name(const struct heap_snapshot *s, uint64_t row)
+{
+	uint32_t t = s->type[row];
+	return (t != 0 && t < s->hdr->ntypes) ? heap_snapshot_string_(s, s->type_names[t]) : NULL;
+}
+/* Returns NULL if the allocation site is unknown. */
+static inline const char *heap_snapshot_site(const struct heap_snapshot *s, uint64_t row,
+	uint64_t *out_offset)
+{
+	uint32_t i = s->site[row];
+	if (i == 0 || i >= s->hdr->nsites) return NULL;
+	if (out_offset) *out_offset = s->sites[i].offset;
+	return heap_snapshot_string_(s, s->sites[i].file);
+}
+
+#if defined(__cplusplus) || defined(c_plusplus)
+} /* end extern "C" */
+#endif
+
+#endif
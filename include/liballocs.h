@@ -52,14 +52,16 @@ struct allocator; // instead of allocmeta.h
 #include "vas.h"
 #include "liballocs_cil_inlines.h"
 
-extern unsigned long __liballocs_aborted_stack;
-extern unsigned long __liballocs_aborted_static;
+#include "liballocs_counters.h"
+/* These are what the exported counters used to be. Code built against
+ * older headers still increments them, so we keep them, and counts made
+ * there are folded into __liballocs_counter_read. Don't use them in new
+ * code. */
 extern unsigned long __liballocs_aborted_unknown_storage;
 extern unsigned long __liballocs_hit_heap_case;
-extern unsigned long __liballocs_hit_stack_case;
-extern unsigned long __liballocs_hit_static_case;
 extern unsigned long __liballocs_aborted_unindexed_heap;
 extern unsigned long __liballocs_aborted_unrecognised_allocsite;
+#include "liballocs_trace.h"
 
 /* This API is a mess because there are three different classes of client. 
  * 
@@ -78,8 +80,14 @@ extern unsigned long __liballocs_aborted_unrecognised_allocsite;
 
 // stuff for use by extenders only -- direct/weak clients shouldn't use this
 struct addrlist;
+struct addrlist_entry
+{
+	void *addr;
+	unsigned long count;
+};
 int __liballocs_addrlist_contains(struct addrlist *l, void *addr);
 void __liballocs_addrlist_add(struct addrlist *l, void *addr);
+unsigned __liballocs_addrlist_top(struct addrlist *l, struct addrlist_entry *out, unsigned n);
 extern struct addrlist __liballocs_unrecognised_heap_alloc_sites;
 
 extern void *__liballocs_main_bp; // beginning of main's stack frame
@@ -277,6 +285,11 @@ inline struct allocator *__liballocs_leaf_allocator_for(const void *obj,
 // declare some more stuff that our inlines need, but is really liballocs-internal
 _Bool __liballocs_notify_unindexed_address(const void *obj);
 void __liballocs_report_wild_address(const void *ptr);
+/* The mmap allocator defers munmap and mprotect notifications (see mmap.c).
+ * A query inside the range they cover must apply them first. */
+extern uintptr_t __mmap_allocator_journal_begin;
+extern uintptr_t __mmap_allocator_journal_end;
+void __mmap_allocator_flush_journal_for(const void *obj);
 
 /* Here "walk" is primarily walking "down". We do a little walking along,
  * in the case of unions. We do both iteratively. */
@@ -516,9 +529,25 @@ __liballocs_first_subobject_spanning(
 	}
 }
 
+/* Flattened per-uniqtype layout indexes (see uniqtype-layout.c). These are
+ * built on first use, for composites up to 64kB. Each call answers from
+ * one table probe, or says that no index is available (0 and -1
+ * respectively), in which case the caller should walk the members. */
+struct uniqtype_layout;
+#define LIBALLOCS_LAYOUT_SHORTCUT_MIN_MEMBERS 8
+const struct uniqtype_layout *__liballocs_get_uniqtype_layout(struct uniqtype *u);
+_Bool __liballocs_layout_get_inner_type(struct uniqtype *u, unsigned offset,
+	struct uniqtype **out_innermost, struct uniqtype **out_containing);
+int __liballocs_layout_has_subobject_at(struct uniqtype *u, unsigned offset,
+	struct uniqtype *test_t);
+int __liballocs_layout_has_subobject_at_if_built(struct uniqtype *u, unsigned offset,
+	struct uniqtype *test_t);
+_Bool __liballocs_layout_get_leaf(struct uniqtype *u, unsigned offset,
+	struct uniqtype **out_leaf, unsigned *out_leaf_begin);
+
 inline
 _Bool 
-__liballocs_find_matching_subobject(unsigned target_offset_within_uniqtype,
+__liballocs_find_matching_subobject_descend(unsigned target_offset_within_uniqtype,
 	struct uniqtype *cur_obj_uniqtype, struct uniqtype *test_uniqtype, 
 	struct uniqtype **last_attempted_uniqtype, unsigned *last_uniqtype_offset,
 		unsigned *p_cumulative_offset_searched,
@@ -555,7 +584,7 @@ __liballocs_find_matching_subobject(unsigned target_offset_within_uniqtype,
 		if (last_uniqtype_offset) *last_uniqtype_offset = sub_target_offset;
 		do {
 			assert(containing_uniqtype == cur_obj_uniqtype);
-			_Bool recursive_test = __liballocs_find_matching_subobject(
+			_Bool recursive_test = __liballocs_find_matching_subobject_descend(
 					sub_target_offset,
 					contained_uniqtype, test_uniqtype, 
 					last_attempted_uniqtype, last_uniqtype_offset, p_cumulative_offset_searched,
@@ -591,6 +620,44 @@ __liballocs_find_matching_subobject(unsigned target_offset_within_uniqtype,
 	}
 }
 
+inline
+_Bool 
+__liballocs_find_matching_subobject(unsigned target_offset_within_uniqtype,
+	struct uniqtype *cur_obj_uniqtype, struct uniqtype *test_uniqtype, 
+	struct uniqtype **last_attempted_uniqtype, unsigned *last_uniqtype_offset,
+		unsigned *p_cumulative_offset_searched,
+		struct uniqtype **p_cur_containing_uniqtype,
+		struct uniqtype_rel_info **p_cur_contained_pos)
+{
+	/* The descent is our primary path. But for a wide struct that already
+	 * has a flattened layout, one probe tells us whether there is a
+	 * test_uniqtype at this offset at all, so a failing search needn't
+	 * descend. We don't build layouts from here: narrow types never make
+	 * the call, and we never spend memory on a type just because it was
+	 * queried. We still report where the descent would have ended. */
+	if (test_uniqtype && target_offset_within_uniqtype != 0
+		&& UNIQTYPE_IS_COMPOSITE_TYPE(cur_obj_uniqtype)
+		&& UNIQTYPE_COMPOSITE_MEMBER_COUNT(cur_obj_uniqtype) >= LIBALLOCS_LAYOUT_SHORTCUT_MIN_MEMBERS
+		&& 0 == __liballocs_layout_has_subobject_at_if_built(cur_obj_uniqtype,
+				target_offset_within_uniqtype, test_uniqtype))
+	{
+		struct uniqtype *leaf;
+		unsigned leaf_begin;
+		if ((last_attempted_uniqtype || last_uniqtype_offset || p_cumulative_offset_searched)
+				&& __liballocs_layout_get_leaf(cur_obj_uniqtype, target_offset_within_uniqtype,
+					&leaf, &leaf_begin))
+		{
+			if (last_attempted_uniqtype) *last_attempted_uniqtype = leaf;
+			if (last_uniqtype_offset) *last_uniqtype_offset = target_offset_within_uniqtype - leaf_begin;
+			if (p_cumulative_offset_searched) *p_cumulative_offset_searched += leaf_begin;
+		}
+		return 0;
+	}
+	return __liballocs_find_matching_subobject_descend(target_offset_within_uniqtype,
+		cur_obj_uniqtype, test_uniqtype, last_attempted_uniqtype, last_uniqtype_offset,
+		p_cumulative_offset_searched, p_cur_containing_uniqtype, p_cur_contained_pos);
+}
+
 /* HACK HACK HACKETY HACK: we want our fast-path functions to be inlined.
  * However, there's a linking problem: we reference pageindex which is a protected
  * symbol. From an executable that is a client of liballocs, under the small code
@@ -614,6 +681,9 @@ __liballocs_get_alloc_info
 	const void **out_alloc_site)
 {
 	struct liballocs_err *err = 0;
+	unsigned long long t0 = __builtin_expect(__liballocs_query_histograms_enabled, 0)
+		? __builtin_ia32_rdtsc() : 0;
+	LIBALLOCS_TRACE1(query_entry, obj);
 	
 	/* This function is always asking about the leaf
 	 * allocator. And our cached memranges always
@@ -627,6 +697,11 @@ __liballocs_get_alloc_info
 	 * there's no need to query the allocator. The
 	 * cache entries should record the allocator. */
 
+	if (__builtin_expect((uintptr_t) obj - __mmap_allocator_journal_begin
+			< __mmap_allocator_journal_end - __mmap_allocator_journal_begin, 0))
+	{
+		__mmap_allocator_flush_journal_for(obj);
+	}
 	struct big_allocation *the_bigalloc;
 	struct allocator *a = __liballocs_leaf_allocator_for(obj, &the_bigalloc);
 	if (__builtin_expect(!a, 0))
@@ -640,7 +715,7 @@ __liballocs_get_alloc_info
 		else
 		{
 			__liballocs_report_wild_address(obj);
-			++__liballocs_aborted_unknown_storage;
+			__liballocs_count(LIBALLOCS_COUNTER_ABORTED_UNKNOWN_STORAGE);
 			err = &__liballocs_err_object_of_unknown_storage;
 			goto out_nocache;
 		}
@@ -655,6 +730,10 @@ __liballocs_get_alloc_info
 		/* We can cache something negative, if we like. */
 	}
 out_nocache:
+	LIBALLOCS_TRACE3(query_exit, obj, a, err);
+	if (__builtin_expect(t0 != 0, 0)) __liballocs_record_query_latency(a,
+		__liballocs_query_kind(out_alloc_start, out_alloc_size_bytes, out_alloc_uniqtype,
+			out_alloc_site), __builtin_ia32_rdtsc() - t0);
 	return err;
 }
 #else
@@ -692,7 +771,7 @@ __liballocs_get_alloc_info
 	({ \
 		static struct allocator *cached_allocator; \
 		static /*bigalloc_num_t */ unsigned short cached_num; \
-		(__builtin_expect(cached_num && __liballocs_pageindex[PAGENUM(obj)] == cached_num, 1)) ? \
+		(__builtin_expect(cached_num && PAGEINDEX_GET(PAGENUM(obj)) == cached_num, 1)) ? \
 		cached_allocator->get_type(obj) \
 		: __liballocs_get_alloc_type_with_fill(obj, &cached_allocator, &cached_num); \
 	})
@@ -708,7 +787,7 @@ __liballocs_get_alloc_type(void *obj);
 	({ \
 		static struct allocator *cached_allocator; \
 		static /*bigalloc_num_t*/ unsigned short cached_num; \
-		(__builtin_expect(cached_num && __liballocs_pageindex[PAGENUM(obj)] == cached_num, 1)) ? \
+		(__builtin_expect(cached_num && PAGEINDEX_GET(PAGENUM(obj)) == cached_num, 1)) ? \
 		generic_bitmap_get_base(obj, &__liballocs_big_allocations[cached_num]) \
 		: __liballocs_get_alloc_base_with_fill(obj, &cached_allocator, &cached_num); \
 	})
@@ -0,0 +1,152 @@
+#ifndef LIBALLOCS_COUNTERS_H_
+#define LIBALLOCS_COUNTERS_H_
+
+#if defined(__cplusplus) || defined(c_plusplus)
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+/* Query counters. Rather than one global per counter, which every thread
+ * would write to, each thread counts into one of a fixed set of shards,
+ * each on its own cache lines, and readers sum the shards. Threads only
+ * share a shard if there are more of them than shards, so the increment is
+ * atomic but almost never contended. See counters.c for how to read the
+ * counters live, from inside or outside the process. */
+enum liballocs_counter
+{
+	LIBALLOCS_COUNTER_ABORTED_STACK,
+	LIBALLOCS_COUNTER_ABORTED_STATIC,
+	LIBALLOCS_COUNTER_ABORTED_UNKNOWN_STORAGE,
+	LIBALLOCS_COUNTER_HIT_HEAP_CASE,
+	LIBALLOCS_COUNTER_HIT_ALLOCA_CASE,
+	LIBALLOCS_COUNTER_HIT_STACK_CASE,
+	LIBALLOCS_COUNTER_HIT_STATIC_CASE,
+	LIBALLOCS_COUNTER_ABORTED_UNINDEXED_HEAP,
+	LIBALLOCS_COUNTER_ABORTED_UNINDEXED_ALLOCA,
+	LIBALLOCS_COUNTER_ABORTED_UNRECOGNISED_ALLOCSITE,
+	LIBALLOCS_NCOUNTERS
+};
+#define LIBALLOCS_COUNTER_NSHARDS 64
+#define LIBALLOCS_CACHE_LINE_SIZE 64
+struct liballocs_counter_shard
+{
+	unsigned long counts[LIBALLOCS_NCOUNTERS];
+} __attribute__((aligned(LIBALLOCS_CACHE_LINE_SIZE)));
+extern struct liballocs_counter_shard *__liballocs_counter_shards;
+#ifndef NO_TLS
+extern __thread unsigned __liballocs_counter_shard_plus_one;
+#else
+extern unsigned __liballocs_counter_shard_plus_one;
+#endif
+unsigned __liballocs_counter_claim_shard(void);
+unsigned long __liballocs_counter_read(enum liballocs_counter c);
+const char *__liballocs_counter_name(enum liballocs_counter c);
+
+extern inline void __liballocs_count(enum liballocs_counter c) __attribute__((gnu_inline,always_inline));
+extern inline void __attribute__((gnu_inline)) __liballocs_count(enum liballocs_counter c)
+{
+	unsigned shard = __liballocs_counter_shard_plus_one;
+	if (__builtin_expect(!shard, 0)) shard = __liballocs_counter_claim_shard();
+	__atomic_fetch_add(&__liballocs_counter_shards[shard - 1].counts[c], 1, __ATOMIC_RELAXED);
+}
+
+/* The layout of the file named by LIBALLOCS_STATS_SHM, for scrapers. The
+ * header is followed, at shards_offset, by nshards shards of shard_size
+ * bytes each; counter i of a shard is the i'th unsigned long in it, and is
+ * named by names[i]. Sum over the shards to get a counter's value. */
+#define LIBALLOCS_STATS_SHM_MAGIC "LASTATS\0"
+#define LIBALLOCS_STATS_SHM_NAMELEN 48
+struct liballocs_stats_shm_header
+{
+	char magic[8];
+	uint32_t ncounters;
+	uint32_t nshards;
+	uint64_t shards_offset; /* shards are nshards * struct liballocs_counter_shard */
+	uint64_t shard_size;
+	char names[LIBALLOCS_NCOUNTERS][LIBALLOCS_STATS_SHM_NAMELEN];
+};
+
+/* Latency and scan-length histograms, per allocator and query kind. These
+ * are off unless LIBALLOCS_QUERY_HISTOGRAMS is set in the environment, in
+ * which case each query costs two rdtscs and an atomic increment. Buckets
+ * are log-linear, as in HdrHistogram: values below 2^LIBALLOCS_HIST_SUB_BITS
+ * get a bucket each, and each higher power of two is split into
+ * 2^LIBALLOCS_HIST_SUB_BITS equal buckets, so every value is within
+ * 1/2^LIBALLOCS_HIST_SUB_BITS of its bucket's lower bound. */
+enum liballocs_query_kind
+{
+	LIBALLOCS_QUERY_BASE,
+	LIBALLOCS_QUERY_SIZE,
+	LIBALLOCS_QUERY_TYPE,
+	LIBALLOCS_QUERY_SITE,
+	LIBALLOCS_QUERY_INFO, /* more than one of the above */
+	LIBALLOCS_NQUERY_KINDS
+};
+#define LIBALLOCS_HIST_SUB_BITS 3
+#define LIBALLOCS_HIST_MAX_LOG 48
+#define LIBALLOCS_HIST_NBUCKETS \
+	((LIBALLOCS_HIST_MAX_LOG - LIBALLOCS_HIST_SUB_BITS + 1) << LIBALLOCS_HIST_SUB_BITS)
+/* Pass this as the kind to read the bitmap scan-length histogram. */
+#define LIBALLOCS_HIST_SCAN_LENGTH (-1)
+
+struct allocator;
+extern _Bool __liballocs_query_histograms_enabled;
+void __liballocs_record_query_latency(struct allocator *a, enum liballocs_query_kind k,
+	unsigned long cycles);
+void __liballocs_record_scan_length(struct allocator *a, unsigned long nbits);
+/* Copies out LIBALLOCS_HIST_NBUCKETS counts. Returns -1 if nothing has been
+ * recorded for this allocator. */
+int __liballocs_read_query_histogram(struct allocator *a, int kind, unsigned long *out_buckets);
+unsigned long __liballocs_histogram_bucket_lower_bound(unsigned i);
+
+static inline enum liballocs_query_kind __liballocs_query_kind(const void *want_base,
+	const void *want_size, const void *want_type, const void *want_site)
+{
+	unsigned n = !!want_base + !!want_size + !!want_type + !!want_site;
+	if (n != 1) return LIBALLOCS_QUERY_INFO;
+	return want_base ? LIBALLOCS_QUERY_BASE : want_size ? LIBALLOCS_QUERY_SIZE
+		: want_type ? LIBALLOCS_QUERY_TYPE : LIBALLOCS_QUERY_SITE;
+}
+
+/* liballocs' own memory footprint, by category and by the allocator that
+ * the memory is spent on behalf of (NULL for liballocs' own structures).
+ * Memory we allocate and use straight away is counted as it comes and
+ * goes, as both reserved and committed. Big mappings that are only
+ * committed as they're touched are registered as regions instead, and
+ * their committed bytes found (with mincore()) only when asked for. */
+enum liballocs_footprint_category
+{
+	LIBALLOCS_FOOTPRINT_ARENA_BITMAPS,
+	LIBALLOCS_FOOTPRINT_SMALL_METADATA,       /* generic_small memrects and start bitmaps */
+	LIBALLOCS_FOOTPRINT_PAGEINDEX,
+	LIBALLOCS_FOOTPRINT_BIGALLOC_TABLE,
+	LIBALLOCS_FOOTPRINT_MAPPING_SEQUENCES,
+	LIBALLOCS_FOOTPRINT_META_DSOS,
+	LIBALLOCS_FOOTPRINT_SYNTHESISED_UNIQTYPES,
+	LIBALLOCS_NFOOTPRINT_CATEGORIES
+};
+struct liballocs_footprint
+{
+	unsigned long reserved;
+	unsigned long committed;
+};
+void __liballocs_footprint_add(enum liballocs_footprint_category c, struct allocator *a,
+	long nbytes);
+void __liballocs_footprint_add_region(enum liballocs_footprint_category c, struct allocator *a,
+	const void *begin, unsigned long len);
+void __liballocs_footprint_remove_region(enum liballocs_footprint_category c, struct allocator *a,
+	const void *begin, unsigned long len);
+/* Returns -1 if 'c' is not a category. */
+int __liballocs_get_footprint(enum liballocs_footprint_category c, struct allocator *a,
+	struct liballocs_footprint *out);
+/* As above, but summed over all allocators. */
+int __liballocs_get_total_footprint(enum liballocs_footprint_category c,
+	struct liballocs_footprint *out);
+const char *__liballocs_footprint_category_name(enum liballocs_footprint_category c);
+
+#if defined(__cplusplus) || defined(c_plusplus)
+} /* end extern "C" */
+#endif
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef LIBALLOCS_TRACE_H_
+#define LIBALLOCS_TRACE_H_
+
+/* Static tracepoints, for attaching perf, bpftrace or SystemTap to a
+ * running process without rebuilding it, e.g.
+ *
+ *   bpftrace -e 'usdt:/path/to/liballocs_preload.so:liballocs:query_exit
+ *       /arg2/ { @[str(*(uint64 *) arg2)] = count(); }'
+ *
+ * These are SystemTap-style SDT probes: each is a single nop plus a note
+ * in .note.stapsdt saying where its arguments live, so they need nothing
+ * from the kernel to compile in and cost next to nothing when nothing is
+ * attached. We only need <sys/sdt.h> to build them; without it, or with
+ * NO_TRACEPOINTS defined, they compile away to nothing. Arguments must be
+ * integers or pointers. The probes (all under the provider 'liballocs') are
+ *
+ *   malloc_index_insert(allocator, userptr, requested_size, site)
+ *   malloc_index_delete(allocator, userptr)
+ *   bigalloc_new(bigalloc, begin, end, allocator)
+ *   bigalloc_delete(bigalloc, begin, end, allocator)
+ *   bigalloc_extend(bigalloc, new_begin, new_end)
+ *   bigalloc_truncate(bigalloc, new_begin, new_end)
+ *   bigalloc_split(bigalloc, new_bigalloc, split_addr)
+ *   mmap(addr, length, prot, flags, caller)
+ *   munmap(addr, length, caller)
+ *   mremap(new_addr, old_addr, old_size, new_size, caller)
+ *   query_entry(obj)
+ *   query_exit(obj, allocator, err)       -- err is a struct liballocs_err *,
+ *                                            whose first field is the message
+ *   meta_dso_load(object_name, meta_dso_name, handle)
+ */
+#if !defined(NO_TRACEPOINTS) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define LIBALLOCS_HAVE_TRACEPOINTS 1
+#endif
+#endif
+
+#ifdef LIBALLOCS_HAVE_TRACEPOINTS
+#define LIBALLOCS_TRACE1(name, a1) \
+	STAP_PROBE1(liballocs, name, a1)
+#define LIBALLOCS_TRACE2(name, a1, a2) \
+	STAP_PROBE2(liballocs, name, a1, a2)
+#define LIBALLOCS_TRACE3(name, a1, a2, a3) \
+	STAP_PROBE3(liballocs, name, a1, a2, a3)
+#define LIBALLOCS_TRACE4(name, a1, a2, a3, a4) \
+	STAP_PROBE4(liballocs, name, a1, a2, a3, a4)
+#define LIBALLOCS_TRACE5(name, a1, a2, a3, a4, a5) \
+	STAP_PROBE5(liballocs, name, a1, a2, a3, a4, a5)
+#else
+#define LIBALLOCS_TRACE1(name, a1) do {} while (0)
+#define LIBALLOCS_TRACE2(name, a1, a2) do {} while (0)
+#define LIBALLOCS_TRACE3(name, a1, a2, a3) do {} while (0)
+#define LIBALLOCS_TRACE4(name, a1, a2, a3, a4) do {} while (0)
+#define LIBALLOCS_TRACE5(name, a1, a2, a3, a4, a5) do {} while (0)
+#endif
+
+#endif
@@ -7,6 +7,8 @@
 #endif
 
 #include <stdbool.h>
+#include <string.h>
+#include <sys/mman.h>
 #include "liballocs_config.h"
 #include "liballocs.h"
 #include "liballocs_ext.h"
@@ -20,6 +22,21 @@ struct linear_malloc_rec {
 	// te insert lives at userptr + caller_usable_size
 };
 
+/* Records are kept sorted by address in a list of page-sized leaves, found
+ * via a sorted directory of leaf pointers, so both inserts and lookups are
+ * two binary searches (plus a memmove within one leaf). We can't use the
+ * malloc bitmaps of generic_malloc_index.h because the ld.so's chunks
+ * are scattered across mappings that have no arena to hang a bitmap on. */
+#define LINEAR_MALLOC_LEAF_SIZE 4096
+#define LINEAR_MALLOC_LEAF_NRECS \
+	((LINEAR_MALLOC_LEAF_SIZE - sizeof (unsigned long) - sizeof (void *)) \
+		/ sizeof (struct linear_malloc_rec))
+struct linear_malloc_leaf {
+	unsigned long nrecs_used;
+	struct linear_malloc_leaf *next_free; /* only meaningful once emptied */
+	struct linear_malloc_rec recs[LINEAR_MALLOC_LEAF_NRECS];
+};
+
 struct linear_malloc_index_instance {
 	/* We have to chain a bigalloc-creating shim onto these once liballocs
 	 * starts up. Otherwise we won't be able to find the linear malloc arenas
@@ -31,44 +48,64 @@ struct linear_malloc_index_instance {
 	void *(**p_orig_calloc)(size_t, size_t);
 	void *(**p_orig_realloc)(void *, size_t);
 	void  (**p_orig_free)(void*);
-	struct linear_malloc_rec *recs;
-	unsigned nrecs;
+	/* Each leaf is non-empty and sorted, and all of one leaf's
+	 * addresses are below all of the next one's. */
+	struct linear_malloc_leaf **leaves;
+	unsigned nleaves;
+	unsigned nleaves_max;
 	unsigned nrecs_used;
+	/* Lookups take no lock, so a reader may still be in a leaf we have just
+	 * emptied, or in a directory we have just outgrown. So we never unmap
+	 * either. Emptied leaves go on this list for reuse; outgrown directories
+	 * are simply retired, which costs at most as much as the current one. */
+	struct linear_malloc_leaf *free_leaves;
 };
 
-
-#ifndef MAX_LINEAR_MALLOCS
+/* The instance lives in a page of its own, and the first directory of
+ * leaves goes in the rest of that page. */
 #define space_left_in_one_page  (\
     (4096 - \
      sizeof (struct linear_malloc_index_instance)) \
-    & ~((_Alignof (struct linear_malloc_rec)) - 1) \
+    & ~((_Alignof (struct linear_malloc_leaf *)) - 1) \
 )
-#define MAX_LINEAR_MALLOCS \
-   ( (space_left_in_one_page) / (sizeof (struct linear_malloc_rec)) )
-#endif
+#define LINEAR_MALLOC_INLINE_NLEAVES \
+   ( (space_left_in_one_page) / (sizeof (struct linear_malloc_leaf *)) )
+
+#define LINEAR_MALLOC_DIR_NBYTES(nleaves) \
+	((((nleaves) * sizeof (struct linear_malloc_leaf *)) + 4095) & ~(size_t) 4095)
+
+#define for_each_linear_malloc_rec(p_rec, inst) \
+	for (unsigned _i_leaf = 0; _i_leaf < (inst)->nleaves; ++_i_leaf) \
+		for (struct linear_malloc_rec *p_rec = &(inst)->leaves[_i_leaf]->recs[0]; \
+			p_rec != &(inst)->leaves[_i_leaf]->recs[(inst)->leaves[_i_leaf]->nrecs_used]; \
+			++p_rec)
 
-static inline int compare_linear_mallocs(const void *arg1, const void *arg2)
+/* The leaf whose range an address would fall in: the last one starting
+ * at or below it, or the first one if none does. */
+static inline
+unsigned linear_malloc_leaf_idx(void *addr, struct linear_malloc_index_instance *inst)
 {
-	/* Mostly we just compare the addresses. But we want null
-	 * addresses to float to the end, to handle deletions properly.
-	 * So... */
-	void *addr1 = ((struct linear_malloc_rec *) arg1)->addr;
-	void *addr2 = ((struct linear_malloc_rec *) arg2)->addr;
-	if (!addr1 && !addr2) return 0;
-	if (!addr1) /* first argument is greater */ return 1;
-	if (!addr2) /* second argument is greater */ return -1;	
-	return (uintptr_t) addr1 - (uintptr_t) addr2;
+#define proj(p_leaf) ((uintptr_t)(*(p_leaf))->recs[0].addr)
+	struct linear_malloc_leaf **found = bsearch_leq_generic(struct linear_malloc_leaf *,
+		(uintptr_t) addr,
+		inst->leaves,
+		inst->nleaves,
+		proj);
+#undef proj
+	return found ? found - inst->leaves : 0;
 }
 
 static inline
-struct linear_malloc_rec *find_linear_malloc_rec(void* addr, struct linear_malloc_rec *recs,
-	unsigned nrecs, unsigned nrecs_used)
+struct linear_malloc_rec *find_linear_malloc_rec(void* addr,
+	struct linear_malloc_index_instance *inst)
 {
+	if (inst->nleaves == 0) return NULL;
+	struct linear_malloc_leaf *leaf = inst->leaves[linear_malloc_leaf_idx(addr, inst)];
 #define proj(r) ((uintptr_t)(r)->addr)
 	struct linear_malloc_rec *found = bsearch_leq_generic(struct linear_malloc_rec,
 		(uintptr_t) addr,
-		recs,
-		nrecs_used,
+		leaf->recs,
+		leaf->nrecs_used,
 		proj);
 #undef proj
 	/* Does 'found' span the address we're looking for? */
@@ -77,11 +114,10 @@ struct linear_malloc_rec *find_linear_malloc_rec(void* addr, struct linear_mallo
 	) return found; else return NULL;
 }
 
-static inline size_t linear_malloc_usable_size(void *arg, struct linear_malloc_rec *recs,
-	unsigned nrecs, unsigned nrecs_used)
+static inline size_t linear_malloc_usable_size(void *arg,
+	struct linear_malloc_index_instance *inst)
 {
-	struct linear_malloc_rec *found
-	 = find_linear_malloc_rec(arg, recs, nrecs, nrecs_used);
+	struct linear_malloc_rec *found = find_linear_malloc_rec(arg, inst);
 	if (found && found->addr == arg)
 	{
 		return found->caller_requested_size + found->padding_to_caller_usable_size;
@@ -89,4 +125,139 @@ static inline size_t linear_malloc_usable_size(void *arg, struct linear_malloc_r
 	return (size_t) -1;
 }
 
+/* We may be running inside the ld.so before anything else is set up,
+ * so we get our memory straight from mmap. */
+static inline
+struct linear_malloc_leaf *linear_malloc_new_leaf(struct linear_malloc_index_instance *inst)
+{
+	if (inst->free_leaves)
+	{
+		struct linear_malloc_leaf *leaf = inst->free_leaves;
+		inst->free_leaves = leaf->next_free;
+		return leaf;
+	}
+	void *ret = mmap(NULL, LINEAR_MALLOC_LEAF_SIZE, PROT_READ|PROT_WRITE,
+		MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (ret == MAP_FAILED) return NULL;
+	return (struct linear_malloc_leaf *) ret;
+}
+
+static inline
+void linear_malloc_free_leaf(struct linear_malloc_index_instance *inst,
+	struct linear_malloc_leaf *leaf)
+{
+	leaf->nrecs_used = 0;
+	leaf->next_free = inst->free_leaves;
+	inst->free_leaves = leaf;
+}
+
+/* Make room for a new leaf at directory position 'pos'. */
+static inline
+int linear_malloc_add_leaf(struct linear_malloc_index_instance *inst, unsigned pos,
+	struct linear_malloc_leaf *leaf)
+{
+	if (inst->nleaves == inst->nleaves_max)
+	{
+		size_t new_max = 2 * (size_t) inst->nleaves_max;
+		size_t new_sz = LINEAR_MALLOC_DIR_NBYTES(new_max);
+		void *new_leaves = mmap(NULL, new_sz, PROT_READ|PROT_WRITE,
+			MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		if (new_leaves == MAP_FAILED) return -1;
+		memcpy(new_leaves, inst->leaves, inst->nleaves * sizeof (struct linear_malloc_leaf *));
+		/* The old directory stays mapped; see free_leaves. */
+		inst->leaves = (struct linear_malloc_leaf **) new_leaves;
+		inst->nleaves_max = new_sz / sizeof (struct linear_malloc_leaf *);
+	}
+	memmove(&inst->leaves[pos + 1], &inst->leaves[pos],
+		(inst->nleaves - pos) * sizeof (struct linear_malloc_leaf *));
+	inst->leaves[pos] = leaf;
+	++inst->nleaves;
+	return 0;
+}
+
+static inline
+int linear_malloc_index_insert_rec(struct linear_malloc_index_instance *inst,
+	struct linear_malloc_rec rec)
+{
+	if (inst->nleaves == 0)
+	{
+		struct linear_malloc_leaf *leaf = linear_malloc_new_leaf(inst);
+		if (!leaf) return -1;
+		leaf->nrecs_used = 0;
+		if (0 != linear_malloc_add_leaf(inst, 0, leaf))
+		{
+			linear_malloc_free_leaf(inst, leaf);
+			return -1;
+		}
+	}
+	unsigned idx = linear_malloc_leaf_idx(rec.addr, inst);
+	struct linear_malloc_leaf *leaf = inst->leaves[idx];
+	if (leaf->nrecs_used == LINEAR_MALLOC_LEAF_NRECS)
+	{
+		/* Split. ld.so mallocs are mostly increasing, so if we're
+		 * appending to the last leaf, start a fresh one rather than
+		 * leaving two half-empty leaves behind. */
+		struct linear_malloc_leaf *new_leaf = linear_malloc_new_leaf(inst);
+		if (!new_leaf) return -1;
+		_Bool appending = (idx == inst->nleaves - 1)
+			&& (uintptr_t) rec.addr > (uintptr_t) leaf->recs[leaf->nrecs_used - 1].addr;
+		unsigned long nkeep = appending ? leaf->nrecs_used : leaf->nrecs_used / 2;
+		new_leaf->nrecs_used = leaf->nrecs_used - nkeep;
+		memcpy(&new_leaf->recs[0], &leaf->recs[nkeep],
+			new_leaf->nrecs_used * sizeof (struct linear_malloc_rec));
+		if (appending)
+		{
+			new_leaf->recs[0] = rec;
+			new_leaf->nrecs_used = 1;
+		}
+		if (0 != linear_malloc_add_leaf(inst, idx + 1, new_leaf))
+		{
+			linear_malloc_free_leaf(inst, new_leaf);
+			return -1;
+		}
+		leaf->nrecs_used = nkeep;
+		if (appending) { ++inst->nrecs_used; return 0; }
+		if ((uintptr_t) rec.addr >= (uintptr_t) new_leaf->recs[0].addr) leaf = new_leaf;
+	}
+	/* Insert after any records at or below our address. */
+	unsigned long pos = 0;
+#define proj(r) ((uintptr_t)(r)->addr)
+	struct linear_malloc_rec *found = bsearch_leq_generic(struct linear_malloc_rec,
+		(uintptr_t) rec.addr,
+		leaf->recs,
+		leaf->nrecs_used,
+		proj);
+#undef proj
+	if (found) pos = (found - &leaf->recs[0]) + 1;
+	memmove(&leaf->recs[pos + 1], &leaf->recs[pos],
+		(leaf->nrecs_used - pos) * sizeof (struct linear_malloc_rec));
+	leaf->recs[pos] = rec;
+	++leaf->nrecs_used;
+	++inst->nrecs_used;
+	return 0;
+}
+
+static inline
+int linear_malloc_index_delete_rec(struct linear_malloc_index_instance *inst, void *addr)
+{
+	if (inst->nleaves == 0) return -1;
+	unsigned idx = linear_malloc_leaf_idx(addr, inst);
+	struct linear_malloc_leaf *leaf = inst->leaves[idx];
+	struct linear_malloc_rec *found = find_linear_malloc_rec(addr, inst);
+	if (!found || found->addr != addr) return -1;
+	unsigned long pos = found - &leaf->recs[0];
+	memmove(&leaf->recs[pos], &leaf->recs[pos + 1],
+		(leaf->nrecs_used - pos - 1) * sizeof (struct linear_malloc_rec));
+	--leaf->nrecs_used;
+	--inst->nrecs_used;
+	if (leaf->nrecs_used == 0)
+	{
+		memmove(&inst->leaves[idx], &inst->leaves[idx + 1],
+			(inst->nleaves - idx - 1) * sizeof (struct linear_malloc_leaf *));
+		--inst->nleaves;
+		linear_malloc_free_leaf(inst, leaf);
+	}
+	return 0;
+}
+
 #endif
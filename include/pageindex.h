@@ -7,6 +7,16 @@
 #define PAGEINDEX_ADDRESS 0x410000000000ul
 #define PAGEINDEX_SIZE_BYTES ((sizeof (bigalloc_num_t)) * DIVIDE_ROUNDING_UP(((uintptr_t)MAXIMUM_USER_ADDRESS), MIN_PAGE_SIZE) )
 
+/* The huge pageindex has one entry per 2MB region, and sits immediately after
+ * the pageindex proper (which also takes care of mapping it). See below. */
+#define LOG_PAGEINDEX_REGION_SIZE 21
+#define PAGEINDEX_REGION_PAGES (1ul << (LOG_PAGEINDEX_REGION_SIZE - LOG_PAGE_SIZE))
+#define PAGEINDEX_REGION(pagenum) ((uintptr_t) (pagenum) >> (LOG_PAGEINDEX_REGION_SIZE - LOG_PAGE_SIZE))
+#define HUGEPAGEINDEX_ADDRESS \
+	(PAGEINDEX_ADDRESS + (sizeof (bigalloc_num_t)) * (((uintptr_t) MAXIMUM_USER_ADDRESS + 1) >> LOG_PAGE_SIZE))
+#define HUGEPAGEINDEX_SIZE_BYTES \
+	((sizeof (bigalloc_num_t)) * (((uintptr_t) MAXIMUM_USER_ADDRESS + 1) >> LOG_PAGEINDEX_REGION_SIZE))
+
 /* We maintain two structures:
  *
  * - an array of "big allocations";
@@ -20,7 +30,15 @@
  * Indeed, one of the points of "big allocations" is to centralise the
  * complex business of allocation nesting. Since all nested allocations
  * are made out of a bigalloc, we can handle all that stuff here once
- * for every possible leaf allocator.
+ * for every possible leaf allocator. *
+ * To avoid writing millions of pageindex entries for very large mappings,
+ * a 2MB region that is wholly spanned by a top-level bigalloc may instead
+ * be recorded by a single entry in the "huge pageindex". A zero pageindex
+ * entry then means "look in the huge pageindex", and a nonzero one always
+ * wins, since it records something deeper. So readers should go via
+ * PAGEINDEX_GET() rather than indexing the pageindex directly. Entering,
+ * removing or resizing a huge top-level bigalloc then costs time
+ * proportional to its regions, not its pages.
  */
 
 struct allocator;
@@ -79,8 +97,26 @@ typedef uint16_t bigalloc_num_t;
 extern bigalloc_num_t *pageindex __attribute__((weak));
 #endif
 /* See comment in liballocs.h. Copy relocations against __liballocs_pageindex are bad. */
+#ifdef IN_LIBALLOCS_DSO
+extern bigalloc_num_t *hugepageindex __attribute__((weak));
+#endif
 #if defined(__PIC__) || defined(__code_model_large__)
 extern bigalloc_num_t *__liballocs_pageindex __attribute__((weak));
+extern bigalloc_num_t *__liballocs_hugepageindex __attribute__((weak));
+#endif
+static inline bigalloc_num_t __liballocs_pageindex_get_from(bigalloc_num_t *pi,
+	bigalloc_num_t *hpi, uintptr_t pagenum)
+{
+	bigalloc_num_t num = pi[pagenum];
+	if (__builtin_expect(num != 0, 1)) return num;
+	return hpi[PAGEINDEX_REGION(pagenum)];
+}
+#ifdef IN_LIBALLOCS_DSO
+#define PAGEINDEX_GET(pagenum) \
+	__liballocs_pageindex_get_from(pageindex, hugepageindex, (pagenum))
+#else
+#define PAGEINDEX_GET(pagenum) \
+	__liballocs_pageindex_get_from(__liballocs_pageindex, __liballocs_hugepageindex, (pagenum))
 #endif
 enum object_memory_kind __liballocs_get_memory_kind(const void *obj) __attribute__((visibility("protected")));
 
@@ -91,6 +127,17 @@ struct big_allocation *__liballocs_new_bigalloc(const void *ptr, size_t size,
 	void *allocator_private, void (*allocator_private_free)(void*),
 	struct big_allocation *maybe_parent, struct allocator *a);
 
+struct bigalloc_batch_entry
+{
+	const void *begin;
+	size_t size;
+	void *allocator_private;
+};
+unsigned __liballocs_new_toplevel_bigallocs_sorted(
+	const struct bigalloc_batch_entry *ents, unsigned n,
+	void (*allocator_private_free)(void*), struct allocator *allocated_by,
+	struct big_allocation **out_bigallocs) __attribute__((visibility("hidden")));
+
 _Bool __liballocs_delete_bigalloc_at(const void *begin, struct allocator *a);
 _Bool __liballocs_extend_bigalloc(struct big_allocation *b, const void *new_end);
 _Bool __liballocs_pre_extend_bigalloc(struct big_allocation *b, const void *new_begin);
@@ -137,7 +184,8 @@ inline struct big_allocation *__liballocs_get_bigalloc_containing(const void *ob
 	// if (__builtin_expect(obj == 0, 0)) return NULL;
 	// if (__builtin_expect(obj == (void*) -1, 0)) return NULL;
 	/* More heuristics go here. */
-	bigalloc_num_t bigalloc_num = __liballocs_pageindex[PAGENUM(obj)];
+	bigalloc_num_t bigalloc_num = __liballocs_pageindex_get_from(__liballocs_pageindex,
+		__liballocs_hugepageindex, PAGENUM(obj));
 	if (bigalloc_num == 0) return NULL;
 	struct big_allocation *b = &__liballocs_big_allocations[bigalloc_num];
 	return b;
@@ -0,0 +1,32 @@
+#ifndef UNIQTYPE_PTRMAP_H_
+#define UNIQTYPE_PTRMAP_H_
+
+/* A pointer map is a bitmap with one bit per word of a type, set where
+ * that word is a pointer slot, plus the static type of each slot in
+ * order. A slot's type is NULL where overlapping members (say, of a union)
+ * hold pointers of different types there; callers that care must look at
+ * the members themselves. Maps are computed lazily (see uniqtype-layout.c)
+ * for types of known size up to 64kB whose pointers are all word-aligned. */
+struct uniqtype_ptrmap
+{
+	struct uniqtype *t;
+	unsigned size;               /* in bytes */
+	unsigned nwords;
+	unsigned nptrs;              /* number of bits set */
+	struct uniqtype **ptr_types; /* one per bit set, in address order */
+	unsigned long bits[];
+};
+
+const struct uniqtype_ptrmap *__liballocs_get_ptrmap(struct uniqtype *t);
+
+typedef void uniqtype_ptrmap_slot_fn(void **slot, struct uniqtype *ptr_t /* may be NULL */, void *arg);
+/* Call 'cb' on every pointer slot of an object of type 't' lying wholly
+ * within its first 'size' bytes. Arrays (including ones of unbounded
+ * length) are done by stride over their element type's map. Returns 0,
+ * having done nothing, if there is no map, so the caller should walk
+ * the type's members itself. Otherwise '*out_covered' says how many
+ * bytes the type accounted for. */
+_Bool __liballocs_for_each_pointer_slot(void *obj, struct uniqtype *t, unsigned long size,
+	uniqtype_ptrmap_slot_fn *cb, void *arg, unsigned long *out_covered);
+
+#endif
@@ -4,30 +4,166 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include <sched.h>
+#ifndef NO_PTHREADS
+#include <pthread.h>
+#endif
 
 #include "liballocs_private.h"
 
 #include <stdlib.h>
 
-int __liballocs_addrlist_contains(struct addrlist *l, void *addr) __attribute__((visibility("protected")));
-int __liballocs_addrlist_contains(struct addrlist *l, void *addr)
+/* An addrlist is a set of addresses, each with a count of how many times it
+ * has been added. It is an open-addressing hash table with linear probing,
+ * and slots are claimed with a CAS, so lookups and adds don't lock. We only
+ * take a lock to grow the table, which we do once it is half full.
+ *
+ * Growing can race with adds. The grower freezes the old table before it
+ * copies it, and an adder that finds the table frozen after claiming its
+ * slot adds again to the new one; so no address is lost, although a count
+ * bumped during the copy may be. Counts are statistics, so we live with
+ * that. Old tables are never freed, because readers may still be in them;
+ * since the table doubles each time, that costs at most what we're using. */
+
+#define ADDRLIST_LOG_INITIAL_NSLOTS 6
+
+__attribute__((visibility("hidden")))
+__thread _Bool __liballocs_addrlist_add_suppressed;
+
+#ifndef NO_PTHREADS
+static pthread_mutex_t grow_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static inline unsigned long hash_addr(void *addr)
 {
-	for (unsigned i = 0; i < l->count; ++i)
+	/* Fibonacci hashing; code addresses are dense in their low bits. */
+	return ((uintptr_t) addr >> 2) * 11400714819323198485ul;
+}
+
+static struct addrlist_entry *find_slot(struct addrlist_table *t, void *addr)
+{
+	unsigned long mask = t->nslots - 1;
+	for (unsigned long i = hash_addr(addr) >> (64 - t->log_nslots); ; i = (i + 1) & mask)
 	{
-		if (l->addrs[i] == addr) return 1 + i;
+		void *k = __atomic_load_n(&t->entries[i].addr, __ATOMIC_ACQUIRE);
+		if (k == addr || !k) return &t->entries[i];
 	}
-	return 0;
 }
+
+static struct addrlist_table *new_table(unsigned log_nslots)
+{
+	struct addrlist_table *t = __private_malloc(sizeof (struct addrlist_table)
+		+ (1ul << log_nslots) * sizeof (struct addrlist_entry));
+	if (!t) abort();
+	t->log_nslots = log_nslots;
+	t->nslots = 1ul << log_nslots;
+	t->frozen = 0;
+	memset(t->entries, 0, t->nslots * sizeof (struct addrlist_entry));
+	return t;
+}
+
+static void grow(struct addrlist *l, struct addrlist_table *old)
+{
+#ifndef NO_PTHREADS
+	pthread_mutex_lock(&grow_mutex);
+#endif
+	/* Someone may have beaten us to it. */
+	if (__atomic_load_n(&l->table, __ATOMIC_ACQUIRE) != old) goto out;
+	struct addrlist_table *t = new_table(old ? old->log_nslots + 1
+		: ADDRLIST_LOG_INITIAL_NSLOTS);
+	if (old)
+	{
+		__atomic_store_n(&old->frozen, 1, __ATOMIC_SEQ_CST);
+		for (unsigned long i = 0; i < old->nslots; ++i)
+		{
+			void *k = __atomic_load_n(&old->entries[i].addr, __ATOMIC_SEQ_CST);
+			if (!k) continue;
+			struct addrlist_entry *e = find_slot(t, k);
+			e->addr = k;
+			e->count = __atomic_load_n(&old->entries[i].count, __ATOMIC_RELAXED);
+		}
+	}
+	__atomic_store_n(&l->table, t, __ATOMIC_RELEASE);
+out:
+#ifndef NO_PTHREADS
+	pthread_mutex_unlock(&grow_mutex);
+#endif
+	return;
+}
+
+int __liballocs_addrlist_contains(struct addrlist *l, void *addr) __attribute__((visibility("protected")));
+int __liballocs_addrlist_contains(struct addrlist *l, void *addr)
+{
+	struct addrlist_table *t = __atomic_load_n(&l->table, __ATOMIC_ACQUIRE);
+	if (!t || !addr) return 0;
+	return __atomic_load_n(&find_slot(t, addr)->addr, __ATOMIC_ACQUIRE) == addr;
+}
+/* Adds 'addr' if it's not already there, and counts it either way. */
 void __liballocs_addrlist_add(struct addrlist *l, void *addr) __attribute__((visibility("protected")));
 void __liballocs_addrlist_add(struct addrlist *l, void *addr)
 {
-	if (l->count == l->allocsz)
+	if (!addr || __liballocs_addrlist_add_suppressed) return;
+	for (;;)
+	{
+		struct addrlist_table *t = __atomic_load_n(&l->table, __ATOMIC_ACQUIRE);
+		if (!t || 2 * (__atomic_load_n(&l->count, __ATOMIC_RELAXED) + 1) > t->nslots)
+		{
+			grow(l, t);
+			continue;
+		}
+		struct addrlist_entry *e = find_slot(t, addr);
+		void *expected = NULL;
+		_Bool claimed = 0;
+		if (__atomic_load_n(&e->addr, __ATOMIC_ACQUIRE) != addr)
+		{
+			if (!__atomic_compare_exchange_n(&e->addr, &expected, addr,
+					/* weak */ 0, __ATOMIC_SEQ_CST, __ATOMIC_ACQUIRE))
+			{
+				/* Someone claimed it. If it was for our address, fine. */
+				if (expected != addr) continue;
+			}
+			else claimed = 1;
+		}
+		if (claimed) __atomic_add_fetch(&l->count, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&e->count, 1, __ATOMIC_RELAXED);
+		if (!__atomic_load_n(&t->frozen, __ATOMIC_SEQ_CST)) return;
+		/* The table was being copied; make sure our address made it into
+		 * the new one, or else add it there. */
+		while (__atomic_load_n(&l->table, __ATOMIC_ACQUIRE) == t) sched_yield();
+		if (__liballocs_addrlist_contains(l, addr)) return;
+		if (claimed) __atomic_sub_fetch(&l->count, 1, __ATOMIC_RELAXED);
+	}
+}
+
+static int compare_entries_by_count_desc(const void *arg1, const void *arg2)
+{
+	const struct addrlist_entry *e1 = arg1;
+	const struct addrlist_entry *e2 = arg2;
+	return (e1->count < e2->count) ? 1 : (e1->count > e2->count) ? -1 : 0;
+}
+/* Fill 'out' with up to 'n' of the most-added addresses, most added first.
+ * Returns how many we filled. */
+unsigned __liballocs_addrlist_top(struct addrlist *l, struct addrlist_entry *out, unsigned n) __attribute__((visibility("protected")));
+unsigned __liballocs_addrlist_top(struct addrlist *l, struct addrlist_entry *out, unsigned n)
+{
+	struct addrlist_table *t = __atomic_load_n(&l->table, __ATOMIC_ACQUIRE);
+	if (!t || n == 0) return 0;
+	struct addrlist_entry *all = __private_malloc(t->nslots * sizeof (struct addrlist_entry));
+	if (!all) return 0;
+	unsigned long nall = 0;
+	for (unsigned long i = 0; i < t->nslots; ++i)
 	{
-		++(l->allocsz);
-		l->allocsz *= 2;
-		l->addrs = __private_realloc(
-			l->addrs,
-			l->allocsz * sizeof (void*));
+		void *k = __atomic_load_n(&t->entries[i].addr, __ATOMIC_ACQUIRE);
+		if (!k) continue;
+		all[nall++] = (struct addrlist_entry) {
+			.addr = k,
+			.count = __atomic_load_n(&t->entries[i].count, __ATOMIC_RELAXED)
+		};
 	}
-	l->addrs[l->count++] = addr;
+	qsort(all, nall, sizeof (struct addrlist_entry), compare_entries_by_count_desc);
+	unsigned nout = MIN(nall, n);
+	memcpy(out, all, nout * sizeof (struct addrlist_entry));
+	__private_free(all);
+	return nout;
 }
@@ -51,7 +51,7 @@ liballocs_err_t __alloca_get_info(void *obj, struct big_allocation *b,
 	struct uniqtype **out_type, void **out_base,
 	unsigned long *out_size, const void **out_site)
 {
-	++__liballocs_hit_alloca_case;
+	__liballocs_count(LIBALLOCS_COUNTER_HIT_ALLOCA_CASE);
 	struct insert *heap_info = NULL;
 	void *base;
 	size_t caller_usable_size;
@@ -65,7 +65,7 @@ liballocs_err_t __alloca_get_info(void *obj, struct big_allocation *b,
 		obj, &base, &alloc_usable_chunksize, NULL, usable_size)))
 	{
 		/* For an unindexed chunk, we don't know the base, so we don't know anything. */
-		++__liballocs_aborted_unindexed_alloca;
+		__liballocs_count(LIBALLOCS_COUNTER_ABORTED_UNINDEXED_ALLOCA);
 		return &__liballocs_err_unindexed_alloca_object;
 	}
 	assert(base);
@@ -87,65 +87,96 @@ struct allocator __alloca_allocator = {
 };
 static void ensure_arena_covers_addr(struct big_allocation *arena, void *addr);
 
+/* Each frame that does alloca gets one of these as its bigalloc's
+ * suballocator_private. The generic malloc index code only ever sees
+ * the bitmap info, so that must come first. Alongside it we keep the
+ * frame's chain of alloca'd chunks, in allocation order, so that
+ * unindexing on return touches only the chunks this frame actually
+ * allocated, rather than scanning the bitmap upwards from sp. We can't
+ * thread the chain through the chunks themselves, because the alloca
+ * header is a single word (the usable size) and the instrumented code
+ * inlines its layout; so it lives out-of-line here instead. Only the
+ * thread owning the frame ever touches its chain, so it needs no lock. */
+struct alloca_frame_info
+{
+	struct arena_bitmap_info bitmap_info; /* must be first */
+	void **chunks;
+	unsigned nchunks;
+	unsigned chunks_capacity;
+};
+
+static void free_alloca_frame_info(void *info)
+{
+	struct alloca_frame_info *fi = info;
+	if (fi && fi->chunks) __private_free(fi->chunks);
+	__free_arena_bitmap_and_info(info);
+}
+
+static void frame_chain_append(struct alloca_frame_info *fi, void *userchunk)
+{
+	if (__builtin_expect(fi->nchunks == fi->chunks_capacity, 0))
+	{
+		unsigned new_capacity = fi->chunks_capacity ? 2 * fi->chunks_capacity : 8;
+		fi->chunks = __private_realloc(fi->chunks, new_capacity * sizeof (void*));
+		if (!fi->chunks) abort();
+		fi->chunks_capacity = new_capacity;
+	}
+	fi->chunks[fi->nchunks++] = userchunk;
+}
+
 void __liballocs_unindex_stack_objects_counted_by(unsigned long *bytes_counter, void *frame_addr)
 {
 	struct big_allocation *b = __lookup_bigalloc_under_pageindex(bytes_counter,
 		&__stackframe_allocator, NULL);
 	if (*bytes_counter == 0) goto out;
 	if (!b) abort();
-	
-	/* Starting at the stack pointer, we look for indexed chunks and 
-	 * keep unindexing until we have unindexed exactly *bytes_counter bytes. */
-	void *sp;
-	#ifdef UNW_TARGET_X86
-		__asm__ ("movl %%esp, %0\n" :"=r"(sp));
-	#else // assume X86_64 for now
-		__asm__("movq %%rsp, %0\n" : "=r"(sp));
-	#endif
-	ensure_arena_covers_addr(b, sp);
 
-	struct arena_bitmap_info *info = b->suballocator_private;
+	/* Walk the frame's chain of chunks, unindexing each. This is
+	 * O(chunks in this frame). We take the bitmap lock once for the whole
+	 * walk, and we don't do the per-chunk promoted-bigalloc lookup that
+	 * __generic_malloc_index_delete does: any chunk big enough to have been
+	 * promoted is a child of the frame bigalloc, so it goes away when we
+	 * delete the frame, below. For the same reason we don't really need to
+	 * clear the bitmap bits, but it is cheap and keeps the bitmap honest. */
+	struct alloca_frame_info *fi = b->suballocator_private;
+	struct arena_bitmap_info *info = &fi->bitmap_info;
 	unsigned long total_to_unindex = *bytes_counter;
 	unsigned long total_unindexed = 0;
-	unsigned chunks_unindexed = 0;
+	uintptr_t lowest = (uintptr_t) -1;
+	uintptr_t highest = 0;
+	assert(ALLOCA_ALIGN == MALLOC_ALIGN);
 	assert(!info->bitmap_base_addr || info->bitmap_base_addr == ROUND_DOWN_PTR(b->begin, ALLOCA_ALIGN*BITMAP_WORD_NBITS));
-	// pretend we're currently on 'one before the initial search start pos'
-	unsigned long cur_bit_idx = (((uintptr_t) sp - (uintptr_t) info->bitmap_base_addr)
-			/ ALLOCA_ALIGN) - 1;
-	
-	/* Iterate forward over bits */
-	while ((unsigned long)-1 != (cur_bit_idx = bitmap_find_first_set1_geq_l(
-			info->bitmap, info->bitmap + info->nwords,
-			cur_bit_idx + 1, NULL)))
+	int lock_ret;
+	BIG_LOCK
+	for (unsigned i = 0; i < fi->nchunks; ++i)
 	{
-		void *cur_userchunk = (void*)((uintptr_t) info->bitmap_base_addr
-			+ (cur_bit_idx * ALLOCA_ALIGN));
-		debug_printf(0, "Walking an alloca chunk at %p (bitmap base: %p) idx %d\n", cur_userchunk,
-			(void*) info->bitmap_base_addr, (int) cur_bit_idx);
-		struct insert *cur_insert = insert_for_chunk(cur_userchunk, usable_size);
-
+		void *cur_userchunk = fi->chunks[i];
 		unsigned long bytes_to_unindex = usable_size(cur_userchunk);
-		assert(ALLOCA_ALIGN == MALLOC_ALIGN);
-		__generic_malloc_index_delete(&__alloca_allocator,
-			arena_info_for_userptr(&__alloca_allocator, cur_userchunk),
-			cur_userchunk, usable_size);
 		assert(bytes_to_unindex < BIGGEST_SANE_ALLOCA);
-		total_unindexed += bytes_to_unindex;
-		if (total_unindexed >= total_to_unindex)
+		debug_printf(0, "Unindexing an alloca chunk at %p (bitmap base: %p)\n", cur_userchunk,
+			(void*) info->bitmap_base_addr);
+		bitmap_clear_l(info->bitmap, ((uintptr_t) cur_userchunk - (uintptr_t) info->bitmap_base_addr)
+			/ ALLOCA_ALIGN);
+		if ((uintptr_t) cur_userchunk < lowest) lowest = (uintptr_t) cur_userchunk;
+		if ((uintptr_t) cur_userchunk + bytes_to_unindex > highest)
 		{
-			if (total_unindexed > total_to_unindex)
-			{
-				fprintf(stderr, 
-					"Warning: unindexed too many bytes "
-					"(requested %lu from %p; got %lu)\n",
-					total_to_unindex, frame_addr, total_unindexed);
-			}
-			goto out;
+			highest = (uintptr_t) cur_userchunk + bytes_to_unindex;
 		}
+		total_unindexed += bytes_to_unindex;
+	}
+	fi->nchunks = 0;
+	BIG_UNLOCK
+	if (total_unindexed > total_to_unindex)
+	{
+		fprintf(stderr, 
+			"Warning: unindexed too many bytes "
+			"(requested %lu from %p; got %lu)\n",
+			total_to_unindex, frame_addr, total_unindexed);
 	}
+	/* One pass over the cache, covering exactly the span of our chunks.
+	 * FIXME: be more discriminating in what cache we zap -- only ours or children */
+	if (highest > lowest) __liballocs_uncache_all((void*) lowest, highest - lowest);
 out:
-	/* FIXME: be more discriminating in what cache we zap -- only ours or children */
-	__liballocs_uncache_all(frame_addr, total_to_unindex);
 	if (b) __liballocs_delete_bigalloc_at(bytes_counter, &__stackframe_allocator);
 }
 
@@ -272,9 +303,9 @@ void __alloca_allocator_notify(void *new_userchunkaddr,
 	else if (b->suballocator != &__alloca_allocator) abort();
 	if (!b->suballocator_private)
 	{
-		b->suballocator_private = __private_malloc(sizeof (struct arena_bitmap_info));
-		bzero(b->suballocator_private, sizeof (struct arena_bitmap_info));
-		b->suballocator_private_free = __free_arena_bitmap_and_info;
+		b->suballocator_private = __private_malloc(sizeof (struct alloca_frame_info));
+		bzero(b->suballocator_private, sizeof (struct alloca_frame_info));
+		b->suballocator_private_free = free_alloca_frame_info;
 		// we leave allocating the actual bitmap to the realloc step, below
 	}
 
@@ -283,6 +314,9 @@ void __alloca_allocator_notify(void *new_userchunkaddr,
 	__generic_malloc_index_insert(&__alloca_allocator, 
 		arena_info_for_userptr(&__alloca_allocator, new_userchunkaddr),
 		new_userchunkaddr, requested_size, caller, usable_size);
+	/* remember it, so that unindexing on frame exit needn't search for it */
+	frame_chain_append((struct alloca_frame_info *) b->suballocator_private,
+		new_userchunkaddr);
 	
 #undef __liballocs_get_alloc_base /* inlcache HACKaround */
 	assert(__liballocs_get_alloc_base(new_userchunkaddr));
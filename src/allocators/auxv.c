@@ -133,7 +133,7 @@ void __auxv_allocator_notify_init_stack_mapping_sequence(struct big_allocation *
 		if (__auxv_asciiz_end > (const char *) our_bigalloc->end)
 		{
 			const char *new_end = RELF_ROUND_UP_PTR_(__auxv_asciiz_end, PAGE_SIZE);
-			unsigned pi = pageindex[PAGENUM(__auxv_asciiz_end)];
+			unsigned pi = PAGEINDEX_GET(PAGENUM(__auxv_asciiz_end));
 			_Bool success;
 			if (pi)
 			{
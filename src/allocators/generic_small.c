@@ -60,9 +60,11 @@ struct entry {
 #define ENTRY_GET_THISBUCKET_SIZE(entry) ((entry)->common.thisbucket_size)
 
 #ifndef NO_PTHREADS
-#define THE_MUTEX &mutex
-/* We're recursive only because assertion failures sometimes want to do 
+/* The global mutex now only serialises setting up new chunks (and promoting
+ * their containers); each chunk's index has its own mutex in its chunk_rec.
+ * We're recursive only because assertion failures sometimes want to do 
  * asprintf, so try to re-acquire our mutex. */
+#define THE_MUTEX &mutex
 static pthread_mutex_t mutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
 #endif
 #include "generic_malloc_index.h"
@@ -82,7 +84,13 @@ static pthread_mutex_t mutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
  *     Need to add suballocator metadata to the bigalloc record.
  */
 
-/* The info that describes the whole arena that we're allocating out of. */
+/* The info that describes the whole arena that we're allocating out of.
+ *
+ * Writers to a chunk's index hold its mutex, and also bump 'seq' to an odd
+ * value for the duration of each change and back to even afterwards. Readers
+ * don't lock: they note 'seq', do their lookup, and retry if 'seq' was odd
+ * or has since changed (a seqlock). So independent chunks never contend, and
+ * lookups never block allocation. */
 struct chunk_rec
 {
 	struct entry *metadata_recs;
@@ -91,8 +99,37 @@ struct chunk_rec
 	char log_pitch;
 	size_t one_layer_nbytes;
 	unsigned long biggest_object;
+#ifndef NO_PTHREADS
+	pthread_mutex_t mutex;
+#endif
+	unsigned long seq;
+	/* What we've seen since the last (re)layout, for maybe_relayout_chunk. */
+	unsigned long nlive;
+	unsigned long live_bytes;
+	unsigned long nops;
+	unsigned long ninserts;
+	unsigned long insert_layers;
+	unsigned nrelayouts;
 };
 
+#ifndef NO_PTHREADS
+#define CHUNK_LOCK(p_chunk_rec) \
+	lock_ret = pthread_mutex_lock(&(p_chunk_rec)->mutex); \
+	assert(lock_ret == 0);
+#define CHUNK_UNLOCK(p_chunk_rec) \
+	lock_ret = pthread_mutex_unlock(&(p_chunk_rec)->mutex); \
+	assert(lock_ret == 0);
+#else
+#define CHUNK_LOCK(p_chunk_rec)
+#define CHUNK_UNLOCK(p_chunk_rec)
+#endif
+/* Only ever used with the chunk's mutex held. */
+#define CHUNK_WRITE_BEGIN(p_chunk_rec) \
+	__atomic_store_n(&(p_chunk_rec)->seq, (p_chunk_rec)->seq + 1, __ATOMIC_RELAXED); \
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+#define CHUNK_WRITE_END(p_chunk_rec) \
+	__atomic_store_n(&(p_chunk_rec)->seq, (p_chunk_rec)->seq + 1, __ATOMIC_RELEASE);
+
 /* A rectangular memtable, or memrect, is structured into "buckets" 
  * covering a certain address range. The width of this range is the 
  * "bucket pitch".
@@ -198,6 +235,17 @@ static struct chunk_rec *make_suballocated_chunk(void *chunk_base, size_t chunk_
 		.log_pitch = 0,
 		.one_layer_nbytes = 0,
 		.biggest_object = 0,
+#ifndef NO_PTHREADS
+		/* Recursive for the same reason as the global mutex. */
+		.mutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP,
+#endif
+		.seq = 0,
+		.nlive = 0,
+		.live_bytes = 0,
+		.nops = 0,
+		.ninserts = 0,
+		.insert_layers = 0,
+		.nrelayouts = 0,
 		.starts_bitmap = mmap(NULL, sizeof (unsigned long) * (chunk_size / UNSIGNED_LONG_NBITS),
 			PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0)
 	}; // others 0 for now
@@ -242,18 +290,21 @@ static struct chunk_rec *make_suballocated_chunk(void *chunk_base, size_t chunk_
 	p_chunk_rec->metadata_recs = mmap(NULL, nbytes,
 			PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
 	assert(p_chunk_rec->metadata_recs != MAP_FAILED);
+	__liballocs_footprint_add_region(LIBALLOCS_FOOTPRINT_SMALL_METADATA, &__generic_small_allocator,
+		p_chunk_rec->metadata_recs, nbytes);
+	__liballocs_footprint_add_region(LIBALLOCS_FOOTPRINT_SMALL_METADATA, &__generic_small_allocator,
+		p_chunk_rec->starts_bitmap, sizeof (unsigned long) * (chunk_size / UNSIGNED_LONG_NBITS));
 	
 	return p_chunk_rec;
 }
 
 
 static int index_small_alloc_internal(void *ptr, unsigned size_bytes, 
-	struct big_allocation *container)
+	unsigned long alloc_site, struct chunk_rec *p_chunk_rec, struct big_allocation *container)
 {
 	if (!container) abort();
 	
 	/* This chunk already records a suballocated region. */
-	struct chunk_rec *p_chunk_rec = container->suballocator_private;
 	assert(p_chunk_rec);
 #ifdef HEAP_INDEX_SMALL_BITMAP_ONLY
 	/* Just maintain the bitmap. Set the first bit and clear up to the size of the object. */
@@ -303,6 +354,8 @@ static int index_small_alloc_internal(void *ptr, unsigned size_bytes,
 	}
 	// we should never need to go beyond the last layer
 	assert(layer_num < NLAYERS(p_chunk_rec));
+	++p_chunk_rec->ninserts;
+	p_chunk_rec->insert_layers += layer_num;
 		
 	/* We also need to represent the object's size somehow. We choose to use 
 	 * continuation entries since the entry doesn't have enough bits.
@@ -317,7 +370,7 @@ static int index_small_alloc_internal(void *ptr, unsigned size_bytes,
 	assert(thisbucket_size <= (1u << p_chunk_rec->log_pitch));
 	
 	*p_ent = (struct entry) { .regular_initial = {
-		.alloc_site = (unsigned long) __current_allocsite,
+		.alloc_site = alloc_site,
 		.bucket_offset = bucket_offset,
 		.thisbucket_size = thisbucket_size
 	} };
@@ -358,6 +411,8 @@ static int index_small_alloc_internal(void *ptr, unsigned size_bytes,
 	
 	check_bucket_sanity(p_bucket, p_chunk_rec, container);
 	if (p_chunk_rec->biggest_object < size_bytes) p_chunk_rec->biggest_object = size_bytes;
+	++p_chunk_rec->nlive;
+	p_chunk_rec->live_bytes += size_bytes;
 	
 #ifndef NDEBUG
 	struct entry *p_found_ent1 = lookup_small_alloc(ptr, p_chunk_rec, container, NULL, NULL);
@@ -370,6 +425,135 @@ static int index_small_alloc_internal(void *ptr, unsigned size_bytes,
 #endif
 	return 2; // FIXME
 }
+/* The whole size of the object whose start entry is p_ent. Only the object
+ * starting last in a bucket can spill into the next one, and if it does, the
+ * next bucket holds a continuation entry recording its whole size. */
+static unsigned long entry_object_size(struct entry *p_ent, struct entry *p_bucket,
+		struct chunk_rec *p_chunk_rec)
+{
+	unsigned long size = ENTRY_GET_THISBUCKET_SIZE(p_ent);
+	if (size == 0) size = 1ul << p_chunk_rec->log_pitch; // see FIXME in check_bucket_sanity
+	if (ENTRY_GET_STORED_OFFSET(p_ent) + size <= (1ul << p_chunk_rec->log_pitch)) return size;
+	for (struct entry *i_layer = p_bucket + 1;
+			!ENTRY_IS_NULL(i_layer);
+			i_layer += ENTRIES_PER_LAYER(p_chunk_rec))
+	{
+		if (ENTRY_IS_CONTINUATION(i_layer)) return i_layer->continuation.size;
+	}
+	return size;
+}
+
+/* The pitch is chosen once, from the first allocation's size, when the chunk
+ * is made. If that was a bad guess, buckets either get deep (pitch too big:
+ * many objects per bucket, so many layers to walk) or lookups back up over
+ * many buckets (pitch too small relative to objects). So we watch the mean
+ * live object size and insertion depth, and if they say a different pitch
+ * would do much better, we rebuild the memrect at that pitch. We only
+ * consider this after as many operations as there are live objects, so the
+ * O(live objects) rebuild is amortised to O(1) per operation.
+ *
+ * Lock-free readers may still be walking the old table, so we never unmap
+ * it; we just give its memory back (so any straggler sees empty buckets and
+ * retries). That costs address space, so we cap the number of relayouts. */
+#define RELAYOUT_MIN_LIVE 64
+#define RELAYOUT_MAX_PER_CHUNK 4
+#define RELAYOUT_MIN_LOG_PITCH 3
+static void relayout_chunk(struct chunk_rec *p_chunk_rec, struct big_allocation *container,
+		unsigned char new_log_pitch);
+static void maybe_relayout_chunk(struct chunk_rec *p_chunk_rec, struct big_allocation *container)
+{
+	if (p_chunk_rec->nlive < RELAYOUT_MIN_LIVE
+			|| p_chunk_rec->nops < p_chunk_rec->nlive
+			|| p_chunk_rec->nrelayouts >= RELAYOUT_MAX_PER_CHUNK) return;
+	unsigned long mean_size = p_chunk_rec->live_bytes / p_chunk_rec->nlive;
+	unsigned long mean_layers = p_chunk_rec->ninserts ?
+		p_chunk_rec->insert_layers / p_chunk_rec->ninserts : 0;
+	/* As in make_suballocated_chunk, the biggest pitch we allow is the one
+	 * giving a one-page layer. */
+	unsigned max_log_pitch = integer_log2(
+		((sizeof (struct entry)) * p_chunk_rec->power_of_two_size) >> LOG_PAGE_SIZE);
+	if (max_log_pitch > integer_log2(MAX_PITCH)) max_log_pitch = integer_log2(MAX_PITCH);
+	unsigned ideal = integer_log2(next_power_of_two_ge(mean_size ?: 1));
+	if (ideal < RELAYOUT_MIN_LOG_PITCH) ideal = RELAYOUT_MIN_LOG_PITCH;
+	if (ideal > max_log_pitch) ideal = max_log_pitch;
+	unsigned cur = p_chunk_rec->log_pitch;
+	/* Start a new observation period either way. */
+	p_chunk_rec->nops = 0;
+	p_chunk_rec->ninserts = 0;
+	p_chunk_rec->insert_layers = 0;
+	if ((ideal < cur && mean_layers >= 2) || ideal >= cur + 2)
+	{
+		relayout_chunk(p_chunk_rec, container, ideal);
+	}
+}
+/* Call with the chunk locked and inside a CHUNK_WRITE_BEGIN/END. */
+static void relayout_chunk(struct chunk_rec *p_chunk_rec, struct big_allocation *container,
+		unsigned char new_log_pitch)
+{
+	struct live_obj { void *start; unsigned long size; unsigned long site; };
+	struct live_obj *objs = __private_malloc(p_chunk_rec->nlive * sizeof (struct live_obj));
+	if (!objs) return; // just stay as we are
+	unsigned long nobjs = 0;
+	/* We count every object we see but store at most nlive of them. If the
+	 * two disagree, our bookkeeping is off; rather than rebuild a table
+	 * from a partial list, we stay as we are and stop relayouting this chunk. */
+	unsigned long nseen = 0;
+	for (struct entry *p_bucket = p_chunk_rec->metadata_recs;
+			p_bucket < p_chunk_rec->metadata_recs + ENTRIES_PER_LAYER(p_chunk_rec);
+			++p_bucket)
+	{
+		for (struct entry *i_layer = p_bucket;
+				!ENTRY_IS_NULL(i_layer);
+				i_layer += ENTRIES_PER_LAYER(p_chunk_rec))
+		{
+			if (ENTRY_IS_CONTINUATION(i_layer)) continue;
+			if (nseen++ >= p_chunk_rec->nlive) continue;
+			objs[nobjs++] = (struct live_obj) {
+				.start = (char*) BUCKET_RANGE_BASE(p_bucket, p_chunk_rec, container->begin)
+					+ ENTRY_GET_STORED_OFFSET(i_layer),
+				.size = entry_object_size(i_layer, p_bucket, p_chunk_rec),
+				.site = i_layer->regular_initial.alloc_site
+			};
+		}
+	}
+	if (nseen != p_chunk_rec->nlive)
+	{
+		debug_printf(0, "generic_small: chunk %p has %lu live objects but thinks it has %lu; "
+			"not relayouting it\n", container->begin, nseen, p_chunk_rec->nlive);
+		p_chunk_rec->nrelayouts = RELAYOUT_MAX_PER_CHUNK;
+		__private_free(objs);
+		return;
+	}
+	/* The table size doesn't depend on the pitch (see make_suballocated_chunk). */
+	unsigned long nbytes = (sizeof (struct entry)) * p_chunk_rec->power_of_two_size;
+	struct entry *new_recs = mmap(NULL, nbytes,
+			PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (new_recs == MAP_FAILED) { __private_free(objs); return; }
+	/* The old table stays mapped, for readers that may still be in it, but
+	 * we drop its pages below; so it stays reserved but not committed. */
+	__liballocs_footprint_add_region(LIBALLOCS_FOOTPRINT_SMALL_METADATA, &__generic_small_allocator,
+		new_recs, nbytes);
+	struct entry *old_recs = p_chunk_rec->metadata_recs;
+	debug_printf(1, "generic_small: relayout of chunk %p from pitch %u to %u (%lu live, mean %lu bytes)\n",
+		container->begin, 1u << p_chunk_rec->log_pitch, 1u << new_log_pitch,
+		nobjs, p_chunk_rec->live_bytes / (nobjs ?: 1));
+	__atomic_store_n(&p_chunk_rec->metadata_recs, new_recs, __ATOMIC_RELAXED);
+	__atomic_store_n(&p_chunk_rec->log_pitch, new_log_pitch, __ATOMIC_RELAXED);
+	p_chunk_rec->one_layer_nbytes = (sizeof (struct entry)) * (p_chunk_rec->power_of_two_size >> new_log_pitch);
+	p_chunk_rec->nlive = 0;
+	p_chunk_rec->live_bytes = 0;
+	for (unsigned long i = 0; i < nobjs; ++i)
+	{
+		index_small_alloc_internal(objs[i].start, objs[i].size, objs[i].site,
+			p_chunk_rec, container);
+	}
+	p_chunk_rec->ninserts = 0;
+	p_chunk_rec->insert_layers = 0;
+	++p_chunk_rec->nrelayouts;
+	madvise(old_recs, nbytes, MADV_DONTNEED);
+	__private_free(objs);
+}
+
 static void unindex_all_overlapping(void *unindex_start, void *unindex_end, 
 		struct chunk_rec *p_chunk_rec, struct big_allocation *container)
 {
@@ -435,7 +619,6 @@ static void unindex_all_overlapping(void *unindex_start, void *unindex_end,
 int __index_small_alloc(void *ptr, int level, unsigned size_bytes)
 {
 	int lock_ret;
-	BIG_LOCK
 			
 	/* Find the deepest existing chunk (>= l1) and its level. 
 	 * Assert that the same such chunk is covering both the beginning and end 
@@ -453,49 +636,63 @@ int __index_small_alloc(void *ptr, int level, unsigned size_bytes)
 	struct big_allocation *container = (b->allocated_by == &__generic_small_allocator) ?
 		BIDX(b->parent) : b;
 	if (!container) abort();
+	/* In the common case, we are already suballocating the container and
+	 * can go straight to its chunk. Otherwise we need the global lock to
+	 * set things up. */
+	if (a != &__generic_small_allocator
+			&& __atomic_load_n(&container->suballocator, __ATOMIC_ACQUIRE) != &__generic_small_allocator)
+	{
+		BIG_LOCK
+		if (container->suballocator != &__generic_small_allocator)
+		{
+			/* 'Container' is a higher-up bigalloc; it's not a bigalloc that we are suballocating.
+			 * This means we need to promote our immediately containing alloc.
+			 * We need to get its info first. */
+			void *containing_alloc_base;
+			size_t sz = (size_t) -1;
+			liballocs_err_t err = a->get_info(ptr, /* maybe_the_alloc? NO GAH GAH */ /*container*/ NULL,
+				NULL, &containing_alloc_base, &sz, NULL);
+			if (err && err != &__liballocs_err_unrecognised_alloc_site) abort();
+			// HMM. We're asking generic_malloc to ensure its own arena base (bigalloc_base) is big.
+			// That won't work. Our chunk *should* be a real malloc alloc and it's not.
+			// But also we're reutrning the wrong bigalloc base.
+			container = a->ensure_big(containing_alloc_base, sz);
+			// we will set up the chunk below
+		}
+		/* Else we hit the parent allocation, and it's already a bigalloc. */
+
+		/* Are we already registered as the suballocator of the parent?
+		 * It's an error if another allocator is.
+		 * If no the suballocator is null, we have to make a new chunk record 
+		 * for ourselves, AND update the cache. Publish the chunk record before
+		 * the suballocator, since the fast path above doesn't lock. */
+		if (__builtin_expect(!container->suballocator, 0))
+		{
+			container->suballocator_private = make_suballocated_chunk(container->begin, 
+					(char*) container->end - (char*) container->begin, 
+					/* guessed_average_size */ size_bytes);
+			__atomic_store_n(&container->suballocator, &__generic_small_allocator, __ATOMIC_RELEASE);
+		}
+		else if (container->suballocator != &__generic_small_allocator) abort();
+		BIG_UNLOCK
+	}
+	
+	struct chunk_rec *p_chunk_rec = container->suballocator_private;
+	CHUNK_LOCK(p_chunk_rec)
+	CHUNK_WRITE_BEGIN(p_chunk_rec)
 	if (a == &__generic_small_allocator)
 	{
 		/* We hit an allocation of our own, which we'd like to silently delete
 		 * (this is a HACK to deal with GCs that don't notify us on free). */
-		struct chunk_rec *chunk_rec = container->suballocator_private;
 		// HACK: do the unindexing
-		unindex_all_overlapping(ptr, (char*) ptr + size_bytes, chunk_rec, container);
+		unindex_all_overlapping(ptr, (char*) ptr + size_bytes, p_chunk_rec, container);
 	}
-	else if (container->suballocator != &__generic_small_allocator)
-	{
-		/* 'Container' is a higher-up bigalloc; it's not a bigalloc that we are suballocating.
-		 * This means we need to promote our immediately containing alloc.
-		 * We need to get its info first. */
-		void *containing_alloc_base;
-		size_t sz = (size_t) -1;
-		liballocs_err_t err = a->get_info(ptr, /* maybe_the_alloc? NO GAH GAH */ /*container*/ NULL,
-			NULL, &containing_alloc_base, &sz, NULL);
-		if (err && err != &__liballocs_err_unrecognised_alloc_site) abort();
-		// HMM. We're asking generic_malloc to ensure its own arena base (bigalloc_base) is big.
-		// That won't work. Our chunk *should* be a real malloc alloc and it's not.
-		// But also we're reutrning the wrong bigalloc base.
-		container = a->ensure_big(containing_alloc_base, sz);
-		// we will set up the chunk below
-	}
-	/* Else we hit the parent allocation, and it's already a bigalloc. */
-
-	/* Are we already registered as the suballocator of the parent?
-	 * It's an error if another allocator is.
-	 * If no the suballocator is null, we have to make a new chunk record 
-	 * for ourselves, AND update the cache. */
-	struct chunk_rec *p_chunk_rec;
-	if (__builtin_expect(!container->suballocator, 0))
-	{
-		container->suballocator = &__generic_small_allocator;
-		container->suballocator_private = make_suballocated_chunk(container->begin, 
-				(char*) container->end - (char*) container->begin, 
-				/* guessed_average_size */ size_bytes);
-	}
-	else if (container->suballocator != &__generic_small_allocator) abort();
-	
-	int ret = index_small_alloc_internal(ptr, size_bytes, container);
-	
-	BIG_UNLOCK
+	int ret = index_small_alloc_internal(ptr, size_bytes, (unsigned long) __current_allocsite,
+		p_chunk_rec, container);
+	++p_chunk_rec->nops;
+	maybe_relayout_chunk(p_chunk_rec, container);
+	CHUNK_WRITE_END(p_chunk_rec)
+	CHUNK_UNLOCK(p_chunk_rec)
 	return ret;
 }
 
@@ -527,8 +724,10 @@ get_start_from_continuation(struct entry *p_ent, struct entry *p_bucket,
 			biggest_bucket_offset_pos = i_layer;
 		}
 	}
-	// we must have seen the last object
+	// we must have seen the last object -- unless a lock-free reader is
+	// racing with a writer, in which case it will retry
 	assert(biggest_bucket_offset_pos);
+	if (!biggest_bucket_offset_pos) return 0;
 	object_ent = biggest_bucket_offset_pos;
 	char *object_start = (char*)(BUCKET_RANGE_BASE(p_object_start_bucket, p_chunk_rec, container->begin)) 
 			+ ENTRY_GET_STORED_OFFSET(biggest_bucket_offset_pos);
@@ -668,6 +867,7 @@ struct entry *lookup_small_alloc(const void *ptr,
 				_Bool success = get_start_from_continuation(p_ent, p_bucket,
 						p_chunk_rec, container,
 						&object_start, &object_size, &object_ent);
+				if (!success) goto fail;
 				
 				if ((char*) object_start + object_size > (char*) ptr)
 				{
@@ -738,6 +938,8 @@ static void unindex_small_alloc_internal_with_ent(void *ptr, struct chunk_rec *p
 {
 	struct entry *p_bucket = BUCKET_PTR_FROM_ENTRY_PTR(p_ent, p_chunk_rec, container);
 	check_bucket_sanity(p_bucket, p_chunk_rec, container);
+	--p_chunk_rec->nlive;
+	p_chunk_rec->live_bytes -= entry_object_size(p_ent, p_bucket, p_chunk_rec);
 	
 	unsigned short our_bucket_offset = ENTRY_GET_STORED_OFFSET(p_ent);
 	_Bool we_are_biggest_offset = 1;
@@ -775,18 +977,58 @@ void __unindex_small_alloc(void *ptr) __attribute__((visibility("protected")));
 void __unindex_small_alloc(void *ptr) 
 {
 	int lock_ret;
-	BIG_LOCK
-	
-	void *existing_object_start;
 	
 	struct big_allocation *b = __lookup_deepest_bigalloc(ptr);
-	while (b && b->suballocator != &__generic_small_allocator)
+	while (b && __atomic_load_n(&b->suballocator, __ATOMIC_ACQUIRE) != &__generic_small_allocator)
 		b = BIDX(b->parent);
 	if (!b) abort();
 	
-	unindex_small_alloc_internal(ptr, (struct chunk_rec *) b->suballocator_private, b);
-	
-	BIG_UNLOCK
+	struct chunk_rec *p_chunk_rec = b->suballocator_private;
+	CHUNK_LOCK(p_chunk_rec)
+	CHUNK_WRITE_BEGIN(p_chunk_rec)
+	unindex_small_alloc_internal(ptr, p_chunk_rec, b);
+	++p_chunk_rec->nops;
+	CHUNK_WRITE_END(p_chunk_rec)
+	CHUNK_UNLOCK(p_chunk_rec)
+}
+
+/* Look up 'ptr' without locking, copying out its entry. We retry until we
+ * get a result that no writer interfered with. In debug builds, the sanity
+ * checks inside the lookup expect a stable index, so we take the lock. */
+static _Bool lookup_small_alloc_consistent(const void *ptr,
+		struct chunk_rec *p_chunk_rec,
+		struct big_allocation *container,
+		void **out_object_start,
+		size_t *out_object_size,
+		struct entry *out_ent)
+{
+	struct entry *p_ent;
+#ifndef NDEBUG
+	int lock_ret;
+	CHUNK_LOCK(p_chunk_rec)
+	p_ent = lookup_small_alloc(ptr, p_chunk_rec, container, out_object_start, out_object_size);
+	if (p_ent) *out_ent = *p_ent;
+	CHUNK_UNLOCK(p_chunk_rec)
+#else
+	unsigned long seq;
+	for (;;)
+	{
+		seq = __atomic_load_n(&p_chunk_rec->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) { __builtin_ia32_pause(); continue; }
+		/* The table and pitch change together on relayout, so take one
+		 * consistent view of them for the whole lookup. */
+		struct chunk_rec view;
+		view.metadata_recs = __atomic_load_n(&p_chunk_rec->metadata_recs, __ATOMIC_RELAXED);
+		view.log_pitch = __atomic_load_n(&p_chunk_rec->log_pitch, __ATOMIC_RELAXED);
+		view.power_of_two_size = p_chunk_rec->power_of_two_size;
+		view.biggest_object = __atomic_load_n(&p_chunk_rec->biggest_object, __ATOMIC_RELAXED);
+		p_ent = lookup_small_alloc(ptr, &view, container, out_object_start, out_object_size);
+		if (p_ent) *out_ent = *p_ent;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (seq == __atomic_load_n(&p_chunk_rec->seq, __ATOMIC_RELAXED)) break;
+	}
+#endif
+	return p_ent != NULL;
 }
 
 static liballocs_err_t get_info(void *obj, struct big_allocation *b, 
@@ -798,13 +1040,14 @@ static liballocs_err_t get_info(void *obj, struct big_allocation *b,
 		? BIDX(b->parent)
 		 : __lookup_deepest_bigalloc(obj);
 	
-	struct entry *p_ent = lookup_small_alloc(obj, container->suballocator_private,
-		container, out_base, out_size);
-	if (!p_ent)
+	struct entry ent;
+	if (!lookup_small_alloc_consistent(obj, container->suballocator_private,
+		container, out_base, out_size, &ent))
 	{
-		++__liballocs_aborted_unindexed_heap;
+		__liballocs_count(LIBALLOCS_COUNTER_ABORTED_UNINDEXED_HEAP);
 		return &__liballocs_err_unindexed_heap_object;
 	}
+	struct entry *p_ent = &ent;
 	struct uniqtype *alloc_uniqtype = NULL;
 	/* Now we have a uniqtype or an allocsite. For long-lived objects 
 	 * the uniqtype will have been installed in the heap header already.
@@ -819,12 +1062,9 @@ static liballocs_err_t get_info(void *obj, struct big_allocation *b,
 		{
 			struct allocsite_entry *entry = __liballocs_find_allocsite_entry_at(alloc_site);
 			alloc_uniqtype = entry ? entry->uniqtype : NULL;
-			/* Remember the unrecog'd alloc sites we see. */
-			if (!alloc_uniqtype && alloc_site && 
-					!__liballocs_addrlist_contains(&__liballocs_unrecognised_heap_alloc_sites, alloc_site))
-			{
-				__liballocs_addrlist_add(&__liballocs_unrecognised_heap_alloc_sites, alloc_site);
-			}
+			/* Remember (and count) the unrecog'd alloc sites we see. */
+			if (!alloc_uniqtype && alloc_site) __liballocs_addrlist_add(
+				&__liballocs_unrecognised_heap_alloc_sites, alloc_site);
 			*out_type = alloc_uniqtype;
 		}
 	}
@@ -838,7 +1078,7 @@ static liballocs_err_t get_info(void *obj, struct big_allocation *b,
 	// if we didn't get an alloc uniqtype, record the abort we abort
 	if (out_type && !alloc_uniqtype) 
 	{
-		++__liballocs_aborted_unrecognised_allocsite;
+		__liballocs_count(LIBALLOCS_COUNTER_ABORTED_UNRECOGNISED_ALLOCSITE);
 		return &__liballocs_err_unrecognised_alloc_site;;
 	}
 	/* return success */
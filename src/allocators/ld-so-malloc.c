@@ -6,9 +6,9 @@
  * method that suffices for the not-so-fully-featured malloc in glibc's
  * dynamic linker. It may be useful for other similar mallocs too. In
  * short it just keeps a linear sequence of records for every malloc
- * chunk. The sequence is append-only, except that the latest one may
- * be freed. They are kept sorted, although we only re-sort if a new
- * address is appended that is not strictly greater than the last one. */
+ * chunk, kept sorted by address (see linear_malloc_index.h). Chunks are
+ * mostly allocated in increasing address order, and only the latest one
+ * may be freed, so inserts and deletes are mostly at the end. */
 
 #include "liballocs_private.h"
 #include "linear_malloc_index.h"
@@ -93,8 +93,7 @@ static struct liballocs_err *linear_malloc_get_info(
 	assert(arena->suballocator_private);
 	assert(arena->suballocator_private == ld_so_malloc_index_info);
 	struct linear_malloc_rec *found = find_linear_malloc_rec(obj,
-		ld_so_malloc_index_info->recs, ld_so_malloc_index_info->nrecs,
-		ld_so_malloc_index_info->nrecs_used);
+		ld_so_malloc_index_info);
 
 	if (found)
 	{
@@ -296,9 +295,9 @@ void __ld_so_malloc_allocator_init(void)
 	 */
 
 	// we walk the array of already-linearly-allocated malloc chunks
-	for (unsigned i = 0; i < ld_so_malloc_index_info->nrecs_used; ++i)
+	for_each_linear_malloc_rec(p_rec, ld_so_malloc_index_info)
 	{
-		ensure_bigalloc_for_userptr(ld_so_malloc_index_info->recs[i].addr);
+		ensure_bigalloc_for_userptr(p_rec->addr);
 	}
 	// also a snarf a (probably) text address in the ld.so
 	// what's something "guaranteed" to be in the ld.so? best guess: __tls_get_addr
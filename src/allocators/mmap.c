@@ -3,6 +3,7 @@
 #include <assert.h>
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -10,6 +11,7 @@
 #include <string.h>
 #include <dlfcn.h>
 #include <link.h>
+#include <pthread.h>
 #include "librunt.h"
 #include "relf.h"
 #include "maps.h"
@@ -37,28 +39,256 @@ uintptr_t executable_data_segment_start_addr __attribute__((visibility("hidden")
  * that requires this; bss areas, where memsz > filesz, are another).
  */
 
+/* Resolving an fd to a filename costs a readlink() on /proc, and programs
+ * often map many pieces of the same file. So when an fd is mmapped, we
+ * don't resolve its filename. We just fstat() it, and give the mapping
+ * sequence a placeholder filename naming the file by device and inode,
+ * which is all that our sequence consistency checks need. The real name
+ * is resolved only when somebody asks for it (__mapping_sequence_filename).
+ *
+ * To make that cheap, we keep a small direct-mapped cache of the files
+ * we've seen mmapped, keyed on (dev, ino), each remembering an fd through
+ * which we saw it. Resolving through that fd is one readlink(), but only
+ * while the fd stays open; so when systrap sees the fd about to be closed
+ * or dup'd over (__mmap_allocator_notify_fds_closing; only when syscall
+ * trampolines are on, since trapping every close would cost more than it
+ * saves), we resolve any still-unnamed file there and then. Any fd we
+ * believe in is checked with fstat() before we use it, so a close we didn't
+ * see can only cost us the cheap path, not give us the wrong file. If the cheap path is gone, we look the sequence up in
+ * /proc/self/maps instead. We also remember each file's ctime, which
+ * changes on rename, so that a cached path is dropped when the file may
+ * have been renamed since. Since fds are process-wide, entries are shared
+ * between threads; each has a sequence number so that readers can detect
+ * a racing update and fall back to the slow path. Paths too long for an
+ * entry are simply not cached. */
+#define MAPPED_FILE_CACHE_SIZE 64
+#define MAPPED_FILE_CACHE_PATH_MAX 512
+struct mapped_file_cache_entry
+{
+	unsigned seq; /* odd while being written */
+	int fd; /* an fd through which the file was mmapped, or -1 */
+	dev_t dev;
+	ino_t ino; /* 0 means empty */
+	struct timespec ctime;
+	char path[MAPPED_FILE_CACHE_PATH_MAX]; /* empty if not yet resolved */
+};
+static struct mapped_file_cache_entry mapped_file_cache[MAPPED_FILE_CACHE_SIZE] = {
+	[0 ... MAPPED_FILE_CACHE_SIZE - 1] = { .fd = -1 }
+};
+static struct mapped_file_cache_entry *mapped_file_cache_entry_for(dev_t dev, ino_t ino)
+{
+	return &mapped_file_cache[(unsigned) ((ino * 31) ^ dev) % MAPPED_FILE_CACHE_SIZE];
+}
+/* Writers take an entry by making its sequence number odd. They never
+ * block while holding it, so spinning is fine. */
+static unsigned mapped_file_cache_begin_write(struct mapped_file_cache_entry *e)
+{
+	unsigned seq;
+	do
+	{
+		seq = __atomic_load_n(&e->seq, __ATOMIC_RELAXED);
+	} while ((seq & 1) || !__atomic_compare_exchange_n(&e->seq, &seq, seq + 1,
+			0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+	return seq + 1;
+}
+static void mapped_file_cache_end_write(struct mapped_file_cache_entry *e, unsigned seq)
+{
+	__atomic_store_n(&e->seq, seq + 1, __ATOMIC_RELEASE);
+}
+/* Copy out the cached path and fd for a file. Returns 0 if we have no
+ * entry for it, or raced with a writer. */
+static _Bool mapped_file_cache_lookup(dev_t dev, ino_t ino, char *out_path, size_t out_bufsz,
+	int *out_fd)
+{
+	struct mapped_file_cache_entry *e = mapped_file_cache_entry_for(dev, ino);
+	unsigned seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+	if (seq & 1) return 0;
+	if (e->ino != ino || e->dev != dev) return 0;
+	size_t len = strnlen(e->path, sizeof e->path);
+	if (len >= out_bufsz) return 0;
+	memcpy(out_path, e->path, len);
+	out_path[len] = '\0';
+	*out_fd = e->fd;
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&e->seq, __ATOMIC_RELAXED) == seq;
+}
+static _Bool same_file(const struct mapped_file_cache_entry *e, const struct stat *s)
+{
+	return e->ino == s->st_ino && e->dev == s->st_dev
+		&& e->ctime.tv_sec == s->st_ctim.tv_sec && e->ctime.tv_nsec == s->st_ctim.tv_nsec;
+}
+static void mapped_file_cache_note_fd(int fd, const struct stat *s)
+{
+	struct mapped_file_cache_entry *e = mapped_file_cache_entry_for(s->st_dev, s->st_ino);
+	unsigned seq = mapped_file_cache_begin_write(e);
+	if (!same_file(e, s))
+	{
+		e->dev = s->st_dev;
+		e->ino = s->st_ino;
+		e->ctime = s->st_ctim;
+		e->path[0] = '\0';
+	}
+	e->fd = fd;
+	mapped_file_cache_end_write(e, seq);
+}
+
+/* Read the name of the file open on 'fd', provided it is still the file
+ * with identity (dev, ino). Returns the length, or -1. */
+static ssize_t readlink_fd_if_same_file(int fd, dev_t dev, ino_t ino, char *buf, size_t bufsz)
+{
+	struct stat s;
+	if (fd < 0 || 0 != fstat(fd, &s) || s.st_dev != dev || s.st_ino != ino) return -1;
+	/* "/proc/self/fd/" plus at most 10 digits. We avoid snprintf, because
+	 * we might be called from the mmap syscall signal handler. */
+	char proc_path[sizeof "/proc/self/fd/" + 10] = "/proc/self/fd/";
+	char *pos = proc_path + sizeof "/proc/self/fd/" - 1;
+	char digits[10];
+	unsigned ndigits = 0;
+	unsigned n = fd;
+	do { digits[ndigits++] = '0' + n % 10; n /= 10; } while (n);
+	while (ndigits) *pos++ = digits[--ndigits];
+	*pos = '\0';
+	ssize_t ret = readlink(proc_path, buf, bufsz);
+	if (ret == -1 || (size_t) ret == bufsz) return -1; /* error, or truncated */
+	buf[ret] = '\0';
+	return ret;
+}
+
+/* Called from the systrap close, close_range, dup2 and dup3 handlers, just
+ * before fds [first, last] go away, and also when open or openat hands
+ * out an fd (in case we missed it being closed). */
+__attribute__((visibility("hidden")))
+void __mmap_allocator_notify_fds_closing(unsigned first, unsigned last)
+{
+	for (unsigned i = 0; i < MAPPED_FILE_CACHE_SIZE; ++i)
+	{
+		struct mapped_file_cache_entry *e = &mapped_file_cache[i];
+		int fd = __atomic_load_n(&e->fd, __ATOMIC_RELAXED);
+		if (fd < 0 || (unsigned) fd < first || (unsigned) fd > last) continue;
+		/* If we never got the name, this is our last cheap chance. We don't
+		 * hold the entry while we readlink(), so check it's still the same
+		 * file afterwards. */
+		dev_t dev = e->dev;
+		ino_t ino = e->ino;
+		char path[MAPPED_FILE_CACHE_PATH_MAX];
+		ssize_t len = -1;
+		if (!e->path[0]) len = readlink_fd_if_same_file(fd, dev, ino, path, sizeof path);
+		unsigned seq = mapped_file_cache_begin_write(e);
+		if (e->fd == fd)
+		{
+			if (len > 0 && !e->path[0] && e->dev == dev && e->ino == ino)
+			{
+				memcpy(e->path, path, len + 1);
+			}
+			e->fd = -1;
+		}
+		mapped_file_cache_end_write(e, seq);
+	}
+}
+
+/* Placeholder filenames are "@<dev>:<ino>", in hex. */
+static char *format_hex(char *pos, unsigned long val)
+{
+	char digits[16];
+	unsigned ndigits = 0;
+	do { digits[ndigits++] = "0123456789abcdef"[val & 0xf]; val >>= 4; } while (val);
+	while (ndigits) *pos++ = digits[--ndigits];
+	return pos;
+}
+static const char *placeholder_filename(dev_t dev, ino_t ino)
+{
+	static char __thread buf[sizeof "@:" + 32];
+	char *pos = buf;
+	*pos++ = '@';
+	pos = format_hex(pos, dev);
+	*pos++ = ':';
+	pos = format_hex(pos, ino);
+	*pos = '\0';
+	return buf;
+}
+static _Bool parse_placeholder_filename(const char *s, dev_t *out_dev, ino_t *out_ino)
+{
+	if (!s || s[0] != '@') return 0;
+	unsigned long vals[2] = { 0, 0 };
+	unsigned nvals = 0;
+	for (const char *pos = s + 1; ; ++pos)
+	{
+		char c = *pos;
+		if (c >= '0' && c <= '9') vals[nvals] = (vals[nvals] << 4) | (c - '0');
+		else if (c >= 'a' && c <= 'f') vals[nvals] = (vals[nvals] << 4) | (10 + c - 'a');
+		else if (c == ':' && nvals == 0) ++nvals;
+		else if (c == '\0' && nvals == 1) break;
+		else return 0;
+	}
+	*out_dev = vals[0];
+	*out_ino = vals[1];
+	return 1;
+}
+
 static const char *filename_for_fd(int fd)
 {
 	if (fd == -1) return NULL;
-	
-	/* We read from /proc into a thread-local buffer. */
-	static char __thread out_buf[8192];
-	
-	static char __thread proc_path[4096];
-	/* FIXME: snprintf is not async-signal-safe, but we might be called 
-	 * from the mmap syscall signal handler. */
-	int ret = snprintf(proc_path, sizeof proc_path, "/proc/%d/fd/%d", getpid(), fd);
-	assert(ret > 0);
-	ret = readlink(proc_path, out_buf, sizeof out_buf);
-	assert(ret != -1);
-	out_buf[ret] = '\0';
-	
-	return out_buf;
+	struct stat s;
+	/* If we can't even fstat it, the mmap can't have used it. */
+	if (0 != fstat(fd, &s)) return NULL;
+	mapped_file_cache_note_fd(fd, &s);
+	return placeholder_filename(s.st_dev, s.st_ino);
+}
+
+static _Bool maps_filename_for_addr(const void *addr, char *out_buf, size_t out_bufsz);
+__attribute__((visibility("hidden")))
+const char *__mapping_sequence_filename(struct mapping_sequence *seq)
+{
+	dev_t dev;
+	ino_t ino;
+	if (!parse_placeholder_filename(seq->filename, &dev, &ino)) return seq->filename;
+	const char *resolved = __atomic_load_n(&seq->resolved_filename, __ATOMIC_ACQUIRE);
+	if (resolved) return resolved;
+	char buf[4096];
+	int fd = -1;
+	_Bool found = mapped_file_cache_lookup(dev, ino, buf, sizeof buf, &fd) && buf[0];
+	if (!found && readlink_fd_if_same_file(fd, dev, ino, buf, sizeof buf) > 0) found = 1;
+	for (unsigned i = 0; !found && i < seq->nused; ++i)
+	{
+		if (seq->mappings[i].is_anon) continue;
+		found = maps_filename_for_addr(seq->mappings[i].begin, buf, sizeof buf);
+		break;
+	}
+	if (!found) return NULL;
+	char *copy = __private_nommap_malloc(1 + strlen(buf));
+	if (!copy) return NULL;
+	strcpy(copy, buf);
+	const char *expected = NULL;
+	if (!__atomic_compare_exchange_n(&seq->resolved_filename, &expected, copy,
+			0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	{
+		/* Somebody beat us to it. */
+		__private_nommap_free(copy);
+		return expected;
+	}
+	return copy;
 }
 
 static void check_mapping_sequence_sanity(struct mapping_sequence *cur);
+void copy_all_left_from_by(struct mapping_sequence *s, int from, int by);
+void copy_all_right_from_by(struct mapping_sequence *s, int from, int by);
 
 /* How are we supposed to allocate the mapping sequence metadata? */
+/* From the private nommap heap, via these two, so that it's counted in
+ * our footprint. */
+static struct mapping_sequence *new_mapping_sequence(void)
+{
+	struct mapping_sequence *seq = __private_nommap_calloc(1, sizeof (struct mapping_sequence));
+	if (seq) __liballocs_footprint_add(LIBALLOCS_FOOTPRINT_MAPPING_SEQUENCES, &__mmap_allocator,
+		sizeof (struct mapping_sequence));
+	return seq;
+}
+static void free_mapping_sequence(void *seq)
+{
+	__liballocs_footprint_add(LIBALLOCS_FOOTPRINT_MAPPING_SEQUENCES, &__mmap_allocator,
+		-(long) sizeof (struct mapping_sequence));
+	__private_nommap_free(seq);
+}
 
 static struct big_allocation *add_bigalloc(void *begin, size_t size)
 {
@@ -91,11 +321,11 @@ static struct big_allocation *add_mapping_sequence_bigalloc_copying_seq(struct m
 {
 	struct big_allocation *b = add_bigalloc(seq_to_copy->begin,
 		(uintptr_t) seq_to_copy->end - (uintptr_t) seq_to_copy->begin);
-	struct mapping_sequence *seq = __private_nommap_malloc(sizeof (struct mapping_sequence));
+	struct mapping_sequence *seq = new_mapping_sequence();
 	assert(seq);
 	memcpy(seq, seq_to_copy, sizeof (struct mapping_sequence));
 	b->allocator_private = seq;
-	b->allocator_private_free = __private_nommap_free;
+	b->allocator_private_free = free_mapping_sequence;
 	return b;
 }
 /* Version exported to the remainder of liballocs... used only for the single statically
@@ -180,10 +410,10 @@ static void add_mapping_sequence_bigalloc_if_absent(struct mapping_sequence *seq
 	/* Test 1. Find the top-level parent of both the beginning
 	 * and end addresses. It should be the same, perhaps zero.
 	 */
-	struct big_allocation *parent_begin = &big_allocations[pageindex[PAGENUM(seq->begin)]];
+	struct big_allocation *parent_begin = &big_allocations[PAGEINDEX_GET(PAGENUM(seq->begin))];
 	while (BIDX(parent_begin->parent)) parent_begin = BIDX(parent_begin->parent);
 	if (parent_begin == &big_allocations[0]) parent_begin = NULL;
-	struct big_allocation *parent_end = &big_allocations[pageindex[PAGENUM(((char*)seq->end)-1)]];
+	struct big_allocation *parent_end = &big_allocations[PAGEINDEX_GET(PAGENUM(((char*)seq->end)-1))];
 	while (BIDX(parent_end->parent)) parent_end = BIDX(parent_end->parent);
 	if (parent_end == &big_allocations[0]) parent_end = NULL;
 	
@@ -523,6 +753,18 @@ static void delete_mapping_sequence_span(struct mapping_sequence *seq,
 	check_mapping_sequence_sanity(seq);
 }
 
+/* From 'cur', where there is no mmap bigalloc, where is the next one
+ * before 'end' (or 'end' if none)? We ask the pageindex rather than
+ * stepping a page at a time, since the gap may be huge. */
+static char *skip_unmapped(char *cur, char *end)
+{
+	struct big_allocation *next = __liballocs_find_mapping_at_or_above(cur);
+	if (!next) return end;
+	/* If something not ours spans 'cur', skip it too. */
+	char *next_cur = ((char*) next->begin > cur) ? (char*) next->begin : (char*) next->end;
+	return (next_cur < end) ? next_cur : end;
+}
+
 static void do_munmap(void *addr, size_t requested_length, void *caller)
 {
 	char *cur = (char*) addr;
@@ -537,9 +779,10 @@ static void do_munmap(void *addr, size_t requested_length, void *caller)
 		if (!b)
 		{
 			/* Okay, no mapping present. Zoom to the next bigalloc. */
-			cur += PAGE_SIZE;
-			remaining_length -= PAGE_SIZE;
-			continue; // FIXME: use wide-character string funcs instead
+			char *next = skip_unmapped(cur, (char*) addr + effective_length);
+			remaining_length -= next - cur;
+			cur = next;
+			continue;
 		}
 		struct mapping_sequence *seq = b->allocator_private;
 		
@@ -590,7 +833,7 @@ static void do_munmap(void *addr, size_t requested_length, void *caller)
 				if (!second_half) abort();
 				__liballocs_truncate_bigalloc_at_end(b, addr);
 				/* Now the bigallocs are in the right place, but their metadata is wrong. */
-				struct mapping_sequence *new_seq = __private_nommap_malloc(sizeof (struct mapping_sequence));
+				struct mapping_sequence *new_seq = new_mapping_sequence();
 				struct mapping_sequence *orig_seq = b->allocator_private;
 				memcpy(new_seq, orig_seq, sizeof (struct mapping_sequence));
 				/* From the first, delete from the hole all the way. */
@@ -605,11 +848,194 @@ static void do_munmap(void *addr, size_t requested_length, void *caller)
 	}
 }
 
+/* Programs like GCs and JITs often issue long runs of munmap or mprotect
+ * calls over adjacent ranges, and updating the mapping sequences and the
+ * pageindex for each one separately is wasteful. So we don't apply these
+ * notifications straight away. Instead we log them in a small journal,
+ * merging each into the previous entry if it is the same operation (with
+ * the same prot, for mprotect) over an overlapping or abutting range. The
+ * journal is applied, in order, when it fills up, before any mmap, mremap
+ * or brk is processed (so that we never index fresh memory on top of stale
+ * metadata), and when a query touches the range it covers, which we keep
+ * in __mmap_allocator_journal_{begin,end} so that the query path can check
+ * it cheaply (see __liballocs_get_alloc_info). */
+#define MMAP_JOURNAL_MAX 64
+struct mmap_journal_entry
+{
+	enum { MMAP_JOURNAL_MUNMAP, MMAP_JOURNAL_MPROTECT } op;
+	char *begin;
+	char *end;
+	int prot;
+	void *caller;
+};
+static struct mmap_journal_entry mmap_journal[MMAP_JOURNAL_MAX];
+static unsigned mmap_journal_len;
+uintptr_t __mmap_allocator_journal_begin __attribute__((visibility("protected")));
+uintptr_t __mmap_allocator_journal_end __attribute__((visibility("protected")));
+/* Recursive because applying the journal may lead to more notifications. */
+static pthread_mutex_t mmap_journal_mutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+/* Split seq->mappings[i] in two at 'at', which must be strictly inside it. */
+static _Bool split_mapping_entry(struct mapping_sequence *seq, unsigned i, char *at)
+{
+	if (seq->nused == MAPPING_SEQUENCE_MAX_LEN) return 0;
+	assert(at > (char*) seq->mappings[i].begin && at < (char*) seq->mappings[i].end);
+	copy_all_right_from_by(seq, i + 1, 1);
+	seq->mappings[i + 1] = seq->mappings[i];
+	seq->mappings[i].end = at;
+	seq->mappings[i + 1].begin = at;
+	if (!seq->mappings[i + 1].is_anon) seq->mappings[i + 1].offset +=
+		at - (char*) seq->mappings[i].begin;
+	return 1;
+}
+/* Merge abutting entries that differ only in where they start, as the
+ * kernel would merge their VMAs. */
+static void merge_mapping_entries(struct mapping_sequence *seq)
+{
+	unsigned i = 1;
+	while (i < seq->nused)
+	{
+		struct mapping_entry *prev = &seq->mappings[i - 1];
+		struct mapping_entry *ent = &seq->mappings[i];
+		if (prev->end == ent->begin && prev->prot == ent->prot && prev->flags == ent->flags
+				&& prev->is_anon == ent->is_anon && prev->caller == ent->caller
+				&& (ent->is_anon || ent->offset == prev->offset
+					+ ((char*) prev->end - (char*) prev->begin)))
+		{
+			prev->end = ent->end;
+			copy_all_left_from_by(seq, i + 1, 1);
+			memset(&seq->mappings[seq->nused], 0, sizeof (struct mapping_entry));
+		}
+		else ++i;
+	}
+}
+/* Set the prot of [begin, end) within seq, splitting any entry that
+ * straddles either end of the range. */
+static void set_mapping_sequence_prot(struct mapping_sequence *seq, char *begin, char *end, int prot)
+{
+	unsigned nsplits = 0;
+	for (unsigned i = 0; i < seq->nused; ++i)
+	{
+		struct mapping_entry *ent = &seq->mappings[i];
+		if (ent->prot == prot) continue;
+		if ((char*) ent->begin < begin && (char*) ent->end > begin) ++nsplits;
+		if ((char*) ent->begin < end && (char*) ent->end > end) ++nsplits;
+	}
+	if (seq->nused + nsplits > MAPPING_SEQUENCE_MAX_LEN) merge_mapping_entries(seq);
+	if (seq->nused + nsplits > MAPPING_SEQUENCE_MAX_LEN)
+	{
+		debug_printf(1, "No room to split mappings in %p-%p for mprotect of %p-%p\n",
+			seq->begin, seq->end, begin, end);
+		return;
+	}
+	for (unsigned i = 0; i < seq->nused; ++i)
+	{
+		struct mapping_entry *ent = &seq->mappings[i];
+		if ((char*) ent->end <= begin || (char*) ent->begin >= end || ent->prot == prot) continue;
+		/* Split off any part below the range; we'll see the rest next time round. */
+		if ((char*) ent->begin < begin) { split_mapping_entry(seq, i, begin); continue; }
+		if ((char*) ent->end > end) split_mapping_entry(seq, i, end);
+		ent->prot = prot;
+	}
+	merge_mapping_entries(seq);
+	check_mapping_sequence_sanity(seq);
+}
+
+static void apply_mprotect(char *begin, char *end, int prot)
+{
+	char *cur = begin;
+	while (cur < end)
+	{
+		struct big_allocation *b = __lookup_bigalloc_from_root(cur, &__mmap_allocator, NULL);
+		if (!b) { cur = skip_unmapped(cur, end); continue; }
+		struct mapping_sequence *seq = b->allocator_private;
+		if (seq) set_mapping_sequence_prot(seq, MAX(cur, (char*) b->begin),
+			MIN(end, (char*) b->end), prot);
+		cur = b->end;
+	}
+}
+
+static void flush_mmap_journal(void)
+{
+	int lock_ret = pthread_mutex_lock(&mmap_journal_mutex);
+	assert(lock_ret == 0);
+	if (__builtin_expect(mmap_journal_len == 0, 1)) goto out;
+	/* Take the entries out of the journal before applying them, in case
+	 * applying them leads back here. */
+	struct mmap_journal_entry to_apply[MMAP_JOURNAL_MAX];
+	unsigned n = mmap_journal_len;
+	memcpy(to_apply, mmap_journal, n * sizeof (struct mmap_journal_entry));
+	mmap_journal_len = 0;
+	__mmap_allocator_journal_begin = 0;
+	__mmap_allocator_journal_end = 0;
+	for (unsigned i = 0; i < n; ++i)
+	{
+		struct mmap_journal_entry *e = &to_apply[i];
+		if (e->op == MMAP_JOURNAL_MUNMAP) do_munmap(e->begin, e->end - e->begin, e->caller);
+		else apply_mprotect(e->begin, e->end, e->prot);
+	}
+out:
+	lock_ret = pthread_mutex_unlock(&mmap_journal_mutex);
+	assert(lock_ret == 0);
+}
+
+/* Called from the query path when 'obj' is within the journalled range.
+ * We only trylock: the lock holder may be waiting on the pageindex lock,
+ * which our caller might hold, and if somebody else is busy with the
+ * journal, a query racing with munmap can't expect a definite answer. */
+__attribute__((visibility("protected")))
+void __mmap_allocator_flush_journal_for(const void *obj)
+{
+	if (0 != pthread_mutex_trylock(&mmap_journal_mutex)) return;
+	if ((uintptr_t) obj >= __mmap_allocator_journal_begin
+			&& (uintptr_t) obj < __mmap_allocator_journal_end)
+	{
+		flush_mmap_journal();
+	}
+	int lock_ret = pthread_mutex_unlock(&mmap_journal_mutex);
+	assert(lock_ret == 0);
+}
+
+static void journal_append(int op, void *addr, size_t length, int prot, void *caller)
+{
+	char *begin = addr;
+	char *end = begin + ROUND_UP(length, PAGE_SIZE);
+	int lock_ret = pthread_mutex_lock(&mmap_journal_mutex);
+	assert(lock_ret == 0);
+	struct mmap_journal_entry *last = mmap_journal_len ? &mmap_journal[mmap_journal_len - 1] : NULL;
+	if (last && last->op == op && (op != MMAP_JOURNAL_MPROTECT || last->prot == prot)
+			&& begin <= last->end && end >= last->begin)
+	{
+		if (begin < last->begin) last->begin = begin;
+		if (end > last->end) last->end = end;
+	}
+	else
+	{
+		if (mmap_journal_len == MMAP_JOURNAL_MAX) flush_mmap_journal();
+		mmap_journal[mmap_journal_len++] = (struct mmap_journal_entry) {
+			.op = op, .begin = begin, .end = end, .prot = prot, .caller = caller
+		};
+	}
+	if (__mmap_allocator_journal_begin == __mmap_allocator_journal_end)
+	{
+		__mmap_allocator_journal_begin = (uintptr_t) begin;
+		__mmap_allocator_journal_end = (uintptr_t) end;
+	}
+	else
+	{
+		if ((uintptr_t) begin < __mmap_allocator_journal_begin) __mmap_allocator_journal_begin = (uintptr_t) begin;
+		if ((uintptr_t) end > __mmap_allocator_journal_end) __mmap_allocator_journal_end = (uintptr_t) end;
+	}
+	lock_ret = pthread_mutex_unlock(&mmap_journal_mutex);
+	assert(lock_ret == 0);
+}
+
 void __mmap_allocator_notify_munmap(void *addr, size_t length, void *caller)
 {
 	/* HACK: Is it actually a stack or sbrk area? Branch out if so. */
 	// FIXME
-	do_munmap(addr, length, caller);
+	LIBALLOCS_TRACE3(munmap, addr, length, caller);
+	journal_append(MMAP_JOURNAL_MUNMAP, addr, length, 0, caller);
 }
 
 struct mapping_entry *__mmap_allocator_find_entry(const void *addr, struct mapping_sequence *seq)
@@ -638,6 +1064,8 @@ void __mmap_allocator_notify_mremap(void *mapped_addr, void *old_addr, size_t ol
 {
 	/* called after a successful mremap call */
 	assert(!MMAP_RETURN_IS_ERROR(mapped_addr)); // don't call us with MAP_FAILED
+	LIBALLOCS_TRACE5(mremap, mapped_addr, old_addr, old_size_as_passed, new_size, caller);
+	flush_mmap_journal();
 	/* 'old_size' is the caller's take on the old size... the kernel
 	 * will have rounded it up if it was not a multiple of the page size */
 	size_t old_size = ROUND_UP(old_size_as_passed, PAGE_SIZE);
@@ -797,6 +1225,7 @@ static void do_mmap(void *mapped_addr, void *requested_addr, size_t requested_le
 {
 	assert(!MMAP_RETURN_IS_ERROR(mapped_addr)); // don't call us with MAP_FAILED
 	if (mapped_addr == NULL) abort();
+	flush_mmap_journal();
 #define TRACE_MMAP_DEBUG_LEVEL 0 /* FIXME: move this up top, default to >0 */
 
 	debug_printf(TRACE_MMAP_DEBUG_LEVEL, 
@@ -815,7 +1244,7 @@ static void do_mmap(void *mapped_addr, void *requested_addr, size_t requested_le
 	for (; i < mapped_length >> LOG_PAGE_SIZE; ++i)
 	{
 		bigalloc_num_t num;
-		if (0 != (num = pageindex[((uintptr_t) mapped_addr >> LOG_PAGE_SIZE) + i]))
+		if (0 != (num = PAGEINDEX_GET(((uintptr_t) mapped_addr >> LOG_PAGE_SIZE) + i)))
 		{
 			/* We found an overlap. Do nothing for now, except remember
 			 * that overlaps exist. */
@@ -892,76 +1321,251 @@ static void do_mmap(void *mapped_addr, void *requested_addr, size_t requested_le
 	}
 
 	/* If we got here, we have to create a new bigalloc. */
-	struct mapping_sequence *p_new_seq = __private_nommap_calloc(1, sizeof (struct mapping_sequence));
+	struct mapping_sequence *p_new_seq = new_mapping_sequence();
 	/* "Extend" the empty sequence. */
 	_Bool success = augment_sequence(p_new_seq, mapped_addr, (char*) mapped_addr + mapped_length, 
 			prot, flags, offset, filename, caller);
 	if (!success) abort();
-	add_mapping_sequence_bigalloc_with_seq(p_new_seq, __private_nommap_free);
+	add_mapping_sequence_bigalloc_with_seq(p_new_seq, free_mapping_sequence);
 }
 void __mmap_allocator_notify_mmap(void *mapped_addr, void *requested_addr, size_t length, 
 		int prot, int flags, int fd, off_t offset, void *caller)
 {
-	do_mmap(mapped_addr, requested_addr, length, prot, flags, filename_for_fd(fd), fd, offset, caller, "mmap");
+	LIBALLOCS_TRACE5(mmap, mapped_addr, length, prot, flags, caller);
+	do_mmap(mapped_addr, requested_addr, length, prot, flags,
+		(flags & MAP_ANONYMOUS) ? NULL : filename_for_fd(fd), fd, offset, caller, "mmap");
 }
 
 void __mmap_allocator_notify_mprotect(void *addr, size_t len, int prot)
 {
-	// FIXME: update prot
+	journal_append(MMAP_JOURNAL_MPROTECT, addr, len, prot, NULL);
 }
 
 static int add_missing_cb(struct maps_entry *ent, char *linebuf, void *arg);
+/* When scanning /proc at startup, most sequences we find are not yet
+ * indexed at all. Rather than creating their bigallocs one at a time,
+ * we queue them up and create them in one go (see
+ * __liballocs_new_toplevel_bigallocs_sorted). Anything that needs
+ * reconciling with existing bigallocs, or is the stack, goes the slow way
+ * via add_mapping_sequence_bigalloc_if_absent, after flushing the queue
+ * so that we still process sequences strictly in address order. */
+#define ADD_MISSING_BATCH_MAX 256
 struct add_missing_cb_args
 {
 	struct mapping_sequence *seq;
 	void *end_addr;
+	unsigned nbatched;
+	struct bigalloc_batch_entry batch[ADD_MISSING_BATCH_MAX];
 };
+static void flush_add_missing_batch(struct add_missing_cb_args *args)
+{
+	if (args->nbatched == 0) return;
+	unsigned n = __liballocs_new_toplevel_bigallocs_sorted(args->batch, args->nbatched,
+		free_mapping_sequence, &__mmap_allocator, NULL);
+	if (n != args->nbatched) abort();
+	args->nbatched = 0;
+}
+static void finish_add_missing_sequence(struct add_missing_cb_args *args)
+{
+	struct mapping_sequence *seq = args->seq;
+	if (seq->nused == 0) return;
+	_Bool is_stack = seq->filename && 0 == strncmp(seq->filename, "[stack", 6);
+	if (!is_stack && __pages_unused(seq->begin, seq->end))
+	{
+		/* This is the go_ahead case of add_mapping_sequence_bigalloc_if_absent,
+		 * so take the same copy of the sequence that it would. */
+		struct mapping_sequence *copy = new_mapping_sequence();
+		if (!copy) abort();
+		memcpy(copy, seq, sizeof (struct mapping_sequence));
+		args->batch[args->nbatched++] = (struct bigalloc_batch_entry) {
+			.begin = seq->begin,
+			.size = (uintptr_t) seq->end - (uintptr_t) seq->begin,
+			.allocator_private = copy
+		};
+		if (args->nbatched == ADD_MISSING_BATCH_MAX) flush_add_missing_batch(args);
+		return;
+	}
+	flush_add_missing_batch(args);
+	add_mapping_sequence_bigalloc_if_absent(seq);
+}
+
+/* Parse one line of /proc/<pid>/maps, in place, without allocating or
+ * calling into stdio. We only fill in the fields that add_missing_cb
+ * uses. Returns 0 if the line is malformed. */
+static _Bool parse_maps_line(const char *pos, const char *line_end, struct maps_entry *ent)
+{
+#define PARSE_HEX(out) do { \
+	unsigned long val = 0; const char *start = pos; \
+	for (; pos < line_end; ++pos) { \
+		char c = *pos; \
+		if (c >= '0' && c <= '9') val = (val << 4) | (c - '0'); \
+		else if (c >= 'a' && c <= 'f') val = (val << 4) | (10 + c - 'a'); \
+		else break; \
+	} \
+	if (pos == start) return 0; \
+	(out) = val; \
+} while (0)
+#define EXPECT(ch) do { if (pos == line_end || *pos != (ch)) return 0; ++pos; } while (0)
+#define SKIP_FIELD do { while (pos < line_end && *pos != ' ') ++pos; } while (0)
+	unsigned long offset;
+	PARSE_HEX(ent->first);
+	EXPECT('-');
+	PARSE_HEX(ent->second);
+	EXPECT(' ');
+	if (line_end - pos < 5) return 0;
+	ent->r = pos[0]; ent->w = pos[1]; ent->x = pos[2]; ent->p = pos[3];
+	pos += 4;
+	EXPECT(' ');
+	PARSE_HEX(offset);
+	ent->offset = offset;
+	EXPECT(' ');
+	SKIP_FIELD; /* device */
+	EXPECT(' ');
+	SKIP_FIELD; /* inode */
+	while (pos < line_end && *pos == ' ') ++pos;
+	size_t restlen = line_end - pos;
+	if (restlen >= sizeof ent->rest) restlen = sizeof ent->rest - 1;
+	memcpy(ent->rest, pos, restlen);
+	ent->rest[restlen] = '\0';
+	return 1;
+#undef PARSE_HEX
+#undef EXPECT
+#undef SKIP_FIELD
+}
+
+/* The slow path for __mapping_sequence_filename: find the /proc maps line
+ * covering 'addr' and take its filename. Unlike at startup, we may be
+ * called at any time, so we read in chunks into a buffer on the stack. */
+static _Bool maps_filename_for_addr(const void *addr, char *out_buf, size_t out_bufsz)
+{
+	int fd = open("/proc/self/maps", O_RDONLY);
+	if (fd == -1) return 0;
+	char buf[8192];
+	size_t nbuf = 0;
+	ssize_t nbytes;
+	_Bool seen = 0, found = 0;
+	while (!seen && 0 < (nbytes = read(fd, buf + nbuf, sizeof buf - nbuf)))
+	{
+		nbuf += nbytes;
+		const char *line = buf;
+		const char *line_end;
+		while (!seen && NULL != (line_end = memchr(line, '\n', buf + nbuf - line)))
+		{
+			struct maps_entry ent;
+			if (parse_maps_line(line, line_end, &ent)
+					&& ent.first <= (uintptr_t) addr && ent.second > (uintptr_t) addr)
+			{
+				seen = 1;
+				size_t len = strlen(ent.rest);
+				if (len > 0 && len < out_bufsz)
+				{
+					memcpy(out_buf, ent.rest, len + 1);
+					found = 1;
+				}
+			}
+			line = line_end + 1;
+		}
+		if (line == buf && nbuf == sizeof buf) break; /* a line too long for us */
+		/* Keep any incomplete last line for next time. */
+		nbuf = buf + nbuf - line;
+		memmove(buf, line, nbuf);
+	}
+	close(fd);
+	return found;
+}
+
 void add_missing_mappings_from_proc(void *executable_end_addr)
 {
 	char proc_buf[sizeof "/proc/%d/maps" - 2 + 10 /* max #digits in an int */];
 	int ret;
 	ret = snprintf(proc_buf, sizeof proc_buf, "/proc/%d/maps", getpid());
 	if (!(ret > 0)) abort();
-	int fd = open(proc_buf, O_RDONLY);
-	if (fd == -1) abort();
-	
+
 	/* We used to use getline(), but in some deployments it's not okay to 
-	 * use malloc when we're called early during initialization. So we write
-	 * our own read loop. Also we read everything in one go, because add_missing_cb
-	 * may . */
-#define MAX_LINES 1024
-#define MAX_ALLBUF 81920 // 80kB
-	static char *lines[MAX_LINES];
-	static char allbuf[MAX_ALLBUF];
-	char linebuf[8192];
-	/* librunt defines the get_a_line_from_maps_fd helper.
-	 * It's really important that during this loop, the memory map does not change.
-	 * Otherwise, the contents of the maps file will change under our feet and
-	 * our fd will no longer point at a line break. Therefore, we don't do add_missing
-	 * for each line as we go along... now that pageindex space is allocated lazily, this
-	 * can easily change the maps file. Instead, we read all lines up-front... librunt now
-	 * has this code factored out from libsystrap (was in example/trace-syscalls.c). */
-	int nlines_read = read_all_maps_lines_from_fd(fd,
-		linebuf, sizeof linebuf, lines, MAX_LINES, allbuf, sizeof allbuf);
-	/* We run during startup, so the number of distinct /proc lines should be small. */
-	assert(nlines_read > 0);
-	/* Now we have an array containing the lines. */
+	 * use malloc when we're called early during initialization. So we read
+	 * the whole file in one go and parse it in place.
+	 * It's really important that while we read, the memory map does not change.
+	 * Otherwise, the contents of the maps file will change under our feet.
+	 * Adding bigallocs can easily change it, now that pageindex space is
+	 * allocated lazily. So we read into a buffer we map ourselves, before
+	 * adding anything. If the file doesn't fit, we map a buffer twice the
+	 * size and read it again from the start, so the snapshot we parse is
+	 * always complete. The buffer shows up in the snapshot, so we cut it out
+	 * of any line covering it (the kernel may have merged it with a
+	 * neighbouring anonymous mapping), and unmap it when we're done. */
+	size_t allbuf_sz = 16 * PAGE_SIZE;
+	char *allbuf;
+	size_t nread;
+	for (;;)
+	{
+		allbuf = raw_mmap(NULL, allbuf_sz, PROT_READ|PROT_WRITE,
+			MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		if (MMAP_RETURN_IS_ERROR(allbuf)) abort();
+		int fd = open(proc_buf, O_RDONLY);
+		if (fd == -1) abort();
+		nread = 0;
+		ssize_t nbytes;
+		while (nread < allbuf_sz
+				&& 0 != (nbytes = read(fd, allbuf + nread, allbuf_sz - nread)))
+		{
+			if (nbytes == -1) abort();
+			nread += nbytes;
+		}
+		close(fd);
+		if (nread < allbuf_sz) break;
+		raw_munmap(allbuf, allbuf_sz);
+		allbuf_sz *= 2;
+	}
+	/* We run during startup, so there should be at least some lines. */
+	assert(nread > 0);
+	uintptr_t allbuf_begin = (uintptr_t) allbuf;
+	uintptr_t allbuf_limit = allbuf_begin + allbuf_sz;
+
+	/* /proc lists mappings in address order, so one pass builds the sequences. */
 	struct mapping_sequence current = {
 		.begin = NULL
 	};
-	struct add_missing_cb_args args = {
+	static struct add_missing_cb_args args; /* big; keep it off the stack */
+	args = (struct add_missing_cb_args) {
 		.seq = &current,
-		.end_addr = executable_end_addr
+		.end_addr = executable_end_addr,
+		.nbatched = 0
 	};
 	struct maps_entry entry;
-	for (int i = 0; i < nlines_read; ++i)
+	const char *allbuf_end = allbuf + nread;
+	for (const char *line = allbuf; line < allbuf_end; )
 	{
-		process_one_maps_line(lines[i], &entry, add_missing_cb, &args);
+		const char *line_end = memchr(line, '\n', allbuf_end - line);
+		if (!line_end) break; /* truncated last line */
+		if (parse_maps_line(line, line_end, &entry))
+		{
+			if (entry.first < allbuf_limit && entry.second > allbuf_begin)
+			{
+				/* Whatever lies either side of our buffer is real. */
+				struct maps_entry above = entry;
+				if (entry.first < allbuf_begin)
+				{
+					entry.second = allbuf_begin;
+					add_missing_cb(&entry, (char*) line, &args);
+				}
+				if (above.second > allbuf_limit)
+				{
+					above.offset += allbuf_limit - above.first;
+					above.first = allbuf_limit;
+					add_missing_cb(&above, (char*) line, &args);
+				}
+			}
+			else add_missing_cb(&entry, (char*) line, &args);
+		}
+		else debug_printf(1, "Warning: could not parse /proc maps line at offset %ld\n",
+			(long) (line - allbuf));
+		line = line_end + 1;
 	}
 	/* Finish off the last mapping. */
-	if (current.nused > 0) add_mapping_sequence_bigalloc_if_absent(&current);
+	finish_add_missing_sequence(&args);
+	flush_add_missing_batch(&args);
 
-	close(fd);
+	raw_munmap(allbuf, allbuf_sz);
 }
 static _Bool initialized;
 static _Bool trying_to_initialize;
@@ -1505,7 +2109,7 @@ static int add_missing_cb(struct maps_entry *ent, char *linebuf, void *args_as_v
 	_Bool extended = extend_current(cur, ent);
 	if (!extended)
 	{
-		add_mapping_sequence_bigalloc_if_absent(cur);
+		finish_add_missing_sequence(args);
 		memset(cur, 0, sizeof (struct mapping_sequence));
 		_Bool began_new = extend_current(cur, ent);
 		if (!began_new) abort();
@@ -1521,6 +2125,7 @@ void __mmap_allocator_notify_brk(void *new_curbrk)
 	 * we're initialized, so that's okay. BUT see the note in 
 	 * __mmap_allocator_init... before we're initialized, we need
 	 * another mechanism to probe for brk updates. */
+	flush_mmap_journal();
 
 	/* If we haven't made the bigalloc yet, sbrk needs no action.
 	 * Otherwise we must update the end. */
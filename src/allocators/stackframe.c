@@ -122,6 +122,79 @@ void ( __attribute__((constructor(101))) __stackframe_allocator_init)(void)
 	}
 }
 
+/* Per-thread cache of recently resolved frames. Hot loops that repeatedly
+ * query locals of the same few frames would otherwise redo the whole
+ * unwind each time. A frame's type and allocation base are a function only
+ * of its ip and its frame base (higherframe sp), so we key on those. An
+ * entry is usable only while its frame is still below us on the stack,
+ * i.e. our current sp is lower than the frame's sp, and while the return
+ * addresses bracketing the frame still hold what we saw when we cached it.
+ * If the frame has been popped and the same call site re-entered at the
+ * same depth, the cached answer is still correct. */
+#define STACKFRAME_CACHE_SIZE 4
+struct stackframe_cache_entry
+{
+	uintptr_t frame_sp;         /* sp in the frame, i.e. just above the callee's return addr */
+	uintptr_t frame_base;       /* higherframe sp, i.e. just above our return addr */
+	uintptr_t ip;               /* == *(frame_sp - 1 word) while the frame is live */
+	uintptr_t higherframe_ip;   /* == *(frame_base - 1 word) while the frame is live */
+	struct uniqtype *frame_desc; /* null means entry is unused */
+	unsigned char *frame_allocation_base;
+};
+static __thread struct stackframe_cache_entry stackframe_cache[STACKFRAME_CACHE_SIZE];
+static __thread unsigned stackframe_cache_next_victim;
+
+static struct stackframe_cache_entry *stackframe_cache_lookup(const void *obj, uintptr_t cur_sp)
+{
+	for (unsigned i = 0; i < STACKFRAME_CACHE_SIZE; ++i)
+	{
+		struct stackframe_cache_entry *e = &stackframe_cache[i];
+		if (!e->frame_desc) continue;
+		if (cur_sp >= e->frame_sp)
+		{
+			/* The frame has been popped (or we are no deeper than it),
+			 * so nothing we know about it can be trusted. */
+			e->frame_desc = NULL;
+			continue;
+		}
+		if (!((unsigned char *) obj >= e->frame_allocation_base
+			&& (unsigned char *) obj < e->frame_allocation_base + e->frame_desc->pos_maxoff))
+		{
+			continue;
+		}
+		/* Since cur_sp < frame_sp, both these words are on the live stack. */
+		if (*(uintptr_t *)(e->frame_sp - sizeof (void*)) != e->ip
+			|| *(uintptr_t *)(e->frame_base - sizeof (void*)) != e->higherframe_ip)
+		{
+			e->frame_desc = NULL;
+			continue;
+		}
+		return e;
+	}
+	return NULL;
+}
+
+static void stackframe_cache_fill(uintptr_t frame_sp, uintptr_t frame_base,
+	uintptr_t ip, uintptr_t higherframe_ip, struct uniqtype *frame_desc,
+	unsigned char *frame_allocation_base)
+{
+	/* We can only validate entries whose bracketing return addresses are
+	 * where we expect. Check that now, e.g. so that a frame whose ip we got
+	 * from a signal context is never cached. */
+	if (*(uintptr_t *)(frame_sp - sizeof (void*)) != ip
+		|| *(uintptr_t *)(frame_base - sizeof (void*)) != higherframe_ip) return;
+	struct stackframe_cache_entry *e = &stackframe_cache[stackframe_cache_next_victim];
+	stackframe_cache_next_victim = (stackframe_cache_next_victim + 1) % STACKFRAME_CACHE_SIZE;
+	*e = (struct stackframe_cache_entry) {
+		.frame_sp = frame_sp,
+		.frame_base = frame_base,
+		.ip = ip,
+		.higherframe_ip = higherframe_ip,
+		.frame_desc = frame_desc,
+		.frame_allocation_base = frame_allocation_base
+	};
+}
+
 // Not declared in any header...
 void __liballocs_sanity_check_bigalloc(struct big_allocation *b);
 
@@ -174,7 +247,7 @@ static liballocs_err_t get_info(void *obj, struct big_allocation *b,
 	struct uniqtype **out_type, void **out_base, 
 	unsigned long *out_size, const void** out_site)
 {		
-	++__liballocs_hit_stack_case;
+	__liballocs_count(LIBALLOCS_COUNTER_HIT_STACK_CASE);
 	liballocs_err_t err;
 #define BEGINNING_OF_STACK ((uintptr_t) MAXIMUM_USER_ADDRESS)
 	// we want to walk a sequence of vaddrs!
@@ -190,6 +263,18 @@ static liballocs_err_t get_info(void *obj, struct big_allocation *b,
 	int unw_ret;
 	unw_context_t unw_context;
 
+	/* Can we skip the walk? */
+	struct stackframe_cache_entry *cached = stackframe_cache_lookup(obj,
+		(uintptr_t) __liballocs_get_sp());
+	if (cached)
+	{
+		if (out_base) *out_base = cached->frame_allocation_base;
+		if (out_type) *out_type = cached->frame_desc;
+		if (out_site) *out_site = (void*) cached->ip;
+		if (out_size) *out_size = cached->frame_desc->pos_maxoff;
+		return NULL;
+	}
+
 	unw_ret = unw_getcontext(&unw_context);
 	unw_init_local(&cursor, /*this->unw_as,*/ &unw_context);
 
@@ -324,6 +409,11 @@ static liballocs_err_t get_info(void *obj, struct big_allocation *b,
 			if (out_type) *out_type = frame_desc;
 			if (out_site) *out_site = (void*)(intptr_t) ip; // HMM -- is this the best way to represent this?
 			if (out_size) *out_size = frame_desc->pos_maxoff;
+			if (higherframe_sp != BEGINNING_OF_STACK)
+			{
+				stackframe_cache_fill(sp, higherframe_sp, ip, higherframe_ip,
+					frame_desc, frame_allocation_base);
+			}
 			goto out_success;
 		}
 		// have we gone too far? we are going upwards in memory...
@@ -349,10 +439,15 @@ out_success:
 	return NULL;
 abort_stack:
 	if (!err) err = &__liballocs_err_unknown_stack_walk_problem;
-	++__liballocs_aborted_stack;
+	__liballocs_count(LIBALLOCS_COUNTER_ABORTED_STACK);
 	return err;
 }
 #define maximum_vaddr_range_size (4*1024) // HACK
+/* These must agree with tools/frametypes2.cpp. */
+#define FRAME_VADDRS_INDEX_LOG_PAGE 12
+#define FRAME_VADDRS_INDEX_LOG_LINE 6
+#define FRAME_VADDRS_INDEX_LINES_PER_PAGE (1u << (FRAME_VADDRS_INDEX_LOG_PAGE - FRAME_VADDRS_INDEX_LOG_LINE))
+#define FRAME_VADDRS_INDEX_OVERFLOW 255
 
 void init_frames_info(struct allocs_file_metadata *file)
 {
@@ -367,9 +462,70 @@ void init_frames_info(struct allocs_file_metadata *file)
 		struct frame_allocsite_entry *first_entry = sym_to_addr(found);
 		file->nframes =  found->st_size / sizeof (struct frame_allocsite_entry);
 		file->frames_info = first_entry;
+		/* Newer frametypes output also has an index over the table. We need all
+		 * three parts of it, else we carry on using binary search. */
+		ElfW(Sym) *found_base = gnu_hash_lookup(
+			get_gnu_hash(file->meta_obj_handle),
+			get_dynsym(file->meta_obj_handle),
+			get_dynstr(file->meta_obj_handle),
+			"frame_vaddrs_index_base");
+		ElfW(Sym) *found_l1 = gnu_hash_lookup(
+			get_gnu_hash(file->meta_obj_handle),
+			get_dynsym(file->meta_obj_handle),
+			get_dynstr(file->meta_obj_handle),
+			"frame_vaddrs_index_l1");
+		ElfW(Sym) *found_l2 = gnu_hash_lookup(
+			get_gnu_hash(file->meta_obj_handle),
+			get_dynsym(file->meta_obj_handle),
+			get_dynstr(file->meta_obj_handle),
+			"frame_vaddrs_index_l2");
+		if (found_base && found_l1 && found_l2
+			&& found_l2->st_size == (found_l1->st_size / sizeof (unsigned))
+				* FRAME_VADDRS_INDEX_LINES_PER_PAGE)
+		{
+			file->frames_index_base_vaddr = *(unsigned long *) sym_to_addr(found_base);
+			file->frames_index_l1 = sym_to_addr(found_l1);
+			file->frames_index_l2 = sym_to_addr(found_l2);
+			file->frames_index_npages = found_l1->st_size / sizeof (unsigned);
+		}
 	}
 }
 
+/* Map a vaddr to the last frame record at or below it, using the index
+ * that frametypes2 emits alongside frame_vaddrs. See the comment on
+ * write_frame_vaddrs_index in tools/frametypes2.cpp for the format. There
+ * is no binary search except within pages too dense for the index's
+ * one-byte deltas. */
+static struct frame_allocsite_entry *
+frames_index_lookup(struct frame_allocsite_entry *frames_info, unsigned nframes,
+	uintptr_t index_base_vaddr, unsigned *l1, unsigned char *l2, unsigned npages,
+	uintptr_t target_vaddr)
+{
+	if (target_vaddr < index_base_vaddr) return NULL;
+	uintptr_t pg = (target_vaddr - index_base_vaddr) >> FRAME_VADDRS_INDEX_LOG_PAGE;
+	/* Beyond the last page, every record is at or below us. */
+	if (pg >= npages) return nframes ? &frames_info[nframes - 1] : NULL;
+	unsigned line = (target_vaddr >> FRAME_VADDRS_INDEX_LOG_LINE)
+		& (FRAME_VADDRS_INDEX_LINES_PER_PAGE - 1);
+	unsigned char delta = l2[pg * FRAME_VADDRS_INDEX_LINES_PER_PAGE + line];
+	unsigned n_leq = l1[pg];
+	if (unlikely(delta == FRAME_VADDRS_INDEX_OVERFLOW))
+	{
+		unsigned lo = n_leq ? n_leq - 1 : 0;
+		unsigned hi = (pg + 1 < npages) ? l1[pg + 1] : nframes;
+#define proj(p) ((p)->entry.allocsite_vaddr)
+		struct frame_allocsite_entry *found = bsearch_leq_generic(
+			struct frame_allocsite_entry, target_vaddr,
+			/*  T*  */ frames_info + lo, /* unsigned */ hi - lo,
+			proj);
+#undef proj
+		return found;
+	}
+	n_leq += delta;
+	while (n_leq < nframes && frames_info[n_leq].entry.allocsite_vaddr <= target_vaddr) ++n_leq;
+	return n_leq ? &frames_info[n_leq - 1] : NULL;
+}
+
 static struct frame_uniqtype_and_offset
 pc_to_frame_uniqtype(const void *addr)
 {
@@ -383,12 +539,22 @@ pc_to_frame_uniqtype(const void *addr)
 	assert(afile);
 	if (!afile->frames_info) goto fail;
 	uintptr_t target_vaddr = (uintptr_t) addr - afile->m.l->l_addr;
+	struct frame_allocsite_entry *found;
+	if (afile->frames_index_l1)
+	{
+		found = frames_index_lookup(afile->frames_info, afile->nframes,
+			afile->frames_index_base_vaddr, afile->frames_index_l1,
+			afile->frames_index_l2, afile->frames_index_npages, target_vaddr);
+	}
+	else
+	{
 #define proj(p) ((p)->entry.allocsite_vaddr)
-	struct frame_allocsite_entry *found = bsearch_leq_generic(
-		struct frame_allocsite_entry, target_vaddr,
-		/*  T*  */ afile->frames_info, /* unsigned */ afile->nframes,
-		proj);
+		found = bsearch_leq_generic(
+			struct frame_allocsite_entry, target_vaddr,
+			/*  T*  */ afile->frames_info, /* unsigned */ afile->nframes,
+			proj);
 #undef proj
+	}
 	if (found)
 	{
 		return (struct frame_uniqtype_and_offset) {
@@ -401,3 +567,96 @@ fail:
 }
 #undef maximum_vaddr_range_size
 #undef BEGINNING_OF_STACK
+
+#ifdef UNIT_TEST
+#include <time.h>
+/* Check the frame_vaddrs index against plain binary search, over a
+ * synthetic table shaped like a large DSO's (many short PC ranges, some
+ * pages dense enough to overflow the index), and time the two. */
+#define NTEST_FRAMES (1u<<20)
+#define NTEST_LOOKUPS (1u<<24)
+static unsigned long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+int main(void)
+{
+	struct frame_allocsite_entry *frames = calloc(NTEST_FRAMES, sizeof *frames);
+	uintptr_t vaddr = 0x1234;
+	srandom(42);
+	for (unsigned i = 0; i < NTEST_FRAMES; ++i)
+	{
+		frames[i].entry.allocsite_vaddr = vaddr;
+		/* Mostly a few dozen bytes apart; occasionally very dense. */
+		vaddr += (i % 4096 < 300) ? 1 : 1 + (random() % 64);
+	}
+	uintptr_t base = frames[0].entry.allocsite_vaddr & ~((1ul<<FRAME_VADDRS_INDEX_LOG_PAGE) - 1);
+	unsigned npages = ((frames[NTEST_FRAMES-1].entry.allocsite_vaddr - base)
+		>> FRAME_VADDRS_INDEX_LOG_PAGE) + 1;
+	unsigned *l1 = calloc(npages, sizeof *l1);
+	unsigned char *l2 = calloc(npages, FRAME_VADDRS_INDEX_LINES_PER_PAGE);
+	/* Build the index just as frametypes2 does. */
+	unsigned n_leq = 0;
+	for (unsigned pg = 0; pg < npages; ++pg)
+	{
+		uintptr_t page_addr = base + ((uintptr_t) pg << FRAME_VADDRS_INDEX_LOG_PAGE);
+		while (n_leq < NTEST_FRAMES && frames[n_leq].entry.allocsite_vaddr <= page_addr) ++n_leq;
+		l1[pg] = n_leq;
+		_Bool overflowed = 0;
+		for (unsigned line = 0; line < FRAME_VADDRS_INDEX_LINES_PER_PAGE; ++line)
+		{
+			uintptr_t line_addr = page_addr + ((uintptr_t) line << FRAME_VADDRS_INDEX_LOG_LINE);
+			while (n_leq < NTEST_FRAMES && frames[n_leq].entry.allocsite_vaddr <= line_addr) ++n_leq;
+			if (n_leq - l1[pg] >= FRAME_VADDRS_INDEX_OVERFLOW) overflowed = 1;
+			l2[pg * FRAME_VADDRS_INDEX_LINES_PER_PAGE + line] = n_leq - l1[pg];
+		}
+		if (overflowed) memset(&l2[pg * FRAME_VADDRS_INDEX_LINES_PER_PAGE],
+			FRAME_VADDRS_INDEX_OVERFLOW, FRAME_VADDRS_INDEX_LINES_PER_PAGE);
+	}
+	uintptr_t *targets = calloc(NTEST_LOOKUPS, sizeof *targets);
+	for (unsigned i = 0; i < NTEST_LOOKUPS; ++i)
+	{
+		targets[i] = random() % (vaddr + 0x100);
+	}
+	/* Correctness first. */
+	for (unsigned i = 0; i < NTEST_LOOKUPS; i += 17)
+	{
+#define proj(p) ((p)->entry.allocsite_vaddr)
+		struct frame_allocsite_entry *by_bsearch = bsearch_leq_generic(
+			struct frame_allocsite_entry, targets[i], frames, NTEST_FRAMES, proj);
+#undef proj
+		struct frame_allocsite_entry *by_index = frames_index_lookup(frames, NTEST_FRAMES,
+			base, l1, l2, npages, targets[i]);
+		assert(by_bsearch == by_index);
+	}
+	/* Now timing. Sum the results so that nothing is optimised away. */
+	uintptr_t sum = 0;
+	unsigned long t0 = now_ns();
+	for (unsigned i = 0; i < NTEST_LOOKUPS; ++i)
+	{
+#define proj(p) ((p)->entry.allocsite_vaddr)
+		struct frame_allocsite_entry *found = bsearch_leq_generic(
+			struct frame_allocsite_entry, targets[i], frames, NTEST_FRAMES, proj);
+#undef proj
+		sum += (uintptr_t) found;
+	}
+	unsigned long t1 = now_ns();
+	for (unsigned i = 0; i < NTEST_LOOKUPS; ++i)
+	{
+		sum -= (uintptr_t) frames_index_lookup(frames, NTEST_FRAMES,
+			base, l1, l2, npages, targets[i]);
+	}
+	unsigned long t2 = now_ns();
+	assert(sum == 0);
+	printf("frame_vaddrs lookup, %u records, %u lookups: bsearch %.1f ns/lookup, index %.1f ns/lookup\n",
+		NTEST_FRAMES, NTEST_LOOKUPS,
+		(double)(t1 - t0) / NTEST_LOOKUPS, (double)(t2 - t1) / NTEST_LOOKUPS);
+	free(targets);
+	free(l2);
+	free(l1);
+	free(frames);
+	return 0;
+}
+#endif /* UNIT_TEST */
@@ -313,7 +313,7 @@ struct big_allocation *plug_hole_or_abort(
 			i != PAGENUM(highest_containing_mapping_bigalloc->begin);
 			++i)
 	{
-		hole_free &= (pageindex[i] == 0);
+		hole_free &= (PAGEINDEX_GET(i) == 0);
 	}
 	if (!hole_free) { failure_kind = "hole not free"; goto hole_err; }
 	debug_printf(0, "Hole seems to be free according to pageindex...\n");
@@ -374,8 +374,8 @@ struct big_allocation *plug_hole_or_abort(
 	assert(lower_seq->nused >= 2);
 	/* If we got the filename from the maps file, it might not
 	 * match the ldso name -- it might be its realpath. */
-	assert(0 == strcmp(lower_seq->filename, __ldso_name)
-		|| 0 == strcmp(lower_seq->filename, realpath_quick(__ldso_name)));
+	assert(0 == strcmp(__mapping_sequence_filename(lower_seq), __ldso_name)
+		|| 0 == strcmp(__mapping_sequence_filename(lower_seq), realpath_quick(__ldso_name)));
 	assert(lower_seq->mappings[lower_seq->nused - 1].is_anon == 0);
 	struct mapping_sequence upper_seq_copy = *upper_seq;
 	/* Now we can delete the upper bigalloc. */
@@ -563,6 +563,8 @@ void __static_file_allocator_notify_unload(const char *copied_filename)
 				if (0 == strcmp(copied_filename, afm->m.filename))
 				{
 					/* unload meta-object */
+					if (afm->meta_obj_handle) __liballocs_footprint_note_meta_dso(
+						afm->meta_obj_handle, 0);
 					dlclose(afm->meta_obj_handle);
 					/* It's a match, so delete. FIXME: don't match by name (fragile);
 					 * load addr is better */
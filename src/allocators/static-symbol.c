@@ -263,7 +263,7 @@ struct lookup_result {
 static
 struct lookup_result do_lookup(void *obj, struct big_allocation *maybe_bigalloc)
 {
-	++__liballocs_hit_static_case;
+	__liballocs_count(LIBALLOCS_COUNTER_HIT_STATIC_CASE);
 	/* Search backwards in the bitmap for the first bit set
 	 * -- bounded by the biggest static object (can we do better?).
 	 * Then count backwards for bits set, down to a shortcut vector
@@ -351,7 +351,7 @@ struct lookup_result do_lookup(void *obj, struct big_allocation *maybe_bigalloc)
 		return (struct lookup_result) { segment_bigalloc, found };
 	}
 fail:
-	++__liballocs_aborted_static;
+	__liballocs_count(LIBALLOCS_COUNTER_ABORTED_STATIC);
 	return (struct lookup_result) { NULL, NULL };
 
 }
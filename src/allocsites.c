@@ -39,6 +39,8 @@ __attribute__((visibility("hidden")))
 void __free_arena_bitmap_and_info(void *info /* really struct arena_bitmap_info * */)
 {
 	struct arena_bitmap_info *the_info = info;
+	if (the_info) __liballocs_footprint_add(LIBALLOCS_FOOTPRINT_ARENA_BITMAPS, the_info->allocator,
+		-(long) (sizeof (*the_info) + the_info->nwords * sizeof (bitmap_word_t)));
 	if (the_info && the_info->bitmap) __private_free(the_info->bitmap);
 	if (the_info) __private_free(the_info);
 }
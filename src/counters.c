@@ -1,11 +1,19 @@
 #define _GNU_SOURCE
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#ifndef NO_PTHREADS
+#include <pthread.h>
+#endif
 #include "liballocs.h"
 #include "liballocs_private.h"
 
-struct addrlist __liballocs_unrecognised_heap_alloc_sites = { 0, 0, NULL };
+struct addrlist __liballocs_unrecognised_heap_alloc_sites = { 0, NULL };
 
 struct liballocs_err __liballocs_err_stack_walk_step_failure 
  = { "stack walk reached higher frame" };
@@ -26,53 +34,307 @@ struct liballocs_err __liballocs_err_unrecognised_static_object
 struct liballocs_err __liballocs_err_object_of_unknown_storage
  = { "object of unknown storage" };
 
-/* Counters -- these are mostly liballocs-internal and therefore hidden,
- * but the ones to do with heap allocation might get ref'd from other
- * DSOs. Also we may find that we want ot inline some paths
- * into clients, in which case others may have to become more visible. */
-unsigned long __liballocs_aborted_stack __attribute__((visibility("hidden")));;
-unsigned long __liballocs_aborted_static __attribute__((visibility("hidden")));;
-unsigned long __liballocs_aborted_unknown_storage __attribute__((visibility("hidden")));;
+/* Counters. These used to be plain globals, incremented non-atomically
+ * from every thread. Now each thread claims one of a fixed array of
+ * cache-line-aligned shards the first time it counts something (round-
+ * robin, so shards are only shared once there are more threads than
+ * shards), and readers sum the shards.
+ *
+ * To read them from outside the process, set LIBALLOCS_STATS_SHM to a
+ * path (e.g. under /dev/shm). We then keep the shards in a shared mapping
+ * of that file, after a struct liballocs_stats_shm_header (declared in
+ * liballocs_counters.h, for the benefit of scrapers) giving the
+ * counter names; a scraper maps the file read-only and sums the shards.
+ * Counts made while we're switching over to the shared mapping may be
+ * lost, but that only happens once, early in initialization. A forked
+ * child goes back to private shards, starting from what its parent had
+ * counted, so that it doesn't count into its parent's file. */
+static struct liballocs_counter_shard static_shards[LIBALLOCS_COUNTER_NSHARDS];
+struct liballocs_counter_shard *__liballocs_counter_shards __attribute__((visibility("protected")))
+	= &static_shards[0];
+__thread unsigned __liballocs_counter_shard_plus_one __attribute__((visibility("protected")));
+static unsigned next_shard;
+
+/* The globals that counters used to be; see liballocs.h. */
+unsigned long __liballocs_aborted_unknown_storage __attribute__((visibility("protected")));
 unsigned long __liballocs_hit_heap_case __attribute__((visibility("protected")));
-unsigned long __liballocs_hit_alloca_case __attribute__((visibility("hidden")));;
-unsigned long __liballocs_hit_stack_case __attribute__((visibility("hidden")));;
-unsigned long __liballocs_hit_static_case __attribute__((visibility("hidden")));;
-unsigned long __liballocs_aborted_unindexed_heap __attribute__((visibility("protected")));;
-unsigned long __liballocs_aborted_unindexed_alloca __attribute__((visibility("hidden")));;
-unsigned long __liballocs_aborted_unrecognised_allocsite __attribute__((visibility("protected")));;
+unsigned long __liballocs_aborted_unindexed_heap __attribute__((visibility("protected")));
+unsigned long __liballocs_aborted_unrecognised_allocsite __attribute__((visibility("protected")));
+static unsigned long *legacy_counters[LIBALLOCS_NCOUNTERS] = {
+	[LIBALLOCS_COUNTER_ABORTED_UNKNOWN_STORAGE] = &__liballocs_aborted_unknown_storage,
+	[LIBALLOCS_COUNTER_HIT_HEAP_CASE] = &__liballocs_hit_heap_case,
+	[LIBALLOCS_COUNTER_ABORTED_UNINDEXED_HEAP] = &__liballocs_aborted_unindexed_heap,
+	[LIBALLOCS_COUNTER_ABORTED_UNRECOGNISED_ALLOCSITE] = &__liballocs_aborted_unrecognised_allocsite
+};
+
+__attribute__((visibility("protected")))
+unsigned __liballocs_counter_claim_shard(void)
+{
+	unsigned shard = 1 + (__atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED)
+		% LIBALLOCS_COUNTER_NSHARDS);
+	__liballocs_counter_shard_plus_one = shard;
+	return shard;
+}
+
+__attribute__((visibility("protected")))
+unsigned long __liballocs_counter_read(enum liballocs_counter c)
+{
+	unsigned long total = legacy_counters[c] ? __atomic_load_n(legacy_counters[c], __ATOMIC_RELAXED) : 0;
+	struct liballocs_counter_shard *shards = __atomic_load_n(&__liballocs_counter_shards, __ATOMIC_ACQUIRE);
+	for (unsigned i = 0; i < LIBALLOCS_COUNTER_NSHARDS; ++i)
+	{
+		total += __atomic_load_n(&shards[i].counts[c], __ATOMIC_RELAXED);
+	}
+	return total;
+}
+
+static const char *counter_names[LIBALLOCS_NCOUNTERS] = {
+	[LIBALLOCS_COUNTER_ABORTED_STACK] = "aborted_stack",
+	[LIBALLOCS_COUNTER_ABORTED_STATIC] = "aborted_static",
+	[LIBALLOCS_COUNTER_ABORTED_UNKNOWN_STORAGE] = "aborted_unknown_storage",
+	[LIBALLOCS_COUNTER_HIT_HEAP_CASE] = "hit_heap_case",
+	[LIBALLOCS_COUNTER_HIT_ALLOCA_CASE] = "hit_alloca_case",
+	[LIBALLOCS_COUNTER_HIT_STACK_CASE] = "hit_stack_case",
+	[LIBALLOCS_COUNTER_HIT_STATIC_CASE] = "hit_static_case",
+	[LIBALLOCS_COUNTER_ABORTED_UNINDEXED_HEAP] = "aborted_unindexed_heap",
+	[LIBALLOCS_COUNTER_ABORTED_UNINDEXED_ALLOCA] = "aborted_unindexed_alloca",
+	[LIBALLOCS_COUNTER_ABORTED_UNRECOGNISED_ALLOCSITE] = "aborted_unrecognised_allocsite"
+};
+__attribute__((visibility("protected")))
+const char *__liballocs_counter_name(enum liballocs_counter c)
+{
+	return ((unsigned) c < LIBALLOCS_NCOUNTERS) ? counter_names[c] : NULL;
+}
+
+/* Query histograms (see liballocs_counters.h). Each allocator we hear about
+ * gets a record, claimed by CAS in a small open-addressed table keyed on
+ * the allocator's address. Queries that find no allocator at all are
+ * filed under no_allocator. */
+_Bool __liballocs_query_histograms_enabled __attribute__((visibility("protected")));
+struct allocator_histograms
+{
+	struct allocator *a;
+	unsigned long latency[LIBALLOCS_NQUERY_KINDS][LIBALLOCS_HIST_NBUCKETS];
+	unsigned long scan_length[LIBALLOCS_HIST_NBUCKETS];
+};
+#define MAX_HISTOGRAMMED_ALLOCATORS 64
+static struct allocator_histograms *histograms[MAX_HISTOGRAMMED_ALLOCATORS];
+static struct allocator no_allocator = { .name = "(no allocator)" };
+
+static unsigned hist_bucket(unsigned long v)
+{
+	if (v < (1ul << LIBALLOCS_HIST_SUB_BITS)) return v;
+	unsigned e = 63 - __builtin_clzl(v);
+	if (e >= LIBALLOCS_HIST_MAX_LOG) return LIBALLOCS_HIST_NBUCKETS - 1;
+	unsigned mant = (v >> (e - LIBALLOCS_HIST_SUB_BITS)) & ((1u << LIBALLOCS_HIST_SUB_BITS) - 1);
+	return ((e - LIBALLOCS_HIST_SUB_BITS + 1) << LIBALLOCS_HIST_SUB_BITS) | mant;
+}
+__attribute__((visibility("protected")))
+unsigned long __liballocs_histogram_bucket_lower_bound(unsigned i)
+{
+	if (i < (1u << LIBALLOCS_HIST_SUB_BITS)) return i;
+	unsigned e = (i >> LIBALLOCS_HIST_SUB_BITS) + LIBALLOCS_HIST_SUB_BITS - 1;
+	unsigned long mant = i & ((1u << LIBALLOCS_HIST_SUB_BITS) - 1);
+	return ((1ul << LIBALLOCS_HIST_SUB_BITS) + mant) << (e - LIBALLOCS_HIST_SUB_BITS);
+}
+
+static struct allocator_histograms *histograms_for(struct allocator *a, _Bool create)
+{
+	if (!a) a = &no_allocator;
+	unsigned start = ((uintptr_t) a >> 4) % MAX_HISTOGRAMMED_ALLOCATORS;
+	for (unsigned n = 0; n < MAX_HISTOGRAMMED_ALLOCATORS; ++n)
+	{
+		struct allocator_histograms **slot = &histograms[(start + n) % MAX_HISTOGRAMMED_ALLOCATORS];
+		struct allocator_histograms *h = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+		if (h && h->a == a) return h;
+		if (h) continue;
+		if (!create) return NULL;
+		struct allocator_histograms *new_h = __private_malloc(sizeof *new_h);
+		if (!new_h) return NULL;
+		memset(new_h, 0, sizeof *new_h);
+		new_h->a = a;
+		if (__atomic_compare_exchange_n(slot, &h, new_h, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		{
+			return new_h;
+		}
+		__private_free(new_h);
+		if (h->a == a) return h;
+	}
+	return NULL; // full; we just don't record
+}
+
+__attribute__((visibility("protected")))
+void __liballocs_record_query_latency(struct allocator *a, enum liballocs_query_kind k,
+	unsigned long cycles)
+{
+	struct allocator_histograms *h = histograms_for(a, 1);
+	if (h) __atomic_fetch_add(&h->latency[k][hist_bucket(cycles)], 1, __ATOMIC_RELAXED);
+}
+__attribute__((visibility("protected")))
+void __liballocs_record_scan_length(struct allocator *a, unsigned long nbits)
+{
+	struct allocator_histograms *h = histograms_for(a, 1);
+	if (h) __atomic_fetch_add(&h->scan_length[hist_bucket(nbits)], 1, __ATOMIC_RELAXED);
+}
+__attribute__((visibility("protected")))
+int __liballocs_read_query_histogram(struct allocator *a, int kind, unsigned long *out_buckets)
+{
+	struct allocator_histograms *h = histograms_for(a, 0);
+	if (!h || kind < LIBALLOCS_HIST_SCAN_LENGTH || kind >= LIBALLOCS_NQUERY_KINDS) return -1;
+	unsigned long *src = (kind == LIBALLOCS_HIST_SCAN_LENGTH) ? h->scan_length : h->latency[kind];
+	for (unsigned i = 0; i < LIBALLOCS_HIST_NBUCKETS; ++i)
+	{
+		out_buckets[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+	}
+	return 0;
+}
+
+static void print_one_histogram(const char *allocator_name, const char *what,
+	const unsigned long *buckets)
+{
+	unsigned long total = 0;
+	unsigned max_i = 0;
+	for (unsigned i = 0; i < LIBALLOCS_HIST_NBUCKETS; ++i)
+	{
+		total += buckets[i];
+		if (buckets[i]) max_i = i;
+	}
+	if (!total) return;
+	static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+	unsigned long q_values[sizeof quantiles / sizeof quantiles[0]];
+	unsigned long seen = 0;
+	unsigned q = 0;
+	for (unsigned i = 0; i < LIBALLOCS_HIST_NBUCKETS && q < sizeof quantiles / sizeof quantiles[0]; ++i)
+	{
+		seen += buckets[i];
+		while (q < sizeof quantiles / sizeof quantiles[0] && seen >= quantiles[q] * total)
+		{
+			q_values[q++] = __liballocs_histogram_bucket_lower_bound(i);
+		}
+	}
+	fprintf(get_stream_err(), "%-32.32s %-12s % 10lu % 9lu % 9lu % 9lu % 9lu % 10lu\n",
+		allocator_name, what, total, q_values[0], q_values[1], q_values[2], q_values[3],
+		__liballocs_histogram_bucket_lower_bound(max_i));
+}
+static const char *query_kind_names[LIBALLOCS_NQUERY_KINDS] = {
+	[LIBALLOCS_QUERY_BASE] = "base",
+	[LIBALLOCS_QUERY_SIZE] = "size",
+	[LIBALLOCS_QUERY_TYPE] = "type",
+	[LIBALLOCS_QUERY_SITE] = "site",
+	[LIBALLOCS_QUERY_INFO] = "info"
+};
+static void print_query_histograms(void)
+{
+	fprintf(get_stream_err(), "====================================================\n");
+	fprintf(get_stream_err(), "liballocs query latencies (cycles) and bitmap scan lengths (bits): \n");
+	fprintf(get_stream_err(), "%-32s %-12s %10s %9s %9s %9s %9s %10s\n",
+		"allocator", "query", "count", "p50", "p90", "p99", "p99.9", "max");
+	for (unsigned i = 0; i < MAX_HISTOGRAMMED_ALLOCATORS; ++i)
+	{
+		struct allocator_histograms *h = __atomic_load_n(&histograms[i], __ATOMIC_ACQUIRE);
+		if (!h) continue;
+		unsigned long buckets[LIBALLOCS_HIST_NBUCKETS];
+		for (int k = 0; k < LIBALLOCS_NQUERY_KINDS; ++k)
+		{
+			__liballocs_read_query_histogram(h->a, k, buckets);
+			print_one_histogram(h->a->name, query_kind_names[k], buckets);
+		}
+		__liballocs_read_query_histogram(h->a, LIBALLOCS_HIST_SCAN_LENGTH, buckets);
+		print_one_histogram(h->a->name, "scan length", buckets);
+	}
+	fprintf(get_stream_err(), "====================================================\n");
+}
+
+#ifndef NO_PTHREADS
+static void use_private_shards_in_child(void)
+{
+	struct liballocs_counter_shard *shared = __liballocs_counter_shards;
+	if (shared == &static_shards[0]) return;
+	memcpy(static_shards, shared, sizeof static_shards);
+	__atomic_store_n(&__liballocs_counter_shards, &static_shards[0], __ATOMIC_RELEASE);
+}
+#endif
+
+__attribute__((visibility("hidden")))
+void __liballocs_counters_init(void)
+{
+	const char *hist_str = getenv("LIBALLOCS_QUERY_HISTOGRAMS");
+	__liballocs_query_histograms_enabled = hist_str && *hist_str && 0 != strcmp(hist_str, "0");
+	const char *path = getenv("LIBALLOCS_STATS_SHM");
+	if (!path || !*path) return;
+	size_t shards_offset = (sizeof (struct liballocs_stats_shm_header)
+		+ LIBALLOCS_CACHE_LINE_SIZE - 1) & ~(size_t)(LIBALLOCS_CACHE_LINE_SIZE - 1);
+	size_t len = shards_offset + sizeof static_shards;
+	int fd = open(path, O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+	if (fd == -1) goto fail;
+	if (0 != ftruncate(fd, len)) { close(fd); goto fail; }
+	void *mapping = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED) goto fail;
+	struct liballocs_stats_shm_header *hdr = mapping;
+	memcpy(hdr->magic, LIBALLOCS_STATS_SHM_MAGIC, sizeof hdr->magic);
+	hdr->ncounters = LIBALLOCS_NCOUNTERS;
+	hdr->nshards = LIBALLOCS_COUNTER_NSHARDS;
+	hdr->shards_offset = shards_offset;
+	hdr->shard_size = sizeof (struct liballocs_counter_shard);
+	for (unsigned i = 0; i < LIBALLOCS_NCOUNTERS; ++i)
+	{
+		strncpy(hdr->names[i], counter_names[i], LIBALLOCS_STATS_SHM_NAMELEN - 1);
+	}
+	struct liballocs_counter_shard *shards = (void*)((char*) mapping + shards_offset);
+	memcpy(shards, static_shards, sizeof static_shards);
+	__atomic_store_n(&__liballocs_counter_shards, shards, __ATOMIC_RELEASE);
+#ifndef NO_PTHREADS
+	pthread_atfork(NULL, NULL, use_private_shards_in_child);
+#endif
+	return;
+fail:
+	debug_printf(0, "could not create stats file %s (%s)\n", path, strerror(errno));
+}
 
 __attribute__((visibility("hidden")))
 void print_exit_summary(void)
 {
-	if (__liballocs_aborted_unknown_storage + __liballocs_hit_static_case + __liballocs_hit_stack_case
-			 + __liballocs_hit_heap_case + __liballocs_hit_alloca_case > 0)
+	unsigned long c[LIBALLOCS_NCOUNTERS];
+	for (unsigned i = 0; i < LIBALLOCS_NCOUNTERS; ++i) c[i] = __liballocs_counter_read(i);
+	if (c[LIBALLOCS_COUNTER_ABORTED_UNKNOWN_STORAGE] + c[LIBALLOCS_COUNTER_HIT_STATIC_CASE]
+			+ c[LIBALLOCS_COUNTER_HIT_STACK_CASE] + c[LIBALLOCS_COUNTER_HIT_HEAP_CASE]
+			+ c[LIBALLOCS_COUNTER_HIT_ALLOCA_CASE] > 0)
 	{
 		fprintf(get_stream_err(), "====================================================\n");
 		fprintf(get_stream_err(), "liballocs summary: \n");
 		fprintf(get_stream_err(), "----------------------------------------------------\n");
-		fprintf(get_stream_err(), "queries aborted for unknown storage:       % 9ld\n", __liballocs_aborted_unknown_storage);
-		fprintf(get_stream_err(), "queries handled by static case:            % 9ld\n", __liballocs_hit_static_case);
-		fprintf(get_stream_err(), "queries handled by stack case:             % 9ld\n", __liballocs_hit_stack_case);
-		fprintf(get_stream_err(), "queries handled by heap case:              % 9ld\n", __liballocs_hit_heap_case);
-		fprintf(get_stream_err(), "queries handled by alloca case:            % 9ld\n", __liballocs_hit_alloca_case);
+		fprintf(get_stream_err(), "queries aborted for unknown storage:       % 9ld\n", c[LIBALLOCS_COUNTER_ABORTED_UNKNOWN_STORAGE]);
+		fprintf(get_stream_err(), "queries handled by static case:            % 9ld\n", c[LIBALLOCS_COUNTER_HIT_STATIC_CASE]);
+		fprintf(get_stream_err(), "queries handled by stack case:             % 9ld\n", c[LIBALLOCS_COUNTER_HIT_STACK_CASE]);
+		fprintf(get_stream_err(), "queries handled by heap case:              % 9ld\n", c[LIBALLOCS_COUNTER_HIT_HEAP_CASE]);
+		fprintf(get_stream_err(), "queries handled by alloca case:            % 9ld\n", c[LIBALLOCS_COUNTER_HIT_ALLOCA_CASE]);
 		fprintf(get_stream_err(), "----------------------------------------------------\n");
-		fprintf(get_stream_err(), "queries aborted for unindexed heap:        % 9ld\n", __liballocs_aborted_unindexed_heap);
-		fprintf(get_stream_err(), "queries aborted for unknown heap allocsite:% 9ld\n", __liballocs_aborted_unrecognised_allocsite);
-		fprintf(get_stream_err(), "queries aborted for unindexed alloca:      % 9ld\n", __liballocs_aborted_unindexed_alloca);
-		fprintf(get_stream_err(), "queries aborted for unknown stackframes:   % 9ld\n", __liballocs_aborted_stack);
-		fprintf(get_stream_err(), "queries aborted for unknown static obj:    % 9ld\n", __liballocs_aborted_static);
+		fprintf(get_stream_err(), "queries aborted for unindexed heap:        % 9ld\n", c[LIBALLOCS_COUNTER_ABORTED_UNINDEXED_HEAP]);
+		fprintf(get_stream_err(), "queries aborted for unknown heap allocsite:% 9ld\n", c[LIBALLOCS_COUNTER_ABORTED_UNRECOGNISED_ALLOCSITE]);
+		fprintf(get_stream_err(), "queries aborted for unindexed alloca:      % 9ld\n", c[LIBALLOCS_COUNTER_ABORTED_UNINDEXED_ALLOCA]);
+		fprintf(get_stream_err(), "queries aborted for unknown stackframes:   % 9ld\n", c[LIBALLOCS_COUNTER_ABORTED_STACK]);
+		fprintf(get_stream_err(), "queries aborted for unknown static obj:    % 9ld\n", c[LIBALLOCS_COUNTER_ABORTED_STATIC]);
 		fprintf(get_stream_err(), "====================================================\n");
-		for (unsigned i = 0; i < __liballocs_unrecognised_heap_alloc_sites.count; ++i)
+#define MAX_REPORTED_SITES 20
+		struct addrlist_entry top[MAX_REPORTED_SITES];
+		unsigned ntop = __liballocs_addrlist_top(&__liballocs_unrecognised_heap_alloc_sites,
+			top, MAX_REPORTED_SITES);
+		for (unsigned i = 0; i < ntop; ++i)
 		{
 			if (i == 0)
 			{
-				fprintf(get_stream_err(), "Saw the following unrecognised heap alloc sites: \n");
+				fprintf(get_stream_err(), "Saw %u unrecognised heap alloc sites; the most queried are: \n",
+					__liballocs_unrecognised_heap_alloc_sites.count);
 			}
-			fprintf(get_stream_err(), "%p (%s)\n", __liballocs_unrecognised_heap_alloc_sites.addrs[i], 
-					format_symbolic_address(__liballocs_unrecognised_heap_alloc_sites.addrs[i]));
+			fprintf(get_stream_err(), "% 9lu  %p (%s)\n", top[i].count, top[i].addr,
+					format_symbolic_address(top[i].addr));
 		}
+		__liballocs_print_footprint();
 	}
 	
+	if (__liballocs_query_histograms_enabled) print_query_histograms();
+
 	if (getenv("LIBALLOCS_DUMP_SMAPS_AT_EXIT"))
 	{
 		char buffer[4096];
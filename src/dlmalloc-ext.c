@@ -5,7 +5,11 @@
 #include <stdio.h>
 #include <dlfcn.h>
 #include <errno.h>
+#include <string.h>
 #include <sys/mman.h>
+#ifndef NO_PTHREADS
+#include <pthread.h>
+#endif
 #include "liballocs_private.h"
 #include "malloc-meta.h"
 #include "pageindex.h"
@@ -189,9 +193,249 @@ static void set_metadata(void *ptr, size_t size, const void *allocsite) {} // FI
 static void clear_metadata(void *ptr) {}
 #endif
 
+/* Per-thread caches of small chunks, in front of dlmalloc. Most of our
+ * metadata allocations are small, and going to dlmalloc for each of them
+ * makes it a serialisation point when many threads are indexing at once.
+ * So each thread keeps a few free chunks of each size class (multiples of
+ * PRIVATE_MALLOC_ALIGN up to TCACHE_MAX_SIZE) and only goes to dlmalloc
+ * when a bin is empty, or to hand back half a bin when it is full.
+ *
+ * Every cached chunk belongs to the thread whose cache first got it from
+ * dlmalloc, recorded in a tag in the last bytes of the chunk. A chunk freed
+ * by another thread goes back to its owner: the freeing thread collects a
+ * batch of chunks for one owner, then pushes the whole batch onto the
+ * owner's 'remote_frees' list with a single CAS. The owner takes that whole
+ * list in one exchange when it next runs out of a size class. (Since pushes
+ * only ever add and the owner only ever takes everything, there is no ABA.)
+ * When a thread exits, its cache gives everything back to dlmalloc and
+ * marks its remote list dead, after which anyone freeing one of its
+ * chunks hands it straight to dlmalloc.
+ *
+ * We tell tagged chunks from others by dlmalloc's usable size: chunks we
+ * get from dlmalloc for any other reason are requested to be at least
+ * TCACHE_UNTAGGED_MIN bytes, which is bigger than dlmalloc will ever
+ * make a tagged chunk (its slop is at most a couple of chunk sizes). */
+#define TCACHE_NCLASSES 16
+#define TCACHE_CLASS_SIZE(i) (((i) + 1) * PRIVATE_MALLOC_ALIGN)
+#define TCACHE_MAX_SIZE TCACHE_CLASS_SIZE(TCACHE_NCLASSES - 1)
+#define TCACHE_BIN_MAX 32
+#define TCACHE_REMOTE_BATCH 16
+struct tcache;
+struct tcache_tag
+{
+	struct tcache *owner;
+	unsigned long class;
+};
+struct tcache_free
+{
+	struct tcache_free *next;
+};
+#define TCACHE_TAGGED_REQUEST(i) (TCACHE_CLASS_SIZE(i) + sizeof (struct tcache_tag))
+#define TCACHE_UNTAGGED_MIN (TCACHE_TAGGED_REQUEST(TCACHE_NCLASSES - 1) + 128)
+#define TCACHE_DEAD ((struct tcache_free *) 1)
+struct tcache
+{
+	struct tcache_free *bins[TCACHE_NCLASSES];
+	unsigned counts[TCACHE_NCLASSES];
+	/* Pushed to by other threads; TCACHE_DEAD once we have exited. */
+	struct tcache_free *remote_frees;
+	/* A batch of chunks we've freed that belong to 'outbox_owner'. */
+	struct tcache *outbox_owner;
+	struct tcache_free *outbox_head;
+	struct tcache_free *outbox_tail;
+	unsigned outbox_count;
+	struct tcache *next_spare;
+};
+static __thread struct tcache *this_thread_tcache;
+static __thread _Bool this_thread_tcache_exited;
+
+static inline struct tcache_tag *tcache_tag_for(void *chunk, size_t real_usable)
+{
+	return (struct tcache_tag *)((char*) chunk + real_usable - sizeof (struct tcache_tag));
+}
+
+static void tcache_flush_outbox(struct tcache *tc)
+{
+	if (!tc->outbox_head) return;
+	struct tcache *owner = tc->outbox_owner;
+	struct tcache_free *old = __atomic_load_n(&owner->remote_frees, __ATOMIC_RELAXED);
+	do
+	{
+		if (old == TCACHE_DEAD)
+		{
+			for (struct tcache_free *f = tc->outbox_head, *next; f; f = next)
+			{ next = f->next; MKIDENT(__real_, dlfree)(f); }
+			break;
+		}
+		tc->outbox_tail->next = old;
+	} while (!__atomic_compare_exchange_n(&owner->remote_frees, &old, tc->outbox_head,
+			/* weak */ 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	tc->outbox_owner = NULL;
+	tc->outbox_head = tc->outbox_tail = NULL;
+	tc->outbox_count = 0;
+}
+
+static void tcache_bin_put(struct tcache *tc, unsigned class, struct tcache_free *f)
+{
+	f->next = tc->bins[class];
+	tc->bins[class] = f;
+	if (++tc->counts[class] > TCACHE_BIN_MAX)
+	{
+		/* Give back half the bin in one go. */
+		while (tc->counts[class] > TCACHE_BIN_MAX / 2)
+		{
+			struct tcache_free *victim = tc->bins[class];
+			tc->bins[class] = victim->next;
+			--tc->counts[class];
+			MKIDENT(__real_, dlfree)(victim);
+		}
+	}
+}
+
+static void tcache_drain_remote(struct tcache *tc)
+{
+	struct tcache_free *f = __atomic_exchange_n(&tc->remote_frees, NULL, __ATOMIC_ACQUIRE);
+	for (struct tcache_free *next; f; f = next)
+	{
+		next = f->next;
+		struct tcache_tag *tag = tcache_tag_for(f, MKIDENT(__real_, dlmalloc_usable_size)(f));
+		tcache_bin_put(tc, tag->class, f);
+	}
+}
+
+#ifndef NO_PTHREADS
+static pthread_mutex_t tcache_spares_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+static _Bool tcache_key_ok;
+#endif
+static struct tcache *tcache_spares;
+
+static void tcache_thread_exit(void *arg)
+{
+	struct tcache *tc = arg;
+	this_thread_tcache = NULL;
+	this_thread_tcache_exited = 1;
+	tcache_flush_outbox(tc);
+	struct tcache_free *f = __atomic_exchange_n(&tc->remote_frees, TCACHE_DEAD, __ATOMIC_ACQUIRE);
+	for (struct tcache_free *next; f; f = next)
+	{ next = f->next; MKIDENT(__real_, dlfree)(f); }
+	for (unsigned i = 0; i < TCACHE_NCLASSES; ++i)
+	{
+		for (struct tcache_free *next, *f = tc->bins[i]; f; f = next)
+		{ next = f->next; MKIDENT(__real_, dlfree)(f); }
+		tc->bins[i] = NULL;
+		tc->counts[i] = 0;
+	}
+	/* Chunks still allocated may be tagged with this cache, so we never free
+	 * it; we keep it for the next thread that comes along. Any such chunk
+	 * then belongs to that thread, which is fine. */
+#ifndef NO_PTHREADS
+	pthread_mutex_lock(&tcache_spares_mutex);
+#endif
+	tc->next_spare = tcache_spares;
+	tcache_spares = tc;
+#ifndef NO_PTHREADS
+	pthread_mutex_unlock(&tcache_spares_mutex);
+#endif
+}
+#ifndef NO_PTHREADS
+static void tcache_key_init(void)
+{
+	tcache_key_ok = (0 == pthread_key_create(&tcache_key, tcache_thread_exit));
+}
+#endif
+
+static struct tcache *tcache_get(void)
+{
+	if (likely(this_thread_tcache != NULL)) return this_thread_tcache;
+	if (this_thread_tcache_exited) return NULL;
+	struct tcache *tc;
+#ifndef NO_PTHREADS
+	pthread_once(&tcache_key_once, tcache_key_init);
+	if (!tcache_key_ok) return NULL;
+	pthread_mutex_lock(&tcache_spares_mutex);
+#endif
+	tc = tcache_spares;
+	if (tc) tcache_spares = tc->next_spare;
+#ifndef NO_PTHREADS
+	pthread_mutex_unlock(&tcache_spares_mutex);
+#endif
+	if (!tc) tc = MKIDENT(__real_, dlmalloc)(MAX(sizeof (struct tcache), TCACHE_UNTAGGED_MIN));
+	if (!tc) return NULL;
+	memset(tc, 0, sizeof *tc);
+	__atomic_store_n(&tc->remote_frees, NULL, __ATOMIC_RELEASE);
+#ifndef NO_PTHREADS
+	pthread_setspecific(tcache_key, tc);
+#endif
+	this_thread_tcache = tc;
+	return tc;
+}
+
+/* These are dlmalloc and dlfree with the caches in front, but nothing else
+ * (no tracing or metadata). */
+static void *cached_malloc(size_t size)
+{
+	if (size > TCACHE_MAX_SIZE) return MKIDENT(__real_, dlmalloc)(MAX(size, TCACHE_UNTAGGED_MIN));
+	unsigned class = (size ? size - 1 : 0) / PRIVATE_MALLOC_ALIGN;
+	struct tcache *tc = tcache_get();
+	if (tc && !tc->bins[class]) tcache_drain_remote(tc);
+	if (tc && tc->bins[class])
+	{
+		struct tcache_free *f = tc->bins[class];
+		tc->bins[class] = f->next;
+		--tc->counts[class];
+		return f;
+	}
+	void *chunk = MKIDENT(__real_, dlmalloc)(TCACHE_TAGGED_REQUEST(class));
+	if (!chunk) return NULL;
+	*tcache_tag_for(chunk, MKIDENT(__real_, dlmalloc_usable_size)(chunk)) = (struct tcache_tag) {
+		.owner = tc, /* may be null if we have no cache; then it is never cached */
+		.class = class
+	};
+	return chunk;
+}
+static void cached_free(void *ptr)
+{
+	if (!ptr) return;
+	size_t real_usable = MKIDENT(__real_, dlmalloc_usable_size)(ptr);
+	if (real_usable >= TCACHE_UNTAGGED_MIN) { MKIDENT(__real_, dlfree)(ptr); return; }
+	struct tcache_tag *tag = tcache_tag_for(ptr, real_usable);
+	struct tcache *owner = tag->owner;
+	struct tcache *tc = tcache_get();
+	struct tcache_free *f = ptr;
+	if (!owner) { MKIDENT(__real_, dlfree)(ptr); return; }
+	if (owner == tc) { tcache_bin_put(tc, tag->class, f); return; }
+	if (!tc)
+	{
+		/* We have no cache to batch in, so push just this one. */
+		struct tcache_free *old = __atomic_load_n(&owner->remote_frees, __ATOMIC_RELAXED);
+		do
+		{
+			if (old == TCACHE_DEAD) { MKIDENT(__real_, dlfree)(ptr); return; }
+			f->next = old;
+		} while (!__atomic_compare_exchange_n(&owner->remote_frees, &old, f,
+				/* weak */ 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+		return;
+	}
+	if (tc->outbox_owner != owner) tcache_flush_outbox(tc);
+	f->next = tc->outbox_head;
+	tc->outbox_head = f;
+	if (!tc->outbox_tail) tc->outbox_tail = f;
+	tc->outbox_owner = owner;
+	if (++tc->outbox_count >= TCACHE_REMOTE_BATCH) tcache_flush_outbox(tc);
+}
+/* How many bytes the caller may use. */
+static size_t cached_usable_size(void *ptr)
+{
+	size_t real_usable = MKIDENT(__real_, dlmalloc_usable_size)(ptr);
+	if (real_usable >= TCACHE_UNTAGGED_MIN) return real_usable;
+	return TCACHE_CLASS_SIZE(tcache_tag_for(ptr, real_usable)->class);
+}
+
 void *MKIDENT(__wrap_, dlmalloc)(size_t size)
 {
-	void *ret = MKIDENT(__real_, dlmalloc)(size);
+	void *ret = cached_malloc(size);
 #ifdef TRACE_PRIVATE_MALLOC
 	write_string("private " INFIX_STRLIT "dlmalloc(");
 	write_ulong((unsigned long) size);
@@ -204,7 +448,19 @@ void *MKIDENT(__wrap_, dlmalloc)(size_t size)
 }
 void *MKIDENT(__wrap_, dlcalloc)(size_t nmemb, size_t size)
 {
-	void *ret = MKIDENT(__real_, dlcalloc)(nmemb, size);
+	void *ret = NULL;
+	size_t total;
+	if (!__builtin_mul_overflow(nmemb, size, &total))
+	{
+		/* Big chunks go straight to dlcalloc, which knows when fresh memory
+		 * is already zero; they need the same padding as in cached_malloc. */
+		if (total > TCACHE_MAX_SIZE) ret = MKIDENT(__real_, dlcalloc)(1, MAX(total, TCACHE_UNTAGGED_MIN));
+		else
+		{
+			ret = cached_malloc(total);
+			if (ret) memset(ret, 0, total);
+		}
+	}
 #ifdef TRACE_PRIVATE_MALLOC
 	write_string("private " INFIX_STRLIT "dlcalloc(nmemb=");
 	write_ulong((unsigned long) nmemb);
@@ -225,7 +481,7 @@ void MKIDENT(__wrap_, dlfree)(void *ptr)
 	write_ulong((unsigned long) ptr);
 	write_string(") called\n");
 #endif
-	MKIDENT(__real_, dlfree)(ptr);
+	cached_free(ptr);
 }
 void *MKIDENT(__wrap_, dlrealloc)(void *ptr, size_t size)
 {
@@ -238,8 +494,21 @@ void *MKIDENT(__wrap_, dlrealloc)(void *ptr, size_t size)
 	write_string(") called...\n");
 #endif
 	// don't mess with the size-zero case, because it means free()
-	if (!size) { MKIDENT(__real_, dlfree)(ptr); return NULL; }
-	void *ret = MKIDENT(__real_, dlrealloc)(ptr, size + sizeof (struct insert)); // FIXME: aligned
+	if (!size) { cached_free(ptr); return NULL; }
+	void *ret;
+	if (!ptr) ret = cached_malloc(size + sizeof (struct insert));
+	else if (size + sizeof (struct insert) <= TCACHE_MAX_SIZE
+			|| MKIDENT(__real_, dlmalloc_usable_size)(ptr) < TCACHE_UNTAGGED_MIN)
+	{
+		/* Small chunks move between size classes by copying. */
+		ret = cached_malloc(size + sizeof (struct insert));
+		if (ret)
+		{
+			memcpy(ret, ptr, MIN(cached_usable_size(ptr), size + sizeof (struct insert)));
+			cached_free(ptr);
+		}
+	}
+	else ret = MKIDENT(__real_, dlrealloc)(ptr, MAX(size + sizeof (struct insert), TCACHE_UNTAGGED_MIN)); // FIXME: aligned
 	// FIXME: better to copy the old metadata, not set new?
 	// FIXME: all this should be common to generic-malloc.c, extracted/macroised somehow
 	if (ret && size > 0) set_metadata(ret, size, __builtin_return_address(0));
@@ -256,13 +525,20 @@ void *MKIDENT(__wrap_, dlrealloc)(void *ptr, size_t size)
 }
 void *MKIDENT(__wrap_, dlmemalign)(size_t boundary, size_t size)
 {
-	void *ret = MKIDENT(__real_, dlmemalign)(boundary, size);
+	void *ret = (boundary <= PRIVATE_MALLOC_ALIGN) ? cached_malloc(size)
+		: MKIDENT(__real_, dlmemalign)(boundary, MAX(size, TCACHE_UNTAGGED_MIN));
 	if (ret) set_metadata(ret, size, __builtin_return_address(0));
 	return ret;
 }
 int MKIDENT(__wrap_, dlposix_memalign)(void **memptr, size_t alignment, size_t size)
 {
-	int ret = MKIDENT(__real_, dlposix_memalign)(memptr, alignment, size);
+	int ret;
+	if (alignment <= PRIVATE_MALLOC_ALIGN)
+	{
+		*memptr = cached_malloc(size);
+		ret = *memptr ? 0 : ENOMEM;
+	}
+	else ret = MKIDENT(__real_, dlposix_memalign)(memptr, alignment, MAX(size, TCACHE_UNTAGGED_MIN));
 	if (ret) set_metadata(*memptr, size, __builtin_return_address(0));
 	return ret;
 }
@@ -270,6 +546,7 @@ int MKIDENT(__wrap_, dlposix_memalign)(void **memptr, size_t alignment, size_t s
 size_t MKIDENT(__wrap_, dlmalloc_usable_size)(void *userptr)
 {
   size_t ret = MKIDENT(__real_, dlmalloc_usable_size)(userptr);
+  if (ret < TCACHE_UNTAGGED_MIN) return cached_usable_size(userptr);
   return ret - sizeof (struct insert); /* FIXME: do we increment the size on malloc??!??! */
 }
 
@@ -2,12 +2,14 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <errno.h>
 #include "allocmeta.h"
 #include "fake-libunwind.h"
 #include "uniqtype.h"
 #include "uniqtype-bfs.h"
 #include "liballocs_cil_inlines.h"
 #include "pageindex.h"
+#include "liballocs_counters.h"
 
 /* NOTE: is linking -R, i.e. "symbols only", the right solution for 
  * getting the weak references to pop out the way we want them?
@@ -57,6 +59,7 @@ struct big_allocation;
  * client code make use of the symbol? It needs to use the large
  * code model, at least in respect of this symbol. */
 uint16_t *__liballocs_pageindex __attribute__((visibility("protected")));//; //__attribute__((alias("pageindex")));
+uint16_t *__liballocs_hugepageindex __attribute__((visibility("protected")));
 
 __attribute__((visibility("protected")))
 struct big_allocation big_allocations[/*NBIGALLOCS*/1];
@@ -317,6 +320,20 @@ int __liballocs_walk_allocations_df(
 {
 	return 0;
 }
+int __liballocs_walk_allocations_df_parallel(
+	const struct walk_df_parallel_ops *ops,
+	void *arg,
+	unsigned nthreads,
+	unsigned flags
+)
+{
+	return 0;
+}
+int __liballocs_write_heap_snapshot(const char *path)
+{
+	errno = ENOSYS;
+	return -1;
+}
 struct walk_refs_state;
 int
 __liballocs_walk_refs_cb(struct big_allocation *maybe_the_allocation,
@@ -449,16 +466,87 @@ void __liballocs_private_free(void *);
 
 void __liballocs_free_arena_bitmap_and_info(void *info  /* really struct arena_bitmap_info * */);
 
-unsigned long __liballocs_aborted_stack __attribute__((visibility("hidden")));;
-unsigned long __liballocs_aborted_static __attribute__((visibility("hidden")));;
-unsigned long __liballocs_aborted_unknown_storage __attribute__((visibility("protected")));;
+unsigned long __liballocs_aborted_unknown_storage __attribute__((visibility("protected")));
 unsigned long __liballocs_hit_heap_case __attribute__((visibility("protected")));
-unsigned long __liballocs_hit_alloca_case __attribute__((visibility("hidden")));;
-unsigned long __liballocs_hit_stack_case __attribute__((visibility("hidden")));;
-unsigned long __liballocs_hit_static_case __attribute__((visibility("hidden")));;
-unsigned long __liballocs_aborted_unindexed_heap __attribute__((visibility("protected")));;
-unsigned long __liballocs_aborted_unindexed_alloca __attribute__((visibility("hidden")));;
-unsigned long __liballocs_aborted_unrecognised_allocsite __attribute__((visibility("protected")));;
+unsigned long __liballocs_aborted_unindexed_heap __attribute__((visibility("protected")));
+unsigned long __liballocs_aborted_unrecognised_allocsite __attribute__((visibility("protected")));
+static struct liballocs_counter_shard dummy_shards[LIBALLOCS_COUNTER_NSHARDS];
+struct liballocs_counter_shard *__liballocs_counter_shards __attribute__((visibility("protected")))
+	= &dummy_shards[0];
+__thread unsigned __liballocs_counter_shard_plus_one __attribute__((visibility("protected")));
+unsigned __liballocs_counter_claim_shard(void) __attribute__((visibility("protected")));
+unsigned __liballocs_counter_claim_shard(void)
+{
+	return __liballocs_counter_shard_plus_one = 1;
+}
+unsigned long __liballocs_counter_read(enum liballocs_counter c) __attribute__((visibility("protected")));
+unsigned long __liballocs_counter_read(enum liballocs_counter c)
+{
+	return 0;
+}
+const char *__liballocs_counter_name(enum liballocs_counter c) __attribute__((visibility("protected")));
+const char *__liballocs_counter_name(enum liballocs_counter c)
+{
+	return NULL;
+}
+_Bool __liballocs_query_histograms_enabled __attribute__((visibility("protected")));
+void __liballocs_record_query_latency(struct allocator *a, enum liballocs_query_kind k,
+	unsigned long cycles) __attribute__((visibility("protected")));
+void __liballocs_record_query_latency(struct allocator *a, enum liballocs_query_kind k,
+	unsigned long cycles)
+{
+}
+void __liballocs_record_scan_length(struct allocator *a, unsigned long nbits) __attribute__((visibility("protected")));
+void __liballocs_record_scan_length(struct allocator *a, unsigned long nbits)
+{
+}
+int __liballocs_read_query_histogram(struct allocator *a, int kind, unsigned long *out_buckets) __attribute__((visibility("protected")));
+int __liballocs_read_query_histogram(struct allocator *a, int kind, unsigned long *out_buckets)
+{
+	return -1;
+}
+unsigned long __liballocs_histogram_bucket_lower_bound(unsigned i) __attribute__((visibility("protected")));
+unsigned long __liballocs_histogram_bucket_lower_bound(unsigned i)
+{
+	return 0;
+}
+void __liballocs_footprint_add(enum liballocs_footprint_category c, struct allocator *a,
+	long nbytes) __attribute__((visibility("protected")));
+void __liballocs_footprint_add(enum liballocs_footprint_category c, struct allocator *a,
+	long nbytes)
+{
+}
+void __liballocs_footprint_add_region(enum liballocs_footprint_category c, struct allocator *a,
+	const void *begin, unsigned long len) __attribute__((visibility("protected")));
+void __liballocs_footprint_add_region(enum liballocs_footprint_category c, struct allocator *a,
+	const void *begin, unsigned long len)
+{
+}
+void __liballocs_footprint_remove_region(enum liballocs_footprint_category c, struct allocator *a,
+	const void *begin, unsigned long len) __attribute__((visibility("protected")));
+void __liballocs_footprint_remove_region(enum liballocs_footprint_category c, struct allocator *a,
+	const void *begin, unsigned long len)
+{
+}
+int __liballocs_get_footprint(enum liballocs_footprint_category c, struct allocator *a,
+	struct liballocs_footprint *out) __attribute__((visibility("protected")));
+int __liballocs_get_footprint(enum liballocs_footprint_category c, struct allocator *a,
+	struct liballocs_footprint *out)
+{
+	return -1;
+}
+int __liballocs_get_total_footprint(enum liballocs_footprint_category c,
+	struct liballocs_footprint *out) __attribute__((visibility("protected")));
+int __liballocs_get_total_footprint(enum liballocs_footprint_category c,
+	struct liballocs_footprint *out)
+{
+	return -1;
+}
+const char *__liballocs_footprint_category_name(enum liballocs_footprint_category c) __attribute__((visibility("protected")));
+const char *__liballocs_footprint_category_name(enum liballocs_footprint_category c)
+{
+	return NULL;
+}
 
 __attribute__((visibility("protected")))
 liballocs_err_t __liballocs_extract_and_output_alloc_site_and_type(
@@ -477,6 +565,15 @@ void __liballocs_uncache_all(const void *allocptr, unsigned long size)
 {}
 
 _Bool __liballocs_notify_unindexed_address(const void *obj) { return 1; }
+uintptr_t __mmap_allocator_journal_begin __attribute__((visibility("protected")));
+uintptr_t __mmap_allocator_journal_end __attribute__((visibility("protected")));
+void __mmap_allocator_flush_journal_for(const void *obj) {}
+int __liballocs_layout_has_subobject_at(struct uniqtype *u, unsigned offset,
+	struct uniqtype *test_t) { return -1; }
+int __liballocs_layout_has_subobject_at_if_built(struct uniqtype *u, unsigned offset,
+	struct uniqtype *test_t) { return -1; }
+_Bool __liballocs_layout_get_leaf(struct uniqtype *u, unsigned offset,
+	struct uniqtype **out_leaf, unsigned *out_leaf_begin) { return 0; }
 
 void *__liballocs_get_specific_by_allocator(const void *obj,
 		struct allocator *a, struct uniqtype **out_specific_type)
@@ -0,0 +1,270 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#ifndef NO_PTHREADS
+#include <pthread.h>
+#endif
+#include "liballocs.h"
+#include "liballocs_private.h"
+
+/* Accounting for liballocs' own memory (see liballocs_counters.h).
+ *
+ * Counted bytes live in a fixed table with a record per allocator, claimed
+ * by CAS on the allocator's address. We don't malloc here, because we're
+ * called from places (the mmap allocator, the private heap's clients) that
+ * our malloc may itself call back into.
+ *
+ * Regions live in a fixed array under a mutex; they come and go only as
+ * big mappings do. If it fills up, we count further regions' bytes as
+ * committed, which overstates things but at least doesn't lose them. We
+ * never free a region's slot until it is removed, so removing a region we
+ * don't find means it was one of those. */
+
+struct allocator_footprint
+{
+	struct allocator *a;
+	long bytes[LIBALLOCS_NFOOTPRINT_CATEGORIES];
+};
+#define MAX_FOOTPRINTED_ALLOCATORS 64
+static struct allocator_footprint footprints[MAX_FOOTPRINTED_ALLOCATORS];
+static struct allocator liballocs_itself = { .name = "(liballocs)" };
+
+struct footprint_region
+{
+	const void *begin;
+	unsigned long len;
+	struct allocator *a;
+	enum liballocs_footprint_category c;
+	/* For sparse regions, a bitmap (owned by whoever registered the region)
+	 * of the 1<<log_granule-byte granules that have ever been written. Only
+	 * those can be resident, so only those are worth asking mincore() about. */
+	const unsigned long *touched;
+	unsigned log_granule;
+};
+#define MAX_FOOTPRINT_REGIONS 4096
+static struct footprint_region regions[MAX_FOOTPRINT_REGIONS];
+static unsigned nregions_used; /* high-water mark */
+#ifndef NO_PTHREADS
+static pthread_mutex_t regions_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define REGIONS_LOCK pthread_mutex_lock(&regions_mutex)
+#define REGIONS_UNLOCK pthread_mutex_unlock(&regions_mutex)
+#else
+#define REGIONS_LOCK
+#define REGIONS_UNLOCK
+#endif
+
+static const char *category_names[LIBALLOCS_NFOOTPRINT_CATEGORIES] = {
+	[LIBALLOCS_FOOTPRINT_ARENA_BITMAPS] = "arena bitmaps",
+	[LIBALLOCS_FOOTPRINT_SMALL_METADATA] = "small-object metadata",
+	[LIBALLOCS_FOOTPRINT_PAGEINDEX] = "pageindex",
+	[LIBALLOCS_FOOTPRINT_BIGALLOC_TABLE] = "bigalloc table",
+	[LIBALLOCS_FOOTPRINT_MAPPING_SEQUENCES] = "mapping sequences",
+	[LIBALLOCS_FOOTPRINT_META_DSOS] = "meta-DSOs",
+	[LIBALLOCS_FOOTPRINT_SYNTHESISED_UNIQTYPES] = "synthesised uniqtypes"
+};
+__attribute__((visibility("protected")))
+const char *__liballocs_footprint_category_name(enum liballocs_footprint_category c)
+{
+	return ((unsigned) c < LIBALLOCS_NFOOTPRINT_CATEGORIES) ? category_names[c] : NULL;
+}
+
+static struct allocator_footprint *footprint_for(struct allocator *a, _Bool create)
+{
+	if (!a) a = &liballocs_itself;
+	unsigned start = ((uintptr_t) a >> 4) % MAX_FOOTPRINTED_ALLOCATORS;
+	for (unsigned n = 0; n < MAX_FOOTPRINTED_ALLOCATORS; ++n)
+	{
+		struct allocator_footprint *f = &footprints[(start + n) % MAX_FOOTPRINTED_ALLOCATORS];
+		struct allocator *owner = __atomic_load_n(&f->a, __ATOMIC_ACQUIRE);
+		if (owner == a) return f;
+		if (owner) continue;
+		if (!create) return NULL;
+		if (__atomic_compare_exchange_n(&f->a, &owner, a, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+				|| owner == a) return f;
+	}
+	return NULL; // full; we just don't record
+}
+
+__attribute__((visibility("protected")))
+void __liballocs_footprint_add(enum liballocs_footprint_category c, struct allocator *a,
+	long nbytes)
+{
+	struct allocator_footprint *f = footprint_for(a, 1);
+	if (f) __atomic_fetch_add(&f->bytes[c], nbytes, __ATOMIC_RELAXED);
+}
+
+static void add_region(enum liballocs_footprint_category c, struct allocator *a,
+	const void *begin, unsigned long len, const unsigned long *touched, unsigned log_granule)
+{
+	if (!a) a = &liballocs_itself;
+	/* Make sure the allocator has a record, so that we report it. */
+	footprint_for(a, 1);
+	REGIONS_LOCK;
+	struct footprint_region *r = NULL;
+	for (unsigned i = 0; i < nregions_used; ++i)
+	{
+		if (!regions[i].begin) { r = &regions[i]; break; }
+	}
+	if (!r && nregions_used < MAX_FOOTPRINT_REGIONS) r = &regions[nregions_used++];
+	if (r) *r = (struct footprint_region) { .begin = begin, .len = len, .a = a, .c = c,
+		.touched = touched, .log_granule = log_granule };
+	REGIONS_UNLOCK;
+	if (!r) __liballocs_footprint_add(c, a, len);
+}
+
+__attribute__((visibility("protected")))
+void __liballocs_footprint_add_region(enum liballocs_footprint_category c, struct allocator *a,
+	const void *begin, unsigned long len)
+{
+	add_region(c, a, begin, len, NULL, 0);
+}
+
+__attribute__((visibility("hidden")))
+void __liballocs_footprint_add_sparse_region(enum liballocs_footprint_category c, struct allocator *a,
+	const void *begin, unsigned long len, const unsigned long *touched, unsigned log_granule)
+{
+	add_region(c, a, begin, len, touched, log_granule);
+}
+
+__attribute__((visibility("protected")))
+void __liballocs_footprint_remove_region(enum liballocs_footprint_category c, struct allocator *a,
+	const void *begin, unsigned long len)
+{
+	if (!a) a = &liballocs_itself;
+	_Bool found = 0;
+	REGIONS_LOCK;
+	for (unsigned i = 0; i < nregions_used; ++i)
+	{
+		if (regions[i].begin == begin && regions[i].a == a && regions[i].c == c)
+		{
+			regions[i] = (struct footprint_region) { .begin = NULL };
+			found = 1;
+			break;
+		}
+	}
+	REGIONS_UNLOCK;
+	if (!found) __liballocs_footprint_add(c, a, -(long) len);
+}
+
+/* How much of [begin, begin+len) is resident? We ask mincore() about a
+ * bounded number of pages at a time, because the pageindex covers the whole
+ * address space. Chunks containing something unmapped count as nothing. */
+static unsigned long resident_bytes(const void *begin, unsigned long len)
+{
+	unsigned char vec[4096];
+	uintptr_t cur = ROUND_DOWN((uintptr_t) begin, PAGE_SIZE);
+	uintptr_t end = ROUND_UP((uintptr_t) begin + len, PAGE_SIZE);
+	unsigned long npages_resident = 0;
+	while (cur < end)
+	{
+		uintptr_t chunk_end = MIN(end, cur + sizeof vec * PAGE_SIZE);
+		if (0 == mincore((void*) cur, chunk_end - cur, vec))
+		{
+			for (unsigned long i = 0; i < (chunk_end - cur) >> LOG_PAGE_SIZE; ++i)
+			{
+				npages_resident += vec[i] & 1;
+			}
+		}
+		cur = chunk_end;
+	}
+	return npages_resident << LOG_PAGE_SIZE;
+}
+
+static unsigned long region_resident_bytes(const struct footprint_region *r)
+{
+	if (!r->touched) return resident_bytes(r->begin, r->len);
+	unsigned long granule = 1ul << r->log_granule;
+	unsigned long ngranules = (r->len + granule - 1) >> r->log_granule;
+	unsigned long word_nbits = 8 * sizeof (unsigned long);
+	unsigned long total = 0;
+	for (unsigned long w = 0; w < (ngranules + word_nbits - 1) / word_nbits; ++w)
+	{
+		unsigned long word = __atomic_load_n(&r->touched[w], __ATOMIC_RELAXED);
+		while (word)
+		{
+			unsigned long i = w * word_nbits + __builtin_ctzl(word);
+			word &= word - 1;
+			if (i >= ngranules) break;
+			unsigned long offset = i << r->log_granule;
+			total += resident_bytes((const char *) r->begin + offset, MIN(granule, r->len - offset));
+		}
+	}
+	return total;
+}
+
+/* If 'any_allocator', sum over all of them. */
+static void get_footprint(enum liballocs_footprint_category c, struct allocator *a,
+	_Bool any_allocator, struct liballocs_footprint *out)
+{
+	long counted = 0;
+	if (any_allocator)
+	{
+		for (unsigned i = 0; i < MAX_FOOTPRINTED_ALLOCATORS; ++i)
+		{
+			counted += __atomic_load_n(&footprints[i].bytes[c], __ATOMIC_RELAXED);
+		}
+	}
+	else
+	{
+		struct allocator_footprint *f = footprint_for(a, 0);
+		if (f) counted = __atomic_load_n(&f->bytes[c], __ATOMIC_RELAXED);
+	}
+	if (counted < 0) counted = 0; // a free raced ahead of its allocation
+	out->reserved = out->committed = counted;
+	if (!a) a = &liballocs_itself;
+	REGIONS_LOCK;
+	for (unsigned i = 0; i < nregions_used; ++i)
+	{
+		if (!regions[i].begin || regions[i].c != c || (!any_allocator && regions[i].a != a)) continue;
+		out->reserved += regions[i].len;
+		out->committed += region_resident_bytes(&regions[i]);
+	}
+	REGIONS_UNLOCK;
+}
+__attribute__((visibility("protected")))
+int __liballocs_get_footprint(enum liballocs_footprint_category c, struct allocator *a,
+	struct liballocs_footprint *out)
+{
+	if ((unsigned) c >= LIBALLOCS_NFOOTPRINT_CATEGORIES) return -1;
+	get_footprint(c, a, 0, out);
+	return 0;
+}
+__attribute__((visibility("protected")))
+int __liballocs_get_total_footprint(enum liballocs_footprint_category c,
+	struct liballocs_footprint *out)
+{
+	if ((unsigned) c >= LIBALLOCS_NFOOTPRINT_CATEGORIES) return -1;
+	get_footprint(c, NULL, 1, out);
+	return 0;
+}
+
+__attribute__((visibility("hidden")))
+void __liballocs_print_footprint(void)
+{
+	fprintf(get_stream_err(), "====================================================\n");
+	fprintf(get_stream_err(), "liballocs memory footprint (kB): \n");
+	fprintf(get_stream_err(), "%-24s %-32s %12s %12s\n", "category", "allocator",
+		"reserved", "committed");
+	struct liballocs_footprint total = { 0, 0 };
+	for (unsigned c = 0; c < LIBALLOCS_NFOOTPRINT_CATEGORIES; ++c)
+	{
+		for (unsigned i = 0; i < MAX_FOOTPRINTED_ALLOCATORS; ++i)
+		{
+			struct allocator *a = __atomic_load_n(&footprints[i].a, __ATOMIC_ACQUIRE);
+			if (!a) continue;
+			struct liballocs_footprint f;
+			get_footprint(c, a, 0, &f);
+			if (!f.reserved) continue;
+			fprintf(get_stream_err(), "%-24s %-32.32s %12lu %12lu\n", category_names[c],
+				a->name, f.reserved >> 10, f.committed >> 10);
+			total.reserved += f.reserved;
+			total.committed += f.committed;
+		}
+	}
+	fprintf(get_stream_err(), "%-24s %-32s %12lu %12lu\n", "total", "",
+		total.reserved >> 10, total.committed >> 10);
+	fprintf(get_stream_err(), "====================================================\n");
+}
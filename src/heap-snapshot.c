@@ -0,0 +1,419 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include "liballocs.h"
+#include "liballocs_private.h"
+#include "heap-snapshot.h"
+
+/* Heap snapshots (see heap-snapshot.h for the file format).
+ *
+ * We work in three phases.
+ *
+ * 1. Collect. We record every bigalloc, and note those whose suballocator
+ *    can walk its allocations.
+ * 2. Walk. We turn each allocation reported by each suballocator's
+ *    walk_allocations hook into a row. How an allocator keeps its walk
+ *    consistent with a running program is its own business; the generic
+ *    malloc indexes copy their chunk-start bitmap under the arena lock and
+ *    walk the copy (see generic_malloc_index.h), so they hold up the
+ *    program only for a memcpy. We hold no locks of our own.
+ * 3. Write. We sort the rows by address, work out which row encloses which,
+ *    intern the names, and stream the file out one column at a time.
+ */
+
+struct snapshot_row
+{
+	uintptr_t base;
+	unsigned long size;
+	struct allocator *a;
+	struct uniqtype *t;
+	const void *site;
+	uint8_t flags;
+};
+struct snapshot_state
+{
+	struct snapshot_row *rows;
+	unsigned long nrows;
+	unsigned long rows_size;
+};
+
+static void add_row(struct snapshot_state *s, struct snapshot_row r)
+{
+	if (s->nrows == s->rows_size)
+	{
+		s->rows_size = s->rows_size ? 2 * s->rows_size : 4096;
+		s->rows = __private_realloc(s->rows, s->rows_size * sizeof (struct snapshot_row));
+		if (!s->rows) abort();
+	}
+	s->rows[s->nrows++] = r;
+}
+
+static int add_walked_row_cb(struct big_allocation *maybe_the_allocation,
+	void *obj, struct uniqtype *t, const void *allocsite,
+	struct alloc_tree_link *link, void *state_as_void)
+{
+	struct snapshot_state *s = (struct snapshot_state *) state_as_void;
+	/* Bigallocs are recorded separately. */
+	if (maybe_the_allocation) return 0;
+	struct big_allocation *b = BOU_BIGALLOC(link->container.bigalloc_or_uniqtype);
+	unsigned long size = 0;
+	if (b->suballocator->get_size) size = b->suballocator->get_size(obj);
+	else if (b->suballocator->get_info) b->suballocator->get_info(obj, NULL,
+		NULL, NULL, &size, NULL);
+	if (!size && t) size = UNIQTYPE_SIZE_IN_BYTES(t);
+	add_row(s, (struct snapshot_row) {
+		.base = (uintptr_t) obj,
+		.size = size,
+		.a = b->suballocator,
+		.t = t,
+		.site = allocsite
+	});
+	return 0;
+}
+
+static int compare_rows(const void *p1, const void *p2)
+{
+	const struct snapshot_row *r1 = p1;
+	const struct snapshot_row *r2 = p2;
+	if (r1->base != r2->base) return (r1->base > r2->base) - (r1->base < r2->base);
+	/* Outer before inner. */
+	if (r1->size != r2->size) return (r1->size < r2->size) - (r1->size > r2->size);
+	/* A bigalloc before the chunk it was promoted from. */
+	return (int) (r2->flags & HEAP_SNAPSHOT_ROW_IS_BIGALLOC)
+		- (int) (r1->flags & HEAP_SNAPSHOT_ROW_IS_BIGALLOC);
+}
+
+/* Interning. We map pointers (allocators, uniqtypes, sites, object file
+ * load addresses) to small indices using a simple open-addressing table.
+ * In the type and site tables, index zero is kept for "unknown". */
+struct intern_table
+{
+	const void **keys;
+	uint32_t *vals;
+	unsigned long nbuckets;
+	unsigned long n;
+};
+static unsigned long intern_hash(const void *k)
+{
+	return ((uintptr_t) k * 0x9e3779b97f4a7c15ul) >> 20;
+}
+static uint32_t *intern_slot(struct intern_table *tab, const void *k, _Bool *out_new)
+{
+	if ((tab->n + 1) * 2 > tab->nbuckets)
+	{
+		struct intern_table bigger = {
+			.nbuckets = tab->nbuckets ? 2 * tab->nbuckets : 1024,
+			.n = tab->n
+		};
+		bigger.keys = __private_malloc(bigger.nbuckets * sizeof (const void *));
+		bigger.vals = __private_malloc(bigger.nbuckets * sizeof (uint32_t));
+		if (!bigger.keys || !bigger.vals) abort();
+		bzero(bigger.keys, bigger.nbuckets * sizeof (const void *));
+		for (unsigned long i = 0; i < tab->nbuckets; ++i)
+		{
+			if (!tab->keys[i]) continue;
+			unsigned long j = intern_hash(tab->keys[i]) & (bigger.nbuckets - 1);
+			while (bigger.keys[j]) j = (j + 1) & (bigger.nbuckets - 1);
+			bigger.keys[j] = tab->keys[i];
+			bigger.vals[j] = tab->vals[i];
+		}
+		__private_free(tab->keys);
+		__private_free(tab->vals);
+		*tab = bigger;
+	}
+	unsigned long i = intern_hash(k) & (tab->nbuckets - 1);
+	while (tab->keys[i] && tab->keys[i] != k) i = (i + 1) & (tab->nbuckets - 1);
+	*out_new = !tab->keys[i];
+	if (*out_new)
+	{
+		tab->keys[i] = k;
+		++tab->n;
+	}
+	return &tab->vals[i];
+}
+static void intern_table_free(struct intern_table *tab)
+{
+	__private_free(tab->keys);
+	__private_free(tab->vals);
+}
+
+/* A growable array of fixed-size elements, used for the name tables and
+ * the string table. */
+struct snapshot_vec
+{
+	char *buf;
+	unsigned long len;
+	unsigned long size;
+};
+static unsigned long vec_append(struct snapshot_vec *v, const void *data, unsigned long len)
+{
+	unsigned long pos = v->len;
+	if (v->len + len > v->size)
+	{
+		while (v->len + len > v->size) v->size = v->size ? 2 * v->size : 4096;
+		v->buf = __private_realloc(v->buf, v->size);
+		if (!v->buf) abort();
+	}
+	memcpy(v->buf + v->len, data, len);
+	v->len += len;
+	return pos;
+}
+static uint32_t add_string(struct snapshot_vec *strings, const char *str)
+{
+	if (!str || !*str) return 0;
+	return vec_append(strings, str, strlen(str) + 1);
+}
+
+struct snapshot_tables
+{
+	struct intern_table allocators, types, sites, files;
+	struct snapshot_vec allocator_names, type_names, site_recs, strings;
+};
+/* Bigallocs with no allocated_by are recorded as belonging to this. */
+static struct allocator unknown_allocator = { .name = "(unknown)" };
+static uint32_t intern_allocator(struct snapshot_tables *tabs, struct allocator *a)
+{
+	_Bool is_new;
+	uint32_t *p = intern_slot(&tabs->allocators, a, &is_new);
+	if (is_new)
+	{
+		uint32_t name = add_string(&tabs->strings, a->name);
+		*p = vec_append(&tabs->allocator_names, &name, sizeof name) / sizeof name;
+	}
+	return *p;
+}
+static uint32_t intern_type(struct snapshot_tables *tabs, struct uniqtype *t)
+{
+	if (!t) return 0;
+	_Bool is_new;
+	uint32_t *p = intern_slot(&tabs->types, t, &is_new);
+	if (is_new)
+	{
+		uint32_t name = add_string(&tabs->strings, UNIQTYPE_NAME(t));
+		*p = vec_append(&tabs->type_names, &name, sizeof name) / sizeof name;
+	}
+	return *p;
+}
+static uint32_t intern_site(struct snapshot_tables *tabs, const void *site)
+{
+	if (!site) return 0;
+	_Bool is_new;
+	uint32_t *p = intern_slot(&tabs->sites, site, &is_new);
+	if (is_new)
+	{
+		/* Addresses mean nothing once the process has gone, so we record
+		 * the site as an offset within its object file. */
+		struct heap_snapshot_site rec = { .offset = (uintptr_t) site };
+		Dl_info info;
+		if (dladdr(site, &info) && info.dli_fbase)
+		{
+			uint32_t *p_file = intern_slot(&tabs->files, info.dli_fbase, &is_new);
+			if (is_new) *p_file = add_string(&tabs->strings, info.dli_fname);
+			rec.file = *p_file;
+			rec.offset = (uintptr_t) site - (uintptr_t) info.dli_fbase;
+		}
+		*p = vec_append(&tabs->site_recs, &rec, sizeof rec) / sizeof rec;
+	}
+	return *p;
+}
+
+/* Writing. We stream each column through a small buffer. */
+struct snapshot_writer
+{
+	int fd;
+	uint64_t offset;
+	int err;
+	unsigned long used;
+	char buf[65536];
+};
+static void writer_flush(struct snapshot_writer *w)
+{
+	char *pos = w->buf;
+	while (!w->err && w->used > 0)
+	{
+		ssize_t ret = write(w->fd, pos, w->used);
+		if (ret == -1 && errno == EINTR) continue;
+		if (ret <= 0) { w->err = (ret == -1) ? errno : EIO; break; }
+		pos += ret;
+		w->used -= ret;
+	}
+	w->used = 0;
+}
+static void writer_put(struct snapshot_writer *w, const void *data, unsigned long len)
+{
+	w->offset += len;
+	while (len > 0)
+	{
+		unsigned long n = MIN(len, sizeof w->buf - w->used);
+		memcpy(w->buf + w->used, data, n);
+		w->used += n;
+		data = (const char *) data + n;
+		len -= n;
+		if (w->used == sizeof w->buf) writer_flush(w);
+	}
+}
+static void writer_align(struct snapshot_writer *w)
+{
+	static const char zeroes[8];
+	if (w->offset % 8) writer_put(w, zeroes, 8 - w->offset % 8);
+}
+static void writer_begin_section(struct snapshot_writer *w, struct heap_snapshot_header *hdr,
+	enum heap_snapshot_section which)
+{
+	writer_align(w);
+	hdr->sections[which].offset = w->offset;
+}
+static void writer_end_section(struct snapshot_writer *w, struct heap_snapshot_header *hdr,
+	enum heap_snapshot_section which)
+{
+	hdr->sections[which].size = w->offset - hdr->sections[which].offset;
+}
+#define WRITE_COLUMN(w, hdr, which, type, rows, nrows, expr) do { \
+	writer_begin_section((w), (hdr), (which)); \
+	for (unsigned long i_ = 0; i_ < (nrows); ++i_) \
+	{ \
+		const struct snapshot_row *r = &(rows)[i_]; (void) r; \
+		type val_ = (expr); \
+		writer_put((w), &val_, sizeof val_); \
+	} \
+	writer_end_section((w), (hdr), (which)); \
+} while (0)
+
+int __liballocs_write_heap_snapshot(const char *path)
+{
+	struct snapshot_state s = { NULL, 0, 0 };
+	struct big_allocation **walkable = NULL;
+	unsigned nwalkable = 0;
+	unsigned walkable_size = 0;
+
+	/* 1. Collect. */
+	for (unsigned idx = 1; idx < NBIGALLOCS; ++idx)
+	{
+		struct big_allocation *b = &big_allocations[idx];
+		if (!BIGALLOC_IN_USE(b)) continue;
+		struct snapshot_row r = {
+			.base = (uintptr_t) b->begin,
+			.size = (uintptr_t) b->end - (uintptr_t) b->begin,
+			.a = b->allocated_by,
+			.flags = HEAP_SNAPSHOT_ROW_IS_BIGALLOC
+		};
+		if (b->allocated_by && b->allocated_by->get_info)
+		{
+			void *base;
+			unsigned long size;
+			b->allocated_by->get_info(b->begin, b, &r.t, &base, &size, &r.site);
+		}
+		add_row(&s, r);
+		if (!b->suballocator || !b->suballocator->walk_allocations) continue;
+		if (nwalkable == walkable_size)
+		{
+			walkable_size = walkable_size ? 2 * walkable_size : 64;
+			walkable = __private_realloc(walkable, walkable_size * sizeof (struct big_allocation *));
+			if (!walkable) abort();
+		}
+		walkable[nwalkable++] = b;
+	}
+
+	/* 2. Walk. */
+	for (unsigned i = 0; i < nwalkable; ++i)
+	{
+		struct big_allocation *b = walkable[i];
+		if (!BIGALLOC_IN_USE(b) || !b->suballocator || !b->suballocator->walk_allocations) continue;
+		struct alloc_tree_pos pos = { .base = b->begin, .bigalloc_or_uniqtype = (uintptr_t) b };
+		b->suballocator->walk_allocations(&pos, add_walked_row_cb, &s, NULL, NULL);
+	}
+	__private_free(walkable);
+
+	/* 3. Write. */
+	qsort(s.rows, s.nrows, sizeof s.rows[0], compare_rows);
+	struct snapshot_tables tabs;
+	bzero(&tabs, sizeof tabs);
+	uint32_t zero = 0;
+	struct heap_snapshot_site no_site = { 0, 0, 0 };
+	vec_append(&tabs.strings, "", 1);
+	vec_append(&tabs.type_names, &zero, sizeof zero);
+	vec_append(&tabs.site_recs, &no_site, sizeof no_site);
+
+	int ret = -1;
+	int saved_errno = 0;
+	struct snapshot_writer *w = __private_malloc(sizeof (struct snapshot_writer));
+	/* Parents: we keep a stack of the rows enclosing the current one. */
+	uint32_t *parents = __private_malloc(MAX(1, s.nrows) * sizeof (uint32_t));
+	uint32_t *stack = __private_malloc(MAX(1, s.nrows) * sizeof (uint32_t));
+	if (!w || !parents || !stack) { saved_errno = ENOMEM; goto out; }
+	if (s.nrows >= HEAP_SNAPSHOT_NO_PARENT) { saved_errno = EOVERFLOW; goto out; }
+	unsigned long depth = 0;
+	for (unsigned long i = 0; i < s.nrows; ++i)
+	{
+		while (depth > 0 && s.rows[i].base - s.rows[stack[depth - 1]].base
+				>= s.rows[stack[depth - 1]].size) --depth;
+		parents[i] = depth > 0 ? stack[depth - 1] : HEAP_SNAPSHOT_NO_PARENT;
+		stack[depth++] = i;
+	}
+	w->fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+	if (w->fd == -1) { saved_errno = errno; goto out; }
+	w->offset = 0;
+	w->err = 0;
+	w->used = 0;
+	struct heap_snapshot_header hdr;
+	bzero(&hdr, sizeof hdr);
+	memcpy(hdr.magic, HEAP_SNAPSHOT_MAGIC, sizeof hdr.magic);
+	hdr.version = HEAP_SNAPSHOT_VERSION;
+	hdr.pid = getpid();
+	hdr.nrows = s.nrows;
+	/* We fill in the header last. */
+	writer_put(w, &hdr, sizeof hdr);
+	WRITE_COLUMN(w, &hdr, HEAP_SNAPSHOT_BASE, uint64_t, s.rows, s.nrows, r->base);
+	WRITE_COLUMN(w, &hdr, HEAP_SNAPSHOT_SIZE, uint64_t, s.rows, s.nrows, r->size);
+	WRITE_COLUMN(w, &hdr, HEAP_SNAPSHOT_PARENT, uint32_t, s.rows, s.nrows, parents[i_]);
+	WRITE_COLUMN(w, &hdr, HEAP_SNAPSHOT_TYPE, uint32_t, s.rows, s.nrows, intern_type(&tabs, r->t));
+	WRITE_COLUMN(w, &hdr, HEAP_SNAPSHOT_SITE, uint32_t, s.rows, s.nrows, intern_site(&tabs, r->site));
+	WRITE_COLUMN(w, &hdr, HEAP_SNAPSHOT_ALLOCATOR, uint16_t, s.rows, s.nrows,
+		intern_allocator(&tabs, r->a ?: &unknown_allocator));
+	WRITE_COLUMN(w, &hdr, HEAP_SNAPSHOT_FLAGS, uint8_t, s.rows, s.nrows, r->flags);
+	hdr.nallocators = tabs.allocator_names.len / sizeof (uint32_t);
+	hdr.ntypes = tabs.type_names.len / sizeof (uint32_t);
+	hdr.nsites = tabs.site_recs.len / sizeof (struct heap_snapshot_site);
+	writer_begin_section(w, &hdr, HEAP_SNAPSHOT_ALLOCATOR_NAMES);
+	writer_put(w, tabs.allocator_names.buf, tabs.allocator_names.len);
+	writer_end_section(w, &hdr, HEAP_SNAPSHOT_ALLOCATOR_NAMES);
+	writer_begin_section(w, &hdr, HEAP_SNAPSHOT_TYPE_NAMES);
+	writer_put(w, tabs.type_names.buf, tabs.type_names.len);
+	writer_end_section(w, &hdr, HEAP_SNAPSHOT_TYPE_NAMES);
+	writer_begin_section(w, &hdr, HEAP_SNAPSHOT_SITES);
+	writer_put(w, tabs.site_recs.buf, tabs.site_recs.len);
+	writer_end_section(w, &hdr, HEAP_SNAPSHOT_SITES);
+	writer_begin_section(w, &hdr, HEAP_SNAPSHOT_STRINGS);
+	writer_put(w, tabs.strings.buf, tabs.strings.len);
+	writer_end_section(w, &hdr, HEAP_SNAPSHOT_STRINGS);
+	writer_flush(w);
+	if (!w->err && sizeof hdr != pwrite(w->fd, &hdr, sizeof hdr, 0)) w->err = errno ?: EIO;
+	if (0 != close(w->fd) && !w->err) w->err = errno;
+	if (w->err) saved_errno = w->err;
+	else
+	{
+		ret = 0;
+		debug_printf(1, "wrote heap snapshot of %lu allocations to %s\n",
+			(unsigned long) s.nrows, path);
+	}
+out:
+	intern_table_free(&tabs.allocators);
+	intern_table_free(&tabs.types);
+	intern_table_free(&tabs.sites);
+	intern_table_free(&tabs.files);
+	__private_free(tabs.allocator_names.buf);
+	__private_free(tabs.type_names.buf);
+	__private_free(tabs.site_recs.buf);
+	__private_free(tabs.strings.buf);
+	__private_free(parents);
+	__private_free(stack);
+	__private_free(w);
+	__private_free(s.rows);
+	if (ret != 0) errno = saved_errno;
+	return ret;
+}
@@ -73,6 +73,7 @@ int ( __attribute__((constructor(103))) __liballocs_global_init)(void)
 	
 	// print a summary when the program exits
 	atexit(print_exit_summary);
+	__liballocs_counters_init();
 
 	const char *debug_level_str = getenv("LIBALLOCS_DEBUG_LEVEL");
 	if (debug_level_str) __liballocs_debug_level = atoi(debug_level_str);
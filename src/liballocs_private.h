@@ -80,7 +80,11 @@ struct mapping_sequence
 {
 	void *begin;
 	void *end;
+	/* For sequences mmapped from an fd, this is a placeholder ("@dev:ino")
+	 * until somebody asks for the real name; see mmap.c. So outside the
+	 * consistency checks, use __mapping_sequence_filename(). */
 	const char *filename;
+	const char *resolved_filename;
 	unsigned nused;
 #if 0 /* sketch for what we might do if tracking fds for deferred mapping */
 	int fd_plus_one_if_part_deferred; /* i.e. zero is still the null value, for the fd -1 */
@@ -92,6 +96,7 @@ _Bool __augment_mapping_sequence(struct mapping_sequence *cur,
 	void *caller);
 struct big_allocation *__add_mapping_sequence_bigalloc_with_seq(struct mapping_sequence *seq,
 	void (*free_fn)(void*));
+const char *__mapping_sequence_filename(struct mapping_sequence *seq) __attribute__((visibility("hidden")));
 
 extern void *executable_end_addr;
 extern struct big_allocation *executable_file_bigalloc;
@@ -163,12 +168,20 @@ extern __thread void *__current_allocsite __attribute__((weak)); // defined by h
 #else
 extern void *__current_allocsite __attribute__((weak)); // defined by heap_index_hooks
 #endif
+/* See addrlist.c. */
+struct addrlist_table
+{
+	unsigned log_nslots;
+	int frozen;
+	unsigned long nslots;
+	struct addrlist_entry entries[];
+};
 struct addrlist
 {
-	unsigned count;
-	unsigned allocsz;
-	void **addrs;
+	unsigned count; /* distinct addresses */
+	struct addrlist_table *table;
 };
+extern __thread _Bool __liballocs_addrlist_add_suppressed __attribute__((visibility("hidden")));
 struct frame_uniqtype_and_offset
 {
 	struct uniqtype *u;
@@ -185,19 +198,13 @@ void __assert_fail(const char *assertion,
 void warnx(const char *fmt, ...);
 unsigned long malloc_usable_size (void *ptr);
 
-/* counters */
-extern unsigned long __liballocs_aborted_stack;
-extern unsigned long __liballocs_aborted_static;
-extern unsigned long __liballocs_aborted_unknown_storage;
-extern unsigned long __liballocs_hit_heap_case;
-extern unsigned long __liballocs_hit_alloca_case;
-extern unsigned long __liballocs_hit_stack_case;
-extern unsigned long __liballocs_hit_static_case;
-extern unsigned long __liballocs_aborted_unindexed_heap;
-extern unsigned long __liballocs_aborted_unindexed_alloca;
-extern unsigned long __liballocs_aborted_unrecognised_allocsite;
-
 void print_exit_summary(void) __attribute__((visibility("hidden")));
+void __liballocs_counters_init(void) __attribute__((visibility("hidden")));
+void __liballocs_print_footprint(void) __attribute__((visibility("hidden")));
+void __liballocs_footprint_note_meta_dso(void *handle, _Bool loaded) __attribute__((visibility("hidden")));
+void __liballocs_footprint_add_sparse_region(enum liballocs_footprint_category c, struct allocator *a,
+	const void *begin, unsigned long len, const unsigned long *touched, unsigned log_granule)
+	__attribute__((visibility("hidden")));
 
 /* We're allowed to malloc, thanks to __private_malloc(), but we 
  * we shouldn't call strdup because libc will do the malloc. */
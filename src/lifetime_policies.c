@@ -1,5 +1,6 @@
 #define _GNU_SOURCE
 #include "liballocs_private.h"
+#include "uniqtype-ptrmap.h"
 
 #ifndef LIFETIME_POLICIES
 #error "This file can only be compiled if LIFETIME_POLICIES is set"
@@ -125,9 +126,29 @@ static _Bool need_copy_notification(struct uniqtype *type)
 	}
 }
 
+struct notify_copy_slot_arg
+{
+	char *dest;
+	const char *src;
+};
+static void notify_copy_slot(void **slot, struct uniqtype *ptr_t, void *arg_as_void)
+{
+	struct notify_copy_slot_arg *arg = arg_as_void;
+	ptrdiff_t off = (char*) slot - arg->dest;
+	__notify_ptr_write((const void **) slot,
+		arg->src ? *(const void **)(arg->src + off) : NULL);
+}
+
 // Return the size of processed data
 static unsigned long notify_copy_for_type(void *dest, const void *src, unsigned long size, struct uniqtype *type)
 {
+	/* If we have a pointer map for this type, just scan that. */
+	struct notify_copy_slot_arg arg = { .dest = dest, .src = src };
+	unsigned long covered;
+	if (__liballocs_for_each_pointer_slot(dest, type, size, notify_copy_slot, &arg, &covered))
+	{
+		return covered;
+	}
 	if (!need_copy_notification(type)) return UNIQTYPE_SIZE_IN_BYTES(type);
 	switch (UNIQTYPE_KIND(type))
 	{
@@ -183,16 +204,16 @@ static struct uniqtype *try_get_alloc_type(void *obj)
 	struct allocator *a = __liballocs_leaf_allocator_for(obj, NULL, &maybe_the_allocation);
 	if (!a) return NULL;
 
-	// HACK: We want to avoid generating unrecognized heap alloc site errors
+	// We want to avoid generating unrecognized heap alloc site errors
 	// FIXME: We are still counting aborted queries...
-	unsigned unrecognized_heap_alloc_site_count =
-		__liballocs_unrecognised_heap_alloc_sites.count;
+	_Bool was_suppressed = __liballocs_addrlist_add_suppressed;
+	__liballocs_addrlist_add_suppressed = 1;
 
 	struct uniqtype *type;
 	struct liballocs_err *err = a->get_info((void *) obj, maybe_the_allocation,
 		&type, NULL, NULL, NULL);
 
-	__liballocs_unrecognised_heap_alloc_sites.count = unrecognized_heap_alloc_site_count;
+	__liballocs_addrlist_add_suppressed = was_suppressed;
 	if (err) return NULL;
 
 	return type;
@@ -64,6 +64,28 @@ static const void *typestr_to_uniqtype_from_lib(void *handle, const char *typest
 
 extern void __libcrunch_scan_lazy_typenames(void *handle) __attribute__((weak));
 
+/* Add or remove a meta-DSO's segments in our footprint. We're called from
+ * inside a dl_iterate_phdr() callback, so rather than iterate again, we
+ * find its program headers from its ELF header, which is mapped by its
+ * first segment as usual for a DSO. */
+__attribute__((visibility("hidden")))
+void __liballocs_footprint_note_meta_dso(void *handle, _Bool loaded)
+{
+	struct link_map *l = handle;
+	const ElfW(Ehdr) *ehdr = (const ElfW(Ehdr) *) l->l_addr;
+	const ElfW(Phdr) *phdrs = (const ElfW(Phdr) *) (l->l_addr + ehdr->e_phoff);
+	for (unsigned i = 0; i < ehdr->e_phnum; ++i)
+	{
+		if (phdrs[i].p_type != PT_LOAD) continue;
+		uintptr_t begin = ROUND_DOWN(l->l_addr + phdrs[i].p_vaddr, PAGE_SIZE);
+		uintptr_t end = ROUND_UP(l->l_addr + phdrs[i].p_vaddr + phdrs[i].p_memsz, PAGE_SIZE);
+		if (loaded) __liballocs_footprint_add_region(LIBALLOCS_FOOTPRINT_META_DSOS, NULL,
+			(void*) begin, end - begin);
+		else __liballocs_footprint_remove_region(LIBALLOCS_FOOTPRINT_META_DSOS, NULL,
+			(void*) begin, end - begin);
+	}
+}
+
 int load_and_init_all_metadata_for_one_object(struct dl_phdr_info *info, size_t size, void *data)
 {
 	void *meta_handle = NULL;
@@ -117,6 +139,8 @@ int load_and_init_all_metadata_for_one_object(struct dl_phdr_info *info, size_t
 		/* That means the object is already loaded. How did that happen? */
 		debug_printf(0, "meta-DSO unexpectedly already dlopened: %s\n", libfile_name);
 		args->out_handle = meta_handle;
+		/* We only count meta-DSOs when we dlopen them ourselves (below), so
+		 * that no load is counted twice. */
 		dlclose(meta_handle); // decrement the refcount, but won't free the link_map
 		free(symlink_path);
 		__private_free(libfile_name);
@@ -136,6 +160,8 @@ int load_and_init_all_metadata_for_one_object(struct dl_phdr_info *info, size_t
 		return 0;
 	}
 	debug_printf(3, "dlopened meta-DSO: %s (as %s)\n", libfile_name, symlink_path);
+	LIBALLOCS_TRACE3(meta_dso_load, info->dlpi_name, libfile_name, meta_handle);
+	__liballocs_footprint_note_meta_dso(meta_handle, 1);
 	__private_free(libfile_name);
 	free(symlink_path);
 	args->out_handle = meta_handle;
@@ -135,8 +135,8 @@ void sanity_check_bigalloc(struct big_allocation *b)
 		assert(b->end != b->begin);
 		/* The pageindex immediately before the beginning should not say
 		 * that it's this bigalloc there. */
-		assert(pageindex[PAGENUM(((char*)(b)->begin)-1)] != IDXB(b));
-		assert(pageindex[PAGENUM((b)->end)] != IDXB(b));
+		assert(PAGEINDEX_GET(PAGENUM(((char*)(b)->begin)-1)) != IDXB(b));
+		assert(PAGEINDEX_GET(PAGENUM((b)->end)) != IDXB(b));
 
 		assert(!b->allocated_by
 				|| !b->allocated_by->min_alignment
@@ -169,18 +169,44 @@ void __liballocs_sanity_check_bigalloc(struct big_allocation *b) __attribute__((
 
 bigalloc_num_t *pageindex __attribute__((visibility("protected")));
 extern bigalloc_num_t *__liballocs_pageindex __attribute__((alias("pageindex")));
-
-static void memset_bigalloc(bigalloc_num_t *begin, bigalloc_num_t num, 
-	bigalloc_num_t old_num, size_t n)
+bigalloc_num_t *hugepageindex __attribute__((visibility("protected")));
+extern bigalloc_num_t *__liballocs_hugepageindex __attribute__((alias("hugepageindex")));
+/* Do we record top-level bigallocs in the huge pageindex? Off by default,
+ * because code outside liballocs may read the pageindex directly. */
+static _Bool use_huge_regions;
+
+/* Which parts of the pageindex have we ever written? Each bit covers 512kB
+ * of pageindex, i.e. 1GB of address space. The footprint code uses this to
+ * avoid mincore()ing the whole reservation (see footprint.c). */
+#define LOG_PAGEINDEX_TOUCHED_GRANULE 19
+#define PAGEINDEX_NBYTES \
+	(sizeof (bigalloc_num_t) * ((uintptr_t)(MAXIMUM_USER_ADDRESS + 1) >> LOG_PAGE_SIZE))
+#define PAGEINDEX_NTOUCHED_GRANULES \
+	DIVIDE_ROUNDING_UP(PAGEINDEX_NBYTES, 1ul << LOG_PAGEINDEX_TOUCHED_GRANULE)
+#define TOUCHED_WORD_NBITS (8 * sizeof (unsigned long))
+static unsigned long pageindex_touched[DIVIDE_ROUNDING_UP(PAGEINDEX_NTOUCHED_GRANULES, TOUCHED_WORD_NBITS)];
+/* Async-signal-safe, since the lazy mapping handler calls it. */
+static void note_pageindex_touched(bigalloc_num_t *begin, size_t n)
 {
-	if (unlikely(n > (BIGGEST_SANE_USER_ALLOC >> LOG_PAGE_SIZE)))
+	uintptr_t begin_off = (uintptr_t) begin - (uintptr_t) pageindex;
+	uintptr_t end_off = MIN(begin_off + n * sizeof (bigalloc_num_t), PAGEINDEX_NBYTES);
+	if (begin_off >= end_off) return;
+	uintptr_t first = begin_off >> LOG_PAGEINDEX_TOUCHED_GRANULE;
+	uintptr_t last = (end_off - 1) >> LOG_PAGEINDEX_TOUCHED_GRANULE;
+	for (uintptr_t g = first; g <= last; ++g)
 	{
-		debug_printf(0,
-			"asked to memset pageindex for an insanely large bigalloc (%ld pages, at %p)\n",
-			(unsigned long) n, begin
-		);
-		abort();
+		unsigned long *p_word = &pageindex_touched[g / TOUCHED_WORD_NBITS];
+		unsigned long bit = 1ul << (g % TOUCHED_WORD_NBITS);
+		if (!(__atomic_load_n(p_word, __ATOMIC_RELAXED) & bit))
+		{
+			__atomic_fetch_or(p_word, bit, __ATOMIC_RELAXED);
+		}
 	}
+}
+
+static void memset_pageindex(bigalloc_num_t *begin, bigalloc_num_t num, 
+	bigalloc_num_t old_num, size_t n)
+{
 	/* NOTE: a lot of this function is debugging checks!
 	 * It collapses to very little when NDEBUG is defined. */
 	assert(1ull<<(8*sizeof(bigalloc_num_t)) >= NBIGALLOCS - 1);
@@ -196,6 +222,7 @@ static void memset_bigalloc(bigalloc_num_t *begin, bigalloc_num_t num,
 #define CHECK_LOC(loc, bad_n_expr)
 #endif
 
+	note_pageindex_touched(begin, n);
 	/* We use wmemset with special cases at the beginning and end */
 	if (n > 0 && (uintptr_t) begin % sizeof (wchar_t) != 0)
 	{
@@ -253,6 +280,103 @@ report_failure_and_abort:
 #endif
 }
 
+#define LOG_PAGES_PER_REGION (LOG_PAGEINDEX_REGION_SIZE - LOG_PAGE_SIZE)
+static _Bool is_toplevel_num(bigalloc_num_t num)
+{
+	return num != 0 && num != (bigalloc_num_t) -1 && !big_allocations[num].parent;
+}
+
+/* Stop using the huge pageindex for a region: every page in it that
+ * has no entry of its own gets the region's number. */
+static void demote_huge_region(uintptr_t region)
+{
+	bigalloc_num_t h = hugepageindex[region];
+	bigalloc_num_t *pos = pageindex + (region << LOG_PAGES_PER_REGION);
+	note_pageindex_touched(pos, PAGEINDEX_REGION_PAGES);
+	for (unsigned i = 0; i < PAGEINDEX_REGION_PAGES; ++i) if (!pos[i]) pos[i] = h;
+	hugepageindex[region] = 0;
+}
+
+/* Set n pageindex entries, starting at begin, from old_num to num. We
+ * go a region at a time. The invariant is that a region's huge entry, if
+ * nonzero, is a top-level bigalloc spanning the whole region, and that
+ * no page entry in the region has that same number (only deeper ones). */
+static void memset_bigalloc(bigalloc_num_t *begin, bigalloc_num_t num, 
+	bigalloc_num_t old_num, size_t n)
+{
+	if (unlikely(n > (BIGGEST_SANE_USER_ALLOC >> LOG_PAGE_SIZE)))
+	{
+		debug_printf(0,
+			"asked to memset pageindex for an insanely large bigalloc (%ld pages, at %p)\n",
+			(unsigned long) n, begin
+		);
+		abort();
+	}
+	/* If we have never used the huge pageindex, it is all zeroes. */
+	if (!use_huge_regions) { memset_pageindex(begin, num, old_num, n); return; }
+	/* Are we moving between top level and nothing, or between
+	 * two top-level bigallocs? */
+	_Bool num_is_toplevel_or_none = (num == 0 || is_toplevel_num(num));
+	uintptr_t pagenum = begin - pageindex;
+	uintptr_t end_pagenum = pagenum + n;
+	while (pagenum < end_pagenum)
+	{
+		uintptr_t region = PAGEINDEX_REGION(pagenum);
+		uintptr_t region_begin_pagenum = region << LOG_PAGES_PER_REGION;
+		uintptr_t region_end_pagenum = (region + 1) << LOG_PAGES_PER_REGION;
+		uintptr_t chunk_end_pagenum = MIN(end_pagenum, region_end_pagenum);
+		_Bool whole_region = (pagenum == region_begin_pagenum
+				&& chunk_end_pagenum == region_end_pagenum);
+		bigalloc_num_t h = hugepageindex[region];
+		if (whole_region && num_is_toplevel_or_none
+				&& ((h != 0 && h == old_num) || (h == 0 && old_num == 0)))
+		{
+			/* Only the huge entry changes. Any page entries are
+			 * either zero or deeper than old_num, and stay put. */
+			hugepageindex[region] = num;
+		}
+		else
+		{
+			if (h != 0 && h == old_num && num_is_toplevel_or_none) demote_huge_region(region);
+			/* If the region's huge entry already says num, pages need no entry. */
+			memset_pageindex(pageindex + pagenum, (h != 0 && h == num) ? 0 : num,
+				old_num, chunk_end_pagenum - pagenum);
+		}
+		pagenum = chunk_end_pagenum;
+	}
+}
+
+/* Replace 'from' with 'to' in the pageindex between the given pages,
+ * leaving other numbers alone. */
+static void substitute_in_pageindex(uintptr_t pagenum, uintptr_t end_pagenum,
+	bigalloc_num_t from, bigalloc_num_t to)
+{
+	while (pagenum < end_pagenum)
+	{
+		uintptr_t region = PAGEINDEX_REGION(pagenum);
+		uintptr_t region_end_pagenum = (region + 1) << LOG_PAGES_PER_REGION;
+		uintptr_t chunk_end_pagenum = MIN(end_pagenum, region_end_pagenum);
+		if (hugepageindex[region] != 0 && hugepageindex[region] == from)
+		{
+			if (pagenum == (region << LOG_PAGES_PER_REGION)
+					&& chunk_end_pagenum == region_end_pagenum)
+			{
+				hugepageindex[region] = to;
+				pagenum = chunk_end_pagenum;
+				continue;
+			}
+			demote_huge_region(region);
+		}
+		/* FIXME: be faster somehow (wmemchr?). */
+		for (bigalloc_num_t *pos = pageindex + pagenum;
+				pos < pageindex + chunk_end_pagenum; ++pos)
+		{
+			if (*pos == from) *pos = to;
+		}
+		pagenum = chunk_end_pagenum;
+	}
+}
+
 const int the_signal = SIGBUS;
 static struct sigaction oldaction; /* We will restore this... */
 
@@ -271,7 +395,9 @@ struct deferred_mapping
 struct deferred_mapping deferred_mappings[MAX_DEFERRED_MAPPINGS] = {
 	[0] = {
 		.begin = (void*)PAGEINDEX_ADDRESS,
-		.size = sizeof (bigalloc_num_t) * ((uintptr_t)(MAXIMUM_USER_ADDRESS + 1) >> LOG_PAGE_SIZE),
+		/* This covers the huge pageindex too. */
+		.size = sizeof (bigalloc_num_t) * ((uintptr_t)(MAXIMUM_USER_ADDRESS + 1) >> LOG_PAGE_SIZE)
+			+ HUGEPAGEINDEX_SIZE_BYTES,
 		.prot = PROT_READ|PROT_WRITE,
 		.flags = MAP_PRIVATE|MAP_FIXED|MAP_NORESERVE,
 		.offset = 0,
@@ -345,6 +471,8 @@ static void deferred_mapping_handle_signal(int n, siginfo_t *info, void *ucontex
 			write_string(")\n");
 			abort();
 		}
+		note_pageindex_touched((bigalloc_num_t *) range_base,
+			DEFERRED_MAPPING_UNIT / sizeof (bigalloc_num_t));
 		write_string("lazily mapped a piece of pageindex at ");
 		write_ulong((uintptr_t) ret);
 		write_string("\n");
@@ -356,6 +484,18 @@ static void deferred_mapping_handle_signal(int n, siginfo_t *info, void *ucontex
 	 * probably that's just exit. However, exiting has the side effect of disabling
 	 * the core handling path. Instead we disable ourselves and then resume! FIXME: this
 	 * is not foolproof, e.g. if there are concurrent threads futzing with the memory map. */
+	/* If there was a handler before ours, pass the signal on to it. */
+	if ((oldaction.sa_flags & SA_SIGINFO) && oldaction.sa_sigaction)
+	{
+		oldaction.sa_sigaction(n, info, ucontext);
+		return;
+	}
+	if (!(oldaction.sa_flags & SA_SIGINFO) && oldaction.sa_handler != SIG_DFL
+			&& oldaction.sa_handler != SIG_IGN)
+	{
+		oldaction.sa_handler(n);
+		return;
+	}
 	write_string("Signal not handleable by lazy mapping of pageindex\n");
 	//raw_exit(128 + the_signal);
 	sigaction(the_signal, &oldaction, NULL);
@@ -419,18 +559,42 @@ void __pageindex_init(void)
 		/* Mmap our region. We map one 16-bit number for every page in the user address region. */
 		/* HACK: always place at a known address (see pageindex.h, but it's 0x410000000000),
 		 * to avoid problems with libcrunch shadow space. */
-		if (getenv("LIBALLOCS_PAGEINDEX_NO_LAZY_MAPPING"))
+		/* There are two ways to get a pageindex that costs nothing until touched.
+		 * The default ("sigbus") maps a zero-length memfd, so that the first touch
+		 * of each DEFERRED_MAPPING_UNIT raises SIGBUS and our handler maps some
+		 * anonymous memory there. The alternative ("noreserve") is a plain
+		 * MAP_NORESERVE anonymous mapping, where the kernel supplies zero pages on
+		 * first touch with no signal round trip and no handler to clobber; we
+		 * exclude it from core dumps with MADV_DONTDUMP. Its cost is that
+		 * pageindex pages are populated one at a time rather than a unit at a
+		 * time. */
+		char *backend = environ_getenv("LIBALLOCS_PAGEINDEX_BACKEND", env);
+		_Bool use_noreserve = (backend && 0 == strcmp(backend, "noreserve"))
+			|| environ_getenv("LIBALLOCS_PAGEINDEX_NO_LAZY_MAPPING", env);
+		if (backend && !use_noreserve && 0 != strcmp(backend, "sigbus"))
+		{
+			write_string("liballocs: unrecognised LIBALLOCS_PAGEINDEX_BACKEND; using sigbus\n");
+		}
+		if (use_noreserve)
 		{
 			pageindex = MEMTABLE_NEW_WITH_TYPE_AT_ADDR(bigalloc_num_t, PAGE_SIZE, (void*) 0,
 				(void*) (MAXIMUM_USER_ADDRESS + 1), (const void *) PAGEINDEX_ADDRESS);
 			if (pageindex == MAP_FAILED) abort();
-			debug_printf(3, "pageindex at %p (mapped eagerly)\n", pageindex);
+			hugepageindex = MEMTABLE_NEW_WITH_TYPE_AT_ADDR(bigalloc_num_t, 1ul<<LOG_PAGEINDEX_REGION_SIZE, (void*) 0,
+				(void*) (MAXIMUM_USER_ADDRESS + 1), (const void *) HUGEPAGEINDEX_ADDRESS);
+			if (hugepageindex == MAP_FAILED) abort();
+			size_t map_size = sizeof (bigalloc_num_t) * ((uintptr_t)(MAXIMUM_USER_ADDRESS + 1) >> LOG_PAGE_SIZE)
+				+ HUGEPAGEINDEX_SIZE_BYTES;
+			if (madvise(pageindex, map_size, MADV_DONTDUMP) < 0) { debug_printf(0, "Failed to madvise MADV_DONTDUMP (%s)\n", strerror(errno)); }
+			debug_printf(3, "pageindex at %p (mapped noreserve)\n", pageindex);
 		}
 		else
 		{
 			int fd = memfd_create("pageindex-lazy-region", 0);
 			if (fd == -1) abort();
-			size_t map_size = sizeof (bigalloc_num_t) * ((uintptr_t)(MAXIMUM_USER_ADDRESS + 1) >> LOG_PAGE_SIZE);
+			/* We map the huge pageindex in the same go, immediately after. */
+			size_t map_size = sizeof (bigalloc_num_t) * ((uintptr_t)(MAXIMUM_USER_ADDRESS + 1) >> LOG_PAGE_SIZE)
+				+ HUGEPAGEINDEX_SIZE_BYTES;
 			pageindex = (bigalloc_num_t *) raw_mmap((void*) PAGEINDEX_ADDRESS,
 				map_size,
 				PROT_READ|PROT_WRITE,
@@ -439,10 +603,21 @@ void __pageindex_init(void)
 			if (pageindex == MAP_FAILED) { debug_printf(0, "Failed to map memfd fd %d (%s)\n", fd, strerror(errno)); abort(); }
 			if (madvise(pageindex, map_size, MADV_DONTDUMP) < 0) { debug_printf(0, "Failed to madvise MADV_DONTDUMP (%s)\n", strerror(errno)); }
 
+			hugepageindex = (bigalloc_num_t *) HUGEPAGEINDEX_ADDRESS;
 			close(fd);
 			install_lazy_pageindex_handler();
 			debug_printf(3, "pageindex at %p (to be mapped lazily)\n", pageindex);
 		}
+		/* The pageindex is registered as sparse, so that asking for our
+		 * footprint only scans the parts we've written. The huge pageindex
+		 * is small enough to scan whole. */
+		__liballocs_footprint_add_sparse_region(LIBALLOCS_FOOTPRINT_PAGEINDEX, NULL, pageindex,
+			PAGEINDEX_NBYTES, pageindex_touched, LOG_PAGEINDEX_TOUCHED_GRANULE);
+		__liballocs_footprint_add_region(LIBALLOCS_FOOTPRINT_PAGEINDEX, NULL, hugepageindex,
+			HUGEPAGEINDEX_SIZE_BYTES);
+		__liballocs_footprint_add_region(LIBALLOCS_FOOTPRINT_BIGALLOC_TABLE, NULL,
+			big_allocations, sizeof big_allocations);
+		use_huge_regions = !!environ_getenv("LIBALLOCS_PAGEINDEX_HUGE_REGIONS", env);
 		create_private_nommap_malloc_heap();
 	}
 }
@@ -464,13 +639,13 @@ static struct big_allocation *find_free_bigalloc(void)
 static _Bool
 is_unindexed(void *begin, void *end)
 {
-	bigalloc_num_t *pos = &pageindex[PAGENUM(begin)];
-	while (pos < pageindex + PAGENUM(end) && !*pos) { ++pos; }
+	uintptr_t pagenum = PAGENUM(begin);
+	while (pagenum < PAGENUM(end) && !PAGEINDEX_GET(pagenum)) { ++pagenum; }
 	
-	if (pos == pageindex + PAGENUM(end)) return 1;
+	if (pagenum == PAGENUM(end)) return 1;
 	
 	debug_printf(6, "Found already-indexed position %p (mapping %d)\n", 
-			ADDR_OF_PAGENUM(pos - pageindex), *pos);
+			ADDR_OF_PAGENUM(pagenum), PAGEINDEX_GET(pagenum));
 	return 0;
 }
 
@@ -550,6 +725,7 @@ static void unlink_toplevel(struct big_allocation *b);
 static void bigalloc_del(struct big_allocation *b)
 {
 	SANITY_CHECK_BIGALLOC(b);
+	LIBALLOCS_TRACE4(bigalloc_delete, b, b->begin, b->end, b->allocated_by);
 	
 	/* Recursively delete all children. */
 	struct big_allocation *child = BIDX(b->first_child);
@@ -682,7 +858,7 @@ struct big_allocation *__liballocs_new_bigalloc(const void *ptr, size_t size,
 			if (deepest_at_start)
 			{
 				write_string("\nStart deepest bigalloc num: ");
-				write_ulong((unsigned long) pageindex[PAGENUM(ptr)]);
+				write_ulong((unsigned long) PAGEINDEX_GET(PAGENUM(ptr)));
 				write_string("\nStart deepest existing begin: ");
 				write_ulong((unsigned long) deepest_at_start->begin);
 				write_string("\nStart deepest existing end: ");
@@ -694,7 +870,7 @@ struct big_allocation *__liballocs_new_bigalloc(const void *ptr, size_t size,
 			if (deepest_at_end)
 			{
 				write_string("\nEnd deepest bigalloc num: ");
-				write_ulong((unsigned long) pageindex[PAGENUM(chunk_lastbyte)]);
+				write_ulong((unsigned long) PAGEINDEX_GET(PAGENUM(chunk_lastbyte)));
 				write_string("\nEnd deepest existing begin: ");
 				write_ulong((unsigned long) deepest_at_end->begin);
 				write_string("\nEnd deepest existing end: ");
@@ -807,6 +983,7 @@ static void bigalloc_init(struct big_allocation *b, const void *ptr, size_t size
 				      ROUND_DOWN((unsigned long) b->end, PAGE_SIZE))
 	);
 	SANITY_CHECK_BIGALLOC(b);
+	LIBALLOCS_TRACE4(bigalloc_new, b, b->begin, b->end, allocated_by);
 }
 
 #define START __liballocs_private_nommap_malloc_bigalloc
@@ -862,6 +1039,90 @@ static void unlink_toplevel(struct big_allocation *b)
 	if (b->prev_sib) BIDX(b->prev_sib)->next_sib = b->next_sib;
 	if (b->next_sib) BIDX(b->next_sib)->prev_sib = b->prev_sib;
 }
+
+/* Bulk version of __liballocs_new_bigalloc, for the startup scan of
+ * /proc/self/maps. The caller passes top-level, page-aligned ranges,
+ * sorted by address, not overlapping each other and not yet indexed.
+ * Creating them one by one costs a linear scan for a free slot and a
+ * linear walk of the top-level list for each; with tens of thousands of
+ * mappings that is quadratic. Here we take the lock once, keep a cursor
+ * into the free slots and another into the top-level list, and fill in
+ * the pageindex in address order. (We can't merge the memsets across
+ * bigallocs, since each writes its own number, but they are at least
+ * done as one ascending sweep.) Writes the new bigallocs' addresses into
+ * out_bigallocs[] and returns how many were made. */
+__attribute__((visibility("hidden")))
+unsigned __liballocs_new_toplevel_bigallocs_sorted(
+	const struct bigalloc_batch_entry *ents, unsigned n,
+	void (*allocator_private_free)(void*), struct allocator *allocated_by,
+	struct big_allocation **out_bigallocs)
+{
+	if (!pageindex) __pageindex_init();
+	if (n == 0) return 0;
+	int lock_ret;
+	BIG_LOCK
+
+	struct big_allocation *free_cursor = &big_allocations[1];
+	struct big_allocation *prev = BIDX(find_toplevel_highest_lt((void*) ents[0].begin));
+	uintptr_t last_end = 0;
+	unsigned i;
+	for (i = 0; i < n; ++i)
+	{
+		const void *begin = ents[i].begin;
+		const void *end = (const char *) ents[i].begin + ents[i].size;
+		if (ents[i].size > BIGGEST_SANE_USER_ALLOC
+				|| ROUND_UP_PTR(begin, PAGE_SIZE) != begin
+				|| ROUND_UP_PTR(end, PAGE_SIZE) != end
+				|| (uintptr_t) begin < last_end)
+		{
+			write_string("Internal error: bad batch of top-level big allocations\n");
+			abort();
+		}
+		last_end = (uintptr_t) end;
+		assert(is_unindexed((void*) begin, (void*) end));
+
+		while (free_cursor < &big_allocations[NBIGALLOCS] && BIGALLOC_IN_USE(free_cursor))
+		{
+			++free_cursor;
+		}
+		if (free_cursor == &big_allocations[NBIGALLOCS]) abort();
+		struct big_allocation *b = free_cursor++;
+		b->begin = (void*) begin;
+		b->end = (void*) end;
+		b->allocator_private = ents[i].allocator_private;
+		b->allocator_private_free = allocator_private_free;
+		b->allocated_by = allocated_by;
+		b->suballocator = NULL;
+		b->suballocator_private = NULL;
+		b->suballocator_private_free = NULL;
+		b->first_child = b->parent = 0;
+
+		/* Find our neighbours: prev is the highest top-level bigalloc
+		 * beginning below us. Since we go in address order, it only ever
+		 * moves forwards, and after the first we always have one. */
+		struct big_allocation *next;
+		for (;;)
+		{
+			next = prev ? BIDX(prev->next_sib) : BIDX(find_toplevel_lowest_ge((void*) begin));
+			if (next && (uintptr_t) next->begin < (uintptr_t) begin) prev = next;
+			else break;
+		}
+		b->prev_sib = IDXB(prev);
+		b->next_sib = IDXB(next);
+		if (prev) prev->next_sib = IDXB(b);
+		if (next) next->prev_sib = IDXB(b);
+		prev = b;
+
+		memset_bigalloc(pageindex + PAGENUM(begin), IDXB(b), 0,
+			PAGE_DIST((uintptr_t) begin, (uintptr_t) end));
+		SANITY_CHECK_BIGALLOC(b);
+		LIBALLOCS_TRACE4(bigalloc_new, b, b->begin, b->end, allocated_by);
+		if (out_bigallocs) out_bigallocs[i] = b;
+	}
+	sanity_check_bigallocs_toplevel();
+	BIG_UNLOCK
+	return i;
+}
 __attribute__((visibility("protected")))
 struct big_allocation *__liballocs_find_mapping_at_or_above(void *addr)
 {
@@ -911,6 +1172,7 @@ _Bool __liballocs_extend_bigalloc(struct big_allocation *b, const void *new_end)
 	);
 	
 	SANITY_CHECK_BIGALLOC(b);
+	LIBALLOCS_TRACE3(bigalloc_extend, b, b->begin, b->end);
 	
 	BIG_UNLOCK
 	return 1;
@@ -971,10 +1233,11 @@ _Bool __liballocs_pre_extend_bigalloc(struct big_allocation *b, const void *new_
 			               * because if a child was spanning the whole page, we don't want to
 			               * clobber its presence in the index. */
 			              ((PAGENUM(b->end) > PAGENUM(old_begin)) 
-			                && !is_one_or_more_levels_under(pageindex[PAGENUM(old_begin)], b)) 
+			                && !is_one_or_more_levels_under(PAGEINDEX_GET(PAGENUM(old_begin)), b)) 
 			                  ? ROUND_UP((unsigned long) old_begin, PAGE_SIZE)
 			                  : ROUND_DOWN((unsigned long) old_begin, PAGE_SIZE) )
 		);
+		LIBALLOCS_TRACE3(bigalloc_extend, b, b->begin, b->end);
 	}
 	
 	
@@ -1016,6 +1279,7 @@ static _Bool bigalloc_truncate_at_end(struct big_allocation *b, const void *new_
 	);
 	
 	SANITY_CHECK_BIGALLOC(b);
+	LIBALLOCS_TRACE3(bigalloc_truncate, b, b->begin, b->end);
 	
 	return 1;
 }
@@ -1049,6 +1313,7 @@ _Bool __liballocs_truncate_bigalloc_at_beginning(struct big_allocation *b, const
 			          ROUND_UP((unsigned long) new_begin, PAGE_SIZE))
 	);
 	SANITY_CHECK_BIGALLOC(b);
+	LIBALLOCS_TRACE3(bigalloc_truncate, b, b->begin, b->end);
 	BIG_UNLOCK
 	return 1;
 }
@@ -1103,17 +1368,14 @@ struct big_allocation *__liballocs_split_bigalloc_at_page_boundary(struct big_al
 	b->end = (void*) split_addr;
 	
 	/* In the portion after the split, the old bigalloc id needs substituting with the
-	 * new (second-half) one, but we don't want to clobber the child bigalloc ids. 
-	 * For now, just do a stupid look-and-replace. FIXME: be faster somehow (wmemchr?). */
-	for (bigalloc_num_t *pos = pageindex + 
-			PAGENUM(ROUND_UP((unsigned long) new_bigalloc->begin, PAGE_SIZE));
-			pos < pageindex + PAGENUM(ROUND_UP((unsigned long) new_bigalloc->end, PAGE_SIZE));
-			++pos)
-	{
-		if (*pos == IDXB(b)) *pos = IDXB(new_bigalloc);
-	}
+	 * new (second-half) one, but we don't want to clobber the child bigalloc ids. */
+	substitute_in_pageindex(
+		PAGENUM(ROUND_UP((unsigned long) new_bigalloc->begin, PAGE_SIZE)),
+		PAGENUM(ROUND_UP((unsigned long) new_bigalloc->end, PAGE_SIZE)),
+		IDXB(b), IDXB(new_bigalloc));
 	SANITY_CHECK_BIGALLOC(b);
 	SANITY_CHECK_BIGALLOC(new_bigalloc);
+	LIBALLOCS_TRACE3(bigalloc_split, b, new_bigalloc, split_addr);
 	BIG_UNLOCK
 	return new_bigalloc;
 }
@@ -1129,7 +1391,7 @@ static struct big_allocation *find_bigalloc_recursive(struct big_allocation *sta
 	 * this address except via the pageindex. */
 	if (!start)
 	{
-		bigalloc_num_t startnum = pageindex[PAGENUM(addr)];
+		bigalloc_num_t startnum = PAGEINDEX_GET(PAGENUM(addr));
 		if (!startnum)
 		{
 			if (unlikely(!startnum && !__liballocs_systrap_is_initialized))
@@ -1142,12 +1404,12 @@ static struct big_allocation *find_bigalloc_recursive(struct big_allocation *sta
 				{
 		#define MAX_BRK_PAGES_TO_SEARCH 128
 					unsigned long search_pagenum = PAGENUM(addr);
-					while (search_pagenum > 0 && pageindex[search_pagenum] == 0)
+					while (search_pagenum > 0 && PAGEINDEX_GET(search_pagenum) == 0)
 					{
 						if (search_pagenum - PAGENUM(addr) > MAX_BRK_PAGES_TO_SEARCH) break;
 						--search_pagenum;
 					}
-					if (pageindex[search_pagenum])
+					if (PAGEINDEX_GET(search_pagenum))
 					{
 						// have we found the brk allocator? test the highest address on the page
 						if (__lookup_bigalloc_from_root(
@@ -1164,7 +1426,7 @@ static struct big_allocation *find_bigalloc_recursive(struct big_allocation *sta
 					__mmap_allocator_init();
 				}
 				// try again
-				startnum = pageindex[PAGENUM(addr)];
+				startnum = PAGEINDEX_GET(PAGENUM(addr));
 				if (!startnum) goto found_nothing;
 			}
 		}
@@ -1194,7 +1456,7 @@ found_nothing:
 }
 static struct big_allocation *find_bigalloc_under_pageindex(const void *addr, struct allocator *a)
 {
-	bigalloc_num_t start_idx = pageindex[PAGENUM(addr)];
+	bigalloc_num_t start_idx = PAGEINDEX_GET(PAGENUM(addr));
 	if (start_idx == 0) return NULL;
 	return find_bigalloc_recursive(&big_allocations[start_idx], addr, a, /* suballocator? */ 0);
 }
@@ -1204,7 +1466,7 @@ static struct big_allocation *find_bigalloc_from_root(const void *addr, struct a
 }
 static struct big_allocation *find_bigalloc_under_pageindex_nofail(const void *addr, struct allocator *a)
 {
-	bigalloc_num_t start_idx = pageindex[PAGENUM(addr)];
+	bigalloc_num_t start_idx = PAGEINDEX_GET(PAGENUM(addr));
 	/* We should always have something at level0 spanning the whole page. */
 	if (start_idx == 0) abort();
 	return find_bigalloc_recursive(&big_allocations[start_idx], addr, a, /* suballocator? */ 0);
@@ -1231,11 +1493,11 @@ static struct big_allocation *find_deepest_bigalloc_recursive(struct big_allocat
 }
 static struct big_allocation *find_deepest_bigalloc(const void *addr)
 {
-	bigalloc_num_t start_idx = pageindex[PAGENUM(addr)];
+	bigalloc_num_t start_idx = PAGEINDEX_GET(PAGENUM(addr));
 	if (unlikely(start_idx == 0))
 	{
 		__liballocs_notify_unindexed_address(addr);
-		start_idx = pageindex[PAGENUM(addr)];
+		start_idx = PAGEINDEX_GET(PAGENUM(addr));
 		if (start_idx == 0) return NULL;
 	}
 	return find_deepest_bigalloc_recursive(&big_allocations[start_idx], addr);
@@ -1270,9 +1532,9 @@ _Bool __liballocs_delete_all_bigallocs_overlapping_range(const void *begin, cons
 		unsigned long initial_pagenum = PAGENUM((unsigned long) deleted_up_to);
 		size_t max_len = PAGENUM(ROUND_UP((unsigned long) end, PAGE_SIZE))
 					- initial_pagenum;
-		bigalloc_num_t *pos = &pageindex[PAGENUM(deleted_up_to)];
-		while (!*pos && pos != &pageindex[initial_pagenum + max_len]) ++pos;
-		size_t actual_len_zero = pos - &pageindex[initial_pagenum];
+		uintptr_t pos = PAGENUM(deleted_up_to);
+		while (!PAGEINDEX_GET(pos) && pos != initial_pagenum + max_len) ++pos;
+		size_t actual_len_zero = pos - initial_pagenum;
 		deleted_up_to = (char*) deleted_up_to + PAGE_SIZE * actual_len_zero;
 		write_string("Deleted up to address ");
 		write_ulong((unsigned long) deleted_up_to);
@@ -1283,7 +1545,7 @@ _Bool __liballocs_delete_all_bigallocs_overlapping_range(const void *begin, cons
 		 * By definition, it parent also overlaps the range, so it must go.
 		 * And by definition, any children must go if their parents go.
 		 * Luckily, bigalloc_del does recursive deletion. */
-		bigalloc_num_t n = pageindex[PAGENUM(deleted_up_to)];
+		bigalloc_num_t n = PAGEINDEX_GET(PAGENUM(deleted_up_to));
 		write_string("Got bigalloc num: ");
 		write_ulong((unsigned long) n);
 		write_string("\n");
@@ -1297,7 +1559,7 @@ _Bool __liballocs_delete_all_bigallocs_overlapping_range(const void *begin, cons
 			deleted_up_to = b->end;
 			bigalloc_del(b);
 			write_string("Pageindex now has bigalloc num: ");
-			write_ulong((unsigned long) pageindex[PAGENUM(old_deleted_up_to)]);
+			write_ulong((unsigned long) PAGEINDEX_GET(PAGENUM(old_deleted_up_to)));
 			write_string("\n");
 		} else { assert(0 && "should not have found a bigalloc here"); abort(); }
 	}
@@ -1371,7 +1633,7 @@ struct big_allocation *__lookup_bigalloc_top_level(const void *mem)
 	if (!pageindex) __pageindex_init();
 	int lock_ret;
 	BIG_LOCK
-	bigalloc_num_t n = pageindex[PAGENUM(mem)];
+	bigalloc_num_t n = PAGEINDEX_GET(PAGENUM(mem));
 	struct big_allocation *b = NULL;
 	if (n != 0)
 	{
@@ -1441,7 +1703,7 @@ void print_bigalloc_slice_for(void *addr)
 	 *       ... in effect this is sliding the rectangle around
 	 *       since we have picked the top ':' position also linearly?
 	 */
-	struct big_allocation *b = BIDX(pageindex[PAGENUM(addr)]);
+	struct big_allocation *b = BIDX(PAGEINDEX_GET(PAGENUM(addr)));
 	while (b && b->parent) b = b->parent;
 	for (struct big_allocation *child = BIDX(start->first_child);
 			child;
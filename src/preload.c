@@ -116,10 +116,10 @@ size_t malloc_or_alloca_usable_size(void *ptr)
 #define INITIAL_STACK_MINIMUM_SIZE 81920
 	_Bool is_definitely_not_stack = (char*) ptr <= (char*) __curbrk
 			|| 
-			big_allocations[pageindex[(uintptr_t) ptr >> LOG_PAGE_SIZE]].allocated_by
+			big_allocations[PAGEINDEX_GET((uintptr_t) ptr >> LOG_PAGE_SIZE)].allocated_by
 				== &__mmap_allocator
 			||
-			big_allocations[pageindex[(uintptr_t) ptr >> LOG_PAGE_SIZE]].allocated_by
+			big_allocations[PAGEINDEX_GET((uintptr_t) ptr >> LOG_PAGE_SIZE)].allocated_by
 				== &__global_malloc_allocator
 			;
 	_Bool is_definitely_stack = 
@@ -58,7 +58,7 @@ __liballocs_get_alloc_base_with_fill(void *obj, struct allocator **out_a, /*biga
 	struct liballocs_err *err = __liballocs_get_alloc_info(obj, out_a, &out,
 		NULL, NULL, NULL);
 	if (err) return NULL;
-	*out_num = pageindex[PAGENUM(obj)]; /* FIXME: should also check it's precise */
+	*out_num = PAGEINDEX_GET(PAGENUM(obj)); /* FIXME: should also check it's precise */
 	return (void*) out;
 }
 
@@ -86,7 +86,7 @@ __liballocs_get_alloc_type_with_fill(void *obj, struct allocator **out_a, /*biga
 	struct liballocs_err *err = __liballocs_get_alloc_info(obj, out_a, NULL,
 		NULL, &out, NULL);
 	if (err) return NULL;
-	*out_num = pageindex[PAGENUM(obj)]; /* FIXME: should also check it's precise */
+	*out_num = PAGEINDEX_GET(PAGENUM(obj)); /* FIXME: should also check it's precise */
 	return out;
 }
 
@@ -129,6 +129,9 @@ __liballocs_get_inner_type(void *obj, unsigned skip_at_bottom)
 	_Bool success = 1;
 	struct uniqtype *cur_containing_uniqtype = NULL;
 	struct uniqtype_rel_info *cur_contained_pos = NULL;
+	/* If we have a flattened layout for this type, that's one probe. */
+	if (__liballocs_layout_get_inner_type(u, target_offset_within_uniqtype,
+			&u, &cur_containing_uniqtype)) success = 0;
 	while (success)
 	{
 		success = __liballocs_first_subobject_spanning(
@@ -205,6 +208,11 @@ alloc_get_allocator(void *obj) __attribute__((alias("__liballocs_get_leaf_alloca
 struct mapping_entry *__liballocs_get_memory_mapping(const void *obj,
 		struct big_allocation **maybe_out_bigalloc)
 {
+	if (__builtin_expect((uintptr_t) obj - __mmap_allocator_journal_begin
+			< __mmap_allocator_journal_end - __mmap_allocator_journal_begin, 0))
+	{
+		__mmap_allocator_flush_journal_for(obj);
+	}
 	struct big_allocation *the_bigalloc = __lookup_bigalloc_top_level(obj);
 	if (!the_bigalloc) return NULL;
 	assert(the_bigalloc->allocated_by == &__mmap_allocator);
@@ -78,6 +78,7 @@ void init_rt_uniqtypes_obj(void)
 		size_t sz = SIZE_FOR_NRELATED(nrelated); \
 		pointer_to_ ## varname = dlalloc(__liballocs_rt_uniqtypes_obj, sz, SHF_WRITE); \
 		if (!pointer_to_ ## varname) abort(); \
+		__liballocs_footprint_add(LIBALLOCS_FOOTPRINT_SYNTHESISED_UNIQTYPES, NULL, sz); \
 		*(struct uniqtype *) pointer_to_ ## varname = (struct uniqtype) __VA_ARGS__; \
 		old_base = (void*) ((struct link_map *) __liballocs_rt_uniqtypes_obj)->l_addr;\
 		dlbind(__liballocs_rt_uniqtypes_obj, symstr, pointer_to_ ## varname, sz, STT_OBJECT);
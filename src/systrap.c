@@ -6,6 +6,8 @@
 #include <sys/syscall.h>
 #include <sys/types.h>
 #include <link.h>
+#include <dlfcn.h>
+#include <cpuid.h>
 #include "systrap.h"
 #include "raw-syscalls-defs.h"
 #include "vas.h"
@@ -36,6 +38,7 @@ void __mmap_allocator_notify_mmap(void *ret, void *requested_addr, size_t length
 void __mmap_allocator_notify_mprotect(void *addr, size_t len, int prot)
 			__attribute__((weak));
 void __mmap_allocator_notify_brk(void *new_curbrk) __attribute__((weak));
+void __mmap_allocator_notify_fds_closing(unsigned first, unsigned last) __attribute__((weak));
 void __brk_allocator_notify_brk(void *new_curbrk, const void *caller) __attribute__((weak));
 _Bool __static_file_allocator_notify_brk(void *new_curbrk) __attribute__((weak));
 _Bool __static_segment_allocator_notify_brk(void *new_curbrk) __attribute__((weak));
@@ -43,6 +46,7 @@ extern _Bool __liballocs_is_initialized __attribute__((weak));
 int __liballocs_global_init(void);
 /* avoid standard headers */
 char *realpath(const char *path, char *resolved_path);
+char *getenv(const char *name);
 int snprintf(char *str, size_t size, const char *format, ...);
 int open(const char *pathname, int flags, ...);
 int close(int fd);
@@ -54,34 +58,85 @@ int close(int fd);
 		? *(void**) ((uintptr_t) (((s)->saved_context->uc.uc_mcontext).MC_REG(rsp, RSP))) \
 		: (void*) (((s)->saved_context->uc.uc_mcontext).MC_REG(rip, RIP)) ) */
 
-void brk_replacement(struct generic_syscall *s, post_handler *post) __attribute__((visibility("hidden")));
-void brk_replacement(struct generic_syscall *s, post_handler *post)
+/* For the syscalls libsystrap has no raw_* wrapper for. We never trap our
+ * own code, so this is not trapped either. */
+static long raw_syscall4(long nr, long a1, long a2, long a3, long a4)
+{
+	long ret;
+	register long r10 __asm__("r10") = a4;
+	__asm__ volatile ("syscall" : "=a"(ret) : "0"(nr), "D"(a1), "S"(a2), "d"(a3), "r"(r10)
+		: "rcx", "r11", "memory");
+	return ret;
+}
+
+/* The allocators' bookkeeping takes locks (and, in the mmap allocator's fd
+ * cache, spins on a seqlock) that a signal handler doing its own mmap, close
+ * or query would deadlock on. So we block asynchronous signals around it,
+ * though not around the syscall itself, which might block indefinitely
+ * (think open() of a FIFO). Synchronous signals stay unblocked: blocking
+ * those doesn't stop them, it just gets us killed, and we need SIGILL for
+ * the traps anyway. */
+#define SIGSET_BIT(sig) (1ul << ((sig) - 1))
+#define SYNCHRONOUS_SIGNALS (SIGSET_BIT(4) /* SIGILL */ | SIGSET_BIT(5) /* SIGTRAP */ \
+	| SIGSET_BIT(7) /* SIGBUS */ | SIGSET_BIT(8) /* SIGFPE */ | SIGSET_BIT(11) /* SIGSEGV */)
+static unsigned long block_async_signals(void)
+{
+	unsigned long to_block = ~SYNCHRONOUS_SIGNALS;
+	unsigned long old = 0;
+	raw_syscall4(SYS_rt_sigprocmask, 0 /* SIG_BLOCK */, (long) &to_block, (long) &old,
+		sizeof to_block);
+	return old;
+}
+static void restore_signal_mask(unsigned long old)
+{
+	raw_syscall4(SYS_rt_sigprocmask, 2 /* SIG_SETMASK */, (long) &old, 0, sizeof old);
+}
+#define WITH_ASYNC_SIGNALS_BLOCKED(stmt) do { \
+	unsigned long old_mask_ = block_async_signals(); \
+	stmt; \
+	restore_signal_mask(old_mask_); \
+} while (0)
+
+/* Each replaced syscall is implemented by a do_*_syscall function taking
+ * the raw argument words and our guess at the caller. They can be reached
+ * in two ways: via a SIGILL trap, in which case the *_replacement wrappers
+ * unpack the generic_syscall and do the post-handling; or via a trampoline
+ * (see below), in which case there is no signal context at all. */
+typedef long trampolined_syscall_fn(const long *args, const void *caller);
+#define SIGNALLED_SYSCALL_ARGS(s) ((const long[6]) { \
+	(long) (s)->args[0], (long) (s)->args[1], (long) (s)->args[2], \
+	(long) (s)->args[3], (long) (s)->args[4], (long) (s)->args[5] })
+
+static long do_brk_syscall(const long *args, const void *caller)
 {
 	/* Linux gives us the old value on failure, and the new value on success. 
 	 * In other words it always gives us the current sbrk. */
-	void *brk_asked_for = (void*) s->args[0];
+	void *brk_asked_for = (void*) args[0];
 	/* HMM. Can I do a raw syscall here? It's an out-of-line call, but
 	 * within DSO. So it should not be trapped. Right? */
 	void *brk_returned = raw_brk(brk_asked_for);
-	if (&__brk_allocator_notify_brk) __brk_allocator_notify_brk(brk_returned,
-		GUESS_CALLER(s));
-	
+	if (&__brk_allocator_notify_brk) WITH_ASYNC_SIGNALS_BLOCKED(
+		__brk_allocator_notify_brk(brk_returned, caller));
+	return (long) brk_returned;
+}
+void brk_replacement(struct generic_syscall *s, post_handler *post) __attribute__((visibility("hidden")));
+void brk_replacement(struct generic_syscall *s, post_handler *post)
+{
+	long ret = do_brk_syscall(SIGNALLED_SYSCALL_ARGS(s), GUESS_CALLER(s));
 	/* Do the post-handling and resume. */
-	post(s, (long) brk_returned, 1);
+	post(s, ret, 1);
 }
 
-void mmap_replacement(struct generic_syscall *s, post_handler *post) __attribute__((visibility("hidden")));
-void mmap_replacement(struct generic_syscall *s, post_handler *post)
+static long do_mmap_syscall(const long *args, const void *caller)
 {
 	/* Unpack the mmap arguments. */
-	void *addr = (void*) s->args[0];
-	size_t length = s->args[1];
-	int prot = s->args[2];
-	int flags = s->args[3];
-	int fd = s->args[4];
-	off_t offset = s->args[5];
-
-	void *caller = GUESS_CALLER(s);
+	void *addr = (void*) args[0];
+	size_t length = args[1];
+	int prot = args[2];
+	int flags = args[3];
+	int fd = args[4];
+	off_t offset = args[5];
+
 	/* Nudge them. */
 	__liballocs_nudge_mmap(&addr, &length, &prot, &flags, 
 			&fd, &offset, caller);
@@ -93,41 +148,49 @@ void mmap_replacement(struct generic_syscall *s, post_handler *post)
 	 * is less than PAGE_SIZE below (void*)-1 to be an error value. */
 	if (!MMAP_RETURN_IS_ERROR(ret) && &__mmap_allocator_notify_mmap)
 	{
-		__mmap_allocator_notify_mmap(ret, addr, length, prot, flags, fd, offset,
-			caller);
+		WITH_ASYNC_SIGNALS_BLOCKED(__mmap_allocator_notify_mmap(ret, addr, length,
+			prot, flags, fd, offset, (void*) caller));
 	}
-
+	return (long) ret;
+}
+void mmap_replacement(struct generic_syscall *s, post_handler *post) __attribute__((visibility("hidden")));
+void mmap_replacement(struct generic_syscall *s, post_handler *post)
+{
+	long ret = do_mmap_syscall(SIGNALLED_SYSCALL_ARGS(s), GUESS_CALLER(s));
 	/* Do the post-handling and resume. */
-	post(s, (long) ret, 1);
+	post(s, ret, 1);
 }
 
-void munmap_replacement(struct generic_syscall *s, post_handler *post) __attribute__((visibility("hidden")));
-void munmap_replacement(struct generic_syscall *s, post_handler *post)
+static long do_munmap_syscall(const long *args, const void *caller)
 {
 	/* Unpack the mmap arguments. */
-	void *addr = (void*) s->args[0];
-	size_t length = s->args[1];
+	void *addr = (void*) args[0];
+	size_t length = args[1];
 	
 	/* Do the call. */
 	int ret = raw_munmap(addr, length);
 	
 	/* If it did something, notify the allocator. */
-	if (ret == 0 && &__mmap_allocator_notify_munmap) __mmap_allocator_notify_munmap(addr, length, 
-		GUESS_CALLER(s));
-	
+	if (ret == 0 && &__mmap_allocator_notify_munmap) WITH_ASYNC_SIGNALS_BLOCKED(
+		__mmap_allocator_notify_munmap(addr, length, (void*) caller));
+	return ret;
+}
+void munmap_replacement(struct generic_syscall *s, post_handler *post) __attribute__((visibility("hidden")));
+void munmap_replacement(struct generic_syscall *s, post_handler *post)
+{
+	long ret = do_munmap_syscall(SIGNALLED_SYSCALL_ARGS(s), GUESS_CALLER(s));
 	/* Do the post-handling and resume. */
 	post(s, ret, 1);
 }
 
-void mremap_replacement(struct generic_syscall *s, post_handler *post) __attribute__((visibility("hidden")));
-void mremap_replacement(struct generic_syscall *s, post_handler *post)
+static long do_mremap_syscall(const long *args, const void *caller)
 {
 	/* Unpack the mremap arguments. */
-	void *old_addr = (void*) s->args[0];
-	size_t old_length = s->args[1];
-	size_t new_length = s->args[2];
-	int mremap_flags = s->args[3];
-	void *maybe_new_address = (void*) s->args[4];
+	void *old_addr = (void*) args[0];
+	size_t old_length = args[1];
+	size_t new_length = args[2];
+	int mremap_flags = args[3];
+	void *maybe_new_address = (void*) args[4];
 
 	/* FIXME: share with preload.c */
 	/* We don't have a prot, flags, fd or offset... or possibly even an addr.
@@ -155,67 +218,559 @@ void mremap_replacement(struct generic_syscall *s, post_handler *post)
 	
 	if (!MMAP_RETURN_IS_ERROR(ret))
 	{
-		__mmap_allocator_notify_mremap(ret, old_addr, old_length, new_length, mremap_flags,
-			(mremap_flags & /*MREMAP_FIXED*/2) ? maybe_new_address : /*MAP_FAILED*/(void*)-1, GUESS_CALLER(s));
+		WITH_ASYNC_SIGNALS_BLOCKED(__mmap_allocator_notify_mremap(ret, old_addr,
+			old_length, new_length, mremap_flags,
+			(mremap_flags & /*MREMAP_FIXED*/2) ? maybe_new_address : /*MAP_FAILED*/(void*)-1, (void*) caller));
 	}
-	
+	return (long) ret;
+}
+void mremap_replacement(struct generic_syscall *s, post_handler *post) __attribute__((visibility("hidden")));
+void mremap_replacement(struct generic_syscall *s, post_handler *post)
+{
+	long ret = do_mremap_syscall(SIGNALLED_SYSCALL_ARGS(s), GUESS_CALLER(s));
 	/* Do the post-handling and resume. */
-	post(s, (long) ret, 1);
+	post(s, ret, 1);
 }
 
-void mprotect_replacement(struct generic_syscall *s, post_handler *post) __attribute__((visibility("hidden")));
-void mprotect_replacement(struct generic_syscall *s, post_handler *post)
+static long do_mprotect_syscall(const long *args, const void *caller)
 {
 	/* Unpack the mprotect arguments. */
-	void *addr = (void*) s->args[0];
-	size_t length = s->args[1];
-	int prot = s->args[2];
+	void *addr = (void*) args[0];
+	size_t length = args[1];
+	int prot = args[2];
 	
 	int ret = raw_mprotect(addr, length, prot);
 	
 	if (ret == 0 && &__mmap_allocator_notify_mprotect)
 	{
-		__mmap_allocator_notify_mprotect(addr, length, prot);
+		WITH_ASYNC_SIGNALS_BLOCKED(__mmap_allocator_notify_mprotect(addr, length, prot));
 	}
-
+	return ret;
+}
+void mprotect_replacement(struct generic_syscall *s, post_handler *post) __attribute__((visibility("hidden")));
+void mprotect_replacement(struct generic_syscall *s, post_handler *post)
+{
+	long ret = do_mprotect_syscall(SIGNALLED_SYSCALL_ARGS(s), GUESS_CALLER(s));
 	post(s, ret, 1);
 }
 
-void open_replacement(struct generic_syscall *s, post_handler *post) __attribute__((visibility("hidden")));
-void open_replacement(struct generic_syscall *s, post_handler *post)
+static long do_open_syscall(const long *args, const void *caller)
 {
 	/* Unpack the arguments */
-	const char *path = (const char *) s->args[0];
-	int flags = s->args[1];
-	mode_t mode = s->args[2];
+	const char *path = (const char *) args[0];
+	int flags = args[1];
+	mode_t mode = args[2];
 	
 	/* Nudge them. */
-	__liballocs_nudge_open(&path, &flags, &mode, GUESS_CALLER(s));
+	__liballocs_nudge_open(&path, &flags, &mode, caller);
 	
 	int ret = raw_open(path, flags, mode);
-	
+	/* A fresh fd can't still refer to anything the mmap allocator knows it
+	 * by, even if we missed its previous incarnation being closed. */
+	if (ret >= 0 && &__mmap_allocator_notify_fds_closing) WITH_ASYNC_SIGNALS_BLOCKED(
+		__mmap_allocator_notify_fds_closing(ret, ret));
+	return ret;
+}
+void open_replacement(struct generic_syscall *s, post_handler *post) __attribute__((visibility("hidden")));
+void open_replacement(struct generic_syscall *s, post_handler *post)
+{
+	long ret = do_open_syscall(SIGNALLED_SYSCALL_ARGS(s), GUESS_CALLER(s));
 	/* Do the post-handling and resume. */
 	post(s, ret, 1);
 }
 
-void openat_replacement(struct generic_syscall *s, post_handler *post) __attribute__((visibility("hidden")));
-void openat_replacement(struct generic_syscall *s, post_handler *post)
+static long do_openat_syscall(const long *args, const void *caller)
 {
 	/* Unpack the arguments */
-	int dirfd = (int) s->args[0];
-	const char *path = (const char *) s->args[1];
-	int flags = s->args[2];
-	mode_t mode = s->args[3];
+	int dirfd = (int) args[0];
+	const char *path = (const char *) args[1];
+	int flags = args[2];
+	mode_t mode = args[3];
 
 	/* Nudge them. */
-	__liballocs_nudge_openat(&dirfd, &path, &flags, &mode, GUESS_CALLER(s));
+	__liballocs_nudge_openat(&dirfd, &path, &flags, &mode, caller);
 
 	int ret = raw_openat(dirfd, path, flags, mode);
+	if (ret >= 0 && &__mmap_allocator_notify_fds_closing) WITH_ASYNC_SIGNALS_BLOCKED(
+		__mmap_allocator_notify_fds_closing(ret, ret));
+	return ret;
+}
+void openat_replacement(struct generic_syscall *s, post_handler *post) __attribute__((visibility("hidden")));
+void openat_replacement(struct generic_syscall *s, post_handler *post)
+{
+	long ret = do_openat_syscall(SIGNALLED_SYSCALL_ARGS(s), GUESS_CALLER(s));
+	/* Do the post-handling and resume. */
+	post(s, ret, 1);
+}
+
+/* We trap close, close_range, dup2 and dup3 only so that the mmap allocator
+ * hears about fds before they go away, while it can still use them to
+ * resolve the names of files it has seen mapped. */
+static long do_close_syscall(const long *args, const void *caller)
+{
+	int fd = (int) args[0];
+	if (&__mmap_allocator_notify_fds_closing) WITH_ASYNC_SIGNALS_BLOCKED(
+		__mmap_allocator_notify_fds_closing(fd, fd));
+	return raw_close(fd);
+}
+void close_replacement(struct generic_syscall *s, post_handler *post) __attribute__((visibility("hidden")));
+void close_replacement(struct generic_syscall *s, post_handler *post)
+{
+	long ret = do_close_syscall(SIGNALLED_SYSCALL_ARGS(s), GUESS_CALLER(s));
+	/* Do the post-handling and resume. */
+	post(s, ret, 1);
+}
+
+/* libsystrap has no raw_* wrapper for close_range, so we use raw_syscall4. */
+#ifndef SYS_close_range
+#define SYS_close_range 436
+#endif
+#define CLOSE_RANGE_CLOEXEC_FLAG (1u << 2)
+static long do_close_range_syscall(const long *args, const void *caller)
+{
+	unsigned first = (unsigned) args[0];
+	unsigned last = (unsigned) args[1];
+	unsigned flags = (unsigned) args[2];
+	/* With CLOSE_RANGE_CLOEXEC, nothing is closed yet. */
+	if (!(flags & CLOSE_RANGE_CLOEXEC_FLAG) && first <= last
+			&& &__mmap_allocator_notify_fds_closing)
+	{
+		WITH_ASYNC_SIGNALS_BLOCKED(__mmap_allocator_notify_fds_closing(first, last));
+	}
+	return raw_syscall4(SYS_close_range, first, last, flags, 0);
+}
+void close_range_replacement(struct generic_syscall *s, post_handler *post) __attribute__((visibility("hidden")));
+void close_range_replacement(struct generic_syscall *s, post_handler *post)
+{
+	long ret = do_close_range_syscall(SIGNALLED_SYSCALL_ARGS(s), GUESS_CALLER(s));
+	/* Do the post-handling and resume. */
+	post(s, ret, 1);
+}
+
+static long do_dup2_syscall(const long *args, const void *caller)
+{
+	int oldfd = (int) args[0];
+	int newfd = (int) args[1];
+	/* newfd is silently closed first, unless it's oldfd. */
+	if (oldfd != newfd && &__mmap_allocator_notify_fds_closing) WITH_ASYNC_SIGNALS_BLOCKED(
+		__mmap_allocator_notify_fds_closing(newfd, newfd));
+	return raw_dup2(oldfd, newfd);
+}
+void dup2_replacement(struct generic_syscall *s, post_handler *post) __attribute__((visibility("hidden")));
+void dup2_replacement(struct generic_syscall *s, post_handler *post)
+{
+	long ret = do_dup2_syscall(SIGNALLED_SYSCALL_ARGS(s), GUESS_CALLER(s));
+	/* Do the post-handling and resume. */
+	post(s, ret, 1);
+}
 
+static long do_dup3_syscall(const long *args, const void *caller)
+{
+	int oldfd = (int) args[0];
+	int newfd = (int) args[1];
+	int flags = (int) args[2];
+	if (oldfd != newfd && &__mmap_allocator_notify_fds_closing) WITH_ASYNC_SIGNALS_BLOCKED(
+		__mmap_allocator_notify_fds_closing(newfd, newfd));
+	return raw_dup3(oldfd, newfd, flags);
+}
+void dup3_replacement(struct generic_syscall *s, post_handler *post) __attribute__((visibility("hidden")));
+void dup3_replacement(struct generic_syscall *s, post_handler *post)
+{
+	long ret = do_dup3_syscall(SIGNALLED_SYSCALL_ARGS(s), GUESS_CALLER(s));
 	/* Do the post-handling and resume. */
 	post(s, ret, 1);
 }
 
+/* Trampolines. Taking a SIGILL for every mmap, munmap or brk is expensive
+ * for programs whose malloc does thousands of them per second. Most syscall
+ * sites in libc and ld.so look like
+ *
+ *     b8 nn nn nn nn     mov $nr, %eax
+ *     0f 05              syscall
+ *
+ * which is seven bytes, enough for a five-byte jmp rel32. So when
+ * LIBALLOCS_SYSTRAP_TRAMPOLINES is set, for sites of this form whose nr is
+ * one we replace, we overwrite the mov with a jmp to a per-site trampoline
+ * (allocated within jmp range), and still trap the syscall instruction
+ * itself. Matching the bytes is not enough: "b8" might be the tail of some
+ * other instruction, so we only patch a site if decoding forwards from the
+ * start of its enclosing function lands exactly on the mov (see
+ * is_insn_boundary()).
+ *
+ * The trampoline sets up %eax, passes the site address in %rcx, calls the
+ * common stub and jumps back to just after the trapped instruction. The
+ * common stub saves the flags, the argument registers and the full
+ * extended state (with xsave, as the kernel's signal frame does), calls the
+ * same do_*_syscall function that the SIGILL path uses, restores it all and
+ * leaves %rcx and %r11 as the syscall instruction would. The do_* functions
+ * block asynchronous signals around their bookkeeping. Anything that jumps
+ * directly to the syscall instruction, bypassing the mov, still hits the
+ * trap, so the SIGILL path remains the fallback for every site we can't
+ * or daren't patch.
+ *
+ * FIXME: like the trapping itself, we only patch at startup, so code in
+ * libraries dlopen'd later neither traps nor gets trampolines. */
+static trampolined_syscall_fn *trampolined_syscalls[] = {
+	[SYS_mmap] = do_mmap_syscall,
+	[SYS_munmap] = do_munmap_syscall,
+	[SYS_mremap] = do_mremap_syscall,
+	[SYS_mprotect] = do_mprotect_syscall,
+	[SYS_brk] = do_brk_syscall,
+	[SYS_open] = do_open_syscall,
+	[SYS_openat] = do_openat_syscall,
+	[SYS_close] = do_close_syscall,
+	[SYS_close_range] = do_close_range_syscall,
+	[SYS_dup2] = do_dup2_syscall,
+	[SYS_dup3] = do_dup3_syscall
+};
+#define NTRAMPOLINED_SYSCALLS (sizeof trampolined_syscalls / sizeof trampolined_syscalls[0])
+
+/* regs[0] is the syscall number, regs[1..6] its arguments, regs[7] the site */
+long __liballocs_trampolined_syscall(long *regs) __attribute__((visibility("hidden")));
+long __liballocs_trampolined_syscall(long *regs)
+{
+	return trampolined_syscalls[regs[0]](&regs[1], (const void *) regs[7]);
+}
+/* Size of the xsave area for the features the OS has enabled, from CPUID
+ * leaf 0xd. The common stub reserves this much (plus alignment) on the stack. */
+unsigned long __liballocs_systrap_xsave_size __attribute__((visibility("hidden")));
+void __liballocs_syscall_trampoline_common(void) __attribute__((visibility("hidden")));
+__asm__(".pushsection .text\n"
+".globl __liballocs_syscall_trampoline_common\n"
+".hidden __liballocs_syscall_trampoline_common\n"
+".type __liballocs_syscall_trampoline_common, @function\n"
+"__liballocs_syscall_trampoline_common:\n"
+"	pushfq\n"
+"	pushq %rbp\n"
+"	movq %rsp, %rbp\n"
+"	cld\n"
+/* the regs[] block for __liballocs_trampolined_syscall */
+"	subq $64, %rsp\n"
+"	movq %rax, 0(%rsp)\n"
+"	movq %rdi, 8(%rsp)\n"
+"	movq %rsi, 16(%rsp)\n"
+"	movq %rdx, 24(%rsp)\n"
+"	movq %r10, 32(%rsp)\n"
+"	movq %r8, 40(%rsp)\n"
+"	movq %r9, 48(%rsp)\n"
+"	movq %rcx, 56(%rsp)\n"
+/* the xsave area below it; its header must start out zeroed */
+"	subq __liballocs_systrap_xsave_size(%rip), %rsp\n"
+"	andq $-64, %rsp\n"
+"	xorl %eax, %eax\n"
+"	movq %rax, 512(%rsp)\n"
+"	movq %rax, 520(%rsp)\n"
+"	movq %rax, 528(%rsp)\n"
+"	movq %rax, 536(%rsp)\n"
+"	movq %rax, 544(%rsp)\n"
+"	movq %rax, 552(%rsp)\n"
+"	movq %rax, 560(%rsp)\n"
+"	movq %rax, 568(%rsp)\n"
+"	movl $-1, %eax\n"
+"	movl $-1, %edx\n"
+"	xsave64 (%rsp)\n"
+"	leaq -64(%rbp), %rdi\n"
+"	call __liballocs_trampolined_syscall\n"
+"	movq %rax, -64(%rbp)\n"
+"	movl $-1, %eax\n"
+"	movl $-1, %edx\n"
+"	xrstor64 (%rsp)\n"
+"	movq -56(%rbp), %rdi\n"
+"	movq -48(%rbp), %rsi\n"
+"	movq -40(%rbp), %rdx\n"
+"	movq -32(%rbp), %r10\n"
+"	movq -24(%rbp), %r8\n"
+"	movq -16(%rbp), %r9\n"
+/* like syscall, leave the return address in %rcx and the flags in %r11 */
+"	movq -8(%rbp), %rcx\n"
+"	addq $2, %rcx\n"
+"	movq -64(%rbp), %rax\n"
+"	movq %rbp, %rsp\n"
+"	popq %rbp\n"
+"	movq (%rsp), %r11\n"
+"	popfq\n"
+"	ret\n"
+".size __liballocs_syscall_trampoline_common, .-__liballocs_syscall_trampoline_common\n"
+".popsection\n"
+);
+
+#define TRAMPOLINE_SLOT_SIZE 64
+#define TRAMPOLINE_BLOCK_SIZE 65536
+#define MAX_TRAMPOLINE_BLOCKS 64
+#define JMP_REL32_REACH 0x7fff0000l /* a little under 2GB, to be safe */
+#define TRAMPOLINE_PROT_RWX (0x1|0x2|0x4) /* PROT_READ|PROT_WRITE|PROT_EXEC */
+#define TRAMPOLINE_PROT_RX  (0x1|0x4)     /* PROT_READ|PROT_EXEC */
+#define TRAMPOLINE_MAP_FLAGS (0x2|0x20)   /* MAP_PRIVATE|MAP_ANONYMOUS */
+static struct trampoline_block
+{
+	unsigned char *begin;
+	unsigned char *next_free;
+} trampoline_blocks[MAX_TRAMPOLINE_BLOCKS];
+static unsigned ntrampoline_blocks;
+static _Bool use_trampolines;
+
+static _Bool within_jmp_reach(const unsigned char *from, const unsigned char *to)
+{
+	long dist = (long) to - (long) from;
+	return dist < JMP_REL32_REACH && dist > -JMP_REL32_REACH;
+}
+static unsigned char *alloc_trampoline_slot(const unsigned char *site)
+{
+	/* Usually the most recent block will do. */
+	for (int i = (int) ntrampoline_blocks - 1; i >= 0; --i)
+	{
+		struct trampoline_block *blk = &trampoline_blocks[i];
+		if (blk->next_free + TRAMPOLINE_SLOT_SIZE <= blk->begin + TRAMPOLINE_BLOCK_SIZE
+				&& within_jmp_reach(site, blk->begin)
+				&& within_jmp_reach(site, blk->begin + TRAMPOLINE_BLOCK_SIZE))
+		{
+			unsigned char *slot = blk->next_free;
+			blk->next_free += TRAMPOLINE_SLOT_SIZE;
+			return slot;
+		}
+	}
+	if (ntrampoline_blocks == MAX_TRAMPOLINE_BLOCKS) return NULL;
+	/* Ask for a block 1GB below the site; if the kernel puts it elsewhere
+	 * and it's out of reach, give up on this site. */
+	uintptr_t hint = ((uintptr_t) site & ~(uintptr_t)(TRAMPOLINE_BLOCK_SIZE - 1)) - (1ul<<30);
+	void *ret = raw_mmap((void*) hint, TRAMPOLINE_BLOCK_SIZE, TRAMPOLINE_PROT_RWX,
+		TRAMPOLINE_MAP_FLAGS, -1, 0);
+	if (MMAP_RETURN_IS_ERROR(ret)) return NULL;
+	if (!within_jmp_reach(site, ret) || !within_jmp_reach(site, (unsigned char *) ret + TRAMPOLINE_BLOCK_SIZE))
+	{
+		raw_munmap(ret, TRAMPOLINE_BLOCK_SIZE);
+		return NULL;
+	}
+	/* The mmap allocator has already scanned /proc, so tell it. */
+	if (&__mmap_allocator_notify_mmap) __mmap_allocator_notify_mmap(ret, (void*) hint,
+		TRAMPOLINE_BLOCK_SIZE, TRAMPOLINE_PROT_RWX, TRAMPOLINE_MAP_FLAGS,
+		-1, 0, (void*) alloc_trampoline_slot);
+	trampoline_blocks[ntrampoline_blocks++] = (struct trampoline_block) {
+		.begin = ret,
+		.next_free = (unsigned char *) ret + TRAMPOLINE_SLOT_SIZE
+	};
+	return ret;
+}
+static void emit_trampoline(unsigned char *t, uint32_t nr, const unsigned char *site)
+{
+	uint64_t site_addr = (uint64_t) site;
+	uint64_t common_addr = (uint64_t) __liballocs_syscall_trampoline_common;
+	static const unsigned char lea_down[] = { 0x48, 0x8d, 0x64, 0x24, 0x80 }; /* lea -0x80(%rsp),%rsp */
+	static const unsigned char call_r11[] = { 0x41, 0xff, 0xd3 };             /* call *%r11 */
+	static const unsigned char lea_up[] = { 0x48, 0x8d, 0xa4, 0x24, 0x80, 0x00, 0x00, 0x00 }; /* lea 0x80(%rsp),%rsp */
+	/* Skip the red zone, which the site's function may be using. */
+	__builtin_memcpy(t, lea_down, sizeof lea_down); t += sizeof lea_down;
+	*t++ = 0xb8; __builtin_memcpy(t, &nr, 4); t += 4;                  /* mov $nr,%eax */
+	*t++ = 0x48; *t++ = 0xb9; __builtin_memcpy(t, &site_addr, 8); t += 8;   /* movabs $site,%rcx */
+	*t++ = 0x49; *t++ = 0xbb; __builtin_memcpy(t, &common_addr, 8); t += 8; /* movabs $common,%r11 */
+	__builtin_memcpy(t, call_r11, sizeof call_r11); t += sizeof call_r11;
+	__builtin_memcpy(t, lea_up, sizeof lea_up); t += sizeof lea_up;
+	/* jmp back to just after the (trapped) syscall instruction */
+	int32_t rel = (int32_t) ((long) (site + 2) - (long) (t + 5));
+	*t++ = 0xe9; __builtin_memcpy(t, &rel, 4);
+}
+
+struct trap_region
+{
+	const unsigned char *begin;
+	const unsigned char *end;
+};
+
+/* Length of the x86-64 instruction at 'p', or 0 if we can't decode it
+ * (or it would run past 'end'). This is a length decoder only, but it
+ * knows every one-byte and 0F-map opcode, plus the VEX and EVEX forms. */
+static unsigned x86_64_insn_len(const unsigned char *p, const unsigned char *end)
+{
+	const unsigned char *start = p;
+	_Bool opsize16 = 0, addr32 = 0, rex_w = 0;
+#define NEED(n) do { if (end - p < (long) (n)) return 0; } while (0)
+	/* Legacy prefixes, then REX. */
+	for (;; ++p)
+	{
+		NEED(1);
+		if (p - start >= 14) return 0;
+		unsigned char c = *p;
+		if (c == 0x66) opsize16 = 1;
+		else if (c == 0x67) addr32 = 1;
+		else if (c == 0xf0 || c == 0xf2 || c == 0xf3 || c == 0x2e || c == 0x36
+				|| c == 0x3e || c == 0x26 || c == 0x64 || c == 0x65) {}
+		else break;
+	}
+	if ((*p & 0xf0) == 0x40) { rex_w = (*p & 0x08) != 0; ++p; NEED(1); }
+	unsigned imm = 0;
+	_Bool modrm = 0;
+	unsigned iz = opsize16 && !rex_w ? 2 : 4; /* "Iz" immediates */
+	unsigned char op = *p++;
+	unsigned map = 0;
+	if (op == 0xc4 || op == 0xc5 || op == 0x62)
+	{
+		/* VEX (3- or 2-byte) or EVEX; the prefix fixes the opcode map. */
+		if (start != p - 1) return 0; /* no legacy prefixes or REX allowed */
+		unsigned npayload = (op == 0xc5) ? 1 : (op == 0xc4) ? 2 : 3;
+		NEED(npayload + 1);
+		map = (op == 0xc5) ? 1 : (op == 0xc4) ? (p[0] & 0x1f) : (p[0] & 0x07);
+		p += npayload;
+		op = *p++;
+		modrm = !(map == 1 && op == 0x77); /* vzeroupper/vzeroall */
+		if (map == 3 || (map == 1 && ((op >= 0x70 && op <= 0x73) || op == 0xc2
+				|| (op >= 0xc4 && op <= 0xc6)))) imm = 1;
+		else if (map != 1 && map != 2 && map != 5 && map != 6) return 0;
+		goto decode_modrm;
+	}
+	if (op == 0x0f)
+	{
+		NEED(1);
+		op = *p++;
+		if (op == 0x38) { NEED(1); ++p; modrm = 1; goto decode_modrm; }
+		if (op == 0x3a) { NEED(1); ++p; modrm = 1; imm = 1; goto decode_modrm; }
+		switch (op)
+		{
+			case 0x05: case 0x06: case 0x07: case 0x08: case 0x09: case 0x0b:
+			case 0x0e: case 0x30: case 0x31: case 0x32: case 0x33: case 0x34:
+			case 0x35: case 0x37: case 0x77: case 0xa0: case 0xa1: case 0xa2:
+			case 0xa8: case 0xa9: case 0xaa:
+				break;
+			case 0xc8: case 0xc9: case 0xca: case 0xcb:
+			case 0xcc: case 0xcd: case 0xce: case 0xcf:
+				break;
+			case 0x04: case 0x0a: case 0x0c: case 0x24: case 0x25: case 0x26:
+			case 0x27: case 0x36: case 0x39: case 0x3b: case 0x3c: case 0x3d:
+			case 0x3e: case 0x3f: case 0x7a: case 0x7b: case 0xa6: case 0xa7:
+				return 0;
+			default:
+				if (op >= 0x80 && op <= 0x8f) { imm = 4; break; } /* jcc rel32 */
+				modrm = 1;
+				if (op == 0x0f || (op >= 0x70 && op <= 0x73) || op == 0xa4 || op == 0xac
+						|| op == 0xba || op == 0xc2 || (op >= 0xc4 && op <= 0xc6)) imm = 1;
+				break;
+		}
+		goto decode_modrm;
+	}
+	/* One-byte opcodes. */
+	if (op < 0x40)
+	{
+		switch (op & 7)
+		{
+			case 0: case 1: case 2: case 3: modrm = 1; break;
+			case 4: imm = 1; break;
+			case 5: imm = iz; break;
+			default: return 0; /* prefixes (handled above), or invalid in 64-bit mode */
+		}
+	}
+	else if (op >= 0x50 && op <= 0x5f) {}
+	else if (op >= 0x70 && op <= 0x7f) imm = 1;
+	else if (op >= 0x84 && op <= 0x8f)
+	{
+		modrm = 1;
+		if (op == 0x8f && end - p >= 1 && (*p & 0x38)) return 0; /* XOP */
+	}
+	else if (op >= 0x90 && op <= 0x9f) { if (op == 0x9a) return 0; }
+	else if (op >= 0xa0 && op <= 0xa3) imm = addr32 ? 4 : 8; /* moffs */
+	else if ((op >= 0xa4 && op <= 0xa7) || (op >= 0xaa && op <= 0xaf)) {}
+	else if (op >= 0xb0 && op <= 0xb7) imm = 1;
+	else if (op >= 0xb8 && op <= 0xbf) imm = rex_w ? 8 : iz;
+	else if (op >= 0xd8 && op <= 0xdf) modrm = 1;
+	else if (op >= 0xe0 && op <= 0xe7) imm = 1;
+	else switch (op)
+	{
+		case 0x63: case 0xd0: case 0xd1: case 0xd2: case 0xd3: case 0xfe: case 0xff:
+			modrm = 1; break;
+		case 0x68: case 0xa9: case 0xe8: case 0xe9: imm = (op >= 0xe8) ? 4 : iz; break;
+		case 0x69: case 0x81: case 0xc7: modrm = 1; imm = iz; break;
+		case 0x6a: case 0xa8: case 0xcd: case 0xeb: imm = 1; break;
+		case 0x6b: case 0x80: case 0x83: case 0xc0: case 0xc1: case 0xc6: modrm = 1; imm = 1; break;
+		case 0x6c: case 0x6d: case 0x6e: case 0x6f: case 0xc3: case 0xc9: case 0xcb:
+		case 0xcc: case 0xcf: case 0xd7: case 0xec: case 0xed: case 0xee: case 0xef:
+		case 0xf1: case 0xf4: case 0xf5: case 0xf8: case 0xf9: case 0xfa: case 0xfb:
+		case 0xfc: case 0xfd:
+			break;
+		case 0xc2: case 0xca: imm = 2; break;
+		case 0xc8: imm = 3; break;
+		case 0xf6: case 0xf7:
+			/* test has an immediate; the rest of the group doesn't */
+			NEED(1);
+			modrm = 1;
+			if (((*p >> 3) & 7) < 2) imm = (op == 0xf6) ? 1 : iz;
+			break;
+		default: return 0;
+	}
+decode_modrm:
+	if (modrm)
+	{
+		NEED(1);
+		unsigned char m = *p++;
+		unsigned mod = m >> 6, rm = m & 7;
+		if (mod != 3)
+		{
+			if (rm == 4)
+			{
+				NEED(1);
+				unsigned char sib = *p++;
+				if (mod == 0 && (sib & 7) == 5) p += 4;
+			}
+			else if (mod == 0 && rm == 5) p += 4; /* rip-relative */
+			if (mod == 1) p += 1;
+			else if (mod == 2) p += 4;
+		}
+	}
+	p += imm;
+	if (p > end || p - start > 15) return 0;
+	return p - start;
+#undef NEED
+}
+
+/* Does an instruction start at 'insn'? x86 can't be decoded backwards, so
+ * we decode forwards from the nearest preceding symbol, which is usually
+ * the start of the enclosing function, and see whether we land on it.
+ * Inter-function padding is nops or int3s, which decode fine; anything we
+ * can't decode, or a symbol outside the region, means we don't know. */
+#define MAX_INSN_SWEEP 262144
+static _Bool is_insn_boundary(const unsigned char *insn, const struct trap_region *r)
+{
+	Dl_info info;
+	if (!dladdr(insn, &info) || !info.dli_saddr) return 0;
+	const unsigned char *pos = info.dli_saddr;
+	if (pos < r->begin || pos > insn || insn - pos > MAX_INSN_SWEEP) return 0;
+	while (pos < insn)
+	{
+		unsigned len = x86_64_insn_len(pos, r->end);
+		if (!len) return 0;
+		pos += len;
+	}
+	return pos == insn;
+}
+static void set_trampoline_or_default_trap(const void *insn_addr, void *arg)
+{
+	struct trap_region *r = arg;
+	const unsigned char *site = insn_addr;
+	unsigned char *mov = (unsigned char *) site - 5;
+	uint32_t nr;
+	if (!use_trampolines
+			|| mov < r->begin
+			|| site + 2 > r->end
+			/* the patch must not span a page boundary, in case the region is
+			 * only made writable piecemeal */
+			|| ((uintptr_t) mov >> 12) != ((uintptr_t) (site + 1) >> 12)
+			|| mov[0] != 0xb8 || site[0] != 0x0f || site[1] != 0x05)
+	{
+		goto fallback;
+	}
+	__builtin_memcpy(&nr, mov + 1, 4);
+	if (nr >= NTRAMPOLINED_SYSCALLS || !trampolined_syscalls[nr]) goto fallback;
+	if (!is_insn_boundary(mov, r)) goto fallback;
+	unsigned char *t = alloc_trampoline_slot(site);
+	if (!t) goto fallback;
+	emit_trampoline(t, nr, site);
+	/* Trap the syscall itself first, then divert the mov. */
+	set_default_trap(insn_addr, NULL);
+	int32_t rel = (int32_t) ((long) t - (long) (mov + 5));
+	mov[0] = 0xe9;
+	__builtin_memcpy(mov + 1, &rel, 4);
+	return;
+fallback:
+	set_default_trap(insn_addr, NULL);
+}
+
 static int maybe_trap_map_cb(struct maps_entry *ent, char *linebuf, void *interpreter_fname_as_void)
 {
 	const char *interpreter_fname = (const char *) interpreter_fname_as_void;
@@ -229,9 +784,13 @@ static int maybe_trap_map_cb(struct maps_entry *ent, char *linebuf, void *interp
 		)
 	{
 		/* It's an executable mapping we want to blanket-trap, so trap it. */
+		struct trap_region r = {
+			(const unsigned char *) ent->first,
+			(const unsigned char *) ent->second
+		};
 		trap_one_executable_region((unsigned char *) ent->first, (unsigned char *) ent->second,
 			ent->rest, ent->w == 'w', ent->r == 'r', addr_is_in_ld_so((void*) ent->first),
-			set_default_trap, NULL);
+			set_trampoline_or_default_trap, &r);
 	}
 	
 	return 0;
@@ -299,6 +858,34 @@ void __liballocs_systrap_init(void)
 	}
 	if (!interpreter_fname) abort();
 
+	use_trampolines = (NULL != getenv("LIBALLOCS_SYSTRAP_TRAMPOLINES"));
+	if (use_trampolines)
+	{
+		/* We need xsave, enabled by the OS, to save what the kernel would. */
+		unsigned eax, ebx, ecx, edx;
+		if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_OSXSAVE)
+				|| !__get_cpuid_count(0xd, 0, &eax, &ebx, &ecx, &edx))
+		{
+			use_trampolines = 0;
+		}
+		else __liballocs_systrap_xsave_size = ebx;
+	}
+	/* The mmap allocator's fd cache checks its entries with fstat before
+	 * trusting them, so hearing about fds closing is only an optimisation.
+	 * Trapping mprotect keeps the mmap allocator's record of permissions
+	 * current, but programs that call it often (RELRO, stack guards, JITs)
+	 * would pay dearly; without it, we are back to recording the permissions
+	 * each mapping was created with. These are worth having when they cost a
+	 * trampoline call, but not a SIGILL round trip on every call. */
+	if (use_trampolines)
+	{
+		replaced_syscalls[SYS_mprotect] = mprotect_replacement;
+		replaced_syscalls[SYS_close] = close_replacement;
+		replaced_syscalls[SYS_close_range] = close_range_replacement;
+		replaced_syscalls[SYS_dup2] = dup2_replacement;
+		replaced_syscalls[SYS_dup3] = dup3_replacement;
+	}
+
 	// we're about to start rewriting syscall instructions, so be ready
 	install_sigill_handler();
 	
@@ -327,6 +914,17 @@ void __liballocs_systrap_init(void)
 	for_each_maps_entry((intptr_t) &m, get_a_line_from_maps_buf,
 		linebuf, sizeof linebuf, &entry, maybe_trap_map_cb, (void*) interpreter_fname);
 	close(fd);
+	/* Trampolines are written; make them read-only. We use the raw syscall,
+	 * since our own sites are not trapped, so tell the mmap allocator. */
+	for (unsigned i = 0; i < ntrampoline_blocks; ++i)
+	{
+		if (0 == raw_mprotect(trampoline_blocks[i].begin, TRAMPOLINE_BLOCK_SIZE, TRAMPOLINE_PROT_RX)
+				&& &__mmap_allocator_notify_mprotect)
+		{
+			__mmap_allocator_notify_mprotect(trampoline_blocks[i].begin, TRAMPOLINE_BLOCK_SIZE,
+				TRAMPOLINE_PROT_RX);
+		}
+	}
 	__liballocs_systrap_is_initialized = 1;
 }
 
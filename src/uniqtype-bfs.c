@@ -3,12 +3,12 @@
 #include <stdint.h>
 #include <limits.h>
 #include <stdio.h>
-#include <search.h>
 #include <assert.h>
 #include <string.h>
 #include <err.h>
 #include "uniqtype.h"
 #include "uniqtype-bfs.h"
+#include "uniqtype-ptrmap.h"
 
 // HACK while we conflict with search.h on 'struct entry'
 extern struct uniqtype *pointer_to___uniqtype__void;
@@ -29,68 +29,105 @@ static void build_adjacency_list_recursive(
 	unsigned long start_offset, struct uniqtype *t_at_offset, 
 	follow_ptr_fn *follow_ptr, void *fp_arg);
 
-enum node_colour { WHITE, GREY, BLACK }; // WHITE == 0, so "absent" pair->v 0 means WHITE
+enum node_colour { WHITE, GREY, BLACK }; // WHITE == 0, so a freshly created record is WHITE
 
 static node_rec *make_node(void *obj, struct uniqtype *t);
 
-struct pair
+/* Everything we know about a node we have reached, keyed by object address.
+ * We keep these in an open-addressing hash table with linear probing, so
+ * that checking an edge costs one probe sequence over a flat array. */
+struct bfs_record
 {
-	const void *k;
-	uintptr_t v;
+	const void *k;          /* NULL means empty */
+	enum node_colour colour;
+	unsigned distance;
+	const void *predecessor;
 };
-/* The tsearch man page says 
- * "The first field in each node of the tree is a pointer to the corresponding
- * data item." */
-typedef struct internal_treenode_s
+struct bfs_map
 {
-	void *key;
-} internal_treenode;
-#define TREENODE_TO_PAIR_PTR(n) ((struct pair *)((n)->key))
+	struct bfs_record *recs;
+	unsigned long nrecs;    /* always a power of two */
+	unsigned long nused;
+};
+#define BFS_MAP_INITIAL_SIZE 4096
 
-static int compar(const void *key1, const void *key2)
+static unsigned long bfs_map_hash(const void *k)
 {
-	return (uintptr_t) ((struct pair *) key1)->k - (uintptr_t) ((struct pair *) key2)->k;
+	/* Objects are at least word-aligned, so drop the low bits, then
+	 * spread the rest using Fibonacci hashing. */
+	return (((uintptr_t) k >> 3) * 0x9e3779b97f4a7c15ul) >> 16;
 }
-
-static uintptr_t treemap_get(void *const *rootp, const void *key)
+static struct bfs_record *bfs_map_find(struct bfs_map *m, const void *k)
 {
-	/* Find an existing pair, if there is one. */
-	struct pair p = { key, 0 };
-	internal_treenode *found = tfind(&p, rootp, compar);
-	if (found)
+	unsigned long mask = m->nrecs - 1;
+	for (unsigned long i = bfs_map_hash(k) & mask; ; i = (i + 1) & mask)
 	{
-		assert(TREENODE_TO_PAIR_PTR(found)->v != 0);
-		return TREENODE_TO_PAIR_PTR(found)->v; 
+		if (m->recs[i].k == k || !m->recs[i].k) return &m->recs[i];
 	}
-	return 0ul;
 }
-
-static void treemap_set(void **rootp, const void *key, uintptr_t value)
+static void bfs_map_init(struct bfs_map *m)
 {
-	/* Find an existing pair, if there is one. */
-	struct pair p = { key, value };
-	internal_treenode *found = tfind(&p, rootp, compar);
-	if (found)
+	m->nrecs = BFS_MAP_INITIAL_SIZE;
+	m->nused = 0;
+	m->recs = calloc(m->nrecs, sizeof (struct bfs_record));
+	if (!m->recs) { warn("insufficient memory"); abort(); }
+}
+static void bfs_map_grow(struct bfs_map *m)
+{
+	struct bfs_map bigger = { .nrecs = m->nrecs * 2, .nused = m->nused };
+	bigger.recs = calloc(bigger.nrecs, sizeof (struct bfs_record));
+	if (!bigger.recs) { warn("insufficient memory"); abort(); }
+	for (unsigned long i = 0; i < m->nrecs; ++i)
 	{
-		TREENODE_TO_PAIR_PTR(found)->v = value;
+		if (m->recs[i].k) *bfs_map_find(&bigger, m->recs[i].k) = m->recs[i];
 	}
-	else
+	free(m->recs);
+	*m = bigger;
+}
+/* Return the record for k, creating a WHITE one if there is none. */
+static struct bfs_record *bfs_map_get(struct bfs_map *m, const void *k)
+{
+	struct bfs_record *r = bfs_map_find(m, k);
+	if (r->k) return r;
+	/* Keep the load factor at most one half. */
+	if ((m->nused + 1) * 2 > m->nrecs)
 	{
-		/* malloc a new node */
-		struct pair *p_new_pair = malloc(sizeof (struct pair));
-		if (!p_new_pair) { warn("insufficient memory"); abort(); }
-		/* initialize the new node with p's k/v */
-		memcpy(p_new_pair, &p, sizeof (struct pair));
-		/* tsearch will add it */
-		internal_treenode *inserted = tsearch(p_new_pair, rootp, compar);
-		assert(inserted->key == p_new_pair);
-		assert(treemap_get(rootp, key) == value);
+		bfs_map_grow(m);
+		r = bfs_map_find(m, k);
 	}
+	r->k = k;
+	++m->nused;
+	return r;
+}
+static void bfs_map_destroy(struct bfs_map *m)
+{
+	free(m->recs);
+	m->recs = NULL;
+	m->nrecs = m->nused = 0;
 }
 
-static void treemap_delete(void **rootp)
+/* Nodes come and go once per edge, so we recycle them through a per-thread
+ * free list, carving new ones out of chunks of NODE_CHUNK_SIZE. Chunks are
+ * never returned to malloc; the pool stays at the peak number of nodes live. */
+#define NODE_CHUNK_SIZE 1024
+static __thread node_rec *free_nodes;
+static void free_node(void *n)
+{
+	node_rec *node = n;
+	node->next = free_nodes;
+	free_nodes = node;
+}
+static node_rec *alloc_node(void)
 {
-	tdestroy(*rootp, free);
+	if (!free_nodes)
+	{
+		node_rec *chunk = malloc(NODE_CHUNK_SIZE * sizeof (node_rec));
+		if (!chunk) { warn("insufficient memory"); abort(); }
+		for (unsigned i = 0; i < NODE_CHUNK_SIZE; ++i) free_node(&chunk[i]);
+	}
+	node_rec *node = free_nodes;
+	free_nodes = node->next;
+	return node;
 }
 
 /* HACK: archdep */
@@ -107,9 +144,11 @@ struct adj_list_ctxt
 	follow_ptr_fn *follow_ptr;
 	void *fp_arg;
 };
-static void visit_one_subobject(int i, struct uniqtype *element_type, long memb_offset,
-	struct adj_list_ctxt *ctxt)
+/* Add the object pointed to from 'slot', if any, to the adjacency list. */
+static void visit_pointer_slot(void **slot, struct uniqtype *element_type,
+	void *ctxt_as_void)
 {
+	struct adj_list_ctxt *ctxt = ctxt_as_void;
 	node_rec **p_adj_u_head = ctxt->p_adj_u_head;
 	node_rec **p_adj_u_tail = ctxt->p_adj_u_tail;
 	void *obj_start = ctxt->obj_start;
@@ -118,12 +157,10 @@ static void visit_one_subobject(int i, struct uniqtype *element_type, long memb_
 	struct uniqtype *t_at_offset = ctxt->t_at_offset;
 	follow_ptr_fn *follow_ptr = ctxt->follow_ptr;
 	void *fp_arg = ctxt->fp_arg;
-	/* Is it a pointer? If so, add it to the adjacency list. */
-	if (UNIQTYPE_IS_POINTER_TYPE(element_type))
 	{
 		struct uniqtype *pointed_to_static_t = UNIQTYPE_POINTEE_TYPE(element_type);
 		// get the address of the pointed-to object
-		void *pointed_to_object = *(void**)((uintptr_t) obj_start + start_offset + memb_offset);
+		void *pointed_to_object = *slot;
 		/* Check sanity of the pointer. We might be reading some union'd storage
 		 * that is currently holding a non-pointer. */
 		node_rec *to_enqueue = NULL;
@@ -149,25 +186,67 @@ static void visit_one_subobject(int i, struct uniqtype *element_type, long memb_
 		}
 		else
 		{
-			fprintf(stderr, "Warning: insane pointer value %p found in field index %d in object %p, type %s\n",
+			fprintf(stderr, "Warning: insane pointer value %p found at offset %ld in object %p, type %s\n",
 				pointed_to_object,
-				i,
+				(long) ((char*) slot - (char*)((uintptr_t) obj_start + start_offset)),
 				(char*)((uintptr_t) obj_start + start_offset),
 				NAME_FOR_UNIQTYPE(t_at_offset)
 			);
 		}
-		if (to_enqueue && to_enqueue->obj) fprintf(stderr, "Found a pointed-to object at %p, statically of type %s, "
-			"added as %p of type %s\n",
-			pointed_to_object, NAME_FOR_UNIQTYPE(pointed_to_static_t),
-			to_enqueue->obj, NAME_FOR_UNIQTYPE(to_enqueue->t));
+	}
+}
+/* Visit every pointer that some member of 't' places at 'offset', for
+ * slots whose pointer map entry doesn't say (overlapping members disagree). */
+static void visit_pointers_at(struct uniqtype *t, unsigned long offset, void **slot,
+	struct adj_list_ctxt *ctxt)
+{
+	if (UNIQTYPE_IS_POINTER_TYPE(t))
+	{
+		if (offset == 0) visit_pointer_slot(slot, t, ctxt);
+	}
+	else if (UNIQTYPE_IS_ARRAY_TYPE(t))
+	{
+		struct uniqtype *element_t = UNIQTYPE_ARRAY_ELEMENT_TYPE(t);
+		unsigned long stride = element_t->pos_maxoff;
+		if (stride == 0 || stride == UNIQTYPE_POS_MAXOFF_UNBOUNDED) return;
+		visit_pointers_at(element_t, offset % stride, slot, ctxt);
+	}
+	else if (UNIQTYPE_IS_COMPOSITE_TYPE(t))
+	{
+		for (unsigned i = 0; i < UNIQTYPE_COMPOSITE_MEMBER_COUNT(t); ++i)
+		{
+			struct uniqtype *memb_t = t->related[i].un.memb.ptr;
+			unsigned long memb_off = t->related[i].un.memb.off;
+			if (memb_off > offset) continue;
+			if (memb_t->pos_maxoff != UNIQTYPE_POS_MAXOFF_UNBOUNDED
+					&& offset - memb_off >= memb_t->pos_maxoff) continue;
+			visit_pointers_at(memb_t, offset - memb_off, slot, ctxt);
+		}
+	}
+}
+static void visit_mapped_pointer_slot(void **slot, struct uniqtype *ptr_t, void *ctxt_as_void)
+{
+	struct adj_list_ctxt *ctxt = ctxt_as_void;
+	if (ptr_t) { visit_pointer_slot(slot, ptr_t, ctxt); return; }
+	visit_pointers_at(ctxt->t_at_offset,
+		(char*) slot - ((char*) ctxt->obj_start + ctxt->start_offset), slot, ctxt);
+}
+static void visit_one_subobject(int i, struct uniqtype *element_type, long memb_offset,
+	struct adj_list_ctxt *ctxt)
+{
+	/* Is it a pointer? If so, add it to the adjacency list. */
+	if (UNIQTYPE_IS_POINTER_TYPE(element_type))
+	{
+		visit_pointer_slot((void**)((uintptr_t) ctxt->obj_start + ctxt->start_offset + memb_offset),
+			element_type, ctxt);
 	}
 	else if (UNIQTYPE_IS_COMPOSITE_TYPE(element_type)) /* Else is it a thing with structure? If so, recurse. */
 	{
 		build_adjacency_list_recursive(
-			p_adj_u_head, p_adj_u_tail,
-			obj_start, obj_t,
-			start_offset + memb_offset, element_type,
-			follow_ptr, fp_arg
+			ctxt->p_adj_u_head, ctxt->p_adj_u_tail,
+			ctxt->obj_start, ctxt->obj_t,
+			ctxt->start_offset + memb_offset, element_type,
+			ctxt->follow_ptr, ctxt->fp_arg
 		);
 	}
 }
@@ -184,10 +263,6 @@ static void build_adjacency_list_recursive(
 
 	assert(!t_at_offset->make_precise);
 	
-	fprintf(stderr, "Descending through subobjects of object at %p, "
-		"currently at subobject offset %ld of type %s\n",
-		obj_start, start_offset, NAME_FOR_UNIQTYPE(t_at_offset));
-	
 	// If someone tries to walk_bfs from a function pointer, we will try to
 	// bootstrap the list from a queue consisting of a single object (the function)
 	// and no type. If so, the list is already complete (i.e. empty), so return
@@ -205,23 +280,28 @@ static void build_adjacency_list_recursive(
 		.fp_arg = fp_arg
 	};
 #define do_thing(_i, _t, _offs) visit_one_subobject((_i), (_t), (_offs), &ctxt)
+	/* If the type has a pointer map, we needn't recurse at all. We don't
+	 * know how big an object of unbounded size is, so for those we don't
+	 * use the map; the usual walk over the members is as good as we get. */
+	if (t_at_offset->pos_maxoff != UNIQTYPE_POS_MAXOFF_UNBOUNDED
+			&& __liballocs_for_each_pointer_slot((char*) obj_start + start_offset, t_at_offset,
+				t_at_offset->pos_maxoff, visit_mapped_pointer_slot, &ctxt, NULL)) return;
 	UNIQTYPE_FOR_EACH_SUBOBJECT(t_at_offset, do_thing);
 }
 
 static void process_bfs_queue_and_maps(
 	node_rec **p_q_head,
 	node_rec **p_q_tail,
-	void **p_colours_root,
-	void **p_distances_root,
-	void **p_predecessors_root,
+	struct bfs_map *m,
 	follow_ptr_fn *follow_ptr, void *fp_arg,
 	on_blacken_fn *on_blacken, void *ob_arg)
 {
 	while (!__uniqtype_node_queue_empty(*p_q_head))
 	{
 		node_rec *u = __uniqtype_node_queue_pop_head(p_q_head, p_q_tail);
+		const void *u_obj = u->obj;
 	
-		treemap_set(p_colours_root, u->obj, GREY);
+		bfs_map_get(m, u_obj)->colour = GREY;
 		
 		/* create the adjacency list for u, by flattening the subobject hierarchy */
 		node_rec *adj_u_head = NULL;
@@ -238,27 +318,22 @@ static void process_bfs_queue_and_maps(
 		node_rec *v;
 		while ((v = __uniqtype_node_queue_pop_head(&adj_u_head, &adj_u_tail)) != NULL)
 		{
-			/* We initialise all nodes' colours to NULL a.k.a. WHITE */
-			uintptr_t colour = treemap_get(p_colours_root, v->obj);
-			fprintf(stderr, "From object at %p, type %s, considering adjacent object at %p, of type %s, colour %s\n",
-				u->obj, NAME_FOR_UNIQTYPE(u->t),
-				v->obj, NAME_FOR_UNIQTYPE(v->t), 
-				(colour == WHITE) ? "white" : (colour == GREY) ? "grey" : (colour == BLACK) ? "black" : "unknown"
-			);
-			if (colour == WHITE)
+			/* A freshly created record is WHITE. Note that growing the map
+			 * may move u's record, so we look it up by key each time. */
+			struct bfs_record *v_rec = bfs_map_get(m, v->obj);
+			if (v_rec->colour == WHITE)
 			{
-				treemap_set(p_colours_root, v->obj, GREY);
-				treemap_set(p_distances_root, v->obj, treemap_get(p_distances_root, v->obj) + 1);
-				treemap_set(p_predecessors_root, v->obj, (uintptr_t) v->obj);
-				fprintf(stderr, "Enqueued object at %p, type %s\n", 
-					v->obj, NAME_FOR_UNIQTYPE(v->t));
+				v_rec->colour = GREY;
+				v_rec->predecessor = u_obj;
+				unsigned u_distance = bfs_map_find(m, u_obj)->distance;
+				v_rec->distance = u_distance + 1;
 				__uniqtype_node_queue_push_tail(p_q_head, p_q_tail, v); // the queue takes our copy of v, which we're finished with
 			}
 			else v->free(v);
 		}
 
 		/* blacken u, and call the function for it */
-		treemap_set(p_colours_root, u->obj, BLACK);
+		bfs_map_find(m, u_obj)->colour = BLACK;
 		on_blacken(u->obj, u->t, ob_arg);
 		u->free(u);
 		
@@ -274,18 +349,13 @@ void __uniqtype_process_bfs_queue(
 	follow_ptr_fn *follow_ptr, void *fp_arg,
 	on_blacken_fn *on_blacken, void *ob_arg)
 {
-	void *colours_root = NULL; /* map void* -> node_colour */
-	void *distances_root = NULL; /* map void* -> int */
-	void *predecessors_root = NULL; /* map void* -> void* */
-	
-	process_bfs_queue_and_maps(p_q_head, p_q_tail, 
-		&colours_root, &distances_root, &predecessors_root,
+	struct bfs_map m; /* map void* -> colour, distance, predecessor */
+	bfs_map_init(&m);
+	process_bfs_queue_and_maps(p_q_head, p_q_tail, &m,
 		follow_ptr, fp_arg,
 		on_blacken, ob_arg
 	);
-	treemap_delete(&colours_root);
-	treemap_delete(&distances_root);
-	treemap_delete(&predecessors_root);
+	bfs_map_destroy(&m);
 }
 void __uniqtype_walk_bfs_from_object(
 	void *object, struct uniqtype *t,
@@ -322,11 +392,8 @@ void __uniqtype_walk_bfs_from_object(
 
 static node_rec *make_node(void *obj, struct uniqtype *t)
 {
-	node_rec *node = calloc(1, sizeof (node_rec));
-	if (!node) { warn("insufficient memory"); abort(); }
-	node->obj = obj;
-	node->t = t;
-	node->free = free;
+	node_rec *node = alloc_node();
+	*node = (node_rec) { .obj = obj, .t = t, .free = free_node };
 	return node;
 }
 
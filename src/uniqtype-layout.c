@@ -0,0 +1,486 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <assert.h>
+#include "liballocs.h"
+#include "liballocs_private.h"
+#include "uniqtype-ptrmap.h"
+
+/* Flattened layout indexes and pointer maps for uniqtypes.
+ *
+ * Descending a struct's member lists level by level, as
+ * __liballocs_first_subobject_spanning does, costs O(depth x log members)
+ * per query. For a struct that we are asked about often, we can instead
+ * precompute two things once.
+ *
+ * - For every byte offset, the innermost subobject reached by that descent
+ *   (and its immediate container). We store these as a vector of "spans"
+ *   of consecutive offsets that reach the same subobject, plus a 16-bit
+ *   span number per byte offset.
+ * - The sorted set of (offset, uniqtype) pairs at which some subobject
+ *   begins, taking in every union member and array element. This answers
+ *   "is there a T at offset o?" with one binary search.
+ *
+ * Layouts are built lazily on the first query and cached in an insert-only
+ * table keyed on the uniqtype. We index only composites of known size up
+ * to 64kB; queries on other types return "no layout", and the caller takes
+ * the usual path. */
+
+struct layout_span
+{
+	unsigned leaf_begin;            /* offset within the indexed type at which 'leaf' begins */
+	struct uniqtype *leaf;
+	struct uniqtype *containing;    /* NULL if the descent went nowhere */
+};
+struct layout_start
+{
+	unsigned offset;
+	struct uniqtype *t;
+};
+struct uniqtype_layout
+{
+	struct uniqtype *u;
+	unsigned size;
+	unsigned nspans;
+	unsigned nstarts;
+	struct layout_span *spans;
+	struct layout_start *starts;
+	_Bool has_overlaps;             /* some composite has members sharing an offset, e.g. a union */
+	unsigned short span_for_offset[];
+};
+
+#define LAYOUT_MAX_SIZE 65536
+#define LAYOUT_MAX_STARTS 16384
+
+static _Bool same_span(const struct layout_span *a, const struct layout_span *b)
+{
+	return a->leaf_begin == b->leaf_begin && a->leaf == b->leaf && a->containing == b->containing;
+}
+
+static int compare_starts(const void *a_as_void, const void *b_as_void)
+{
+	const struct layout_start *a = a_as_void;
+	const struct layout_start *b = b_as_void;
+	if (a->offset != b->offset) return (a->offset < b->offset) ? -1 : 1;
+	if (a->t != b->t) return ((uintptr_t) a->t < (uintptr_t) b->t) ? -1 : 1;
+	return 0;
+}
+
+static int compare_offsets(const void *a_as_void, const void *b_as_void)
+{
+	unsigned a = *(const unsigned *) a_as_void;
+	unsigned b = *(const unsigned *) b_as_void;
+	return (a < b) ? -1 : (a > b) ? 1 : 0;
+}
+
+/* We walk the subobject tree twice: once to count, so that we can size
+ * our buffers exactly, and once to collect. Besides the starts, we note
+ * where each array's elements end, since the descent changes there too
+ * (past the last element, it stops at the array). An array of unbounded
+ * length we enumerate only as far as the indexed type's size. */
+struct layout_walk
+{
+	unsigned size;
+	unsigned nstarts;
+	unsigned nends;
+	struct layout_start *starts; /* NULL when counting */
+	unsigned *ends;
+	_Bool overlaps;
+};
+static _Bool walk_starts(struct uniqtype *t, unsigned base, struct layout_walk *w)
+{
+	if (w->nstarts == LAYOUT_MAX_STARTS) return 0;
+	if (w->starts) w->starts[w->nstarts] = (struct layout_start) { .offset = base, .t = t };
+	++w->nstarts;
+	if (UNIQTYPE_IS_ARRAY_TYPE(t))
+	{
+		struct uniqtype *element_t = UNIQTYPE_ARRAY_ELEMENT_TYPE(t);
+		unsigned nelems = UNIQTYPE_ARRAY_LENGTH(t);
+		if (element_t->pos_maxoff == UNIQTYPE_POS_MAXOFF_UNBOUNDED) return 0;
+		if (element_t->pos_maxoff == 0) return 1;
+		if (nelems == UNIQTYPE_ARRAY_LENGTH_UNBOUNDED)
+		{
+			nelems = (base < w->size) ? DIVIDE_ROUNDING_UP(w->size - base, element_t->pos_maxoff) : 0;
+		}
+		else if (base + (unsigned long) nelems * element_t->pos_maxoff < w->size)
+		{
+			if (w->ends) w->ends[w->nends] = base + nelems * element_t->pos_maxoff;
+			++w->nends;
+		}
+		for (unsigned i = 0; i < nelems; ++i)
+		{
+			if (!walk_starts(element_t, base + i * element_t->pos_maxoff, w)) return 0;
+		}
+	}
+	else if (UNIQTYPE_IS_COMPOSITE_TYPE(t))
+	{
+		for (unsigned i = 0; i < UNIQTYPE_COMPOSITE_MEMBER_COUNT(t); ++i)
+		{
+			if (i > 0 && t->related[i].un.memb.off == t->related[i-1].un.memb.off) w->overlaps = 1;
+			if (!walk_starts(t->related[i].un.memb.ptr,
+				base + t->related[i].un.memb.off, w)) return 0;
+		}
+	}
+	return 1;
+}
+
+static struct layout_span span_at(struct uniqtype *u, unsigned off)
+{
+	unsigned remaining = off;
+	struct uniqtype *cur = u;
+	struct uniqtype *containing = NULL;
+	struct uniqtype_rel_info *contained_pos = NULL;
+	while (__liballocs_first_subobject_spanning(&remaining, &cur, &containing, &contained_pos));
+	return (struct layout_span) { .leaf_begin = off - remaining, .leaf = cur, .containing = containing };
+}
+
+static struct uniqtype_layout *build_layout(struct uniqtype *u)
+{
+	unsigned size = u->pos_maxoff;
+	struct layout_walk w = { .size = size };
+	if (!walk_starts(u, 0, &w)) return NULL;
+	/* The descent's answer can only change where some subobject starts or
+	 * some array's elements end. So we descend once at each such offset
+	 * and let the answer stand until the next. */
+	unsigned nbounds = w.nstarts + w.nends;
+	char *tmp = __private_malloc(w.nstarts * sizeof (struct layout_start)
+		+ nbounds * sizeof (struct layout_span) + nbounds * sizeof (unsigned));
+	if (!tmp) return NULL;
+	struct layout_start *starts = (struct layout_start *) tmp;
+	struct layout_span *spans = (struct layout_span *) (starts + w.nstarts);
+	unsigned *bounds = (unsigned *) (spans + nbounds);
+	w = (struct layout_walk) { .size = size, .starts = starts, .ends = bounds + w.nstarts };
+	if (!walk_starts(u, 0, &w)) { __private_free(tmp); return NULL; } /* can't happen */
+	qsort(starts, w.nstarts, sizeof (struct layout_start), compare_starts);
+	for (unsigned i = 0; i < w.nstarts; ++i) bounds[i] = starts[i].offset;
+	qsort(bounds, nbounds, sizeof (unsigned), compare_offsets);
+
+	unsigned nspans = 0;
+	unsigned last_bound = UINT_MAX;
+	for (unsigned i = 0; i < nbounds; ++i)
+	{
+		if (bounds[i] >= size || bounds[i] == last_bound) continue;
+		last_bound = bounds[i];
+		struct layout_span this = span_at(u, bounds[i]);
+		if (nspans > 0 && same_span(&this, &spans[nspans - 1])) continue;
+		spans[nspans] = this;
+		bounds[nspans] = bounds[i]; /* now: offset at which span 'nspans' begins */
+		++nspans;
+	}
+	assert(nspans > 0 && bounds[0] == 0);
+	if (nspans > USHRT_MAX) { __private_free(tmp); return NULL; }
+
+	size_t sz = offsetof(struct uniqtype_layout, span_for_offset)
+		+ size * sizeof (unsigned short);
+	sz = ROUND_UP(sz, sizeof (void*));
+	struct uniqtype_layout *l = __private_malloc(sz
+		+ nspans * sizeof (struct layout_span)
+		+ w.nstarts * sizeof (struct layout_start));
+	if (!l) { __private_free(tmp); return NULL; }
+	*l = (struct uniqtype_layout) {
+		.u = u,
+		.size = size,
+		.nspans = nspans,
+		.nstarts = w.nstarts,
+		.has_overlaps = w.overlaps,
+		.spans = (struct layout_span *) ((char*) l + sz),
+		.starts = (struct layout_start *) ((char*) l + sz + nspans * sizeof (struct layout_span))
+	};
+	memcpy(l->spans, spans, nspans * sizeof (struct layout_span));
+	memcpy(l->starts, starts, w.nstarts * sizeof (struct layout_start));
+	for (unsigned i = 0; i < nspans; ++i)
+	{
+		unsigned end = (i + 1 < nspans) ? bounds[i + 1] : size;
+		for (unsigned off = bounds[i]; off < end; ++off) l->span_for_offset[off] = i;
+	}
+	__private_free(tmp);
+	return l;
+}
+
+/* Pointer maps. For a type of known size, we record one bit per word,
+ * set if that word holds a pointer in some member (so unions are treated
+ * conservatively), and the static pointer type of each such slot, or NULL
+ * if members overlapping there disagree on it. A type whose pointers are
+ * not word-aligned cannot be described this way. */
+static char ambiguous_ptr_type_sentinel;
+#define AMBIGUOUS_PTR_TYPE ((struct uniqtype *) &ambiguous_ptr_type_sentinel)
+static int collect_ptr_slots(struct uniqtype *t, unsigned long base,
+	unsigned long *bits, struct uniqtype **types_by_word, unsigned nwords)
+{
+	if (UNIQTYPE_IS_POINTER_TYPE(t))
+	{
+		if (base % sizeof (void*) != 0) return -1;
+		unsigned long word = base / sizeof (void*);
+		if (word >= nwords) return -1;
+		bits[word / (8 * sizeof (unsigned long))] |= 1ul << (word % (8 * sizeof (unsigned long)));
+		if (!types_by_word[word]) types_by_word[word] = t;
+		else if (types_by_word[word] != t) types_by_word[word] = AMBIGUOUS_PTR_TYPE;
+		return 0;
+	}
+	if (UNIQTYPE_IS_ARRAY_TYPE(t))
+	{
+		struct uniqtype *element_t = UNIQTYPE_ARRAY_ELEMENT_TYPE(t);
+		unsigned nelems = UNIQTYPE_ARRAY_LENGTH(t);
+		if (nelems == UNIQTYPE_ARRAY_LENGTH_UNBOUNDED
+				|| element_t->pos_maxoff == UNIQTYPE_POS_MAXOFF_UNBOUNDED) return -1;
+		for (unsigned i = 0; i < nelems; ++i)
+		{
+			if (0 != collect_ptr_slots(element_t, base + i * element_t->pos_maxoff,
+					bits, types_by_word, nwords)) return -1;
+		}
+		return 0;
+	}
+	if (UNIQTYPE_IS_COMPOSITE_TYPE(t))
+	{
+		for (unsigned i = 0; i < UNIQTYPE_COMPOSITE_MEMBER_COUNT(t); ++i)
+		{
+			if (0 != collect_ptr_slots(t->related[i].un.memb.ptr,
+					base + t->related[i].un.memb.off, bits, types_by_word, nwords)) return -1;
+		}
+	}
+	return 0;
+}
+
+static struct uniqtype_ptrmap *build_ptrmap(struct uniqtype *t)
+{
+	unsigned nwords = DIVIDE_ROUNDING_UP(t->pos_maxoff, sizeof (void*));
+	unsigned nbitwords = DIVIDE_ROUNDING_UP(nwords, 8 * sizeof (unsigned long));
+	struct uniqtype **types_by_word = __private_malloc(nwords * sizeof (struct uniqtype *));
+	if (!types_by_word) return NULL;
+	bzero(types_by_word, nwords * sizeof (struct uniqtype *));
+	size_t sz = offsetof(struct uniqtype_ptrmap, bits) + nbitwords * sizeof (unsigned long);
+	struct uniqtype_ptrmap *m = __private_malloc(sz);
+	if (!m) { __private_free(types_by_word); return NULL; }
+	bzero(m, sz);
+	if (0 != collect_ptr_slots(t, 0, m->bits, types_by_word, nwords))
+	{
+		__private_free(types_by_word);
+		__private_free(m);
+		return NULL;
+	}
+	unsigned nptrs = 0;
+	for (unsigned i = 0; i < nbitwords; ++i) nptrs += __builtin_popcountl(m->bits[i]);
+	/* Now we know how many slots there are, put their types in a tail
+	 * allocation. */
+	struct uniqtype_ptrmap *resized = __private_realloc(m, sz + nptrs * sizeof (struct uniqtype *));
+	if (!resized) { __private_free(types_by_word); __private_free(m); return NULL; }
+	m = resized;
+	m->t = t;
+	m->size = t->pos_maxoff;
+	m->nwords = nwords;
+	m->nptrs = nptrs;
+	m->ptr_types = (struct uniqtype **) ((char*) m + sz);
+	unsigned n = 0;
+	for (unsigned word = 0; word < nwords; ++word)
+	{
+		if (types_by_word[word]) m->ptr_types[n++] =
+			(types_by_word[word] == AMBIGUOUS_PTR_TYPE) ? NULL : types_by_word[word];
+	}
+	assert(n == nptrs);
+	__private_free(types_by_word);
+	return m;
+}
+
+/* The cache. As with the derived-type cache in uniqtype-util.c, slots are
+ * claimed by CAS on the key. Each of a slot's products is built lazily
+ * and published by CAS from null, so concurrent builders may duplicate
+ * work but never disagree. Types we decline to index get a marker. */
+#define LAYOUT_CACHE_SIZE 8192 /* must be a power of two */
+static struct layout_cache_entry
+{
+	struct uniqtype *u;
+	struct uniqtype_layout *l;
+	struct uniqtype_ptrmap *m;
+} layout_cache[LAYOUT_CACHE_SIZE];
+static unsigned layout_cache_nused;
+static struct uniqtype_layout not_indexable;
+static struct uniqtype_ptrmap no_ptrmap;
+
+static unsigned layout_hash(struct uniqtype *u)
+{
+	return (unsigned) (((uintptr_t) u * 0x9e3779b97f4a7c15ul) >> 32) & (LAYOUT_CACHE_SIZE - 1);
+}
+
+static struct layout_cache_entry *cache_entry_for(struct uniqtype *u)
+{
+	unsigned i = layout_hash(u);
+	for (unsigned n = 0; n < LAYOUT_CACHE_SIZE; ++n, i = (i + 1) & (LAYOUT_CACHE_SIZE - 1))
+	{
+		struct uniqtype *k = __atomic_load_n(&layout_cache[i].u, __ATOMIC_ACQUIRE);
+		if (k == u) return &layout_cache[i];
+		if (k != NULL) continue;
+		/* Not cached. Don't let the table get too full. */
+		if (__atomic_load_n(&layout_cache_nused, __ATOMIC_RELAXED) > LAYOUT_CACHE_SIZE / 2) return NULL;
+		struct uniqtype *expected = NULL;
+		if (__atomic_compare_exchange_n(&layout_cache[i].u, &expected, u,
+				0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		{
+			__atomic_fetch_add(&layout_cache_nused, 1, __ATOMIC_RELAXED);
+			return &layout_cache[i];
+		}
+		if (expected == u) return &layout_cache[i]; // somebody else beat us to it
+	}
+	return NULL;
+}
+
+/* Like cache_entry_for, but never claims a slot, and gives only a layout
+ * that somebody has already built. */
+static const struct uniqtype_layout *built_layout_for(struct uniqtype *u)
+{
+	unsigned i = layout_hash(u);
+	for (unsigned n = 0; n < LAYOUT_CACHE_SIZE; ++n, i = (i + 1) & (LAYOUT_CACHE_SIZE - 1))
+	{
+		struct uniqtype *k = __atomic_load_n(&layout_cache[i].u, __ATOMIC_ACQUIRE);
+		if (!k) return NULL;
+		if (k != u) continue;
+		struct uniqtype_layout *l = __atomic_load_n(&layout_cache[i].l, __ATOMIC_ACQUIRE);
+		return (l == &not_indexable) ? NULL : l;
+	}
+	return NULL;
+}
+
+const struct uniqtype_layout *__liballocs_get_uniqtype_layout(struct uniqtype *u)
+{
+	if (!u) return NULL;
+	struct layout_cache_entry *e = cache_entry_for(u);
+	if (!e) return NULL;
+	struct uniqtype_layout *l = __atomic_load_n(&e->l, __ATOMIC_ACQUIRE);
+	if (l) return (l == &not_indexable) ? NULL : l;
+	_Bool indexable = UNIQTYPE_IS_COMPOSITE_TYPE(u)
+		&& u->pos_maxoff != 0
+		&& u->pos_maxoff != UNIQTYPE_POS_MAXOFF_UNBOUNDED
+		&& u->pos_maxoff <= LAYOUT_MAX_SIZE;
+	struct uniqtype_layout *built = indexable ? build_layout(u) : NULL;
+	struct uniqtype_layout *expected = NULL;
+	if (!__atomic_compare_exchange_n(&e->l, &expected, built ? built : &not_indexable,
+			0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	{
+		if (built) __private_free(built);
+		return (expected == &not_indexable) ? NULL : expected;
+	}
+	return built;
+}
+
+const struct uniqtype_ptrmap *__liballocs_get_ptrmap(struct uniqtype *t)
+{
+	if (!t) return NULL;
+	struct layout_cache_entry *e = cache_entry_for(t);
+	if (!e) return NULL;
+	struct uniqtype_ptrmap *m = __atomic_load_n(&e->m, __ATOMIC_ACQUIRE);
+	if (m) return (m == &no_ptrmap) ? NULL : m;
+	_Bool mappable = t->pos_maxoff != 0
+		&& t->pos_maxoff != UNIQTYPE_POS_MAXOFF_UNBOUNDED
+		&& t->pos_maxoff <= LAYOUT_MAX_SIZE;
+	struct uniqtype_ptrmap *built = mappable ? build_ptrmap(t) : NULL;
+	struct uniqtype_ptrmap *expected = NULL;
+	if (!__atomic_compare_exchange_n(&e->m, &expected, built ? built : &no_ptrmap,
+			0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	{
+		if (built) __private_free(built);
+		return (expected == &no_ptrmap) ? NULL : expected;
+	}
+	return built;
+}
+
+static void scan_ptrmap(char *obj, const struct uniqtype_ptrmap *m,
+	unsigned long limit, uniqtype_ptrmap_slot_fn *cb, void *arg, unsigned *p_n)
+{
+	const unsigned bits_per_word = 8 * sizeof (unsigned long);
+	unsigned long limit_words = limit / sizeof (void*);
+	for (unsigned bw = 0; bw * bits_per_word < m->nwords; ++bw)
+	{
+		unsigned long bits = m->bits[bw];
+		while (bits)
+		{
+			unsigned word = bw * bits_per_word + __builtin_ctzl(bits);
+			if (word >= limit_words) return;
+			cb((void**) (obj + word * sizeof (void*)), m->ptr_types[(*p_n)++], arg);
+			bits &= bits - 1;
+		}
+	}
+}
+
+_Bool __liballocs_for_each_pointer_slot(void *obj, struct uniqtype *t, unsigned long size,
+	uniqtype_ptrmap_slot_fn *cb, void *arg, unsigned long *out_covered)
+{
+	if (!t) return 0;
+	if (UNIQTYPE_IS_ARRAY_TYPE(t))
+	{
+		/* Arrays, perhaps huge or of unbounded length, go by stride
+		 * over their element's map. */
+		struct uniqtype *element_t = UNIQTYPE_ARRAY_ELEMENT_TYPE(t);
+		const struct uniqtype_ptrmap *m = __liballocs_get_ptrmap(element_t);
+		if (!m) return 0;
+		unsigned nelems = UNIQTYPE_ARRAY_LENGTH(t);
+		unsigned long stride = element_t->pos_maxoff;
+		unsigned long covered = (nelems == UNIQTYPE_ARRAY_LENGTH_UNBOUNDED) ? size
+			: MIN(size, (unsigned long) nelems * stride);
+		if (m->nptrs != 0)
+		{
+			for (unsigned long off = 0; off < covered; off += stride)
+			{
+				unsigned n = 0;
+				scan_ptrmap((char*) obj + off, m, covered - off, cb, arg, &n);
+			}
+		}
+		if (out_covered) *out_covered = covered;
+		return 1;
+	}
+	const struct uniqtype_ptrmap *m = __liballocs_get_ptrmap(t);
+	if (!m) return 0;
+	unsigned n = 0;
+	if (m->nptrs != 0) scan_ptrmap(obj, m, MIN(size, m->size), cb, arg, &n);
+	if (out_covered) *out_covered = MIN(size, m->size);
+	return 1;
+}
+
+_Bool __liballocs_layout_get_inner_type(struct uniqtype *u, unsigned offset,
+	struct uniqtype **out_innermost, struct uniqtype **out_containing)
+{
+	const struct uniqtype_layout *l = __liballocs_get_uniqtype_layout(u);
+	if (!l || offset >= l->size) return 0;
+	const struct layout_span *s = &l->spans[l->span_for_offset[offset]];
+	if (out_innermost) *out_innermost = s->leaf;
+	if (out_containing) *out_containing = s->containing;
+	return 1;
+}
+
+_Bool __liballocs_layout_get_leaf(struct uniqtype *u, unsigned offset,
+	struct uniqtype **out_leaf, unsigned *out_leaf_begin)
+{
+	const struct uniqtype_layout *l = __liballocs_get_uniqtype_layout(u);
+	if (!l || offset >= l->size) return 0;
+	const struct layout_span *s = &l->spans[l->span_for_offset[offset]];
+	if (out_leaf) *out_leaf = s->leaf;
+	if (out_leaf_begin) *out_leaf_begin = s->leaf_begin;
+	return 1;
+}
+
+static _Bool layout_has_start(const struct uniqtype_layout *l, unsigned offset,
+	struct uniqtype *test_t)
+{
+	struct layout_start key = { .offset = offset, .t = test_t };
+	return NULL != bsearch(&key, l->starts, l->nstarts, sizeof (struct layout_start),
+		compare_starts);
+}
+
+int __liballocs_layout_has_subobject_at(struct uniqtype *u, unsigned offset,
+	struct uniqtype *test_t)
+{
+	const struct uniqtype_layout *l = __liballocs_get_uniqtype_layout(u);
+	if (!l || offset >= l->size) return -1;
+	return layout_has_start(l, offset, test_t);
+}
+
+/* For find_matching_subobject's shortcut: never builds a layout, and says
+ * nothing about types with overlapping members, since a failed descent
+ * through those reports the first member it tried, which the layout
+ * doesn't record. */
+int __liballocs_layout_has_subobject_at_if_built(struct uniqtype *u, unsigned offset,
+	struct uniqtype *test_t)
+{
+	const struct uniqtype_layout *l = built_layout_for(u);
+	if (!l || l->has_overlaps || offset >= l->size) return -1;
+	return layout_has_start(l, offset, test_t);
+}
@@ -28,10 +28,83 @@ get_type_from_symname(const char *precise_uniqtype_name)
 	return (struct uniqtype *) dlsym(NULL, precise_uniqtype_name);
 }
 
+/* Before we go anywhere near symbol names, we look in an in-process cache
+ * of the types we have already been asked to derive, keyed on how they
+ * were derived: the constructor kind, the type it was applied to and the
+ * length (for arrays). Heap queries on dynamically sized arrays hit
+ * this on every call. The table is insert-only and lock-free: a slot is
+ * claimed by CAS on its first key word, and becomes visible to readers
+ * only when its value is stored. A reader that sees a claimed slot with
+ * no value yet just takes the slow path, which is always correct. Once
+ * the table is half full we stop memoising, so that probes stay short
+ * and a miss never has to scan the whole table. */
+enum derived_type_kind
+{
+	DERIVED_ARRAY = 1,
+	DERIVED_FLEXIBLE_ARRAY = 2,
+	DERIVED_ADDRESS = 3
+};
+#define DERIVED_TYPE_CACHE_SIZE 4096 /* must be a power of two */
+static struct derived_type_cache_entry
+{
+	uintptr_t base_and_kind; /* uniqtypes are word-aligned, so the kind goes in the bottom bits */
+	unsigned len;
+	struct uniqtype *t;
+} derived_type_cache[DERIVED_TYPE_CACHE_SIZE];
+static unsigned derived_type_cache_nused;
+
+static unsigned derived_type_hash(uintptr_t base_and_kind, unsigned len)
+{
+	uintptr_t h = (base_and_kind ^ ((uintptr_t) len * 0x9e3779b97f4a7c15ul)) * 0xff51afd7ed558ccdul;
+	return (unsigned) (h >> 32) & (DERIVED_TYPE_CACHE_SIZE - 1);
+}
+
+static struct uniqtype *derived_type_cache_lookup(enum derived_type_kind kind,
+	const struct uniqtype *base, unsigned len)
+{
+	uintptr_t key = (uintptr_t) base | kind;
+	unsigned i = derived_type_hash(key, len);
+	for (unsigned n = 0; n < DERIVED_TYPE_CACHE_SIZE; ++n, i = (i + 1) & (DERIVED_TYPE_CACHE_SIZE - 1))
+	{
+		struct derived_type_cache_entry *e = &derived_type_cache[i];
+		uintptr_t k = __atomic_load_n(&e->base_and_kind, __ATOMIC_ACQUIRE);
+		if (k == 0) return NULL;
+		if (k != key) continue;
+		struct uniqtype *t = __atomic_load_n(&e->t, __ATOMIC_ACQUIRE);
+		if (t && e->len == len) return t;
+	}
+	return NULL;
+}
+
+static void derived_type_cache_insert(enum derived_type_kind kind,
+	const struct uniqtype *base, unsigned len, struct uniqtype *t)
+{
+	uintptr_t key = (uintptr_t) base | kind;
+	unsigned i = derived_type_hash(key, len);
+	for (unsigned n = 0; n < DERIVED_TYPE_CACHE_SIZE; ++n, i = (i + 1) & (DERIVED_TYPE_CACHE_SIZE - 1))
+	{
+		struct derived_type_cache_entry *e = &derived_type_cache[i];
+		uintptr_t expected = 0;
+		if (__atomic_load_n(&derived_type_cache_nused, __ATOMIC_RELAXED) >= DERIVED_TYPE_CACHE_SIZE / 2) return;
+		if (__atomic_compare_exchange_n(&e->base_and_kind, &expected, key,
+				0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		{
+			__atomic_fetch_add(&derived_type_cache_nused, 1, __ATOMIC_RELAXED);
+			e->len = len;
+			__atomic_store_n(&e->t, t, __ATOMIC_RELEASE);
+			return;
+		}
+		/* Someone else got there first with the same type? Then we're done. */
+		if (expected == key && __atomic_load_n(&e->t, __ATOMIC_ACQUIRE) == t) return;
+	}
+}
+
 static
 struct uniqtype *
 get_or_create_array_type(struct uniqtype *element_t, unsigned array_len)
 {
+	struct uniqtype *cached = derived_type_cache_lookup(DERIVED_ARRAY, element_t, array_len);
+	if (cached) return cached;
 	char precise_uniqtype_name[4096];
 	const char *element_name = UNIQTYPE_NAME(element_t); /* gets "simple", not symbol, name */
 	if (array_len == UNIQTYPE_ARRAY_LENGTH_UNBOUNDED)
@@ -50,11 +123,16 @@ get_or_create_array_type(struct uniqtype *element_t, unsigned array_len)
 	/* FIXME: compute hash code. Should be an easy case. */
 
 	struct uniqtype *found = get_type_from_symname(precise_uniqtype_name);
-	if (found) return found;
+	if (found)
+	{
+		derived_type_cache_insert(DERIVED_ARRAY, element_t, array_len, found);
+		return found;
+	}
 
 	/* Create it and memoise using libdlbind. */
 	size_t sz = offsetof(struct uniqtype, related) + 1 * (sizeof (struct uniqtype_rel_info));
 	void *allocated = dlalloc(__liballocs_rt_uniqtypes_obj, sz, SHF_WRITE);
+	if (allocated) __liballocs_footprint_add(LIBALLOCS_FOOTPRINT_SYNTHESISED_UNIQTYPES, NULL, sz);
 	struct uniqtype *allocated_uniqtype = allocated;
 	*allocated_uniqtype = (struct uniqtype) {
 		.pos_maxoff = (array_len == UNIQTYPE_ARRAY_LENGTH_UNBOUNDED)
@@ -79,6 +157,7 @@ get_or_create_array_type(struct uniqtype *element_t, unsigned array_len)
 	void *reloaded = dlbind(__liballocs_rt_uniqtypes_obj, precise_uniqtype_name,
 		allocated, sz, STT_OBJECT);
 	assert(reloaded);
+	derived_type_cache_insert(DERIVED_ARRAY, element_t, array_len, allocated_uniqtype);
 
 	return allocated_uniqtype;
 }
@@ -106,6 +185,8 @@ __liballocs_get_or_create_flexible_array_type(struct uniqtype *element_t)
 	assert(element_t);
 	if (element_t->pos_maxoff == 0) return NULL;
 	if (element_t->pos_maxoff == UNIQTYPE_POS_MAXOFF_UNBOUNDED) return NULL;
+	struct uniqtype *cached = derived_type_cache_lookup(DERIVED_FLEXIBLE_ARRAY, element_t, 0);
+	if (cached) return cached;
 
 	char precise_uniqtype_name[4096];
 	const char *element_name = UNIQTYPE_NAME(element_t); /* gets "simple", not symbol, name */
@@ -114,11 +195,16 @@ __liballocs_get_or_create_flexible_array_type(struct uniqtype *element_t)
 	/* FIXME: compute hash code. */
 
 	struct uniqtype *found = get_type_from_symname(precise_uniqtype_name);
-	if (found) return found;
+	if (found)
+	{
+		derived_type_cache_insert(DERIVED_FLEXIBLE_ARRAY, element_t, 0, found);
+		return found;
+	}
 
 	/* Create it and memoise using libdlbind. */
 	size_t sz = offsetof(struct uniqtype, related) + 1 * (sizeof (struct uniqtype_rel_info));
 	void *allocated = dlalloc(__liballocs_rt_uniqtypes_obj, sz, SHF_WRITE);
+	if (allocated) __liballocs_footprint_add(LIBALLOCS_FOOTPRINT_SYNTHESISED_UNIQTYPES, NULL, sz);
 	struct uniqtype *allocated_uniqtype = allocated;
 	*allocated_uniqtype = (struct uniqtype) {
 		.pos_maxoff = UNIQTYPE_POS_MAXOFF_UNBOUNDED,
@@ -141,6 +227,7 @@ __liballocs_get_or_create_flexible_array_type(struct uniqtype *element_t)
 	void *reloaded = dlbind(__liballocs_rt_uniqtypes_obj, precise_uniqtype_name,
 		allocated, sz, STT_OBJECT);
 	assert(reloaded);
+	derived_type_cache_insert(DERIVED_FLEXIBLE_ARRAY, element_t, 0, allocated_uniqtype);
 
 	return allocated_uniqtype;
 }
@@ -149,6 +236,8 @@ struct uniqtype *
 __liballocs_get_or_create_address_type(const struct uniqtype *pointee_t)
 {
 	assert(pointee_t);
+	struct uniqtype *cached = derived_type_cache_lookup(DERIVED_ADDRESS, pointee_t, 0);
+	if (cached) return cached;
 
 	char precise_uniqtype_name[4096];
 	const char *pointee_name = UNIQTYPE_NAME(pointee_t); /* gets "simple", not symbol, name */
@@ -157,7 +246,11 @@ __liballocs_get_or_create_address_type(const struct uniqtype *pointee_t)
 	/* FIXME: compute hash code. Should be an easy case. */
 
 	struct uniqtype *found = get_type_from_symname(precise_uniqtype_name);
-	if (found) return found;
+	if (found)
+	{
+		derived_type_cache_insert(DERIVED_ADDRESS, pointee_t, 0, found);
+		return found;
+	}
 
 	int indir_level;
 	const struct uniqtype *ultimate_pointee_t;
@@ -175,6 +268,7 @@ __liballocs_get_or_create_address_type(const struct uniqtype *pointee_t)
 	/* Create it and memoise using libdlbind. */
 	size_t sz = offsetof(struct uniqtype, related) + 2 * (sizeof (struct uniqtype_rel_info));
 	void *allocated = dlalloc(__liballocs_rt_uniqtypes_obj, sz, SHF_WRITE);
+	if (allocated) __liballocs_footprint_add(LIBALLOCS_FOOTPRINT_SYNTHESISED_UNIQTYPES, NULL, sz);
 	struct uniqtype *allocated_uniqtype = allocated;
 	*allocated_uniqtype = (struct uniqtype) {
 		.pos_maxoff = sizeof(void *),
@@ -197,6 +291,7 @@ __liballocs_get_or_create_address_type(const struct uniqtype *pointee_t)
 	void *reloaded = dlbind(__liballocs_rt_uniqtypes_obj, precise_uniqtype_name,
 		allocated, sz, STT_OBJECT);
 	assert(reloaded);
+	derived_type_cache_insert(DERIVED_ADDRESS, pointee_t, 0, allocated_uniqtype);
 
 	return allocated_uniqtype;
 }
@@ -229,6 +324,7 @@ __liballocs_get_or_create_subprogram_type(struct uniqtype *return_type, unsigned
 	/* Create it and memoise using libdlbind. */
 	size_t sz = offsetof(struct uniqtype, related) + (1+narg) * (sizeof (struct uniqtype_rel_info));
 	void *allocated = dlalloc(__liballocs_rt_uniqtypes_obj, sz, SHF_WRITE);
+	if (allocated) __liballocs_footprint_add(LIBALLOCS_FOOTPRINT_SYNTHESISED_UNIQTYPES, NULL, sz);
 	struct uniqtype *allocated_uniqtype = allocated;
 	*allocated_uniqtype = (struct uniqtype) {
 		.pos_maxoff = UNIQTYPE_POS_MAXOFF_UNBOUNDED,
@@ -339,6 +435,7 @@ __liballocs_get_or_create_union_type(unsigned n, /* struct uniqtype *first_memb_
 	/* Create it and memoise using libdlbind. */
 	size_t sz = offsetof(struct uniqtype, related) + n * (sizeof (struct uniqtype_rel_info));
 	void *allocated = dlalloc(__liballocs_rt_uniqtypes_obj, sz, SHF_WRITE);
+	if (allocated) __liballocs_footprint_add(LIBALLOCS_FOOTPRINT_SYNTHESISED_UNIQTYPES, NULL, sz);
 	struct uniqtype *allocated_uniqtype = allocated;
 	*allocated_uniqtype = (struct uniqtype) {
 		.pos_maxoff = max_len,
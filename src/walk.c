@@ -1,5 +1,10 @@
 #define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
 #include "liballocs.h"
 #include "liballocs_private.h"
 
@@ -127,6 +132,9 @@ int __liballocs_walk_allocations(
 	{
 		struct big_allocation *b = BOU_BIGALLOC(scope->bigalloc_or_uniqtype);
 		assert(b->begin == scope->base);
+		/* Not every suballocator can walk its allocations (yet). If ours
+		 * can't, there is nothing for us to walk. */
+		if (!b->suballocator || !b->suballocator->walk_allocations) return 0;
 		struct alloc_tree_path new_cont = {
 			.to_here = (struct alloc_tree_link) {
 				.container = (struct alloc_tree_pos) {
@@ -325,6 +333,287 @@ int __liballocs_walk_allocations_df(
 	);
 }
 
+/* Parallel whole-heap walking. Each task is a subtree of the bigalloc tree
+ * rooted at 'root'. Running a task calls back for the root, walks its
+ * suballocations depth-first (which also descends into promoted chunks), and
+ * queues a new task for each child bigalloc that its suballocator would not
+ * reach. Each worker owns a deque: it pushes and pops at the back, so that
+ * it stays depth-first and local, while idle workers steal from the front,
+ * which holds the oldest and usually biggest subtrees. */
+struct df_task
+{
+	struct big_allocation *root;
+	void *begin;             /* as it was when queued, for the ordered merge */
+	unsigned depth;
+	unsigned containee_coord;
+	_Bool begun;
+	void *subtree_arg;
+};
+struct df_deque
+{
+	pthread_mutex_t mutex;
+	struct df_task **tasks;
+	unsigned head;
+	unsigned tail;
+	unsigned size;
+};
+struct df_pool
+{
+	const struct walk_df_parallel_ops *ops;
+	void *arg;
+	unsigned flags;
+	unsigned nworkers;
+	struct df_deque *deques;
+	unsigned long outstanding; /* tasks queued or running */
+	int stop_ret;              /* set once, by the first cb to say "stop" */
+	/* Every task ever created, for the ordered merge and for freeing. */
+	pthread_mutex_t all_mutex;
+	struct df_task **all;
+	unsigned nall;
+	unsigned all_size;
+};
+struct df_worker
+{
+	struct df_pool *pool;
+	unsigned idx;
+};
+struct df_task_ctxt
+{
+	struct df_pool *pool;
+	void *subtree_arg;
+};
+
+static void df_push(struct df_pool *pool, unsigned worker_idx, struct big_allocation *root,
+	unsigned depth, unsigned containee_coord)
+{
+	struct df_task *task = __private_malloc(sizeof (struct df_task));
+	if (!task) abort();
+	*task = (struct df_task) { .root = root, .begin = root->begin, .depth = depth, .containee_coord = containee_coord };
+	pthread_mutex_lock(&pool->all_mutex);
+	if (pool->nall == pool->all_size)
+	{
+		pool->all_size = pool->all_size ? 2 * pool->all_size : 256;
+		pool->all = __private_realloc(pool->all, pool->all_size * sizeof (struct df_task *));
+		if (!pool->all) abort();
+	}
+	pool->all[pool->nall++] = task;
+	pthread_mutex_unlock(&pool->all_mutex);
+	/* Count the task before anyone can run it, so that 'outstanding'
+	 * never reads zero while there is still work. */
+	__atomic_add_fetch(&pool->outstanding, 1, __ATOMIC_ACQ_REL);
+	struct df_deque *d = &pool->deques[worker_idx];
+	pthread_mutex_lock(&d->mutex);
+	if (d->tail == d->size)
+	{
+		if (d->head > 0)
+		{
+			memmove(d->tasks, d->tasks + d->head, (d->tail - d->head) * sizeof (struct df_task *));
+			d->tail -= d->head;
+			d->head = 0;
+		}
+		if (d->tail == d->size)
+		{
+			d->size = d->size ? 2 * d->size : 64;
+			d->tasks = __private_realloc(d->tasks, d->size * sizeof (struct df_task *));
+			if (!d->tasks) abort();
+		}
+	}
+	d->tasks[d->tail++] = task;
+	pthread_mutex_unlock(&d->mutex);
+}
+static struct df_task *df_take(struct df_pool *pool, unsigned worker_idx)
+{
+	struct df_task *task = NULL;
+	/* Our own deque first, from the back... */
+	struct df_deque *d = &pool->deques[worker_idx];
+	pthread_mutex_lock(&d->mutex);
+	if (d->tail > d->head) task = d->tasks[--d->tail];
+	pthread_mutex_unlock(&d->mutex);
+	if (task) return task;
+	/* ... then steal from the front of someone else's. */
+	for (unsigned i = 1; i < pool->nworkers && !task; ++i)
+	{
+		d = &pool->deques[(worker_idx + i) % pool->nworkers];
+		pthread_mutex_lock(&d->mutex);
+		if (d->tail > d->head) task = d->tasks[d->head++];
+		pthread_mutex_unlock(&d->mutex);
+	}
+	return task;
+}
+static int df_parallel_cb(struct big_allocation *maybe_the_allocation,
+	void *obj, struct uniqtype *t, const void *allocsite,
+	struct alloc_tree_link *link, void *task_ctxt_as_void)
+{
+	struct df_task_ctxt *c = (struct df_task_ctxt *) task_ctxt_as_void;
+	int stop_ret = __atomic_load_n(&c->pool->stop_ret, __ATOMIC_RELAXED);
+	if (stop_ret) return stop_ret;
+	int ret = c->pool->ops->cb(maybe_the_allocation, obj, t, allocsite, link, c->subtree_arg);
+	if (ret != 0 && ret != -1)
+	{
+		int expected = 0;
+		__atomic_compare_exchange_n(&c->pool->stop_ret, &expected, ret, 0,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED);
+	}
+	return ret;
+}
+static void df_run_task(struct df_pool *pool, unsigned worker_idx, struct df_task *task)
+{
+	if (__atomic_load_n(&pool->stop_ret, __ATOMIC_RELAXED)) return;
+	struct big_allocation *b = task->root;
+	/* The tree may have changed since we queued this; the serial walk is
+	 * racy in the same way. */
+	if (!BIGALLOC_IN_USE(b)) return;
+	task->subtree_arg = pool->ops->subtree_begin ? pool->ops->subtree_begin(b, pool->arg)
+		: pool->arg;
+	task->begun = 1;
+	struct df_task_ctxt ctxt = { .pool = pool, .subtree_arg = task->subtree_arg };
+
+	struct uniqtype *t = NULL;
+	const void *site = NULL;
+	if (b->allocated_by && b->allocated_by->get_info)
+	{
+		void *base;
+		unsigned long size;
+		b->allocated_by->get_info(b->begin, b, &t, &base, &size, &site);
+	}
+	struct big_allocation *parent = BIDX(b->parent);
+	struct alloc_tree_path path_to_root = {
+		.to_here = { .container = { .base = parent ? parent->begin : NULL,
+		                            .bigalloc_or_uniqtype = (uintptr_t) parent },
+		             .containee_coord = task->containee_coord },
+		.encl = NULL,
+		.encl_depth = 0
+	};
+	int ret = df_parallel_cb(b, b->begin, t, site, &path_to_root.to_here, &ctxt);
+	if (ret != 0) goto out; // skipping the subtree, or stopping
+	struct alloc_tree_pos pos = { .base = b->begin, .bigalloc_or_uniqtype = (uintptr_t) b };
+	if (b->suballocator && b->suballocator->walk_allocations)
+	{
+		ret = __liballocs_walk_allocations_df(&pos, df_parallel_cb, &ctxt);
+	}
+	else if (t && !b->first_child)
+	{
+		pos.bigalloc_or_uniqtype = (uintptr_t) t;
+		ret = __liballocs_walk_allocations_df(&pos, df_parallel_cb, &ctxt);
+	}
+	if (ret != 0 && ret != -1) goto out;
+	/* Queue the children that the suballocator's walk won't have reached. */
+	unsigned coord = 1;
+	for (struct big_allocation *child = BIDX(b->first_child); child;
+			child = BIDX(child->next_sib), ++coord)
+	{
+		if (!b->suballocator || child->allocated_by != b->suballocator)
+		{
+			df_push(pool, worker_idx, child, task->depth + 1, coord);
+		}
+	}
+out:
+	if (!(pool->flags & ALLOC_WALK_PARALLEL_ORDERED) && pool->ops->subtree_end)
+	{
+		pool->ops->subtree_end(b, task->subtree_arg, pool->arg);
+	}
+}
+static void *df_worker_loop(void *worker_as_void)
+{
+	struct df_worker *w = (struct df_worker *) worker_as_void;
+	struct df_pool *pool = w->pool;
+	for (;;)
+	{
+		struct df_task *task = df_take(pool, w->idx);
+		if (!task)
+		{
+			if (0 == __atomic_load_n(&pool->outstanding, __ATOMIC_ACQUIRE)) break;
+			sched_yield();
+			continue;
+		}
+		df_run_task(pool, w->idx, task);
+		__atomic_sub_fetch(&pool->outstanding, 1, __ATOMIC_ACQ_REL);
+	}
+	return NULL;
+}
+static int compare_df_tasks(const void *p1, const void *p2)
+{
+	const struct df_task *t1 = *(const struct df_task **) p1;
+	const struct df_task *t2 = *(const struct df_task **) p2;
+	if ((uintptr_t) t1->begin < (uintptr_t) t2->begin) return -1;
+	if ((uintptr_t) t1->begin > (uintptr_t) t2->begin) return 1;
+	return (t1->depth > t2->depth) - (t1->depth < t2->depth);
+}
+static int compare_toplevel_bigallocs(const void *p1, const void *p2)
+{
+	const struct big_allocation *b1 = *(const struct big_allocation **) p1;
+	const struct big_allocation *b2 = *(const struct big_allocation **) p2;
+	return ((uintptr_t) b1->begin > (uintptr_t) b2->begin)
+		- ((uintptr_t) b1->begin < (uintptr_t) b2->begin);
+}
+int __liballocs_walk_allocations_df_parallel(
+	const struct walk_df_parallel_ops *ops,
+	void *arg,
+	unsigned nthreads,
+	unsigned flags
+)
+{
+	assert(ops && ops->cb);
+	if (nthreads == 0)
+	{
+		long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+		nthreads = (ncpus > 0) ? ncpus : 1;
+	}
+	struct df_pool pool = {
+		.ops = ops,
+		.arg = arg,
+		.flags = flags,
+		.nworkers = nthreads,
+		.all_mutex = PTHREAD_MUTEX_INITIALIZER
+	};
+	pool.deques = __private_malloc(nthreads * sizeof (struct df_deque));
+	struct df_worker *workers = __private_malloc(nthreads * sizeof (struct df_worker));
+	pthread_t *threads = __private_malloc(nthreads * sizeof (pthread_t));
+	struct big_allocation **roots = __private_malloc(NBIGALLOCS * sizeof (struct big_allocation *));
+	if (!pool.deques || !workers || !threads || !roots) abort();
+	for (unsigned i = 0; i < nthreads; ++i)
+	{
+		pool.deques[i] = (struct df_deque) { .mutex = PTHREAD_MUTEX_INITIALIZER };
+		workers[i] = (struct df_worker) { .pool = &pool, .idx = i };
+	}
+	/* Seed the deques with the top-level bigallocs, in address order,
+	 * dealt out round-robin. */
+	unsigned nroots = 0;
+	for (unsigned idx = 1; idx < NBIGALLOCS; ++idx)
+	{
+		struct big_allocation *b = &big_allocations[idx];
+		if (BIGALLOC_IN_USE(b) && !b->parent) roots[nroots++] = b;
+	}
+	qsort(roots, nroots, sizeof roots[0], compare_toplevel_bigallocs);
+	for (unsigned i = 0; i < nroots; ++i) df_push(&pool, i % nthreads, roots[i], 0, i + 1);
+	__private_free(roots);
+	/* The calling thread is worker 0. If we can't make some threads,
+	 * the rest of us will steal their share. */
+	unsigned nstarted = 1;
+	for (; nstarted < nthreads; ++nstarted)
+	{
+		if (0 != pthread_create(&threads[nstarted], NULL, df_worker_loop, &workers[nstarted])) break;
+	}
+	df_worker_loop(&workers[0]);
+	for (unsigned i = 1; i < nstarted; ++i) pthread_join(threads[i], NULL);
+	if ((flags & ALLOC_WALK_PARALLEL_ORDERED) && ops->subtree_end)
+	{
+		qsort(pool.all, pool.nall, sizeof pool.all[0], compare_df_tasks);
+		for (unsigned i = 0; i < pool.nall; ++i)
+		{
+			if (pool.all[i]->begun) ops->subtree_end(pool.all[i]->root,
+				pool.all[i]->subtree_arg, arg);
+		}
+	}
+	for (unsigned i = 0; i < pool.nall; ++i) __private_free(pool.all[i]);
+	__private_free(pool.all);
+	for (unsigned i = 0; i < nthreads; ++i) __private_free(pool.deques[i].tasks);
+	__private_free(pool.deques);
+	__private_free(workers);
+	__private_free(threads);
+	return pool.stop_ret;
+}
+
 int
 __liballocs_walk_refs_cb(struct big_allocation *maybe_the_allocation,
 	void *obj, struct uniqtype *t, const void *allocsite,
@@ -400,6 +689,13 @@ __liballocs_walk_environ_cb(struct big_allocation *maybe_the_allocation,
 
 // instantiate inline
 extern inline _Bool 
+__liballocs_find_matching_subobject_descend(unsigned target_offset_within_uniqtype,
+	struct uniqtype *cur_obj_uniqtype, struct uniqtype *test_uniqtype, 
+	struct uniqtype **last_attempted_uniqtype, unsigned *last_uniqtype_offset,
+		unsigned *p_cumulative_offset_searched,
+		struct uniqtype **p_cur_containing_uniqtype,
+		struct uniqtype_rel_info **p_cur_contained_pos);
+extern inline _Bool 
 __liballocs_find_matching_subobject(unsigned target_offset_within_uniqtype,
 	struct uniqtype *cur_obj_uniqtype, struct uniqtype *test_uniqtype, 
 	struct uniqtype **last_attempted_uniqtype, unsigned *last_uniqtype_offset,
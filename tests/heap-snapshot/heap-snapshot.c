@@ -0,0 +1,49 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include "liballocs.h"
+#include "heap-snapshot.h"
+
+#define NOBJS 100
+
+int main(void)
+{
+	void *objs[NOBJS];
+	for (int i = 0; i < NOBJS; ++i)
+	{
+		objs[i] = malloc(32 + i);
+		assert(objs[i]);
+	}
+	char path[] = "/tmp/heap-snapshot.XXXXXX";
+	int fd = mkstemp(path);
+	assert(fd != -1);
+	close(fd);
+	int ret = __liballocs_write_heap_snapshot(path);
+	assert(ret == 0);
+
+	/* Now read it back as an offline tool would. */
+	struct heap_snapshot s;
+	ret = heap_snapshot_open(path, &s);
+	assert(ret == 0);
+	printf("Snapshot has %lu allocations\n", (unsigned long) s.nrows);
+	for (int i = 0; i < NOBJS; ++i)
+	{
+		long row = heap_snapshot_lookup(&s, (uintptr_t) objs[i] + 1);
+		assert(row != -1);
+		assert(s.base[row] == (uintptr_t) objs[i]);
+		assert(s.size[row] >= 32 + i);
+		assert(!(s.flags[row] & HEAP_SNAPSHOT_ROW_IS_BIGALLOC));
+		assert(0 != strlen(heap_snapshot_allocator_name(&s, row)));
+		/* The enclosing row should be a bigalloc containing the chunk. */
+		uint32_t parent = s.parent[row];
+		assert(parent != HEAP_SNAPSHOT_NO_PARENT);
+		assert(s.base[parent] <= s.base[row]
+			&& s.base[row] + s.size[row] <= s.base[parent] + s.size[parent]);
+	}
+	heap_snapshot_close(&s);
+	unlink(path);
+	for (int i = 0; i < NOBJS; ++i) free(objs[i]);
+	return 0;
+}
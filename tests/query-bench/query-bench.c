@@ -0,0 +1,261 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <alloca.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "liballocs.h"
+#include "allocmeta.h"
+#include "pageindex.h"
+
+/* Microbenchmarks for the query and indexing hot paths. Each result is
+ * one JSON object per line on stdout, so that the 'bench' target in
+ * mk.inc can collect them and a regression check can diff two runs.
+ * Run as a test case we use few iterations, just to check it all works.
+ *
+ * With --malloc-only we run only the malloc/free benchmarks, which need
+ * nothing from liballocs, so that they can be compared with and without
+ * liballocs preloaded. */
+
+struct point
+{
+	int x;
+	int y;
+	double weight;
+};
+
+#define NOBJS 256
+#define MAX_THREADS 8
+static unsigned long iters = 10000;
+static int preloaded;
+static long long timer_overhead_ns;
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
+static void report(const char *bench, const char *kind, unsigned nthreads,
+	unsigned long nops, long long ns)
+{
+	printf("{\"bench\": \"%s\", \"kind\": \"%s\", \"preload\": %s, "
+		"\"threads\": %u, \"ops\": %lu, \"ns\": %lld, \"ns_per_op\": %.2f}\n",
+		bench, kind, preloaded ? "true" : "false", nthreads, nops, ns,
+		nops ? (double) ns / nops : 0.0);
+}
+
+/* Time 'iters' calls of each of the three queries, cycling through
+ * 'nobjs' addresses. */
+static volatile unsigned long sink;
+static void bench_queries(const char *kind, void **objs, unsigned nobjs)
+{
+	long long before = now_ns();
+	for (unsigned long i = 0; i < iters; ++i) sink += (uintptr_t) alloc_get_type(objs[i % nobjs]);
+	report("alloc_get_type", kind, 1, iters, now_ns() - before);
+
+	before = now_ns();
+	for (unsigned long i = 0; i < iters; ++i) sink += (uintptr_t) alloc_get_base(objs[i % nobjs]);
+	report("alloc_get_base", kind, 1, iters, now_ns() - before);
+
+	before = now_ns();
+	for (unsigned long i = 0; i < iters; ++i) sink += alloc_get_size(objs[i % nobjs]);
+	report("alloc_get_size", kind, 1, iters, now_ns() - before);
+}
+
+static struct point static_points[NOBJS];
+static void bench_static(void)
+{
+	void *objs[NOBJS];
+	for (unsigned i = 0; i < NOBJS; ++i) objs[i] = &static_points[i];
+	bench_queries("static", objs, NOBJS);
+}
+
+static void bench_heap(void)
+{
+	void *objs[NOBJS];
+	for (unsigned i = 0; i < NOBJS; ++i)
+	{
+		objs[i] = malloc(sizeof (struct point));
+		assert(objs[i]);
+	}
+	bench_queries("heap", objs, NOBJS);
+	for (unsigned i = 0; i < NOBJS; ++i) free(objs[i]);
+}
+
+static void __attribute__((noinline)) bench_stack(void)
+{
+	struct point p = { 1, 2, 3.0 };
+	void *objs[] = { &p };
+	bench_queries("stack", objs, 1);
+	sink += p.x;
+}
+
+static void __attribute__((noinline)) bench_alloca(void)
+{
+	struct point *ps = alloca(NOBJS * sizeof (struct point));
+	void *objs[NOBJS];
+	for (unsigned i = 0; i < NOBJS; ++i) objs[i] = &ps[i];
+	bench_queries("alloca", objs, NOBJS);
+}
+
+static void bench_mmap(void)
+{
+	size_t len = NOBJS * 4096;
+	char *m = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	assert(m != MAP_FAILED);
+	void *objs[NOBJS];
+	for (unsigned i = 0; i < NOBJS; ++i) objs[i] = m + i * 4096;
+	bench_queries("mmap", objs, NOBJS);
+	munmap(m, len);
+}
+
+/* As in the packed-seq-walk test, promote a calloc'd chunk to a bigalloc
+ * and make it a packed sequence of (empty) NUL-terminated strings. */
+static void bench_packed_seq(void)
+{
+	size_t len = 131072;
+	char *chunk = calloc(1, len);
+	assert(chunk);
+	struct big_allocation *seq_b = __lookup_bigalloc_from_root(chunk,
+		&__default_lib_malloc_allocator, NULL);
+	assert(seq_b);
+	seq_b->suballocator = &__packed_seq_allocator;
+	seq_b->suballocator_private = malloc(sizeof (struct packed_sequence));
+	if (!seq_b->suballocator_private) abort();
+	seq_b->suballocator_private_free = __packed_seq_free;
+	__default_lib_malloc_allocator.set_type(seq_b, chunk, NULL);
+	*(struct packed_sequence *) seq_b->suballocator_private = (struct packed_sequence) {
+		.fam = &__string8_nulterm_packed_sequence
+	};
+	void *objs[NOBJS];
+	for (unsigned i = 0; i < NOBJS; ++i) objs[i] = chunk + i * (len / NOBJS);
+	bench_queries("packed_seq", objs, NOBJS);
+}
+
+/* First query of a fresh allocation versus a repeat query of the same
+ * one, each timed singly, less the cost of reading the clock. */
+static void first_versus_cached(void *obj, long long *first_ns, long long *cached_ns)
+{
+	long long t0 = now_ns();
+	sink += (uintptr_t) alloc_get_type(obj);
+	long long t1 = now_ns();
+	sink += (uintptr_t) alloc_get_type(obj);
+	long long t2 = now_ns();
+	*first_ns += (t1 - t0) - timer_overhead_ns;
+	*cached_ns += (t2 - t1) - timer_overhead_ns;
+}
+static void bench_first_query(void)
+{
+	unsigned long n = iters / 10 + 1;
+	long long first_ns = 0, cached_ns = 0;
+	for (unsigned long i = 0; i < n; ++i)
+	{
+		struct point *p = malloc(sizeof (struct point));
+		assert(p);
+		first_versus_cached(p, &first_ns, &cached_ns);
+		free(p);
+	}
+	report("first_query", "heap", 1, n, first_ns);
+	report("cached_query", "heap", 1, n, cached_ns);
+}
+static void __attribute__((noinline)) one_stack_first_query(long long *first_ns, long long *cached_ns)
+{
+	struct point p = { 1, 2, 3.0 };
+	first_versus_cached(&p, first_ns, cached_ns);
+	sink += p.x;
+}
+static void bench_stack_first_query(void)
+{
+	unsigned long n = iters / 10 + 1;
+	long long first_ns = 0, cached_ns = 0;
+	for (unsigned long i = 0; i < n; ++i) one_stack_first_query(&first_ns, &cached_ns);
+	report("first_query", "stack", 1, n, first_ns);
+	report("cached_query", "stack", 1, n, cached_ns);
+}
+
+/* Each iteration's mapping is a fresh bigalloc, created when the mmap
+ * allocator hears of the mmap and deleted again on munmap. */
+static void bench_bigalloc_churn(void)
+{
+	unsigned long n = iters / 10 + 1;
+	long long before = now_ns();
+	for (unsigned long i = 0; i < n; ++i)
+	{
+		void *m = mmap(NULL, 65536, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		assert(m != MAP_FAILED);
+		*(volatile char *) m = 42;
+		munmap(m, 65536);
+	}
+	report("bigalloc_churn", "mmap", 1, n, now_ns() - before);
+}
+
+/* Malloc/free with a window of live objects of mixed sizes, so that we
+ * exercise indexing of inserts and deletes rather than just the
+ * allocator's fast path. */
+#define WINDOW 64
+static void *malloc_free_loop(void *arg)
+{
+	void *live[WINDOW] = { NULL };
+	unsigned long seed = (uintptr_t) arg;
+	for (unsigned long i = 0; i < iters; ++i)
+	{
+		unsigned slot = i % WINDOW;
+		free(live[slot]);
+		seed = seed * 6364136223846793005ul + 1442695040888963407ul;
+		live[slot] = malloc(16 + (seed >> 55));
+		assert(live[slot]);
+	}
+	for (unsigned i = 0; i < WINDOW; ++i) free(live[i]);
+	return NULL;
+}
+static void bench_malloc(void)
+{
+	for (unsigned nthreads = 1; nthreads <= MAX_THREADS; nthreads *= 2)
+	{
+		pthread_t threads[MAX_THREADS];
+		long long before = now_ns();
+		for (unsigned i = 0; i < nthreads; ++i)
+		{
+			int ret = pthread_create(&threads[i], NULL, malloc_free_loop, (void*)(uintptr_t)(i + 1));
+			assert(ret == 0);
+		}
+		for (unsigned i = 0; i < nthreads; ++i) pthread_join(threads[i], NULL);
+		/* Each op is one malloc and one free. */
+		report("malloc_free", "heap", nthreads, nthreads * iters, now_ns() - before);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	_Bool malloc_only = 0;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (0 == strcmp(argv[i], "--malloc-only")) malloc_only = 1;
+		else if (0 == strcmp(argv[i], "--iters") && i + 1 < argc) iters = strtoul(argv[++i], NULL, 0);
+		else { fprintf(stderr, "usage: %s [--malloc-only] [--iters N]\n", argv[0]); return 1; }
+	}
+	const char *preload = getenv("LD_PRELOAD");
+	preloaded = preload && strstr(preload, "liballocs");
+	long long before = now_ns();
+	for (int i = 0; i < 1000; ++i) now_ns();
+	timer_overhead_ns = (now_ns() - before) / 1000;
+
+	bench_malloc();
+	if (malloc_only) return 0;
+
+	bench_heap();
+	bench_alloca();
+	bench_stack();
+	bench_static();
+	bench_mmap();
+	bench_packed_seq();
+	bench_first_query();
+	bench_stack_first_query();
+	bench_bigalloc_churn();
+	return 0;
+}
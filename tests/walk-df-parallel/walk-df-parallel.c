@@ -0,0 +1,72 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <sys/mman.h>
+#include "liballocs.h"
+#include "allocmeta.h"
+#include "pageindex.h"
+
+/* Make some mappings far enough apart that each is its own top-level
+ * bigalloc, then check that a parallel walk sees each exactly once and
+ * that the ordered merge hands us subtrees in address order. */
+#define NMAPPINGS 16
+#define STRIDE (1ul<<30)
+#define BASE ((char*) 0x300000000000ul)
+static char *mappings[NMAPPINGS];
+
+struct subtree_count
+{
+	void *begin;
+	unsigned long nseen;
+};
+static void *subtree_begin(struct big_allocation *root, void *arg)
+{
+	struct subtree_count *c = calloc(1, sizeof *c);
+	assert(c);
+	c->begin = root->begin;
+	return c;
+}
+static int count_cb(struct big_allocation *maybe_the_allocation,
+	void *obj, struct uniqtype *t, const void *allocsite,
+	struct alloc_tree_link *link, void *arg)
+{
+	struct subtree_count *c = arg;
+	for (unsigned i = 0; i < NMAPPINGS; ++i)
+	{
+		if (maybe_the_allocation && obj == mappings[i]) ++c->nseen;
+	}
+	return 0;
+}
+static void *last_begin;
+static unsigned long total_seen;
+static void subtree_end(struct big_allocation *root, void *subtree_arg, void *arg)
+{
+	struct subtree_count *c = subtree_arg;
+	assert((uintptr_t) c->begin >= (uintptr_t) last_begin);
+	last_begin = c->begin;
+	total_seen += c->nseen;
+	free(c);
+}
+
+int main(void)
+{
+	for (unsigned i = 0; i < NMAPPINGS; ++i)
+	{
+		mappings[i] = mmap(BASE + i * STRIDE, 4096, PROT_READ|PROT_WRITE,
+			MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED_NOREPLACE, -1, 0);
+		assert(mappings[i] != MAP_FAILED);
+		assert(__liballocs_get_bigalloc_containing(mappings[i]));
+	}
+	struct walk_df_parallel_ops ops = {
+		.cb = count_cb,
+		.subtree_begin = subtree_begin,
+		.subtree_end = subtree_end
+	};
+	int ret = __liballocs_walk_allocations_df_parallel(&ops, NULL, 4,
+		ALLOC_WALK_PARALLEL_ORDERED);
+	assert(ret == 0);
+	printf("Saw %lu of our %d mappings\n", total_seen, NMAPPINGS);
+	assert(total_seen == NMAPPINGS);
+	return 0;
+}
@@ -19,6 +19,12 @@
  *      If we represent the table (3) instead as a giant switch statement,
  *      potentially with millions of cases, how does a compiler optimise it?
  *      Then try an eh-elfs-style binary tree for comparison.
+ *
+ * For now, alongside the table (3) in the traditional output, we emit a
+ * two-level page table over it (see write_frame_vaddrs_index), so that the
+ * runtime can get from a PC to its record without any binary search.
+ * This is a lot simpler than a generated switch and keeps the table as
+ * the single source of truth.
  */
  
 #include <fstream>
@@ -31,6 +37,7 @@
 #include <cctype>
 #include <cstdlib>
 #include <memory>
+#include <vector>
 #include <boost/regex.hpp>
 #include <boost/algorithm/string.hpp>
 #include <boost/icl/interval_map.hpp>
@@ -316,6 +323,67 @@ local_elements_by_stack_offset(set<frame_element> const& elts)
 	return out;
 }
 
+/* The frame_vaddrs index is a two-level page table over the sorted
+ * frame_vaddrs table. Level 1 has one entry per 2^LOG_PAGE bytes of
+ * text, from the page holding the first record to that holding the last.
+ * It records how many records begin at or below the page's start address.
+ * Level 2 has one byte per 2^LOG_LINE-byte line, holding how many more
+ * records begin at or below the line's start address. The runtime adds
+ * the two, then steps forward over the (few) records that begin within
+ * the line. If a page holds too many records for a byte delta, its
+ * line entries are all FRAME_VADDRS_INDEX_OVERFLOW and the runtime
+ * falls back to searching within that page.
+ *
+ * These constants must agree with those in src/allocators/stackframe.c. */
+#define FRAME_VADDRS_INDEX_LOG_PAGE 12
+#define FRAME_VADDRS_INDEX_LOG_LINE 6
+#define FRAME_VADDRS_INDEX_OVERFLOW 255
+static void write_frame_vaddrs_index(ostream& s, std::vector<Dwarf_Addr> const& vaddrs)
+{
+	if (vaddrs.size() == 0) return;
+	const unsigned lines_per_page = 1u << (FRAME_VADDRS_INDEX_LOG_PAGE - FRAME_VADDRS_INDEX_LOG_LINE);
+	const Dwarf_Addr base = vaddrs.front() & ~((Dwarf_Addr)(1ul << FRAME_VADDRS_INDEX_LOG_PAGE) - 1);
+	const unsigned npages = ((vaddrs.back() - base) >> FRAME_VADDRS_INDEX_LOG_PAGE) + 1;
+	std::vector<unsigned> l1(npages);
+	std::vector<unsigned char> l2(npages * lines_per_page);
+	unsigned n_leq = 0; // how many records begin at or below the current address
+	for (unsigned pg = 0; pg < npages; ++pg)
+	{
+		Dwarf_Addr page_addr = base + ((Dwarf_Addr) pg << FRAME_VADDRS_INDEX_LOG_PAGE);
+		while (n_leq < vaddrs.size() && vaddrs[n_leq] <= page_addr) ++n_leq;
+		l1[pg] = n_leq;
+		bool overflowed = false;
+		for (unsigned line = 0; line < lines_per_page; ++line)
+		{
+			Dwarf_Addr line_addr = page_addr + ((Dwarf_Addr) line << FRAME_VADDRS_INDEX_LOG_LINE);
+			while (n_leq < vaddrs.size() && vaddrs[n_leq] <= line_addr) ++n_leq;
+			if (n_leq - l1[pg] >= FRAME_VADDRS_INDEX_OVERFLOW) overflowed = true;
+			l2[pg * lines_per_page + line] = n_leq - l1[pg];
+		}
+		if (overflowed) for (unsigned line = 0; line < lines_per_page; ++line)
+		{
+			l2[pg * lines_per_page + line] = FRAME_VADDRS_INDEX_OVERFLOW;
+		}
+	}
+	s << "\n/* two-level index over frame_vaddrs, " << npages << " pages from 0x"
+		<< std::hex << base << std::dec << " */";
+	s << "\nunsigned long frame_vaddrs_index_base = 0x" << std::hex << base << std::dec << "UL;";
+	s << "\nunsigned frame_vaddrs_index_l1[] = {";
+	for (unsigned i = 0; i < l1.size(); ++i)
+	{
+		if (i % 16 == 0) s << "\n\t";
+		s << l1[i] << ",";
+	}
+	s << "\n};";
+	s << "\nunsigned char frame_vaddrs_index_l2[] = {";
+	for (unsigned i = 0; i < l2.size(); ++i)
+	{
+		if (i % lines_per_page == 0) s << "\n\t";
+		s << (unsigned) l2[i] << ",";
+	}
+	s << "\n};\n";
+}
+
 void write_traditional_output(
 	subprogram_vaddr_interval_map_t const& subprograms_by_vaddr,
 	map<subprogram_key, iterator_df<subprogram_die> > const& subprograms_by_key,
@@ -678,9 +746,11 @@ void write_traditional_output(
 	 * We need to refer to that range's frametype, even if the frame
 	 * offset is coincidentally the same as a neighbouring range's. */
 	cout << "struct frame_allocsite_entry frame_vaddrs[] = {" << endl;
+	std::vector<Dwarf_Addr> emitted_vaddrs;
 	for (auto i_pair = sorted_intervals.begin(); i_pair != sorted_intervals.end(); ++i_pair)
 	{
 		auto interval = i_pair->first;
+		emitted_vaddrs.push_back(interval.lower());
 		unsigned offset_from_frame_base = frame_offsets_by_subprogram[i_pair->second];
 	
 		if (i_pair != sorted_intervals.begin()) cout << ",";
@@ -696,6 +766,7 @@ void write_traditional_output(
 	}
 	// close the list
 	cout << "\n};\n";
+	write_frame_vaddrs_index(cout, emitted_vaddrs);
 }
 
 struct triple : public pair<string, pair< codeful_name, pair<unsigned,unsigned> > >